@@ -28,6 +28,8 @@
 #define PSTATUS 	0x0035
 #define IMR2        0x0036
 
+#define MR_RST      0x80    // software reset, clears itself when done
+
 /* Socket Modes */
 #define CLOSE       0x00
 #define TCP         0x01
@@ -66,6 +68,9 @@
 #define STATUS_MACRAW       0x42
 #define STATUS_PPPOE        0x5F
 
+/* Interrupt Mask */
+#define IMR_S0_INT  0x01
+
 /* Socket Interrupt */
 #define IR_SEND_OK  0x10
 #define IR_TIMEOUT  0x08
@@ -78,10 +83,15 @@
 #define S0_CR       0x0401  // Command Register
 #define S0_IR       0x0402  // Interrupt Register
 #define S0_SR       0x0403  // Status Register
+#define S0_PORT0    0x0404  // Source Port 0
+#define S0_PORT1    0x0405  // Source Port 1
+#define S0_DHAR0    0x0406  // Dest MAC: 0x0406 to 0x040B
 #define S0_DIPR0    0x040C  // Dest IP 0
 #define S0_DIPR1    0x040D  // Dest IP 1
 #define S0_DIPR2    0x040E  // Dest IP 2
 #define S0_DIPR3    0x040F  // Dest IP 3
+#define S0_DPORT0   0x0410  // Dest Port 0
+#define S0_DPORT1   0x0411  // Dest Port 1
 #define S0_TX_FSR0  0x0420  // TX Free Size 0
 #define S0_TX_FSR1  0x0421  // TX Free size 1
 #define S0_TX_RD0   0x0422  // TX Read Pointer 0
@@ -95,19 +105,66 @@
 #define S0_RX_WR0   0x042A  // RX Write Pointer 0
 #define S0_RX_WR1   0x042B  // RX Write Pointer 0
 
+/* Sockets 1 to 3 have the same registers 0x100 apart,
+ * Sn(2, S0_CR) is the command register of socket 2 */
+#define W3150_SOCKETS   4
+#define Sn(n, reg)      ((reg) + (n) * 0x0100)
+
 /* MISC... */
 #define MACRAW_HEADER_SIZE  0x08
+#define MACRAW_INFO_SIZE    0x02    // length prefix on each received frame
+#define MACRAW_MAX_FRAME    1518    // tagged ethernet frame without FCS
 
 /* Masks and Memory Addressing for MACRAW mode
  * using socket 0.  Using maxed out memory size
+ * (the default, see w3150_set_memory())
  */
 #define s0_rx_base  0x6000
 #define s0_rx_mask  0x1FFF
 #define s0_tx_base  0x4000
 #define s0_tx_mask  0x1FFF
 
+/* Batched register access
+ * Reads and writes are queued and sent in a single SPI transfer by
+ * w3150_cmdq_flush(), which also stores the read results.  A full queue
+ * flushes itself.  If the transfer fails the reads come back 0 and the
+ * flush returns -1.  w3150_cmdq_init() binds the queue to the default
+ * device, w3150_dev_cmdq_init() (w3150_dev.h) to another one. */
+#define W3150_CMDQ_MAX  32
+
+struct w3150_dev;
+
+struct w3150_cmdq {
+    struct w3150_dev *dev;
+    uint8_t frames[W3150_CMDQ_MAX * 4];
+    uint8_t kind[W3150_CMDQ_MAX];
+    void *dest[W3150_CMDQ_MAX];
+    int count;
+    uint8_t op;     // what the transfers are for, see w3150_trace.h
+};
+
+void w3150_cmdq_init(struct w3150_cmdq *q);
+void w3150_cmdq_read(struct w3150_cmdq *q, uint16_t addr, uint8_t *dest);
+void w3150_cmdq_read16(struct w3150_cmdq *q, uint16_t addr, uint16_t *dest);
+void w3150_cmdq_write(struct w3150_cmdq *q, uint16_t addr, uint8_t data);
+void w3150_cmdq_write16(struct w3150_cmdq *q, uint16_t addr, uint16_t data);
+int w3150_cmdq_flush(struct w3150_cmdq *q);
+
 /* General configuration methods */
-void w3150_init_networking(uint8_t *mac, uint8_t *ip, uint8_t *gw, uint8_t *subnet);
+void w3150_set_transport(const char *name);
+
+/* Warm start: w3150_init_networking() keeps the chip as it is when
+ * socket 0 is already in MACRAW with the same addresses, e.g. after the
+ * process was restarted, and w3150_init_macraw() then leaves socket 0
+ * open with the frames it holds.  The SPI clock is then only calibrated
+ * (see below) if socket 0 has nothing left to send, as calibration
+ * borrows its TX memory.  Otherwise, and always when warm start is off,
+ * the chip is reset.  Turned on here before init or with
+ * $W3150_WARM_START=1. */
+#define W3150_WARM_START_ENV "W3150_WARM_START"
+void w3150_set_warm_start(uint8_t on);
+
+uint8_t w3150_init_networking(uint8_t *mac, uint8_t *ip, uint8_t *gw, uint8_t *subnet);
 void w3150_ping_block();
 void w3150_set_mac(const uint8_t *mac);
 void w3150_set_ip(const uint8_t *ip);
@@ -119,13 +176,177 @@ void w3150_read_mac(uint8_t *mac);
 void w3150_read_subnet(uint8_t *subnet);
 uint8_t w3150_init_macraw();
 
+/* SPI clock
+ * w3150_init_networking() starts the bus at W3150_SPI_RATE_SAFE, the
+ * 8MHz that used to be fixed, then calibrates: the clock climbs a ladder
+ * of rates and at each step patterns written to TX memory, and VERSIONR,
+ * must read back unchanged with every reply frame well formed.  The bus
+ * settles one step below the fastest rate that passed.
+ * $W3150_SPI_RATE set to a number in Hz fixes the rate instead, "auto:N"
+ * calibrates up to N.
+ *
+ * After that the chip's 0x00 0x01 0x02 reply bytes are checked in every
+ * frame of every transfer, and a few bad transfers within a second take
+ * the clock down a step.  A transfer with a bad reply is dropped like
+ * one the transport failed: its reads come back 0, received frames stay
+ * on the chip for the next read and sends give up.  Only the reply bytes
+ * are checked, a bit lost in a data byte alone goes unnoticed.
+ *
+ * w3150_spi_calibrate() runs it again up to max_rate and returns the
+ * rate it settled at.  It borrows the start of TX memory, so no socket
+ * may be sending meanwhile. */
+#define W3150_SPI_RATE_ENV  "W3150_SPI_RATE"
+#define W3150_SPI_RATE_SAFE 8000000
+
+int w3150_spi_calibrate(int max_rate);
+int w3150_spi_rate();
+
+/* Host owned registers (GAR, SUBR, SHAR, SIPR, RMSR, TMSR, S0_MR, S0_TX_WR,
+ * S0_RX_RD) are cached by the driver.  Resync reloads the cache from the
+ * chip, verify returns 1 if the chip still matches it. */
+void w3150_shadow_resync();
+uint8_t w3150_shadow_verify();
+
 /* Read and write methods */
 void w3150_read(uint16_t addr, uint8_t *buf, uint16_t len);
 void w3150_write(uint16_t addr, uint8_t *buf, uint16_t len);
 void w3150_macraw_set_recv();
 uint8_t w3150_macraw_check_recv();
 uint8_t w3150_macraw_write(uint8_t *tx_buf, uint16_t len);
+uint8_t w3150_macraw_tx_submit(const uint8_t *tx_buf, uint16_t len);
+uint8_t w3150_macraw_tx_poll();
+void w3150_macraw_tx_flush();
+
+/* Interrupts, see w3150_irq.h for the sources */
+int w3150_irq_open(const char *name);
+int w3150_irq_fd();
+uint8_t w3150_irq_ack();
+uint8_t w3150_irq_wait(int timeout_ms);
 uint16_t w3150_macraw_read(uint8_t *recv_buf);
 
+/* A received frame inside the buffer given to w3150_macraw_read_batch() */
+struct w3150_frame {
+    uint8_t *data;
+    uint16_t len;
+};
+
+int w3150_macraw_read_batch(uint8_t *buf, uint16_t buf_len, struct w3150_frame *frames, int max_frames);
+
+/* Zero copy form of w3150_macraw_read_batch(): each frame is read
+ * straight into one of the empty pool buffers given (see w3150_pool.h),
+ * at data + off, and buffers left over are not touched.
+ * returns the number of buffers filled */
+struct w3150_buf;
+int w3150_macraw_read_bufs(struct w3150_buf **bufs, int max_bufs);
+
+/* Capture form of w3150_macraw_read_batch(): only the first snaplen
+ * bytes of each frame are read from the chip and stored, the read
+ * pointer still moves past the whole frame.  wire_len[i] gets the
+ * frame's full length, frames[i].len what was kept.  The receive filter
+ * is not applied.  A small snaplen takes one short transfer per frame
+ * instead of the frame itself, for headers of a busy link.
+ * returns the number of frames stored in frames[] */
+int w3150_macraw_read_snap(uint8_t *buf, uint16_t buf_len, struct w3150_frame *frames, uint16_t *wire_len,
+                           int max_frames, uint16_t snaplen);
+
+/* RX interleaving: while w3150_macraw_write() or w3150_macraw_tx_flush()
+ * waits for TX room or a SEND, the chip's RX size comes back with each
+ * TX status read and complete frames are pulled into a host queue
+ * (16KB) in the meantime, easing the 8KB RX buffer under full duplex
+ * traffic.  Every receive call (check_recv, macraw_read, read_batch,
+ * read_bufs, read_snap) hands out queued frames first, in order.  Only for a
+ * program that sends and receives from the same thread.  Turned on here
+ * or with $W3150_RX_INTERLEAVE=1 before w3150_init_macraw(). */
+#define W3150_RX_INTERLEAVE_ENV "W3150_RX_INTERLEAVE"
+void w3150_set_rx_interleave(uint8_t on);
+
+/* Receive filter, see w3150_filter.h */
+struct w3150_filter;
+void w3150_macraw_set_filter(struct w3150_filter *filter);
+
+/* Socket memory
+ * The 8KB of RX and 8KB of TX memory are split between the sockets in
+ * order, 1, 2, 4 or 8KB each.  Sizes are in bytes, 0 gives a socket no
+ * memory and is only allowed once the ones before it have used all 8KB
+ * (socket 0 always gets some).  Call after w3150_init_networking() and
+ * before opening sockets; without it w3150_init_macraw() gives socket 0
+ * everything and the chip's own default is 2KB per socket.
+ * return 1 if successful */
+uint8_t w3150_set_memory(const uint16_t *rx_sizes, const uint16_t *tx_sizes);
+
+/* UDP sockets
+ * Sockets 1 to 3 can be UDP sockets run by the chip's own IP/UDP stack,
+ * next to MACRAW on socket 0 or without it.  Only the payload crosses
+ * the SPI bus.  The chip resolves the destination with ARP and answers
+ * ARP for the address set with w3150_set_ip().
+ *
+ * recvfrom belongs to the receive side and sendto to the transmit side
+ * (see w3150_dev.h for threads).  UDP sockets are polled, they do not
+ * drive the INT pin. */
+#define W3150_UDP_HEADER_SIZE   8   // peer IP, peer port, length before each datagram
+
+/* Open socket s (1 to 3) bound to port
+ * return 1 if successful */
+uint8_t w3150_udp_open(uint8_t s, uint16_t port);
+void w3150_udp_close(uint8_t s);
+/* Send one datagram and wait for the chip to put it on the wire
+ * return 1 if sent, 0 if it does not fit, ARP timed out or the chip
+ * did not answer */
+uint8_t w3150_udp_sendto(uint8_t s, const uint8_t *buf, uint16_t len, const uint8_t *ip, uint16_t port);
+/* Take the next datagram, ip and port (either may be NULL) get the
+ * sender.  A datagram longer than len is truncated.
+ * return the bytes stored, 0 if nothing was waiting */
+uint16_t w3150_udp_recvfrom(uint8_t s, uint8_t *buf, uint16_t len, uint8_t *ip, uint16_t *port);
+
+/* TCP sockets
+ * Any socket can be a TCP connection run by the chip, socket 0 only when
+ * it is not in MACRAW mode.  The chip does the handshake, retransmission,
+ * ACKs, windows and checksums; the host moves payload in and out of the
+ * socket buffers.  Buffer sizes come from w3150_set_memory().
+ *
+ * Nothing blocks.  Connect and listen return once the chip is on it,
+ * w3150_tcp_poll() then reports progress as W3150_TCP_* bits and is what
+ * an event loop waits on (TCP sockets do not drive the INT pin).  send
+ * takes what fits in the socket's free TX memory; while a SEND is in
+ * flight more data is staged behind it and goes with the next one, from
+ * send or poll.  recv returns what has
+ * arrived and hands the space back to the receive window straight away.
+ *
+ * A listening socket turns into the connection when a peer connects,
+ * listen on another socket to take more.
+ *
+ * recv belongs to the receive side, the rest to the transmit side (see
+ * w3150_dev.h for threads). */
+#define W3150_TCP_READABLE  0x01    // data waiting, or the peer closed
+#define W3150_TCP_WRITABLE  0x02    // send would take data
+#define W3150_TCP_CONNECTED 0x04
+#define W3150_TCP_CLOSED    0x08    // closed, reset, timed out or refused
+
+/* return 1 if the socket is listening on port */
+uint8_t w3150_tcp_listen(uint8_t s, uint16_t port);
+/* Start connecting to ip:port from a local port the driver picks
+ * return 1 if the chip is trying */
+uint8_t w3150_tcp_connect(uint8_t s, const uint8_t *ip, uint16_t port);
+/* return 1 once a peer has connected to a listening socket, ip and port
+ * (either may be NULL) get its address */
+uint8_t w3150_tcp_accept(uint8_t s, uint8_t *ip, uint16_t *port);
+/* return the bytes taken, 0 if there is no room (or not connected yet),
+ * -1 if the connection is gone */
+int w3150_tcp_send(uint8_t s, const uint8_t *buf, uint16_t len);
+/* return the bytes read, 0 if nothing has arrived, -1 once the peer has
+ * closed and everything it sent was read, or the connection is gone */
+int w3150_tcp_recv(uint8_t s, uint8_t *buf, uint16_t len);
+/* return W3150_TCP_* bits */
+uint8_t w3150_tcp_poll(uint8_t s);
+/* Send a keepalive from w3150_tcp_poll() once nothing was sent for
+ * idle_ms, 0 turns it off, listen and connect reset it.  The chip only
+ * sends them after the connection carried some data.  A peer that
+ * stops answering shows up as W3150_TCP_CLOSED. */
+void w3150_tcp_keepalive(uint8_t s, uint32_t idle_ms);
+/* Graceful close (FIN), the socket reads W3150_TCP_CLOSED when done */
+void w3150_tcp_close(uint8_t s);
+/* Drop the connection without a FIN and free the socket now */
+void w3150_tcp_abort(uint8_t s);
+
 
 #endif 
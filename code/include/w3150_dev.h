@@ -0,0 +1,227 @@
+#ifndef W3150_DEV_H__
+#define W3150_DEV_H__
+
+#include <stdint.h>
+#include <w3150.h>
+#include <w3150_transport.h>
+#include <w3150_irq.h>
+#include <w3150_wait.h>
+#include <w3150_stats.h>
+
+/* Device handle
+ *
+ * Everything the driver knows about one W3150: its transport, the
+ * interrupt source, the shadow of the host owned registers and the
+ * transmit queue.  The plain w3150_* functions in w3150.h work on a
+ * default device (channel 1), w3150_dev_* takes the device explicitly.
+ *
+ * Threads: the receive side (macraw_read, read_batch/bufs/snap, irq_ack/wait,
+ * check_recv, udp_recvfrom, tcp_recv) and the transmit side (tx_submit/
+ * poll/flush, macraw_write, udp_sendto, tcp_send/poll/keepalive) keep
+ * separate state and may each run in their own thread, sharing the bus
+ * through the transport's arbiter.  Each side is single threaded.  Setup
+ * (init, set_*, shadow, filter, irq_open, spi_calibrate, udp_open/close,
+ * tcp_listen/connect/close/abort) must not overlap either of them.
+ * RX interleaving (w3150_set_rx_interleave()) has the transmit side
+ * read frames, so it is only for a device used from a single thread.
+ *
+ * The struct is large (burst buffers), keep it static or on the heap.
+ */
+
+#define W3150_BURST_MAX_BYTES   0x2000
+#define W3150_TX_QUEUE_MAX      16
+#define W3150_RXQ_BYTES         0x4000
+#define W3150_RXQ_FRAMES        128
+
+#define W3150_NET_SIZE          (SIPR + 4 - GAR)
+
+struct w3150_filter;
+
+/* Host owned registers, see w3150_shadow_resync() */
+struct w3150_shadow {
+    uint8_t valid;
+    uint8_t net[W3150_NET_SIZE];    // GAR, SUBR, SHAR, SIPR
+    uint8_t rmsr;
+    uint8_t tmsr;
+    uint8_t s0_mr;
+    uint16_t tx_wr;                 // transmit side
+    uint16_t rx_rd;                 // receive side
+};
+
+/* Frames staged in TX memory, see w3150_macraw_tx_submit() */
+struct w3150_txq {
+    uint16_t staged_wr;
+    uint16_t free;
+    uint16_t len[W3150_TX_QUEUE_MAX];
+    unsigned int head;
+    unsigned int tail;
+    uint8_t in_flight;
+};
+
+/* Frames read during TX waits, handed out by the next receive call, see
+ * w3150_set_rx_interleave() */
+struct w3150_rxq {
+    uint16_t used;                  // bytes of buf in use
+    int count;                      // frames in frames[]
+    int next;                       // first not handed out yet
+    uint16_t chip_size;             // S0_RX_RSR read with the TX status, 0 once stale
+    struct w3150_frame frames[W3150_RXQ_FRAMES];
+    uint8_t buf[W3150_RXQ_BYTES];
+};
+
+/* Where a socket's buffers sit in chip memory, from RMSR/TMSR.  A
+ * socket without memory has base 0. */
+struct w3150_sock_mem {
+    uint16_t rx_base;
+    uint16_t rx_mask;
+    uint16_t tx_base;
+    uint16_t tx_mask;
+};
+
+/* UDP or TCP socket, see w3150_udp_open() and w3150_tcp_listen() */
+struct w3150_sock {
+    uint8_t mode;           // UDP or TCP while open, CLOSE otherwise
+    uint16_t port;
+
+    // transmit side
+    uint8_t dst_ip[4];      // last UDP destination written to the chip
+    uint16_t dst_port;
+    uint16_t tx_wr;         // committed with SEND
+    uint16_t staged_wr;     // TCP data written past tx_wr
+    uint16_t free;          // TCP room for staging, a lower bound
+    uint8_t send_pending;   // TCP SEND without SEND_OK yet
+    uint8_t status;         // Sn_SR when last looked at
+    uint8_t error;          // TCP connection timed out
+    uint64_t keepalive_ns;
+    uint64_t last_tx_ns;
+    uint64_t sent;          // datagrams (UDP) or bytes (TCP)
+    uint64_t timeouts;
+
+    // receive side
+    uint16_t rx_rd;
+    uint64_t received;      // datagrams (UDP) or bytes (TCP)
+};
+
+/* SPI clock state, see w3150_spi_calibrate().  Both sides report bad
+ * replies, so the counters are atomic. */
+struct w3150_clock {
+    int max_ok;                 // fastest rate that passed calibration
+    uint8_t check;              // replies are well formed, watch them
+    unsigned int steps_down;    // taken at run time
+    atomic_uint window_errors;
+    _Atomic uint64_t window_start;
+    _Atomic uint64_t mismatches;
+};
+
+struct w3150_dev {
+    int channel;
+    const char *transport_name;
+    struct w3150_transport spi;
+    struct w3150_clock clock;
+
+    // transfers the transport failed, from either side, and when that
+    // was last reported
+    _Atomic uint64_t spi_failures;
+    _Atomic uint64_t spi_fail_report_ns;
+
+    struct w3150_irq irq;
+    struct w3150_shadow shadow;
+    struct w3150_sock_mem mem[W3150_SOCKETS];
+    uint8_t mem_set;        // w3150_set_memory() was called
+    uint8_t warm_start;     // see w3150_set_warm_start()
+    uint8_t s0_kept;        // warm start found socket 0 open
+    uint8_t rx_interleave;  // see w3150_set_rx_interleave()
+    struct w3150_sock sock[W3150_SOCKETS];
+    uint16_t next_port;     // local port for the next connect
+
+    // counters, each side writes its own slot, see w3150_stats.h.
+    // stats points at local_stats until w3150_stats_export().
+    struct w3150_stats *stats;
+    struct w3150_stats local_stats;
+
+    // receive side
+    struct w3150_filter *rx_filter;
+    uint64_t rx_failures;   // spi_failures when the current read began
+    struct w3150_wait irq_poll_wait;
+    uint8_t rx_burst[W3150_BURST_MAX_BYTES * W3150_FRAME_SIZE];
+    struct w3150_rxq rxq;
+
+    // transmit side
+    struct w3150_txq txq;
+    struct w3150_wait tx_space_wait;
+    struct w3150_wait tx_send_wait;
+    uint8_t tx_burst[W3150_BURST_MAX_BYTES * W3150_FRAME_SIZE];
+};
+
+/* Set up a handle for the chip on channel (the SPI chip select).  NULL
+ * transport falls back to $W3150_TRANSPORT, then spidev.  Nothing is
+ * opened until w3150_dev_init_networking(). */
+void w3150_dev_init(struct w3150_dev *dev, const char *transport, int channel);
+void w3150_dev_close(struct w3150_dev *dev);
+
+/* The device the w3150_* functions use */
+struct w3150_dev *w3150_default_dev();
+
+void w3150_dev_cmdq_init(struct w3150_dev *dev, struct w3150_cmdq *q);
+
+/* Same as the w3150_* functions of the same name */
+uint8_t w3150_dev_init_networking(struct w3150_dev *dev, uint8_t *mac, uint8_t *ip, uint8_t *gw, uint8_t *subnet);
+void w3150_dev_ping_block(struct w3150_dev *dev);
+int w3150_dev_spi_calibrate(struct w3150_dev *dev, int max_rate);
+void w3150_dev_set_mac(struct w3150_dev *dev, const uint8_t *mac);
+void w3150_dev_set_ip(struct w3150_dev *dev, const uint8_t *ip);
+void w3150_dev_set_subnet(struct w3150_dev *dev, const uint8_t *subnet);
+void w3150_dev_set_gateway(struct w3150_dev *dev, const uint8_t *gw);
+void w3150_dev_read_gateway(struct w3150_dev *dev, uint8_t *gw);
+void w3150_dev_read_ip(struct w3150_dev *dev, uint8_t *ip);
+void w3150_dev_read_mac(struct w3150_dev *dev, uint8_t *mac);
+void w3150_dev_read_subnet(struct w3150_dev *dev, uint8_t *subnet);
+uint8_t w3150_dev_init_macraw(struct w3150_dev *dev);
+uint8_t w3150_dev_set_memory(struct w3150_dev *dev, const uint16_t *rx_sizes, const uint16_t *tx_sizes);
+
+void w3150_dev_shadow_resync(struct w3150_dev *dev);
+uint8_t w3150_dev_shadow_verify(struct w3150_dev *dev);
+
+void w3150_dev_read(struct w3150_dev *dev, uint16_t addr, uint8_t *buf, uint16_t len);
+void w3150_dev_write(struct w3150_dev *dev, uint16_t addr, uint8_t *buf, uint16_t len);
+
+void w3150_dev_macraw_set_recv(struct w3150_dev *dev);
+uint8_t w3150_dev_macraw_check_recv(struct w3150_dev *dev);
+uint16_t w3150_dev_macraw_read(struct w3150_dev *dev, uint8_t *recv_buf);
+int w3150_dev_macraw_read_batch(struct w3150_dev *dev, uint8_t *buf, uint16_t buf_len,
+                                struct w3150_frame *frames, int max_frames);
+int w3150_dev_macraw_read_bufs(struct w3150_dev *dev, struct w3150_buf **bufs, int max_bufs);
+int w3150_dev_macraw_read_snap(struct w3150_dev *dev, uint8_t *buf, uint16_t buf_len,
+                               struct w3150_frame *frames, uint16_t *wire_len, int max_frames,
+                               uint16_t snaplen);
+void w3150_dev_macraw_set_filter(struct w3150_dev *dev, struct w3150_filter *filter);
+void w3150_dev_set_rx_interleave(struct w3150_dev *dev, uint8_t on);
+
+uint8_t w3150_dev_macraw_write(struct w3150_dev *dev, uint8_t *tx_buf, uint16_t len);
+uint8_t w3150_dev_macraw_tx_submit(struct w3150_dev *dev, const uint8_t *tx_buf, uint16_t len);
+uint8_t w3150_dev_macraw_tx_poll(struct w3150_dev *dev);
+void w3150_dev_macraw_tx_flush(struct w3150_dev *dev);
+
+uint8_t w3150_dev_udp_open(struct w3150_dev *dev, uint8_t s, uint16_t port);
+void w3150_dev_udp_close(struct w3150_dev *dev, uint8_t s);
+uint8_t w3150_dev_udp_sendto(struct w3150_dev *dev, uint8_t s, const uint8_t *buf, uint16_t len,
+                             const uint8_t *ip, uint16_t port);
+uint16_t w3150_dev_udp_recvfrom(struct w3150_dev *dev, uint8_t s, uint8_t *buf, uint16_t len,
+                                uint8_t *ip, uint16_t *port);
+
+uint8_t w3150_dev_tcp_listen(struct w3150_dev *dev, uint8_t s, uint16_t port);
+uint8_t w3150_dev_tcp_connect(struct w3150_dev *dev, uint8_t s, const uint8_t *ip, uint16_t port);
+uint8_t w3150_dev_tcp_accept(struct w3150_dev *dev, uint8_t s, uint8_t *ip, uint16_t *port);
+int w3150_dev_tcp_send(struct w3150_dev *dev, uint8_t s, const uint8_t *buf, uint16_t len);
+int w3150_dev_tcp_recv(struct w3150_dev *dev, uint8_t s, uint8_t *buf, uint16_t len);
+uint8_t w3150_dev_tcp_poll(struct w3150_dev *dev, uint8_t s);
+void w3150_dev_tcp_keepalive(struct w3150_dev *dev, uint8_t s, uint32_t idle_ms);
+void w3150_dev_tcp_close(struct w3150_dev *dev, uint8_t s);
+void w3150_dev_tcp_abort(struct w3150_dev *dev, uint8_t s);
+
+int w3150_dev_irq_open(struct w3150_dev *dev, const char *name);
+int w3150_dev_irq_fd(struct w3150_dev *dev);
+uint8_t w3150_dev_irq_ack(struct w3150_dev *dev);
+uint8_t w3150_dev_irq_wait(struct w3150_dev *dev, int timeout_ms);
+
+#endif
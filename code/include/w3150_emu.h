@@ -0,0 +1,144 @@
+#ifndef W3150_EMU_H__
+#define W3150_EMU_H__
+
+#include <stdint.h>
+#include <pthread.h>
+#include <w3150_transport.h>
+
+/* Software model of the W3150A+ used as the "emu" SPI transport.
+ *
+ * It decodes the same 4 byte frames the real chip sees and keeps the
+ * common registers, the socket registers and the 16KB of TX/RX memory.
+ * Socket commands (OPEN, CLOSE, SEND, RECV) update the pointers the way
+ * the chip does, and the other side of the MII is a "wire": frames
+ * pushed into it land in the socket 0 RX ring, frames sent by the
+ * driver queue up until they are pulled back out.
+ *
+ * Select it with W3150_TRANSPORT=emu (or "emu:<max_frames>" to limit the
+ * frames per submission like a spidev bufsiz would).  Each opened
+ * instance is registered by channel so tests and tools can reach it
+ * through w3150_emu_find().
+ *
+ * IR, IMR and Sn_IR are modelled, and the INT pin can be delivered to
+ * an eventfd (see w3150_irq.h).
+ *
+ * UDP sockets get the IPv4/UDP frames sent to their port and the chip's
+ * IP (or broadcast), ahead of socket 0.  SEND builds the frame, to a MAC
+ * learned from frames pushed in; an unknown destination puts an ARP
+ * request on the wire and ends in TIMEOUT, as if nobody answered.  ARP
+ * requests for the chip's IP are answered.
+ *
+ * TCP sockets go through LISTEN/CONNECT, data and DISCON with a peer
+ * that is well behaved: segments are taken in order only, SEND puts
+ * the data on the wire as MSS sized segments and frees it at once
+ * (nothing is retransmitted) and an RST closes the connection.
+ *
+ * The bus has a maximum rate, $W3150_EMU_MAX_RATE in Hz (0 or unset for
+ * none).  Above it reply bytes come back with flipped bits, the more
+ * often the further the clock is over, as a board with a marginal SPI
+ * path would.
+ *
+ * Transfers and the wire side take the chip's lock, so frames can be
+ * pushed and pulled from another thread while the driver runs.
+ */
+
+#define W3150_EMU_MEM_SIZE      0x8000
+#define W3150_EMU_SOCKETS       4
+#define W3150_EMU_WIRE_FRAMES   64
+#define W3150_EMU_MAX_FRAME     1518
+#define W3150_EMU_MAX_CHIPS     4
+#define W3150_EMU_ARP_ENTRIES   8
+#define W3150_EMU_MAX_RATE_ENV  "W3150_EMU_MAX_RATE"
+
+struct w3150_emu_frame {
+    uint16_t len;
+    uint8_t data[W3150_EMU_MAX_FRAME];
+};
+
+struct w3150_emu_wire {
+    struct w3150_emu_frame frames[W3150_EMU_WIRE_FRAMES];
+    unsigned int head;
+    unsigned int tail;
+};
+
+struct w3150_emu_arp {
+    uint8_t ip[4];
+    uint8_t mac[6];
+};
+
+struct w3150_emu_tcp {
+    uint32_t snd_nxt;
+    uint32_t rcv_nxt;
+    uint8_t peer_mac[6];
+};
+
+struct w3150_emu_stats {
+    uint64_t submissions;   // transport calls
+    uint64_t transactions;  // 4 byte frames
+    uint64_t bytes;         // bytes clocked, 4 per transaction
+    uint64_t reads;
+    uint64_t writes;
+    uint64_t bad_opcodes;
+    uint64_t commands;
+    uint64_t frames_in;     // pushed onto the wire and accepted
+    uint64_t datagrams_in;  // of those, taken by a UDP socket
+    uint64_t frames_dropped;// pushed but no room in the RX ring
+    uint64_t frames_out;    // sent by the driver
+    uint64_t interrupts;    // INT pin assertions
+    uint64_t garbled;       // replies spoilt by a clock above max_rate
+};
+
+struct w3150_emu {
+    int channel;
+    pthread_mutex_t lock;
+    uint8_t mem[W3150_EMU_MEM_SIZE];
+
+    // SPI clock set by the driver and the most the bus takes
+    int rate;
+    int max_rate;
+    uint32_t noise;
+
+    // Reads of Sn_CR left before a SEND is reported complete
+    unsigned int send_polls;
+    unsigned int cr_busy[W3150_EMU_SOCKETS];
+
+    struct w3150_emu_wire tx_wire;  // sent by the chip, not yet pulled
+
+    // learned from frames pushed in, oldest replaced first
+    struct w3150_emu_arp arp[W3150_EMU_ARP_ENTRIES];
+    unsigned int arp_next;
+    uint16_t ip_id;
+
+    struct w3150_emu_tcp tcp[W3150_EMU_SOCKETS];
+    uint32_t isn;
+
+    // INT pin, (IR & IMR) != 0.  irq_fd, when set, is an eventfd that
+    // gets a count every time the pin asserts.
+    uint8_t int_asserted;
+    int irq_fd;
+
+    struct w3150_emu_stats stats;
+};
+
+struct w3150_emu *w3150_emu_find(int channel);
+
+void w3150_emu_reset(struct w3150_emu *emu);
+
+/* Run one buffer of frames through the chip, replies left in place */
+void w3150_emu_transfer(struct w3150_emu *emu, uint8_t *frames, int len);
+
+/* Wire side.  push returns 0 if the frame was received, -1 if it was
+ * dropped.  pull returns the frame length, 0 if nothing was sent. */
+int w3150_emu_push_frame(struct w3150_emu *emu, const uint8_t *data, uint16_t len);
+int w3150_emu_pull_frame(struct w3150_emu *emu, uint8_t *data, uint16_t max_len);
+
+/* Direct register/memory access that bypasses the SPI counters */
+uint8_t  w3150_emu_peek(struct w3150_emu *emu, uint16_t addr);
+uint16_t w3150_emu_peek16(struct w3150_emu *emu, uint16_t addr);
+void     w3150_emu_poke(struct w3150_emu *emu, uint16_t addr, uint8_t data);
+
+void w3150_emu_clear_stats(struct w3150_emu *emu);
+
+extern const struct w3150_transport_ops w3150_emu_ops;
+
+#endif
@@ -0,0 +1,84 @@
+#ifndef W3150_FILTER_H__
+#define W3150_FILTER_H__
+
+#include <stdint.h>
+
+/* MACRAW receive filter
+ *
+ * Socket 0 in MACRAW mode takes every frame on the wire.  With a filter
+ * installed (w3150_macraw_set_filter) the driver reads the 2 byte MACRAW
+ * header and the first W3150_FILTER_PEEK bytes of each frame, and frames
+ * the filter rejects are skipped by moving S0_RX_RD past them, so their
+ * payload never crosses the SPI bus.
+ *
+ * A frame is accepted when all of these hold:
+ *   destination  it is one of the unicast addresses, a listed multicast
+ *                group, any multicast with W3150_FILTER_MULTICAST, or
+ *                broadcast with W3150_FILTER_BROADCAST.  No destination
+ *                rules at all means any destination.
+ *   VLAN         with VLAN ids listed, tagged frames must carry one of
+ *                them and untagged frames need W3150_FILTER_UNTAGGED
+ *   EtherType    with types listed, the (inner) EtherType is one of them
+ *
+ * Rules are added to the lists and w3150_filter_compile() turns them into
+ * the form w3150_filter_match() uses; compile again after changing them.
+ *
+ * As text (W3150_FILTER), a comma separated list of:
+ *   XX:XX:XX:XX:XX:XX   unicast address or multicast group
+ *   broadcast, multicast, untagged
+ *   type=N              EtherType, e.g. type=0x0800
+ *   vlan=N              VLAN id
+ */
+
+#define W3150_FILTER_ENV        "W3150_FILTER"
+
+// dst, src, TPID or EtherType, TCI, inner EtherType
+#define W3150_FILTER_PEEK       18
+
+#define W3150_FILTER_MAX_ADDRS  16
+#define W3150_FILTER_MAX_TYPES  8
+
+#define W3150_FILTER_BROADCAST  0x01
+#define W3150_FILTER_MULTICAST  0x02
+#define W3150_FILTER_UNTAGGED   0x04
+
+struct w3150_filter {
+    uint8_t flags;
+
+    // rules
+    uint8_t addrs[W3150_FILTER_MAX_ADDRS][6];
+    int n_addrs;
+    uint16_t types[W3150_FILTER_MAX_TYPES];
+    int n_types;
+    uint64_t vlans[4096 / 64];
+    int n_vlans;
+
+    // compiled
+    uint64_t ucast[W3150_FILTER_MAX_ADDRS];
+    int n_ucast;
+    uint64_t mcast[W3150_FILTER_MAX_ADDRS];
+    int n_mcast;
+    uint64_t mcast_hash;    // one bit per group, checked before the list
+    uint8_t any_dst;
+
+    // counters, updated by the driver
+    uint64_t accepted;
+    uint64_t rejected;
+    uint64_t skipped_bytes;
+};
+
+void w3150_filter_init(struct w3150_filter *f);
+/* Return 0, or -1 if the list is full */
+int  w3150_filter_add_addr(struct w3150_filter *f, const uint8_t *mac);
+int  w3150_filter_add_type(struct w3150_filter *f, uint16_t type);
+void w3150_filter_add_vlan(struct w3150_filter *f, uint16_t vid);
+/* Add the rules in spec (see above), return 0 or -1 on a bad entry */
+int  w3150_filter_parse(struct w3150_filter *f, const char *spec);
+void w3150_filter_compile(struct w3150_filter *f);
+
+/* frame starts at the destination address, len is the frame length
+ * (only the first W3150_FILTER_PEEK bytes are looked at).
+ * Returns 1 to accept, 0 to drop. */
+int  w3150_filter_match(const struct w3150_filter *f, const uint8_t *frame, uint16_t len);
+
+#endif
@@ -0,0 +1,24 @@
+#ifndef W3150_FLOW_H__
+#define W3150_FLOW_H__
+
+#include <stdint.h>
+
+/* Flow hashing
+ *
+ * Spreads Ethernet frames over several boards so that every frame of a
+ * flow takes the same one and stays in order.  The flow is:
+ *   IPv4/IPv6 + TCP, UDP or SCTP   addresses, protocol and ports
+ *   other IPv4/IPv6, fragments     addresses and protocol
+ *   anything else                  the two MAC addresses
+ * looking through up to two VLAN tags.  The hash is symmetric, both
+ * directions of a flow hash the same.
+ */
+
+uint32_t w3150_flow_hash(const uint8_t *frame, uint16_t len);
+
+/* Which of n boards a hash goes to */
+static inline unsigned int w3150_flow_pick(uint32_t hash, unsigned int n){
+    return (unsigned int)(((uint64_t)hash * n) >> 32);
+}
+
+#endif
@@ -0,0 +1,52 @@
+#ifndef W3150_IRQ_H__
+#define W3150_IRQ_H__
+
+#include <stdint.h>
+
+/* W3150 INT pin sources
+ *
+ * The INT pin is active low and stays low while (IR & IMR) != 0.  A
+ * source turns it into something a thread can sleep on and a file
+ * descriptor that can go into poll/epoll.
+ *
+ * Sources are picked by name, "source[:argument]":
+ *   gpio:[/dev/gpiochipN:]LINE  line events from the GPIO character device,
+ *                               /dev/gpiochip0 when no chip is given
+ *   eventfd                     an eventfd; the emu transport signals it
+ *                               when its INT pin asserts
+ *
+ * When no name is given the W3150_IRQ environment variable is used.
+ */
+
+#define W3150_IRQ_ENV   "W3150_IRQ"
+
+struct w3150_irq;
+
+struct w3150_irq_ops {
+    const char *name;
+    int  (*open)(struct w3150_irq *irq, const char *arg);
+    // 1 if INT is low, 0 if high, -1 if the source cannot tell
+    int  (*asserted)(struct w3150_irq *irq);
+    // Sleep until INT asserts or timeout_ms passes (-1 forever).
+    // Return 1 on an assertion, 0 on timeout, -1 on error.
+    int  (*wait)(struct w3150_irq *irq, int timeout_ms);
+    // Drop any pending notifications without blocking
+    void (*clear)(struct w3150_irq *irq);
+    void (*close)(struct w3150_irq *irq);
+};
+
+struct w3150_irq {
+    const struct w3150_irq_ops *ops;
+    int channel;
+    int fd;
+    void *priv;
+};
+
+/* Returns 0 on success, -1 if no source is configured or it failed */
+int  w3150_irq_source_open(struct w3150_irq *irq, const char *name, int channel);
+void w3150_irq_source_close(struct w3150_irq *irq);
+
+extern const struct w3150_irq_ops w3150_irq_gpio_ops;
+extern const struct w3150_irq_ops w3150_irq_eventfd_ops;
+
+#endif
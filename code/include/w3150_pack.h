@@ -0,0 +1,42 @@
+#ifndef W3150_PACK_H__
+#define W3150_PACK_H__
+
+#include <stdint.h>
+
+/* SPI frame packing
+ *
+ * Every byte of W3150 memory moves in its own 4 byte frame,
+ * {opcode, addr_hi, addr_lo, data}, so a burst of n bytes is 4n bytes on
+ * the bus.  w3150_pack() expands a range of a socket buffer into frames,
+ * with the address wrapping inside the buffer, and w3150_unpack() picks
+ * the data bytes back out of the frames a read returned.
+ *
+ * The work is done by the fastest kernel the CPU has: NEON on ARM,
+ * AVX2 or SSE2 on x86, scalar otherwise.  w3150_pack_select() forces one
+ * by name (for benchmarks), w3150_pack_kernels lists them.
+ */
+
+struct w3150_pack_ops {
+    const char *name;
+    int  (*supported)();
+    // frames[4i..4i+3] = {opcode, (addr + i) >> 8, (addr + i) & 0xff,
+    // data ? data[i] : 0}, the address does not wrap
+    void (*pack)(uint8_t *frames, uint8_t opcode, uint16_t addr, const uint8_t *data, uint16_t len);
+    // data[i] = frames[4i + 3]
+    void (*unpack)(const uint8_t *frames, uint8_t *data, uint16_t len);
+};
+
+/* Frames for len bytes at base + ((offset + i) & mask).  data is NULL
+ * for reads. */
+void w3150_pack(uint8_t *frames, uint8_t opcode, uint16_t base, uint16_t mask, uint16_t offset,
+                const uint8_t *data, uint16_t len);
+void w3150_unpack(const uint8_t *frames, uint8_t *data, uint16_t len);
+
+const struct w3150_pack_ops *w3150_pack_get();
+/* Return 0, or -1 if there is no such kernel or the CPU lacks it */
+int w3150_pack_select(const char *name);
+
+// NULL terminated, best first
+extern const struct w3150_pack_ops *w3150_pack_kernels[];
+
+#endif
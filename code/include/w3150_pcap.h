@@ -0,0 +1,91 @@
+#ifndef W3150_PCAP_H__
+#define W3150_PCAP_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Packet capture files
+ *
+ * The reader maps a classic pcap or a pcapng file and walks it frame by
+ * frame without copying, for replaying captures onto the wire.  Only
+ * Ethernet is taken: a classic file of another link type is refused,
+ * pcapng packets on other interfaces are skipped.
+ *
+ * The writer produces pcapng: a section header, one Ethernet interface
+ * with nanosecond timestamps and an enhanced packet block per frame,
+ * which keeps both the bytes captured and the frame's length on the
+ * wire.  Blocks are built in a buffer and written out with one write()
+ * when it fills up or on w3150_pcapng_flush(), never per frame, so a
+ * capture keeps up with the link without a system call per packet.
+ */
+
+#define W3150_PCAPNG_BUF_SIZE   (256 * 1024)
+#define W3150_LINKTYPE_ETHERNET 1
+#define W3150_PCAP_MAX_IFACES   16
+
+struct w3150_pcap_iface {
+    uint8_t ethernet;
+    uint8_t tsresol;        // pcapng if_tsresol, 6 for microseconds
+};
+
+struct w3150_pcap_reader {
+    const uint8_t *map;
+    size_t size;
+    size_t off;             // next record or block
+    size_t start;           // first record, for rewinding
+    uint8_t ng;             // pcapng rather than classic pcap
+    uint8_t swap;           // file written in the other byte order
+    uint8_t nsec;           // classic pcap with nanosecond timestamps
+    int num_ifaces;         // of the current pcapng section
+    struct w3150_pcap_iface ifaces[W3150_PCAP_MAX_IFACES];
+};
+
+struct w3150_pcap_pkt {
+    const uint8_t *data;    // into the mapping
+    uint32_t caplen;
+    uint32_t wire_len;
+    uint64_t ts_ns;         // 0 when the file has none (pcapng simple packets)
+};
+
+struct w3150_pcapng_writer {
+    int fd;
+    uint8_t *buf;
+    size_t size;
+    size_t used;
+    uint64_t frames;        // packets written
+    uint64_t bytes;         // file size so far
+    uint64_t writes;        // write() calls made
+};
+
+/* Map a capture file for reading
+ * return 0, -1 if it cannot be read or is not pcap/pcapng of Ethernet */
+int w3150_pcap_open(struct w3150_pcap_reader *r, const char *path);
+
+/* Next Ethernet frame, in file order
+ * return 1, 0 at the end of the file, -1 if the file is damaged there */
+int w3150_pcap_next(struct w3150_pcap_reader *r, struct w3150_pcap_pkt *pkt);
+
+/* Back to the first frame */
+void w3150_pcap_rewind(struct w3150_pcap_reader *r);
+
+void w3150_pcap_close(struct w3150_pcap_reader *r);
+
+/* Start a capture on fd with the section header and the interface
+ * description, buf_size 0 for W3150_PCAPNG_BUF_SIZE
+ * return 0, -1 on failure */
+int w3150_pcapng_open(struct w3150_pcapng_writer *w, int fd, size_t buf_size, const char *if_name,
+                      uint32_t snaplen, const char *app);
+
+/* Add a frame, ts_ns is wall clock time in ns since the epoch
+ * return 0, -1 if writing the buffer out failed */
+int w3150_pcapng_add(struct w3150_pcapng_writer *w, uint64_t ts_ns, const uint8_t *data,
+                     uint32_t caplen, uint32_t wire_len);
+
+/* return 0, -1 on failure */
+int w3150_pcapng_flush(struct w3150_pcapng_writer *w);
+
+/* Flush and free the buffer, fd stays open
+ * return 0, -1 if the last write failed */
+int w3150_pcapng_close(struct w3150_pcapng_writer *w);
+
+#endif
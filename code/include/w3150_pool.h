@@ -0,0 +1,60 @@
+#ifndef W3150_POOL_H__
+#define W3150_POOL_H__
+
+#include <stdint.h>
+#include <pthread.h>
+
+/* Frame buffer pool
+ *
+ * Fixed size buffers, each big enough for one MACRAW frame with its
+ * 2 byte header plus the head of the frame after it, so the receive
+ * path can read straight into them (w3150_macraw_read_bufs()) and the
+ * tap can be written from them (w3150_tapio.h) without a copy in
+ * between.  The buffers are allocated once by w3150_pool_init() and
+ * recycled through a free list from then on.
+ *
+ * The frame in a buffer is len bytes at data + off.  A buffer may be
+ * taken from a pool in one thread and put back in another, e.g. a
+ * frame read from the tap by one board and sent by another.
+ */
+
+#define W3150_BUF_SIZE      1600    // 2 + 1518 + filter head, in 64 byte lines
+
+struct w3150_pool;
+
+struct w3150_buf {
+    struct w3150_buf *next;     // free list, or the owner's own queue
+    struct w3150_pool *pool;
+    int32_t res;                // result of the last tap I/O, see w3150_tapio.h
+    uint16_t off;
+    uint16_t len;
+    uint8_t data[W3150_BUF_SIZE] __attribute__((aligned(64)));
+};
+
+struct w3150_pool {
+    pthread_mutex_t lock;
+    struct w3150_buf *free;
+    struct w3150_buf *bufs;
+    int count;
+    int available;
+    uint64_t empty;             // gets that found no buffer
+};
+
+/* return 0, or -1 if the buffers cannot be allocated */
+int w3150_pool_init(struct w3150_pool *pool, int count);
+void w3150_pool_destroy(struct w3150_pool *pool);
+
+/* return a buffer, NULL when all are in use */
+struct w3150_buf *w3150_pool_get(struct w3150_pool *pool);
+
+/* Take up to max buffers at once
+ * return the number stored in bufs[] */
+int w3150_pool_get_many(struct w3150_pool *pool, struct w3150_buf **bufs, int max);
+
+void w3150_pool_put(struct w3150_buf *buf);
+
+static inline uint8_t *w3150_buf_frame(struct w3150_buf *buf){
+    return buf->data + buf->off;
+}
+
+#endif
@@ -0,0 +1,179 @@
+#ifndef W3150_STATS_H__
+#define W3150_STATS_H__
+
+#include <stdint.h>
+
+/* Runtime statistics
+ *
+ * Each device counts into a struct w3150_stats made of slots a cache
+ * line apart, every slot with a single writer: bus by whichever thread
+ * holds the bus, rx by the receive side, tx by the transmit side.  RX
+ * interleaving (w3150_set_rx_interleave()) has the transmit side read
+ * frames and count them in rx as well, which keeps a single writer only
+ * because interleaving is for a device used from one thread; with the
+ * sides in separate threads leave it off.
+ * Counters are bumped with relaxed atomic stores, so nothing takes a
+ * lock, no line bounces between the threads and a reader never sees a
+ * torn value.  Keeping them reads nothing from the chip, sizes and
+ * times are what the driver has in hand anyway and the clock comes
+ * from the vDSO.  Even so a clock read costs about as much as the
+ * driver's own work for a small frame, so transfers, RX reads and TX
+ * staging are timed one in W3150_STATS_SAMPLE; waits are timed anyway
+ * and always counted.
+ *
+ * Every field is a count that only goes up (histograms count samples
+ * per bucket), so the difference of two snapshots is what happened in
+ * between.
+ *
+ * w3150_stats_export() moves a process's devices into a shared memory
+ * segment, W3150_STATS_DEFAULT unless $W3150_STATS names another one
+ * ("off" for none), that everyone else can only map read only.
+ * w3150_stat shows it live.  Until then the counters live in the
+ * device.
+ */
+
+#define W3150_STATS_ENV         "W3150_STATS"
+#define W3150_STATS_DEFAULT     "/w3150-stats"
+#define W3150_STATS_MAGIC       0x57335354      // "W3ST"
+#define W3150_STATS_VERSION     1
+#define W3150_STATS_DEVS        8
+#define W3150_CACHE_LINE        64
+#define W3150_STATS_SAMPLE      16              // a power of 2
+
+/* Log2 histogram, bucket b counts values in [2^b, 2^(b + 1)), bucket 0
+ * takes 0 as well and the last one everything above it */
+#define W3150_HIST_BUCKETS      32
+
+struct w3150_hist {
+    uint64_t count[W3150_HIST_BUCKETS];
+    uint64_t sum;
+};
+
+/* SPI bus, written under the bus lock */
+struct w3150_bus_stats {
+    uint64_t transfers;         // calls into the backend
+    uint64_t frames;            // 4 byte frames clocked
+    uint64_t errors;            // failed transfers
+    uint64_t contended;         // turns that had to wait
+    uint64_t wait_ns;           // waiting for turns
+    uint64_t busy_ns;           // in the backend, from the timed transfers
+    struct w3150_hist transfer_ns;      // sampled
+} __attribute__((aligned(W3150_CACHE_LINE)));
+
+/* Receive side.  A read is one look at the chip by macraw_read,
+ * read_batch or read_bufs (or an interleaved one, see
+ * w3150_set_rx_interleave()). */
+struct w3150_rx_stats {
+    uint64_t frames;
+    uint64_t bytes;
+    uint64_t reads;
+    uint64_t empty;             // reads that found nothing
+    uint64_t interleaved;       // of frames, read during TX waits
+    uint64_t wraps;             // bursts that ran off the end of RX memory
+
+    // filled by the application: frames passed on (e.g. written to a
+    // tap), those that failed and the system calls it took
+    uint64_t host_frames;
+    uint64_t host_errors;
+    uint64_t host_calls;
+
+    struct w3150_hist fill;     // S0_RX_RSR in bytes, at reads that found data
+    struct w3150_hist read_ns;  // reads that returned frames, sampled
+} __attribute__((aligned(W3150_CACHE_LINE)));
+
+/* Transmit side */
+struct w3150_tx_stats {
+    uint64_t frames;
+    uint64_t bytes;
+    uint64_t full;              // submits turned away for lack of room
+    uint64_t wraps;             // bursts that ran off the end of TX memory
+    uint64_t send_spins;        // status reads that found the SEND still going
+    uint64_t space_waits;       // writes that waited for room
+    uint64_t send_waits;        // writes, flushes and datagrams that waited for SEND
+
+    // filled by the application: frames taken in (e.g. read from a
+    // tap), failed attempts and the system calls it took
+    uint64_t host_frames;
+    uint64_t host_errors;
+    uint64_t host_calls;
+
+    struct w3150_hist stage_ns;         // copying a frame into TX memory, sampled
+    struct w3150_hist space_wait_ns;
+    struct w3150_hist send_wait_ns;
+} __attribute__((aligned(W3150_CACHE_LINE)));
+
+struct w3150_stats {
+    struct w3150_bus_stats bus;
+    struct w3150_rx_stats rx;
+    struct w3150_tx_stats tx;
+};
+
+/* Shared memory layout, magic is set last */
+struct w3150_stats_dev {
+    int32_t channel;
+    char transport[28];
+    struct w3150_stats stats;
+};
+
+struct w3150_stats_shm {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t size;              // of this struct
+    uint32_t num_devs;
+    int32_t pid;
+    uint64_t start_ns;          // CLOCK_MONOTONIC at export
+    struct w3150_stats_dev devs[W3150_STATS_DEVS];
+};
+
+/* Only the slot's own writer calls these */
+static inline void w3150_stat_add(uint64_t *c, uint64_t n){
+    __atomic_store_n(c, __atomic_load_n(c, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+static inline void w3150_stat_set(uint64_t *c, uint64_t v){
+    __atomic_store_n(c, v, __ATOMIC_RELAXED);
+}
+
+/* 1 when the event that makes count go up next is to be timed */
+static inline int w3150_stat_sampled(uint64_t count){
+    return (count & (W3150_STATS_SAMPLE - 1)) == 0;
+}
+
+static inline void w3150_hist_add(struct w3150_hist *h, uint64_t v){
+
+    int b = (v == 0) ? 0 : 63 - __builtin_clzll(v);
+
+    if (b >= W3150_HIST_BUCKETS)
+        b = W3150_HIST_BUCKETS - 1;
+
+    w3150_stat_add(&h->count[b], 1);
+    w3150_stat_add(&h->sum, v);
+}
+
+struct w3150_dev;
+
+/* Move the counters of devs[0] to devs[count - 1] into the segment
+ * name (NULL for $W3150_STATS, then W3150_STATS_DEFAULT), replacing
+ * one left by a process that is gone; while its process still runs the
+ * export fails.  Call after w3150_dev_init_networking() and before any
+ * receive or transmit thread starts.
+ * return 0, 1 when turned off, -1 on failure */
+int w3150_stats_export(struct w3150_dev **devs, int count, const char *name);
+
+/* Remove the exported segment's name, the mapping stays */
+void w3150_stats_unlink();
+
+/* Map a segment read only
+ * return it, or NULL if it is missing or not a stats segment */
+const struct w3150_stats_shm *w3150_stats_open(const char *name);
+void w3150_stats_close(const struct w3150_stats_shm *shm);
+
+/* Copy live counters, dst and src may be in different processes */
+void w3150_stats_snapshot(struct w3150_stats *dst, const struct w3150_stats *src);
+
+/* Upper bound of the bucket holding the p quantile (0 to 1) of the
+ * samples, 0 with none */
+uint64_t w3150_hist_percentile(const struct w3150_hist *h, double p);
+uint64_t w3150_hist_samples(const struct w3150_hist *h);
+
+#endif
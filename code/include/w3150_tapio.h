@@ -0,0 +1,96 @@
+#ifndef W3150_TAPIO_H__
+#define W3150_TAPIO_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <w3150_pool.h>
+
+/* Batched frame I/O on a tap
+ *
+ * A tap moves exactly one frame per read() or write(), writev() only
+ * gathers the pieces of a single frame, so a burst of N frames costs N
+ * system calls.  With io_uring each frame is one submission queue
+ * entry instead and a whole burst goes to the kernel in one
+ * io_uring_enter(), reads are kept posted and complete as frames
+ * arrive.  Where io_uring is not available (not built with it, an old
+ * kernel, a seccomp filter) or W3150_TAPIO=plain, the same calls fall
+ * back to one read() or write() per frame on the non-blocking fd.
+ *
+ * Usage, one thread per w3150_tapio:
+ *     w3150_tapio_write(&io, buf) / w3150_tapio_read(&io, buf)   queue
+ *     w3150_tapio_submit(&io)                                    start
+ *     n = w3150_tapio_reap(&io, done, max, wait)                 finished
+ * A finished buffer has res set to the bytes moved or -errno, a read
+ * has the frame at data, len bytes.  Buffers belong to the kernel from
+ * queueing until they are reaped.  poll() w3150_tapio_fd() for POLLIN
+ * to sleep until something can be reaped.
+ */
+
+#define W3150_TAPIO_ENV     "W3150_TAPIO"   // "uring" (default) or "plain"
+
+struct w3150_tapio {
+    int fd;                     // the tap
+    int ring_fd;                // io_uring, -1 in plain mode
+    unsigned int depth;         // buffers queued or in flight at most
+    unsigned int queued;        // not submitted yet
+    unsigned int inflight;      // submitted, not reaped
+
+    // io_uring rings, mapped from ring_fd
+    void *sq_map;
+    void *cq_map;
+    void *sqes;
+    size_t sq_map_len;
+    size_t cq_map_len;
+    size_t sqes_len;
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int *sq_mask;
+    unsigned int *sq_array;
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int *cq_mask;
+    void *cqes;
+    unsigned int sq_local_tail;
+
+    // plain mode
+    struct w3150_buf *reads;    // posted
+    struct w3150_buf *done;     // written
+
+    uint64_t frames;            // reaped
+    uint64_t calls;             // system calls made
+};
+
+/* depth is the most buffers that are ever queued at once
+ * return 0, or -1 if nothing works */
+int w3150_tapio_init(struct w3150_tapio *io, int fd, unsigned int depth);
+void w3150_tapio_close(struct w3150_tapio *io);
+
+/* 1 when using io_uring */
+int w3150_tapio_uring(struct w3150_tapio *io);
+
+/* Queue len bytes at data + off to go out as one frame
+ * return 0, or -1 when depth buffers are already queued */
+int w3150_tapio_write(struct w3150_tapio *io, struct w3150_buf *buf);
+
+/* Queue a read of the next frame into buf
+ * return 0, or -1 when depth buffers are already queued */
+int w3150_tapio_read(struct w3150_tapio *io, struct w3150_buf *buf);
+
+/* Hand the queued buffers to the kernel
+ * return 0, or -errno */
+int w3150_tapio_submit(struct w3150_tapio *io);
+
+/* Collect up to max finished buffers, waiting for at least one when
+ * wait is set and something is in flight
+ * return the number stored in done[] */
+int w3150_tapio_reap(struct w3150_tapio *io, struct w3150_buf **done, int max, int wait);
+
+/* fd that polls readable when there may be buffers to reap */
+int w3150_tapio_fd(struct w3150_tapio *io);
+
+/* Buffers queued or in flight */
+static inline unsigned int w3150_tapio_pending(struct w3150_tapio *io){
+    return io->queued + io->inflight;
+}
+
+#endif
@@ -0,0 +1,129 @@
+#ifndef W3150_TRACE_H__
+#define W3150_TRACE_H__
+
+#include <stdint.h>
+
+/* SPI transaction trace
+ *
+ * While tracing, every turn on the bus (one backend transfer of up to
+ * max_frames frames) leaves a fixed size binary record in a ring
+ * allocated up front: when it started and how long it took, the opcode,
+ * address and data of its first frame, how many frames it carried and
+ * which driver operation asked for it.  The record is written under the
+ * bus lock, so the ring has one writer at a time and tracing costs two
+ * clock reads and a 32 byte store per transfer.  Nothing is printed and
+ * nothing is ever allocated while running.  The ring keeps the newest
+ * records, older ones are overwritten.
+ *
+ * A dump copies the ring without stopping the driver and writes a
+ * section of the binary format below, records oldest first.  Sections
+ * for several devices go one after the other in the same file.
+ * w3150_trace_analyze reads them back and charges bus time and
+ * transactions to the operations.
+ *
+ * $W3150_TRACE=<records> starts tracing every device as it opens its
+ * bus, rounded up to a power of 2.
+ */
+
+#define W3150_TRACE_ENV         "W3150_TRACE"
+#define W3150_TRACE_FILE_ENV    "W3150_TRACE_FILE"
+#define W3150_TRACE_FILE        "w3150-trace.bin"
+#define W3150_TRACE_MAGIC       0x52543357      // "W3TR"
+#define W3150_TRACE_VERSION     1
+#define W3150_TRACE_MAX         (1 << 24)       // records
+
+/* What a transfer was for, the driver tags every one of them */
+enum {
+    W3150_OP_USER = 0,      // w3150_read/write, command queues and register wrappers
+    W3150_OP_SETUP,         // init, set_*, shadow, calibration, socket open and close
+    W3150_OP_RX_SIZE,       // S0_RX_RSR, with the first header when read together
+    W3150_OP_RX_HEADER,     // frame headers read on their own, for the filter
+    W3150_OP_RX_PAYLOAD,    // frame data, and the headers inside a burst
+    W3150_OP_RX_COMMIT,     // S0_RX_RD and RECV
+    W3150_OP_TX_STATUS,     // S0_CR and S0_TX_FSR, the SEND in flight and room
+    W3150_OP_TX_PAYLOAD,    // frame data into TX memory
+    W3150_OP_TX_COMMIT,     // S0_TX_WR and SEND
+    W3150_OP_IRQ,           // S0_IR read and clear
+    W3150_OP_SOCK_STATUS,   // UDP and TCP status, sizes and pointers
+    W3150_OP_SOCK_PAYLOAD,  // UDP and TCP data either way
+    W3150_OP_SOCK_COMMIT,   // UDP and TCP pointer updates and commands
+    W3150_OP_COUNT
+};
+
+#define W3150_TRACE_OP_NAME     16
+
+/* One bus turn */
+struct w3150_trace_rec {
+    uint64_t ts_ns;         // CLOCK_MONOTONIC when the transfer started
+    uint32_t dur_ns;
+    uint16_t frames;
+    uint16_t addr;          // of the first frame
+    uint16_t last_addr;     // of the last frame
+    uint8_t opcode;         // of the first frame, W3150_READ or W3150_WRITE
+    uint8_t tx_data;        // first frame's data byte as sent
+    uint8_t rx_data;        // and as received
+    uint8_t op;             // W3150_OP_*
+    uint8_t failed;         // the backend returned an error
+    uint8_t pad[9];
+};
+
+struct w3150_trace {
+    uint32_t mask;          // records - 1
+    uint64_t head;          // records written since start
+    struct w3150_trace_rec rec[];
+};
+
+/* File section, followed by num_ops names of W3150_TRACE_OP_NAME bytes
+ * and count records */
+struct w3150_trace_hdr {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t rec_size;
+    int32_t channel;
+    uint32_t num_ops;
+    uint64_t count;         // records that follow
+    uint64_t lost;          // overwritten before the dump
+    uint64_t dump_ns;       // CLOCK_MONOTONIC at the dump
+    char transport[16];
+};
+
+/* Ring of at least records entries, NULL if it cannot be allocated */
+struct w3150_trace *w3150_trace_alloc(uint32_t records);
+void w3150_trace_free(struct w3150_trace *tr);
+
+/* Called by the transport under the bus lock around each backend
+ * transfer: begin before it with the frames about to go out, end after
+ * it with the reply in the same buffer.  The record only counts once it
+ * has ended. */
+struct w3150_trace_rec *w3150_trace_begin(struct w3150_trace *tr, uint8_t op, const uint8_t *frames, int len);
+void w3150_trace_end(struct w3150_trace *tr, struct w3150_trace_rec *r, const uint8_t *frames,
+                     uint64_t start_ns, uint64_t end_ns, int failed);
+
+/* Write a section to fd, may run while the ring is being written
+ * return 0, -1 on failure */
+int w3150_trace_dump(const struct w3150_trace *tr, int fd, int channel, const char *transport);
+
+const char *w3150_trace_op_name(uint8_t op);
+
+struct w3150_dev;
+
+/* Start tracing with a ring of records entries, a running trace is
+ * dropped.  Takes a turn on the bus, the receive and transmit threads
+ * may be running.
+ * return 0, -1 if the bus is not open or there is no memory */
+int w3150_dev_trace_start(struct w3150_dev *dev, uint32_t records);
+
+/* Stop and free the ring, must not overlap a dump */
+void w3150_dev_trace_stop(struct w3150_dev *dev);
+
+/* Write the device's section to fd
+ * return 0, 1 if it is not tracing, -1 on failure */
+int w3150_dev_trace_dump(struct w3150_dev *dev, int fd);
+
+/* Dump devs[0] to devs[count - 1] into path (NULL for
+ * $W3150_TRACE_FILE, then W3150_TRACE_FILE), replacing it.  Devices
+ * that are not tracing are left out, with none of them nothing is written.
+ * return the number of sections written, -1 on failure */
+int w3150_trace_dump_file(struct w3150_dev **devs, int count, const char *path);
+
+#endif
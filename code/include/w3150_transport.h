@@ -0,0 +1,99 @@
+#ifndef W3150_TRANSPORT_H__
+#define W3150_TRANSPORT_H__
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <w3150_stats.h>
+#include <w3150_trace.h>
+
+/* SPI transport layer
+ *
+ * Every W3150 access is a 4 byte frame {opcode, addr_hi, addr_lo, data}
+ * and the chip needs chip select released between frames.  A transport
+ * takes a buffer holding any number of those frames, clocks them out
+ * full duplex and leaves the received bytes in place.  Backends that can
+ * queue several frames per system call (spidev) get the whole buffer in
+ * chunks of at most max_frames.
+ *
+ * Backends are picked at runtime by name, "backend[:argument]":
+ *   spidev[:/dev/spidevX.Y]  Linux spidev, default /dev/spidev0.<channel>
+ *   wiringpi                 wiringPi, only when built with HAVE_WIRINGPI
+ *   loopback[:bufsiz]        spidev's messages run against the emu model
+ *   emu[:max_frames]         software W3150A+, see w3150_emu.h
+ *
+ * When no name is given the W3150_TRANSPORT environment variable is used,
+ * then spidev.
+ *
+ * A transport may be shared by several threads.  Each submission to the
+ * backend is a turn on the bus and turns are handed out in arrival order
+ * (a ticket lock), so threads interleave chunk by chunk and none of them
+ * can hold the bus for a whole large burst.  Frames are independent
+ * register accesses, so interleaving is safe at any frame boundary.
+ *
+ * Each transfer carries the W3150_OP_* it was made for, which only
+ * matters to the trace (see w3150_trace.h).
+ */
+
+#define W3150_FRAME_SIZE        4
+#define W3150_TRANSPORT_ENV     "W3150_TRANSPORT"
+#define W3150_TRANSPORT_DEFAULT "spidev"
+
+struct w3150_transport;
+
+/* Bus arbiter.  A waiter spins for a short while, most turns are a few
+ * register frames, then sleeps on a futex. */
+struct w3150_bus {
+    atomic_uint next;       // next ticket to hand out
+    atomic_uint serving;    // ticket that owns the bus
+    atomic_int waiters;     // sleeping in the futex
+};
+
+struct w3150_transport_ops {
+    const char *name;
+    // arg is the text after ':' in the transport name, or NULL
+    int  (*open)(struct w3150_transport *t, const char *arg);
+    // len is always a multiple of W3150_FRAME_SIZE and at most
+    // max_frames frames.  Return 0 on success.
+    int  (*transfer)(struct w3150_transport *t, uint8_t *frames, int len);
+    int  (*set_rate)(struct w3150_transport *t, int rate);
+    void (*close)(struct w3150_transport *t);
+};
+
+struct w3150_transport {
+    const struct w3150_transport_ops *ops;
+    int channel;
+    int rate;
+    int fd;
+    int max_frames;     // frames per ops->transfer call, set by open
+    void *priv;
+    struct w3150_bus bus;
+
+    // Bus accounting, counted under the bus lock.  stats points at
+    // local_stats after open, the device moves it to its own.
+    struct w3150_bus_stats *stats;
+    struct w3150_bus_stats local_stats;
+
+    // NULL unless tracing, changed under the bus lock
+    struct w3150_trace *trace;
+};
+
+const struct w3150_transport_ops *w3150_transport_find(const char *name);
+
+/* Returns 0 on success, -1 if the backend is unknown or failed to open */
+int  w3150_transport_open(struct w3150_transport *t, const char *name, int channel, int rate);
+int  w3150_transport_transfer(struct w3150_transport *t, uint8_t *frames, int len, uint8_t op);
+int  w3150_transport_set_rate(struct w3150_transport *t, int rate);
+
+/* Install a trace ring (NULL stops tracing) between two turns on the bus
+ * return the one it replaces */
+struct w3150_trace *w3150_transport_set_trace(struct w3150_transport *t, struct w3150_trace *tr);
+void w3150_transport_close(struct w3150_transport *t);
+
+/* Backends */
+extern const struct w3150_transport_ops w3150_spidev_ops;
+extern const struct w3150_transport_ops w3150_loopback_ops;
+#ifdef HAVE_WIRINGPI
+extern const struct w3150_transport_ops w3150_wiringpi_ops;
+#endif
+
+#endif
@@ -0,0 +1,64 @@
+#ifndef W3150_WAIT_H__
+#define W3150_WAIT_H__
+
+#include <stdint.h>
+
+/* Wait strategy for polling loops
+ *
+ * usleep(1) really sleeps for the timer slack, 50-100us on a stock
+ * kernel, which is longer than most of the things the driver waits on.
+ * A waiter busy polls for a bounded budget first, then sleeps with an
+ * exponential backoff.  It keeps a moving average of how long recent
+ * waits took (or, in event loop form, the gaps between events): when
+ * those fit in the spin window the whole window is spun, otherwise only
+ * a short slice of it before going to sleep.
+ *
+ * Loop form:
+ *     w3150_wait_begin(&w);
+ *     while (!condition())
+ *         w3150_wait_step(&w);
+ *     w3150_wait_end(&w);      // returns how long it took
+ *
+ * Event loop form: w3150_wait_next(&w, found_work) after each pass gives
+ * the time to sleep before the next one, 0 meaning poll again now.
+ */
+
+struct w3150_wait {
+    uint32_t spin_ns;       // longest busy poll
+    uint32_t sleep_min_ns;
+    uint32_t sleep_max_ns;
+
+    uint64_t start_ns;      // begin of this wait or last event
+    uint32_t sleep_ns;      // current backoff
+    uint32_t avg_ns;        // moving average of wait lengths/event gaps
+};
+
+void w3150_wait_init(struct w3150_wait *w, uint32_t spin_ns, uint32_t sleep_min_ns, uint32_t sleep_max_ns);
+void w3150_wait_begin(struct w3150_wait *w);
+void w3150_wait_step(struct w3150_wait *w);
+uint64_t w3150_wait_end(struct w3150_wait *w);
+uint64_t w3150_wait_elapsed_ns(struct w3150_wait *w);
+uint32_t w3150_wait_next(struct w3150_wait *w, int found_work);
+
+uint64_t w3150_now_ns();
+
+/* Hint to the CPU that this is a spin loop */
+#if defined(__x86_64__) || defined(__i386__)
+#define w3150_cpu_relax() __builtin_ia32_pause()
+#elif defined(__aarch64__) || defined(__arm__)
+#define w3150_cpu_relax() __asm__ __volatile__("yield" ::: "memory")
+#else
+#define w3150_cpu_relax() __asm__ __volatile__("" ::: "memory")
+#endif
+
+/* Real time setup for the calling process: pin to cpu (if >= 0), run
+ * SCHED_FIFO at priority (if > 0), lock memory (if lock_memory) and
+ * drop the timer slack to 1ns.  Returns 0 if everything asked for
+ * worked.  w3150_rt_setup_env() takes "cpu[,priority]" from $W3150_RT
+ * and locks memory when it is set. */
+#define W3150_RT_ENV "W3150_RT"
+
+int w3150_rt_setup(int cpu, int priority, int lock_memory);
+int w3150_rt_setup_env();
+
+#endif
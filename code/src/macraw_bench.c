@@ -0,0 +1,515 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/utsname.h>
+
+#include <w3150.h>
+#include <w3150_dev.h>
+#include <w3150_emu.h>
+#include <w3150_wait.h>
+
+/*
+ * Throughput and latency benchmark for the MACRAW hot path.
+ *
+ * For each frame size w3150_macraw_write(), w3150_macraw_read() and
+ * w3150_macraw_read_batch() are timed call by call, reporting frames/s,
+ * Mbit/s, SPI transfers and bus bytes per frame and the p50/p99/p999
+ * latency of a call.  As the frames walk through the socket buffers some
+ * cross the end and wrap, those calls are also reported on their own.
+ *
+ * With the emu transport (make bench) frames are pushed into the model
+ * outside the timed calls, so the numbers are the host side cost of the
+ * driver.  Every frame the model sends or the driver hands back is also
+ * compared with what was written or pushed, and a mismatch fails the
+ * run.  On the board (W3150_TRANSPORT=spidev...) TX frames go out on
+ * the wire and RX takes whatever arrives within -d seconds, so a
+ * traffic source is needed for the RX cases.
+ *
+ * The report is JSON, one case per line.  With -b the cases are compared
+ * with a stored report and more SPI transfers per frame counts as a
+ * regression.  Throughput depends on the machine and its load, so less
+ * of it only counts with -T, and then only when the baseline was taken
+ * on the same transport and architecture.  Exits 1 on a regression or a
+ * mismatch.
+ *
+ * Run: ./macraw_bench [-n frames] [-d seconds] [-o report] [-b baseline] [-t tolerance%] [-T]
+ */
+
+#define MAX_CASES       32
+#define RX_BATCH        64
+
+static const uint16_t sizes[] = {60, 128, 256, 512, 1024, 1514};
+#define NUM_SIZES       (sizeof(sizes) / sizeof(sizes[0]))
+
+enum { OP_TX, OP_RX, OP_RX_BATCH, NUM_OPS };
+static const char *op_names[NUM_OPS] = {"tx", "rx", "rx_batch"};
+
+struct latency {
+    uint32_t p50;
+    uint32_t p99;
+    uint32_t p999;
+};
+
+struct result {
+    int op;
+    uint16_t size;
+    long frames;
+    long wrapped;
+    long mismatches;        // frames that came out different, emu only
+    double seconds;         // inside the timed calls
+    double frames_per_s;
+    double mbit_per_s;
+    double transfers;       // SPI transfers per frame
+    double bus_bytes;       // bytes on the bus per frame
+    struct latency all;
+    struct latency wrap;    // calls whose frame wrapped
+};
+
+static struct result results[MAX_CASES];
+static int num_results;
+
+static struct w3150_dev *dev;
+static struct w3150_emu *emu;   // NULL on real hardware
+
+// what the cases write and push, a different pattern for each size
+static uint8_t tx_frame[MACRAW_MAX_FRAME];
+static uint8_t rx_frame[MACRAW_MAX_FRAME];
+
+static uint32_t *samples;
+static uint32_t *wrap_samples;
+
+static int cmp_u32(const void *a, const void *b){
+
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+static uint32_t percentile(const uint32_t *sorted, long n, double p){
+
+    long i;
+
+    if (n == 0)
+        return 0;
+
+    i = (long)(p * n);
+    if (i >= n)
+        i = n - 1;
+    return sorted[i];
+}
+
+static void latency_of(uint32_t *s, long n, struct latency *l){
+
+    qsort(s, n, sizeof(s[0]), cmp_u32);
+    l->p50 = percentile(s, n, 0.50);
+    l->p99 = percentile(s, n, 0.99);
+    l->p999 = percentile(s, n, 0.999);
+}
+
+static void finish(struct result *r, long bytes, uint64_t submissions, uint64_t bus_frames){
+
+    r->frames_per_s = (r->seconds > 0) ? r->frames / r->seconds : 0;
+    r->mbit_per_s = (r->seconds > 0) ? bytes * 8 / r->seconds / 1e6 : 0;
+    r->transfers = r->frames ? (double)submissions / r->frames : 0;
+    r->bus_bytes = r->frames ? (double)bus_frames * W3150_FRAME_SIZE / r->frames : 0;
+}
+
+static void fill_frame(uint8_t *frame, uint16_t size, int step){
+
+    int i;
+
+    for (i = 0; i < size; i++)
+        frame[i] = (uint8_t)(i * step + size);
+    memset(frame, 0xff, 6);
+}
+
+/* Take what the model sent off its wire
+ * return the number of frames that differ from the one written */
+static long emu_drain(uint16_t size, long *pulled){
+
+    static uint8_t buf[W3150_EMU_MAX_FRAME];
+    long bad = 0;
+    int len;
+
+    while ((len = w3150_emu_pull_frame(emu, buf, sizeof(buf))) > 0){
+        if (len != size || memcmp(buf, tx_frame, size) != 0)
+            bad++;
+        (*pulled)++;
+    }
+
+    return bad;
+}
+
+/* w3150_macraw_write() of n frames of one size */
+static void bench_tx(struct result *r, long n){
+
+    struct w3150_sock_mem *mem = &dev->mem[0];
+    uint64_t submissions = dev->stats->bus.transfers;
+    uint64_t bus_frames = dev->stats->bus.frames;
+    uint64_t t0;
+    uint32_t ns;
+    long nw = 0;
+    long pulled = 0;
+    long i;
+    int wrapped;
+
+    fill_frame(tx_frame, r->size, 7);
+
+    for (i = 0; i < n; i++){
+        wrapped = (dev->txq.staged_wr & mem->tx_mask) + r->size > mem->tx_mask + 1U;
+
+        t0 = w3150_now_ns();
+        w3150_macraw_write(tx_frame, r->size);
+        ns = w3150_now_ns() - t0;
+
+        // before the wire fills up and drops the oldest
+        if (emu != NULL)
+            r->mismatches += emu_drain(r->size, &pulled);
+
+        samples[i] = ns;
+        if (wrapped)
+            wrap_samples[nw++] = ns;
+        r->seconds += ns / 1e9;
+    }
+    w3150_macraw_tx_flush();
+
+    if (emu != NULL){
+        r->mismatches += emu_drain(r->size, &pulled);
+        if (pulled != n)
+            r->mismatches += labs(n - pulled);
+    }
+
+    r->frames = n;
+    r->wrapped = nw;
+    latency_of(samples, n, &r->all);
+    latency_of(wrap_samples, nw, &r->wrap);
+    finish(r, n * r->size, dev->stats->bus.transfers - submissions, dev->stats->bus.frames - bus_frames);
+}
+
+/* Fill the model's RX buffer with frames of one size
+ * return the number pushed */
+static long emu_fill(uint16_t size, long max){
+
+    long n = 0;
+
+    while (n < max && w3150_emu_push_frame(emu, rx_frame, size) == 0)
+        n++;
+
+    return n;
+}
+
+/* w3150_macraw_read() or read_batch of n frames of one size, or of
+ * what arrives in seconds on real hardware */
+static void bench_rx(struct result *r, long n, double seconds){
+
+    static uint8_t buf[0x2000];
+    struct w3150_frame frames[RX_BATCH];
+    struct w3150_sock_mem *mem = &dev->mem[0];
+    uint64_t submissions = 0;
+    uint64_t bus_frames = 0;
+    uint64_t s0, f0;
+    uint16_t rx_rd;
+    uint64_t deadline = w3150_now_ns() + (uint64_t)(seconds * 1e9);
+    uint64_t t0;
+    uint32_t ns;
+    long bytes = 0;
+    long got = 0;
+    long nw = 0;
+    long pending = 0;
+    int count;
+    int i;
+    int wrapped;
+
+    fill_frame(rx_frame, r->size, 3);
+
+    while (got < n){
+        if (emu != NULL && pending == 0){
+            pending = emu_fill(r->size, n - got);
+            if (pending == 0)
+                break;
+        }
+        else if (emu == NULL && w3150_now_ns() > deadline)
+            break;
+
+        rx_rd = dev->shadow.rx_rd;
+        s0 = dev->stats->bus.transfers;
+        f0 = dev->stats->bus.frames;
+
+        t0 = w3150_now_ns();
+        if (r->op == OP_RX){
+            frames[0].data = buf;
+            frames[0].len = w3150_macraw_read(buf);
+            count = (frames[0].len != 0);
+        }
+        else
+            count = w3150_macraw_read_batch(buf, sizeof(buf), frames, RX_BATCH);
+        ns = w3150_now_ns() - t0;
+
+        // idle polls on the board are not part of the numbers, on the
+        // model the buffer is refilled
+        if (count == 0){
+            pending = 0;
+            continue;
+        }
+
+        // read pointer moved over the end of the buffer
+        wrapped = (rx_rd & mem->rx_mask) + (uint16_t)(dev->shadow.rx_rd - rx_rd) > mem->rx_mask + 1U;
+        submissions += dev->stats->bus.transfers - s0;
+        bus_frames += dev->stats->bus.frames - f0;
+
+        // a batch is one call, its latency counts once per frame
+        if (count > n - got)
+            count = n - got;
+        for (i = 0; i < count; i++){
+            samples[got + i] = ns / count;
+            bytes += frames[i].len;
+            if (emu != NULL && (frames[i].len != r->size || memcmp(frames[i].data, rx_frame, r->size) != 0))
+                r->mismatches++;
+        }
+        if (wrapped)
+            wrap_samples[nw++] = ns / count;
+
+        got += count;
+        pending -= count;
+        if (pending < 0)
+            pending = 0;
+        r->seconds += ns / 1e9;
+    }
+
+    r->frames = got;
+    r->wrapped = nw;
+    latency_of(samples, got, &r->all);
+    latency_of(wrap_samples, nw, &r->wrap);
+    finish(r, bytes, submissions, bus_frames);
+}
+
+static void print_report(FILE *f, const char *transport, const char *machine, long n){
+
+    struct result *r;
+    int i;
+
+    fprintf(f, "{\n");
+    fprintf(f, "  \"transport\": \"%s\",\n", transport);
+    fprintf(f, "  \"machine\": \"%s\",\n", machine);
+    fprintf(f, "  \"spi_rate\": %d,\n", dev->spi.rate);
+    fprintf(f, "  \"frames_per_case\": %ld,\n", n);
+    fprintf(f, "  \"cases\": [\n");
+
+    for (i = 0; i < num_results; i++){
+        r = &results[i];
+        fprintf(f, "    {\"op\": \"%s\", \"size\": %u, \"frames\": %ld, \"frames_per_s\": %.0f, "
+                   "\"mbit_per_s\": %.2f, \"spi_transfers_per_frame\": %.3f, \"spi_bytes_per_frame\": %.1f, "
+                   "\"latency_ns\": {\"p50\": %u, \"p99\": %u, \"p999\": %u}, "
+                   "\"wrapped\": %ld, \"wrapped_latency_ns\": {\"p50\": %u, \"p99\": %u, \"p999\": %u}, "
+                   "\"mismatches\": %ld}%s\n",
+                op_names[r->op], r->size, r->frames, r->frames_per_s,
+                r->mbit_per_s, r->transfers, r->bus_bytes,
+                r->all.p50, r->all.p99, r->all.p999,
+                r->wrapped, r->wrap.p50, r->wrap.p99, r->wrap.p999, r->mismatches,
+                (i + 1 < num_results) ? "," : "");
+    }
+
+    fprintf(f, "  ]\n}\n");
+}
+
+/* Pick a number or string field out of a report line
+ * return 1 if found */
+static int field_num(const char *line, const char *key, double *value){
+
+    char pattern[64];
+    const char *p;
+
+    snprintf(pattern, sizeof(pattern), "\"%s\": ", key);
+    p = strstr(line, pattern);
+    if (p == NULL)
+        return 0;
+    *value = strtod(p + strlen(pattern), NULL);
+    return 1;
+}
+
+static int field_str(const char *line, const char *key, char *value, int len){
+
+    char pattern[64];
+    const char *p;
+    const char *end;
+
+    snprintf(pattern, sizeof(pattern), "\"%s\": \"", key);
+    p = strstr(line, pattern);
+    if (p == NULL)
+        return 0;
+    p += strlen(pattern);
+    end = strchr(p, '"');
+    if (end == NULL || end - p >= len)
+        return 0;
+    memcpy(value, p, end - p);
+    value[end - p] = '\0';
+    return 1;
+}
+
+/* Compare with a stored report
+ * return the number of regressions, -1 if it cannot be read */
+static int compare(const char *path, const char *transport, const char *machine, int throughput, double tolerance){
+
+    FILE *f = fopen(path, "r");
+    char line[1024];
+    char op[16];
+    char base_transport[64] = "";
+    char base_machine[64] = "";
+    double size, fps, transfers, p99;
+    struct result *r;
+    int same_host;
+    int regressions = 0;
+    int i;
+
+    if (f == NULL){
+        fprintf(stderr, "No baseline %s\n", path);
+        return -1;
+    }
+
+    fprintf(stderr, "%-9s %5s %12s %12s %7s %10s %10s %8s %8s\n",
+            "op", "size", "frames/s", "baseline", "change", "xfer/frame", "baseline", "p99 us", "baseline");
+
+    while (fgets(line, sizeof(line), f) != NULL){
+        field_str(line, "transport", base_transport, sizeof(base_transport));
+        field_str(line, "machine", base_machine, sizeof(base_machine));
+
+        if (!field_str(line, "op", op, sizeof(op)) || !field_num(line, "size", &size) ||
+            !field_num(line, "frames_per_s", &fps) || !field_num(line, "spi_transfers_per_frame", &transfers) ||
+            !field_num(line, "p99", &p99))
+            continue;
+
+        for (i = 0; i < num_results; i++){
+            r = &results[i];
+            if (strcmp(op_names[r->op], op) != 0 || r->size != (uint16_t)size)
+                continue;
+
+            same_host = throughput && strcmp(base_transport, transport) == 0 && strcmp(base_machine, machine) == 0;
+
+            fprintf(stderr, "%-9s %5u %12.0f %12.0f %+6.1f%% %10.3f %10.3f %8.1f %8.1f",
+                    op, r->size, r->frames_per_s, fps, fps ? 100.0 * (r->frames_per_s - fps) / fps : 0.0,
+                    r->transfers, transfers, r->all.p99 / 1e3, p99 / 1e3);
+
+            if (r->frames == 0)
+                fprintf(stderr, "  no frames\n");
+            else if (r->transfers > transfers * 1.01 + 0.01){
+                fprintf(stderr, "  REGRESSION (SPI transfers)\n");
+                regressions++;
+            }
+            else if (same_host && r->frames_per_s < fps * (1 - tolerance / 100)){
+                fprintf(stderr, "  REGRESSION (throughput)\n");
+                regressions++;
+            }
+            else
+                fprintf(stderr, "\n");
+        }
+    }
+
+    fclose(f);
+
+    if (throughput && (strcmp(base_transport, transport) != 0 || strcmp(base_machine, machine) != 0))
+        fprintf(stderr, "Baseline is from %s on %s, only SPI transfers compared\n", base_transport, base_machine);
+
+    return regressions;
+}
+
+int main(int argc, char **argv){
+
+    uint8_t mac_address[6] = {0xde,0xad,0xbe,0xef,0xba,0x5e};
+    uint8_t local_host[4]  = {192,168,10,123};
+    uint8_t gateway[4]     = {192,168,50,1};
+    uint8_t subnet[4]     =  {255,255,255,0};
+
+    const char *report = NULL;
+    const char *baseline = NULL;
+    const char *transport = getenv(W3150_TRANSPORT_ENV);
+    double seconds = 2.0;
+    double tolerance = 20.0;
+    int throughput = 0;
+    long n = 5000;
+    struct utsname host;
+    struct result *r;
+    FILE *out = stdout;
+    int regressions = 0;
+    long mismatches = 0;
+    int opt;
+    int op;
+    unsigned int s;
+
+    while ((opt = getopt(argc, argv, "n:d:o:b:t:Th")) != -1){
+        switch (opt){
+        case 'n': n = atol(optarg); break;
+        case 'd': seconds = atof(optarg); break;
+        case 'o': report = optarg; break;
+        case 'b': baseline = optarg; break;
+        case 't': tolerance = atof(optarg); break;
+        case 'T': throughput = 1; break;
+        default:
+            fprintf(stderr, "Usage: %s [-n frames] [-d seconds] [-o report] [-b baseline] [-t tolerance%%] [-T]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    if (n <= 0)
+        return 2;
+
+    if (transport == NULL || transport[0] == '\0')
+        transport = "spidev";
+    uname(&host);
+
+    samples = malloc(n * sizeof(samples[0]));
+    wrap_samples = malloc(n * sizeof(wrap_samples[0]));
+
+    if (w3150_init_networking(mac_address, local_host, gateway, subnet) != 1 ||
+        w3150_init_macraw() != 1){
+        fprintf(stderr, "W3150 init failed\n");
+        return 2;
+    }
+
+    dev = w3150_default_dev();
+    emu = w3150_emu_find(dev->channel);
+
+    for (op = 0; op < NUM_OPS; op++){
+        for (s = 0; s < NUM_SIZES; s++){
+            r = &results[num_results++];
+            memset(r, 0, sizeof(*r));
+            r->op = op;
+            r->size = sizes[s];
+
+            if (op == OP_TX)
+                bench_tx(r, n);
+            else
+                bench_rx(r, n, seconds);
+
+            fprintf(stderr, "%-9s %5u %8ld frames %10.0f frames/s %8.2f Mbit/s %6.2f xfers/frame p50 %6.1fus p99 %6.1fus\n",
+                    op_names[op], r->size, r->frames, r->frames_per_s, r->mbit_per_s, r->transfers,
+                    r->all.p50 / 1e3, r->all.p99 / 1e3);
+
+            if (r->mismatches > 0)
+                fprintf(stderr, "%-9s %5u %ld frames differ from what was %s\n", op_names[op], r->size,
+                        r->mismatches, (op == OP_TX) ? "written" : "pushed");
+            mismatches += r->mismatches;
+        }
+    }
+
+    if (report != NULL){
+        out = fopen(report, "w");
+        if (out == NULL){
+            perror(report);
+            return 2;
+        }
+    }
+    print_report(out, transport, host.machine, n);
+    if (out != stdout)
+        fclose(out);
+
+    if (baseline != NULL){
+        regressions = compare(baseline, transport, host.machine, throughput, tolerance);
+        if (regressions > 0)
+            fprintf(stderr, "%d regression%s against %s\n", regressions, (regressions > 1) ? "s" : "", baseline);
+    }
+
+    return (regressions > 0 || mismatches > 0) ? 1 : 0;
+}
@@ -0,0 +1,129 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <w3150.h>
+#include <w3150_pack.h>
+
+/*
+ * Microbenchmark for the SPI frame packing kernels.
+ *
+ * Every kernel the CPU supports is checked against the scalar one
+ * (including bursts that wrap at the end of a socket buffer), then timed
+ * packing a full size frame for TX, packing the read frames for RX and
+ * unpacking the RX data.  Exits 1 if any kernel disagrees.
+ *
+ * Run: ./pack_bench [iterations]
+ */
+
+#define FRAME_LEN   1514
+#define RING_BYTES  0x2000
+
+static uint8_t payload[RING_BYTES];
+static uint8_t frames[RING_BYTES * 4];
+static uint8_t expect[RING_BYTES * 4];
+static uint8_t out[RING_BYTES];
+
+static double now(){
+
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Compare a kernel with the scalar one over a spread of lengths and
+ * offsets, return the number of mismatches */
+static int check(const char *name){
+
+    int bad = 0;
+    uint16_t offset;
+    uint16_t len;
+
+    for (offset = 0; offset < RING_BYTES; offset += 997){
+        for (len = 0; len <= FRAME_LEN + 64; len += 61){
+            w3150_pack_select("scalar");
+            w3150_pack(expect, W3150_WRITE, s0_tx_base, s0_tx_mask, offset, payload, len);
+
+            w3150_pack_select(name);
+            memset(frames, 0xAA, len * 4 + 4);
+            w3150_pack(frames, W3150_WRITE, s0_tx_base, s0_tx_mask, offset, payload, len);
+            if (memcmp(frames, expect, len * 4) != 0 || frames[len * 4] != 0xAA)
+                bad++;
+
+            memset(out, 0xAA, len + 1);
+            w3150_unpack(frames, out, len);
+            if (memcmp(out, payload, len) != 0 || out[len] != 0xAA)
+                bad++;
+
+            w3150_pack_select("scalar");
+            w3150_pack(expect, W3150_READ, s0_rx_base, s0_rx_mask, offset, NULL, len);
+            w3150_pack_select(name);
+            w3150_pack(frames, W3150_READ, s0_rx_base, s0_rx_mask, offset, NULL, len);
+            if (memcmp(frames, expect, len * 4) != 0)
+                bad++;
+        }
+    }
+
+    return bad;
+}
+
+int main(int argc, char **argv){
+
+    long iterations = (argc > 1) ? atol(argv[1]) : 200000;
+    const struct w3150_pack_ops *ops;
+    double t0, tx, rx, un;
+    long n;
+    int i;
+    int bad;
+    int failed = 0;
+    volatile uint8_t sink = 0;
+
+    for (i = 0; i < RING_BYTES; i++)
+        payload[i] = (uint8_t)(i * 7 + 3);
+
+    printf("%-8s %12s %12s %12s %10s  (ns per %d byte frame)\n",
+           "kernel", "pack tx", "pack rx", "unpack", "check", FRAME_LEN);
+
+    for (i = 0; w3150_pack_kernels[i] != NULL; i++){
+        ops = w3150_pack_kernels[i];
+
+        if (!ops->supported()){
+            printf("%-8s not supported on this CPU\n", ops->name);
+            continue;
+        }
+
+        bad = check(ops->name);
+        if (bad)
+            failed++;
+        w3150_pack_select(ops->name);
+
+        // start near the end of the buffer so every burst wraps
+        t0 = now();
+        for (n = 0; n < iterations; n++)
+            w3150_pack(frames, W3150_WRITE, s0_tx_base, s0_tx_mask, RING_BYTES - 100 + n, payload, FRAME_LEN);
+        tx = now() - t0;
+        sink ^= frames[n & 0xff];
+
+        t0 = now();
+        for (n = 0; n < iterations; n++)
+            w3150_pack(frames, W3150_READ, s0_rx_base, s0_rx_mask, RING_BYTES - 100 + n, NULL, FRAME_LEN);
+        rx = now() - t0;
+        sink ^= frames[n & 0xff];
+
+        t0 = now();
+        for (n = 0; n < iterations; n++){
+            w3150_unpack(frames, out, FRAME_LEN);
+            sink ^= out[n & 0xff];
+        }
+        un = now() - t0;
+
+        printf("%-8s %12.1f %12.1f %12.1f %10s\n", ops->name,
+               tx * 1e9 / iterations, rx * 1e9 / iterations, un * 1e9 / iterations,
+               bad ? "FAILED" : "ok");
+    }
+
+    return (failed > 0) ? 1 : 0;
+}
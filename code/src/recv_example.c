@@ -1,8 +1,8 @@
 #include <stdio.h>
 #include <errno.h>
-#include <wiringPiSPI.h>
 #include <unistd.h>
 #include <w3150.h>
+#include <w3150_wait.h>
 #include <stdlib.h>
 
 int main(void) {
@@ -11,8 +11,10 @@ int main(void) {
     // Raw frames are printed as they arrive
 
     int i;
-    uint8_t recv_buf[0xffff];
+    uint8_t recv_buf[MACRAW_MAX_FRAME];
     uint16_t recv_len;
+    int use_irq;
+    struct w3150_wait rx_wait;
 
     uint8_t mac_address[6] = {0xde,0xad,0xbe,0xef,0xba,0x5e};
     uint8_t local_host[4]  = {192,168,10,123};
@@ -20,7 +22,10 @@ int main(void) {
     uint8_t subnet[4]     =  {255,255,255,0};
 
     printf("--------Receive Example--------\n");
-    w3150_init_networking(mac_address,local_host,gateway,subnet);
+    if (w3150_init_networking(mac_address,local_host,gateway,subnet) != 1){
+        printf("networking init failed\n");
+        exit(0);
+    }
 
     w3150_ping_block();
 
@@ -29,11 +34,26 @@ int main(void) {
         exit(0);
     }
 
+    use_irq = (w3150_irq_open(NULL) == 0);
+
+    // busy poll up to 50us, then back off to at most 1ms
+    w3150_wait_init(&rx_wait, 50000, 10000, 1000000);
+    w3150_rt_setup_env();
+
     while(1){
         
-        // wait for a response
-        while(w3150_macraw_check_recv() != 1){
-            usleep(1);
+        // wait for a response, sleeping on the INT pin if there
+        // is an interrupt source
+        if (use_irq){
+            while (w3150_macraw_check_recv() != 1)
+                w3150_irq_wait(-1);
+        }
+        else {
+            w3150_wait_begin(&rx_wait);
+            while(w3150_macraw_check_recv() != 1){
+                w3150_wait_step(&rx_wait);
+            }
+            w3150_wait_end(&rx_wait);
         }
 
         printf("Got a packet\n");
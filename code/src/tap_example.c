@@ -1,9 +1,12 @@
+#define _GNU_SOURCE     // ppoll
+
 #include <fcntl.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/ioctl.h>
 #include <stdint.h>
+#include <unistd.h>
 
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -13,19 +16,38 @@
 
 #include <errno.h>
 #include <dirent.h> 
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/eventfd.h>
+#include <time.h>
 
 #include <w3150.h>
+#include <w3150_dev.h>
+#include <w3150_wait.h>
+#include <w3150_filter.h>
+#include <w3150_flow.h>
+#include <w3150_pool.h>
+#include <w3150_tapio.h>
+#include <w3150_stats.h>
+#include <w3150_trace.h>
 
 /*
  * This sets up a TAP interface tunnel on the 
- * Raspberry PI.  The W3150+ library uses the WIRINGPI library for 
- * the SPI interface.  Using other SPI libraries might result in 
- * greater speeds.
+ * Raspberry PI.  The W3150+ library talks to the board through
+ * spidev by default, set W3150_TRANSPORT to pick another backend
+ * (see w3150_transport.h).
  *
  * Setup Tap Interface: sudo ip tuntap add mode tap
  * Configure Tap Interface: sudo ifconfig tap0 192.168.10.123
  * Run tap_test: ./tap_example tap0 -tap
  *
+ * In tap mode only frames for the tap interface's MAC, broadcast and
+ * multicast are pulled from the W3150, the rest of the switch's traffic
+ * is skipped on the chip.  W3150_FILTER replaces the broadcast and
+ * multicast part with its own rules (see w3150_filter.h), W3150_FILTER=off
+ * takes everything, e.g. when the tap is bridged.
+ *
  */
 
 //#define STDOUT
@@ -33,6 +55,470 @@
 
 const char* TunTapDev = "/dev/net/tun";
 
+/* Boards
+ * W3150_BOARDS drives several W3150s, one per SPI chip select, as one
+ * interface: a comma separated list of CHANNEL[=IRQ], e.g.
+ * "1=gpio:25,0=gpio:24".  Boards without an IRQ use W3150_IRQ.  Without
+ * W3150_BOARDS there is one board, the default device on channel 1.
+ *
+ * With more than one board the tap is opened with IFF_MULTI_QUEUE and
+ * every board gets a queue.  Inbound frames from each board are written
+ * to its queue and the kernel merges them.  Outbound frames are read
+ * from every queue and sent on the board w3150_flow_hash() picks, so a
+ * flow always leaves through the same board and stays in order; a frame
+ * read on another board's queue is handed over through that board's
+ * ring.  The boards' switch ports should form a static link aggregate,
+ * otherwise the switch sees the MAC move between them.
+ *
+ * SIGUSR1 prints the per board counters, as does exiting on SIGINT or
+ * SIGTERM.  They are also in shared memory while the bridge runs (see
+ * w3150_stats.h), w3150_stat shows them live.
+ *
+ * With W3150_TRACE set every board keeps a trace of its SPI transfers
+ * (see w3150_trace.h).  SIGUSR2 writes it to W3150_TRACE_FILE, as does
+ * exiting, for w3150_trace_analyze.
+ */
+
+/* Threads
+ * Each board runs one thread per direction.  The receive thread sleeps
+ * on the W3150 INT pin when an interrupt source is configured
+ * (W3150_IRQ, see w3150_irq.h), otherwise it paces itself with a
+ * w3150_wait: busy polling for a short while after traffic, then
+ * sleeping with an exponential backoff while the chip is idle.  It
+ * drains the chip with read_bufs and blocks while the tap will not
+ * take more, leaving the burst in the W3150's own RX buffer.
+ *
+ * The transmit thread sleeps on its tap queue and its ring, stages each
+ * frame into the W3150 as it arrives and keeps the SENDs going.  Frames
+ * handed over by other boards go before its own.  While the W3150 (or
+ * the ring of the board a frame belongs to) has no room no more of the
+ * queue is read than the reads already posted.
+ *
+ * Frames live in pool buffers (w3150_pool.h) from end to end: the
+ * receive thread has the W3150 read into them and queues them to the
+ * tap as they are, the transmit thread keeps TX_READS of them posted on
+ * its queue and a frame for another board is handed over by pointer.
+ * Tap reads and writes go through w3150_tapio, io_uring batching each
+ * burst into one system call (W3150_TAPIO, see w3150_tapio.h).
+ *
+ * The two threads of a board only meet on the SPI bus, where the
+ * transport's arbiter has them take turns, so a long TX burst does not
+ * hold up RX.  W3150_RT pins and prioritises them all (see w3150_wait.h).
+ */
+
+#define BOARDS_ENV      "W3150_BOARDS"
+#define MAX_BOARDS      4
+#define RING_SLOTS      32
+
+#define POLL_SPIN_NS    50000       // busy poll after traffic
+#define POLL_MIN_NS     20000
+#define POLL_MAX_NS     10000000    // 10ms when idle
+#define POLL_IRQ_MS     100         // safety net with interrupts
+#define RX_BATCH        64
+#define RX_BUFS         (2 * RX_BATCH)  // a batch on its way to the tap, the next being read
+#define TX_READS        16              // reads kept posted on a tap queue
+#define TX_BUFS         (TX_READS + RING_SLOTS)
+
+/* Frames handed to a board by the others, the buffer goes back to the
+ * pool of the board that read it once sent.  efd is readable while the
+ * ring holds anything. */
+struct ring {
+    pthread_mutex_t lock;
+    int efd;
+    unsigned int head;
+    unsigned int tail;
+    struct w3150_buf *slots[RING_SLOTS];
+};
+
+struct board {
+    struct w3150_dev *w3150;
+    char *irq_name;         // NULL for $W3150_IRQ
+    int fd;                 // tap queue
+    int use_irq;
+    struct w3150_filter rx_filter;
+    struct ring ring;
+    struct w3150_pool rx_pool;
+    struct w3150_pool tx_pool;
+    struct w3150_tapio rx_io;   // owned by the receive thread
+    struct w3150_tapio tx_io;   // owned by the transmit thread
+
+    uint64_t handed_off;    // own queue frames sent on another board
+};
+
+static struct board *boards[MAX_BOARDS];
+static int num_boards;
+
+static void ring_init(struct ring *r){
+
+    pthread_mutex_init(&r->lock, NULL);
+    r->efd = eventfd(0, EFD_NONBLOCK);
+    r->head = r->tail = 0;
+}
+
+/* return 1 if the frame was queued, 0 if the ring is full */
+static int ring_push(struct ring *r, struct w3150_buf *buf){
+
+    uint64_t one = 1;
+
+    pthread_mutex_lock(&r->lock);
+
+    if (r->head - r->tail == RING_SLOTS){
+        pthread_mutex_unlock(&r->lock);
+        return 0;
+    }
+
+    r->slots[r->head % RING_SLOTS] = buf;
+    if (r->head++ == r->tail)
+        write(r->efd, &one, sizeof(one));
+
+    pthread_mutex_unlock(&r->lock);
+    return 1;
+}
+
+/* return the oldest frame, NULL if none */
+static struct w3150_buf *ring_pop(struct ring *r){
+
+    struct w3150_buf *buf;
+    uint64_t count;
+
+    pthread_mutex_lock(&r->lock);
+
+    if (r->head == r->tail){
+        pthread_mutex_unlock(&r->lock);
+        return NULL;
+    }
+
+    buf = r->slots[r->tail % RING_SLOTS];
+    if (++r->tail == r->head)
+        read(r->efd, &count, sizeof(count));
+
+    pthread_mutex_unlock(&r->lock);
+    return buf;
+}
+
+static struct w3150_filter rx_filter;
+
+/* Build the receive filter for a tap interface, each board installs
+ * its own copy
+ * return 1 if there is one */
+static int setup_filter(const char *dev){
+
+    const char *spec = getenv(W3150_FILTER_ENV);
+    struct ifreq ifr;
+    int sock;
+
+    if (spec != NULL && strcmp(spec, "off") == 0)
+        return 0;
+
+    w3150_filter_init(&rx_filter);
+
+    memset(&ifr, 0, sizeof(ifr));
+    snprintf(ifr.ifr_name, IFNAMSIZ, "%s", dev);
+
+    sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sock < 0 || ioctl(sock, SIOCGIFHWADDR, &ifr) < 0){
+        fprintf(stderr, "Cannot get the MAC of %s, not filtering\n", dev);
+        if (sock >= 0)
+            close(sock);
+        return 0;
+    }
+    close(sock);
+
+    w3150_filter_add_addr(&rx_filter, (uint8_t *)ifr.ifr_hwaddr.sa_data);
+
+    if (spec == NULL || spec[0] == '\0')
+        rx_filter.flags |= W3150_FILTER_BROADCAST | W3150_FILTER_MULTICAST;
+    else if (w3150_filter_parse(&rx_filter, spec) != 0)
+        exit(1);
+
+    w3150_filter_compile(&rx_filter);
+
+    return 1;
+}
+
+static void sleep_ns(uint32_t ns){
+
+    struct timespec ts;
+
+    ts.tv_sec = ns / 1000000000;
+    ts.tv_nsec = ns % 1000000000;
+    nanosleep(&ts, NULL);
+}
+
+/* Give the buffers the tap has written back to their pool */
+static void release(struct board *b, struct w3150_buf **done, int count){
+
+    struct w3150_rx_stats *st = &b->w3150->stats->rx;
+    int errors = 0;
+    int i;
+
+    for (i = 0; i < count; i++){
+        if (done[i]->res < 0){
+            fprintf(stderr, "Error writing to %s: %s\n", TunTapDev, strerror(-done[i]->res));
+            errors++;
+        }
+        w3150_pool_put(done[i]);
+    }
+
+    w3150_stat_add(&st->host_frames, count - errors);
+    w3150_stat_add(&st->host_errors, errors);
+    w3150_stat_set(&st->host_calls, b->rx_io.calls);
+}
+
+/* W3150 to tap */
+static void *rx_thread(void *arg){
+
+    struct board *b = arg;
+    struct w3150_buf *bufs[RX_BATCH];   // empty, for the next batch
+    struct w3150_buf *done[RX_BUFS];
+    struct w3150_wait wait;
+    int have = 0;
+    int count;
+    int acked = 0;
+    int i;
+    uint32_t ns;
+
+    w3150_wait_init(&wait, POLL_SPIN_NS, POLL_MIN_NS, POLL_MAX_NS);
+
+    while (1){
+        // Clear S0_IR before draining so a frame that lands
+        // meanwhile raises INT again
+        if (b->use_irq && !acked)
+            w3150_dev_irq_ack(b->w3150);
+        acked = 0;
+
+        // Recycle what the tap has taken and top up the batch.  With
+        // every buffer still on its way to the tap, wait for it.
+        release(b, done, w3150_tapio_reap(&b->rx_io, done, RX_BUFS, 0));
+        have += w3150_pool_get_many(&b->rx_pool, bufs + have, RX_BATCH - have);
+        if (have == 0){
+            release(b, done, w3150_tapio_reap(&b->rx_io, done, RX_BUFS, 1));
+            continue;
+        }
+
+        count = w3150_dev_macraw_read_bufs(b->w3150, bufs, have);
+
+        for (i = 0; i < count; i++){
+            #ifdef DEBUG_NET
+            printf("Read %d bytes from W3150\n", bufs[i]->len);
+            #endif
+            w3150_tapio_write(&b->rx_io, bufs[i]);
+        }
+        w3150_tapio_submit(&b->rx_io);
+
+        have -= count;
+        memmove(bufs, bufs + count, have * sizeof(bufs[0]));
+
+        if (b->use_irq){
+            if (count == 0)
+                acked = (w3150_dev_irq_wait(b->w3150, POLL_IRQ_MS) != 0);
+            continue;
+        }
+
+        ns = w3150_wait_next(&wait, count > 0);
+        if (ns != 0)
+            sleep_ns(ns);
+    }
+
+    return NULL;
+}
+
+/* Tap to W3150 */
+static void *tx_thread(void *arg){
+
+    struct board *b = arg;
+    struct w3150_tx_stats *st = &b->w3150->stats->tx;
+    struct w3150_buf *cur = NULL;   // frame waiting for the W3150 or a ring
+    struct w3150_buf *buf;
+    struct board *target = b;       // where cur goes
+    struct w3150_wait wait;
+    struct pollfd pfd[2];
+    struct timespec ts;
+    int busy;
+    int idle;
+    uint32_t ns;
+
+    pfd[0].fd = w3150_tapio_fd(&b->tx_io);
+    pfd[0].events = POLLIN;
+    pfd[1].fd = b->ring.efd;
+    pfd[1].events = POLLIN;
+    w3150_wait_init(&wait, POLL_SPIN_NS, POLL_MIN_NS, POLL_MAX_NS);
+
+    while (1){
+        busy = 0;
+
+        // Keep reads posted on the tap queue, topped up once half of
+        // them have come back so they go in together, as far as the
+        // pool goes while other boards still hold our frames
+        if (w3150_tapio_pending(&b->tx_io) <= TX_READS / 2){
+            while (w3150_tapio_pending(&b->tx_io) < TX_READS &&
+                   (buf = w3150_pool_get(&b->tx_pool)) != NULL)
+                w3150_tapio_read(&b->tx_io, buf);
+            w3150_tapio_submit(&b->tx_io);
+        }
+
+        // Frames other boards read for us first
+        if (cur == NULL && num_boards > 1){
+            cur = ring_pop(&b->ring);
+            target = b;
+        }
+
+        // A frame from the tap device file
+        // This is data coming from the PI going to the outside.
+        // A frame the W3150 had no room for is kept in cur and
+        // offered again before taking the next one.
+        if (cur == NULL && w3150_tapio_reap(&b->tx_io, &cur, 1, 0) == 1){
+            w3150_stat_set(&st->host_calls, b->tx_io.calls);
+            if (cur->res <= 0)
+                w3150_stat_add(&st->host_errors, 1);
+            else
+                w3150_stat_add(&st->host_frames, 1);
+
+            if (cur->res == 0) {
+                fprintf(stderr, "End of file on %s\n", TunTapDev);
+                exit(0);
+            } else if (cur->res < 0) {
+                if (cur->res != -EAGAIN && cur->res != -EINTR){
+                    fprintf(stderr, "Some error occured while reading from %s: %s\n", TunTapDev, strerror(-cur->res));
+                    exit(4);
+                }
+                w3150_pool_put(cur);
+                cur = NULL;
+            }
+            else {
+                #ifdef DEBUG_NET
+                printf("Read %d bytes from tap\n", cur->len);
+                #endif
+                target = b;
+                if (num_boards > 1)
+                    target = boards[w3150_flow_pick(w3150_flow_hash(w3150_buf_frame(cur), cur->len), num_boards)];
+            }
+        }
+
+        if (cur != NULL && target != b){
+            if (ring_push(&target->ring, cur)){
+                b->handed_off++;
+                cur = NULL;
+                busy = 1;
+            }
+        }
+        // Staged while the previous frame is still going out
+        else if (cur != NULL && w3150_dev_macraw_tx_submit(b->w3150, w3150_buf_frame(cur), cur->len)){
+            w3150_pool_put(cur);
+            cur = NULL;
+            busy = 1;
+        }
+
+        // Issue the next SEND if the chip finished the last one
+        idle = w3150_dev_macraw_tx_poll(b->w3150);
+
+        ns = w3150_wait_next(&wait, busy);
+        if (ns == 0)
+            continue;
+
+        if (cur != NULL || w3150_tapio_pending(&b->tx_io) == 0){
+            // waiting for TX room, or for buffers to come back
+            sleep_ns(ns);
+        }
+        else if (idle){
+            // nothing on its way out, sleep until there is a frame
+            poll(pfd, 2, -1);
+        }
+        else {
+            // a frame, or the next look at the SEND in flight
+            ts.tv_sec = ns / 1000000000;
+            ts.tv_nsec = ns % 1000000000;
+            ppoll(pfd, 2, &ts, NULL);
+        }
+    }
+
+    return NULL;
+}
+
+static void print_stats(){
+
+    struct w3150_stats *st;
+    uint64_t rx_total = 0;
+    uint64_t tx_total = 0;
+    int i;
+
+    for (i = 0; i < num_boards; i++){
+        rx_total += boards[i]->w3150->stats->rx.bytes;
+        tx_total += boards[i]->w3150->stats->tx.bytes;
+    }
+
+    fprintf(stderr, "board channel  rx frames    rx bytes   rx%%  tx frames    tx bytes   tx%%  handed off  bus waits  tap calls tap errors\n");
+    for (i = 0; i < num_boards; i++){
+        st = boards[i]->w3150->stats;
+        fprintf(stderr, "%5d %7d %10llu %11llu %5.1f %10llu %11llu %5.1f %11llu %10llu %10llu %10llu\n",
+                i, boards[i]->w3150->channel,
+                (unsigned long long)st->rx.frames, (unsigned long long)st->rx.bytes,
+                rx_total ? 100.0 * st->rx.bytes / rx_total : 0.0,
+                (unsigned long long)st->tx.frames, (unsigned long long)st->tx.bytes,
+                tx_total ? 100.0 * st->tx.bytes / tx_total : 0.0,
+                (unsigned long long)boards[i]->handed_off,
+                (unsigned long long)st->bus.contended,
+                (unsigned long long)(st->rx.host_calls + st->tx.host_calls),
+                (unsigned long long)(st->rx.host_errors + st->tx.host_errors));
+    }
+}
+
+/* Write the boards' SPI traces, if they keep one.  asked is set when
+ * someone sent SIGUSR2 and wants to hear about it either way. */
+static void dump_trace(struct w3150_dev **devs, int count, int asked){
+
+    const char *path = getenv(W3150_TRACE_FILE_ENV);
+    int n = w3150_trace_dump_file(devs, count, path);
+
+    if (path == NULL || path[0] == '\0')
+        path = W3150_TRACE_FILE;
+
+    if (n > 0)
+        fprintf(stderr, "SPI trace of %d board(s) in %s, see w3150_trace_analyze\n", n, path);
+    else if (n == 0 && asked)
+        fprintf(stderr, "No SPI trace, start with %s=<records>\n", W3150_TRACE_ENV);
+}
+
+/* Parse W3150_BOARDS into boards[]
+ * return 0, or -1 if it is malformed */
+static int parse_boards(const char *spec){
+
+    char buf[256];
+    char *tok;
+    char *save;
+    char *irq;
+    char *end;
+    struct board *b;
+    long channel;
+
+    snprintf(buf, sizeof(buf), "%s", spec);
+
+    for (tok = strtok_r(buf, ",", &save); tok != NULL; tok = strtok_r(NULL, ",", &save)){
+        if (num_boards == MAX_BOARDS){
+            fprintf(stderr, "At most %d boards\n", MAX_BOARDS);
+            return -1;
+        }
+
+        irq = strchr(tok, '=');
+        if (irq != NULL)
+            *irq++ = '\0';
+
+        channel = strtol(tok, &end, 0);
+        if (end == tok || *end != '\0' || channel < 0){
+            fprintf(stderr, "Bad board in %s: %s\n", BOARDS_ENV, tok);
+            return -1;
+        }
+
+        b = calloc(1, sizeof(*b));
+        b->w3150 = malloc(sizeof(*b->w3150));
+        w3150_dev_init(b->w3150, NULL, channel);
+        b->irq_name = (irq != NULL) ? strdup(irq) : NULL;
+        boards[num_boards++] = b;
+    }
+
+    return (num_boards > 0) ? 0 : -1;
+}
+
 int main(int argc, char** argv) {
 
     // Parse command line arguments
@@ -55,9 +541,6 @@ int main(int argc, char** argv) {
     }
 
     // Initialize W3150 
-    uint8_t w3150_recv_buf[0xffff];
-    uint16_t w3150_recv_len;
-
     // set this to whatever you want, helps to match with the tap interface
     uint8_t mac_address[6] = {0xca,0x1f,0xfd,0xc9,0xb2,0xe7};
     
@@ -67,14 +550,38 @@ int main(int argc, char** argv) {
     uint8_t gateway[4]     = {192,168,50,1};
     uint8_t subnet[4]     =  {255,255,255,0};
 
-    w3150_init_networking(mac_address,local_host,gateway,subnet);
+    const char *board_spec = getenv(BOARDS_ENV);
+    struct board *b;
+    int i;
 
-    // Ping is disabled so the W3150 hardware stack will not respond.
-    w3150_ping_block();
+    if (board_spec != NULL && board_spec[0] != '\0'){
+        if (parse_boards(board_spec) != 0)
+            exit(1);
+    }
+    else {
+        b = calloc(1, sizeof(*b));
+        b->w3150 = w3150_default_dev();
+        boards[num_boards++] = b;
+    }
 
-    if (w3150_init_macraw() != 1){
-        printf("macraw init failed\n");
-        exit(1);
+    for (i = 0; i < num_boards; i++){
+        b = boards[i];
+
+        if (w3150_dev_init_networking(b->w3150, mac_address,local_host,gateway,subnet) != 1){
+            printf("networking init failed on channel %d\n", b->w3150->channel);
+            exit(1);
+        }
+
+        // Ping is disabled so the W3150 hardware stack will not respond.
+        w3150_dev_ping_block(b->w3150);
+
+        if (w3150_dev_init_macraw(b->w3150) != 1){
+            printf("macraw init failed on channel %d\n", b->w3150->channel);
+            exit(1);
+        }
+
+        // the two threads each keep to their own side of the chip
+        w3150_dev_set_rx_interleave(b->w3150, 0);
     }
 
     struct ifreq ifr;
@@ -100,7 +607,7 @@ int main(int argc, char** argv) {
         // Different capture length?
         if (argc > 3) CaptureLen = atoi(argv[3]);
         
-        if (CaptureLen < 1) {
+        if (CaptureLen < 1 || CaptureLen > W3150_BUF_SIZE) {
             fprintf(stderr, "Capture length %d invalid!\n", CaptureLen);
             exit(1);
         }
@@ -109,6 +616,8 @@ int main(int argc, char** argv) {
         
         // Include packet info in output?
         if (!(argc > 4 && strcmp(argv[4], "-pi") == 0)) ifrflags = ifrflags | IFF_NO_PI;
+        // One queue per board
+        if (num_boards > 1) ifrflags = ifrflags | IFF_MULTI_QUEUE;
             // Set ifr flags
             ifr.ifr_flags = ifrflags;
     }
@@ -116,58 +625,107 @@ int main(int argc, char** argv) {
     int TunFD; // Tun/tap stream
 
     // Try to open the tun/tap device file, exit on failure
-    // Use the nonblocking flag
-    fprintf(stderr, "Opening %s\n", TunTapDev);
-    
-    if ((TunFD = open(TunTapDev, O_RDWR | O_NONBLOCK)) < 0) {
-        fprintf(stderr, "Failed to open %s: %d\n", TunTapDev, TunFD);
-        exit(2);
-    }
+    // Use the nonblocking flag.  Every open with the same name
+    // attaches one more queue.
+    for (i = 0; i < num_boards; i++){
+        fprintf(stderr, "Opening %s\n", TunTapDev);
 
-    // Request the interface and set its flags
-    fprintf(stderr, "Requesting device: %s\n", dev);
-    
-    if (ioctl(TunFD, TUNSETIFF, (void *)&ifr) < 0 ) {
-        fprintf(stderr, "ioctl for device name failed!\n");
-        close(TunFD);
-        exit(3);
+        if ((TunFD = open(TunTapDev, O_RDWR | O_NONBLOCK)) < 0) {
+            fprintf(stderr, "Failed to open %s: %d\n", TunTapDev, TunFD);
+            exit(2);
+        }
+
+        // Request the interface and set its flags
+        fprintf(stderr, "Requesting device: %s\n", ifr.ifr_name);
+
+        if (ioctl(TunFD, TUNSETIFF, (void *)&ifr) < 0 ) {
+            fprintf(stderr, "ioctl for device name failed!\n");
+            close(TunFD);
+            exit(3);
+        }
+
+        boards[i]->fd = TunFD;
+
+        if (w3150_pool_init(&boards[i]->rx_pool, RX_BUFS) != 0 ||
+            w3150_pool_init(&boards[i]->tx_pool, TX_BUFS) != 0 ||
+            w3150_tapio_init(&boards[i]->rx_io, TunFD, RX_BUFS) != 0 ||
+            w3150_tapio_init(&boards[i]->tx_io, TunFD, TX_READS) != 0){
+            fprintf(stderr, "Cannot set up the frame buffers for %s\n", TunTapDev);
+            exit(2);
+        }
     }
 
     strcpy(dev, ifr.ifr_name);
-    fprintf(stderr, "Tunnel interface: %s\n", dev);
+    fprintf(stderr, "Tunnel interface: %s, %d board%s\n", dev, num_boards, (num_boards > 1) ? "s" : "");
+    fprintf(stderr, "Tap I/O: %s\n", w3150_tapio_uring(&boards[0]->rx_io) ? "io_uring" : "read/write");
+
+    int filter = (ifr.ifr_flags & IFF_TAP) && setup_filter(dev);
+    if (filter)
+        fprintf(stderr, "Receive filter on\n");
+
+    for (i = 0; i < num_boards; i++){
+        b = boards[i];
+
+        if (filter){
+            b->rx_filter = rx_filter;
+            w3150_dev_macraw_set_filter(b->w3150, &b->rx_filter);
+        }
+
+        b->use_irq = (w3150_dev_irq_open(b->w3150, b->irq_name) == 0);
+
+        b->ring.efd = -1;
+        if (num_boards > 1)
+            ring_init(&b->ring);
+    }
+
+    // counters move to shared memory before the threads start
+    struct w3150_dev *devs[MAX_BOARDS];
+    for (i = 0; i < num_boards; i++)
+        devs[i] = boards[i]->w3150;
+    if (w3150_stats_export(devs, num_boards, NULL) == 0)
+        fprintf(stderr, "Stats exported, see w3150_stat\n");
+
     fprintf(stderr, "Proxy ready for action!\n");
 
-    unsigned char RBuf[CaptureLen]; //Data buffers
-    int RBufLen = 0; //Packet length
-    
-    //Start an infinite loop
-    while (1) {
-        // Read from tap device file
-        // This is data coming from the PI going to the outside
-        RBufLen = read(TunFD, RBuf, CaptureLen);
-        
-        if (RBufLen > 0){
-            #ifdef DEBUG_NET
-            printf("Read %d bytes from tap\n", RBufLen);
-            #endif
-            if (RBufLen == 0) {
-                fprintf(stderr, "End of file on %s\n", TunTapDev);
-                exit(0);
-            } else if (RBufLen < 0) {
-                fprintf(stderr, "Some error occured while reading from %s: %d\n", TunTapDev, RBufLen);
-                exit(4);
-            }
-            w3150_macraw_write(RBuf, RBufLen);
+    pthread_t rx, tx;
+    sigset_t sigs;
+    int sig;
+
+    // Signals are taken by this thread only
+    sigemptyset(&sigs);
+    sigaddset(&sigs, SIGUSR1);
+    sigaddset(&sigs, SIGUSR2);
+    sigaddset(&sigs, SIGINT);
+    sigaddset(&sigs, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+
+    // threads inherit the scheduling set up here
+    w3150_rt_setup_env();
+
+    for (i = 0; i < num_boards; i++){
+        if (pthread_create(&rx, NULL, rx_thread, boards[i]) != 0 ||
+            pthread_create(&tx, NULL, tx_thread, boards[i]) != 0){
+            fprintf(stderr, "Failed to start the bridge threads\n");
+            exit(5);
         }
-        
-        // Read from the W3150
-        if (w3150_macraw_check_recv() == 1){
-            w3150_recv_len = w3150_macraw_read(w3150_recv_buf);
-            #ifdef DEBUG_NET
-            printf("Read %d bytes from W3150\n", w3150_recv_len);
-            #endif
-            // Write to tun/tap device file
-            write(TunFD, w3150_recv_buf, w3150_recv_len);
+    }
+
+    for (;;){
+        sigwait(&sigs, &sig);
+
+        if (sig == SIGUSR2){
+            dump_trace(devs, num_boards, 1);
+            continue;
         }
+
+        print_stats();
+        if (sig != SIGUSR1)
+            break;
     }
+
+    dump_trace(devs, num_boards, 0);
+
+    w3150_stats_unlink();
+
+    return 0;
 }
@@ -0,0 +1,125 @@
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <w3150.h>
+#include <w3150_wait.h>
+#include <stdlib.h>
+
+#define ECHO_PORT   7
+#define ECHO_CHUNK  0x400   // half a socket buffer
+
+int main(void) {
+
+    // Simple example of the W3150's own TCP stack
+    // All four sockets listen on port 7 and echo back what they are
+    // sent, so up to four clients at once.  Try: nc 192.168.10.123 7
+
+    // what was read but not echoed yet, per socket
+    uint8_t buf[W3150_SOCKETS][ECHO_CHUNK];
+    int len[W3150_SOCKETS] = {0};
+    int sent[W3150_SOCKETS] = {0};
+    int n;
+    uint8_t s;
+    uint8_t events;
+    uint8_t busy;
+    uint8_t peer_ip[4];
+    uint16_t peer_port;
+    uint8_t connected[W3150_SOCKETS] = {0};
+    struct w3150_wait wait;
+    struct timespec ts;
+    uint32_t ns;
+
+    uint8_t mac_address[6] = {0xde,0xad,0xbe,0xef,0xba,0x5e};
+    uint8_t local_host[4]  = {192,168,10,123};
+    uint8_t gateway[4]     = {192,168,50,1};
+    uint8_t subnet[4]     =  {255,255,255,0};
+
+    // 2KB each way per socket
+    uint16_t sizes[4] = {0x800, 0x800, 0x800, 0x800};
+
+    printf("--------TCP Example--------\n");
+    if (w3150_init_networking(mac_address,local_host,gateway,subnet) != 1){
+        printf("networking init failed\n");
+        exit(0);
+    }
+
+    if (w3150_set_memory(sizes, sizes) != 1){
+        printf("memory split failed\n");
+        exit(0);
+    }
+
+    for (s = 0; s < W3150_SOCKETS; s++){
+        if (w3150_tcp_listen(s, ECHO_PORT) != 1){
+            printf("listen failed on socket %d\n", s);
+            exit(0);
+        }
+        // probe idle peers every 10s
+        w3150_tcp_keepalive(s, 10000);
+    }
+
+    // busy poll up to 50us after activity, then back off to at most 1ms
+    w3150_wait_init(&wait, 50000, 10000, 1000000);
+    w3150_rt_setup_env();
+
+    while(1){
+
+        busy = 0;
+
+        for (s = 0; s < W3150_SOCKETS; s++){
+
+            events = w3150_tcp_poll(s);
+
+            if (!connected[s] && w3150_tcp_accept(s, peer_ip, &peer_port)){
+                printf("socket %d: %d.%d.%d.%d:%d connected\n", s,
+                       peer_ip[0], peer_ip[1], peer_ip[2], peer_ip[3], peer_port);
+                connected[s] = 1;
+            }
+
+            if (events & W3150_TCP_CLOSED){
+                if (connected[s])
+                    printf("socket %d: closed\n", s);
+                connected[s] = 0;
+                len[s] = sent[s] = 0;
+                if (w3150_tcp_listen(s, ECHO_PORT) == 1)
+                    w3150_tcp_keepalive(s, 10000);
+                continue;
+            }
+
+            // half a buffer at a time, what is not read yet stays on
+            // the chip and holds the client back through the window
+            if (sent[s] == len[s] && (events & W3150_TCP_READABLE)){
+                n = w3150_tcp_recv(s, buf[s], ECHO_CHUNK);
+                if (n < 0){
+                    w3150_tcp_close(s);
+                    len[s] = sent[s] = 0;
+                    continue;
+                }
+                len[s] = n;
+                sent[s] = 0;
+                busy = 1;
+            }
+
+            // echo as much as the socket takes now, the rest waits for
+            // the next W3150_TCP_WRITABLE while the other sockets run
+            if (sent[s] < len[s] && (events & W3150_TCP_WRITABLE)){
+                n = w3150_tcp_send(s, buf[s] + sent[s], len[s] - sent[s]);
+                if (n < 0)
+                    len[s] = sent[s] = 0;
+                else
+                    sent[s] += n;
+                busy = 1;
+            }
+        }
+
+        ns = w3150_wait_next(&wait, busy);
+        if (ns != 0){
+            ts.tv_sec = 0;
+            ts.tv_nsec = ns;
+            nanosleep(&ts, NULL);
+        }
+    }
+
+    return 0;
+
+}
@@ -1,6 +1,5 @@
 #include <stdio.h>
 #include <errno.h>
-#include <wiringPiSPI.h>
 #include <unistd.h>
 #include <w3150.h>
 #include <stdlib.h>
@@ -29,7 +28,10 @@ int main(void) {
     uint8_t subnet[4]     =  {255,255,255,0};
 
     printf("--------Transmit Example--------\n");
-    w3150_init_networking(mac_address,local_host,gateway,subnet);
+    if (w3150_init_networking(mac_address,local_host,gateway,subnet) != 1){
+        printf("networking init failed\n");
+        exit(0);
+    }
 
     if (w3150_init_macraw() != 1){
         printf("macraw init failed\n");
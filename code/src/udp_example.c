@@ -0,0 +1,73 @@
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <w3150.h>
+#include <w3150_wait.h>
+#include <stdlib.h>
+
+#define ECHO_PORT   7
+
+int main(void) {
+
+    // Simple example of the W3150's own UDP stack
+    // Socket 1 echoes every datagram sent to port 7 back to its sender,
+    // next to MACRAW on socket 0.  Try: nc -u 192.168.10.123 7
+
+    uint8_t buf[0x800];
+    uint16_t len;
+    uint8_t peer_ip[4];
+    uint16_t peer_port;
+    struct w3150_wait rx_wait;
+
+    uint8_t mac_address[6] = {0xde,0xad,0xbe,0xef,0xba,0x5e};
+    uint8_t local_host[4]  = {192,168,10,123};
+    uint8_t gateway[4]     = {192,168,50,1};
+    uint8_t subnet[4]     =  {255,255,255,0};
+
+    // 4KB each way for MACRAW, 2KB for the echo socket,
+    // 1KB for sockets 2 and 3
+    uint16_t rx_sizes[4] = {0x1000, 0x800, 0x400, 0x400};
+    uint16_t tx_sizes[4] = {0x1000, 0x800, 0x400, 0x400};
+
+    printf("--------UDP Example--------\n");
+    if (w3150_init_networking(mac_address,local_host,gateway,subnet) != 1){
+        printf("networking init failed\n");
+        exit(0);
+    }
+
+    if (w3150_set_memory(rx_sizes, tx_sizes) != 1){
+        printf("memory split failed\n");
+        exit(0);
+    }
+
+    if (w3150_init_macraw() != 1){
+        printf("macraw init failed\n");
+        exit(0);
+    }
+
+    if (w3150_udp_open(1, ECHO_PORT) != 1){
+        printf("udp open failed\n");
+        exit(0);
+    }
+
+    // busy poll up to 50us, then back off to at most 1ms
+    w3150_wait_init(&rx_wait, 50000, 10000, 1000000);
+    w3150_rt_setup_env();
+
+    while(1){
+
+        w3150_wait_begin(&rx_wait);
+        while ((len = w3150_udp_recvfrom(1, buf, sizeof(buf), peer_ip, &peer_port)) == 0)
+            w3150_wait_step(&rx_wait);
+        w3150_wait_end(&rx_wait);
+
+        printf("%d bytes from %d.%d.%d.%d:%d\n", len,
+               peer_ip[0], peer_ip[1], peer_ip[2], peer_ip[3], peer_port);
+
+        if (w3150_udp_sendto(1, buf, len, peer_ip, peer_port) != 1)
+            printf("echo failed\n");
+    }
+
+    return 0;
+
+}
@@ -1,8 +1,16 @@
 #include <stdint.h>
 #include <w3150.h>
+#include <w3150_dev.h>
+#include <w3150_transport.h>
+#include <w3150_irq.h>
+#include <w3150_wait.h>
+#include <w3150_filter.h>
+#include <w3150_pack.h>
+#include <w3150_pool.h>
+#include <w3150_trace.h>
 #include <stdio.h>
-#include <wiringPiSPI.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <netinet/in.h>
 #include <string.h>
 #include <unistd.h>
@@ -11,6 +19,9 @@
 /* This library is designed for use with the 
  * macraw functionality of the W3150+.  Therefore, many
  * of the functions are set up to work with socket 0.
+ *
+ * All state lives in a struct w3150_dev (w3150_dev.h), the w3150_*
+ * functions at the bottom of this file wrap the default device.
  */
 
 //#define DEBUG_RECV
@@ -18,27 +29,173 @@
 //#define DEBUG
 //#define DEBUG_TRANSFER
 
-static const int CHANNEL = 1;
+// chip select of the default device
+#define DEFAULT_CHANNEL 1
 
-int initializeSPI(int rate){
-    
-    int fd = 0;
+/* Waits on the chip, each learns how long its own condition takes.
+ * A full size SEND is ~120us on the wire at 100Mbit. */
+#define WAIT_SPIN_NS        100000
+#define WAIT_SLEEP_MIN_NS   10000
+#define WAIT_SLEEP_MAX_NS   1000000
+
+static struct w3150_dev default_dev = {
+    .channel = DEFAULT_CHANNEL,
+    .irq.fd = -1,
+    .stats = &default_dev.local_stats,
+};
+
+void w3150_dev_init(struct w3150_dev *dev, const char *transport, int channel){
+
+    memset(dev, 0, sizeof(*dev));
+    dev->channel = channel;
+    dev->transport_name = transport;
+    dev->irq.fd = -1;
+    dev->stats = &dev->local_stats;
+}
+
+void w3150_dev_close(struct w3150_dev *dev){
+
+    w3150_irq_source_close(&dev->irq);
+    w3150_dev_trace_stop(dev);
+    w3150_transport_close(&dev->spi);
+}
+
+struct w3150_dev *w3150_default_dev(){
+    return &default_dev;
+}
+
+static int initializeSPI(struct w3150_dev *dev, int rate){
+
+    const char *trace;
+
+    // a device being set up again keeps its bus and clock
+    if (dev->spi.ops != NULL)
+        return 0;
 
     printf("Initializing SPI\n");
-    fd = wiringPiSPISetupMode(CHANNEL, rate, 0);
 
-    if (fd == -1){
-        printf("Error Setting up SPI");
-        exit(0);
+    if (w3150_transport_open(&dev->spi, dev->transport_name, dev->channel, rate) != 0){
+        printf("Error Setting up SPI\n");
+        return -1;
     }
-    else
-        return fd;
+
+    dev->spi.stats = &dev->stats->bus;
+
+    printf("SPI transport: %s, %d frames per transfer\n", dev->spi.ops->name, dev->spi.max_frames);
+
+    trace = getenv(W3150_TRACE_ENV);
+    if (trace != NULL && atol(trace) > 0){
+        if (w3150_dev_trace_start(dev, atol(trace)) == 0)
+            printf("SPI trace: %u records\n", dev->spi.trace->mask + 1);
+        else
+            printf("SPI trace not started\n");
+    }
+
+    return 0;
 }
 
-uint8_t spi_transfer(uint8_t* bytes, int len){
+/* SPI clock ladder.  The Pi makes its SPI clock by dividing the 250MHz
+ * core clock, the steps above 8MHz are rates it can produce. */
+static const int spi_rates[] = {
+    1000000, 2000000, 4000000, 8000000, 10416666, 12500000,
+    15625000, 20833333, 25000000, 31250000, 41666666,
+};
+
+#define NUM_SPI_RATES   (sizeof(spi_rates) / sizeof(spi_rates[0]))
+
+// bad replies within CLOCK_WINDOW_NS that take the clock down a step
+#define CLOCK_ERRORS_MAX    3
+#define CLOCK_WINDOW_NS     1000000000ULL
+
+/* The chip answers each frame with 0x00 0x01 0x02 ahead of the data
+ * byte.  A clock the board cannot carry garbles them along with the
+ * data. */
+static int reply_ok(const uint8_t *frame){
+    return frame[0] == 0x00 && frame[1] == 0x01 && frame[2] == 0x02;
+}
+
+/* return 1 if every frame of a transfer replied well formed.  No early
+ * exit, so a whole payload burst is checked in one vectorised pass. */
+static int replies_ok(const uint8_t *bytes, int len){
+
+    uint8_t bad = 0;
+    int i;
+
+    for (i = 0; i < len; i += W3150_FRAME_SIZE)
+        bad |= bytes[i] | (bytes[i + 1] ^ 0x01) | (bytes[i + 2] ^ 0x02);
+
+    return bad == 0;
+}
+
+/* Move to the next slower step of the ladder */
+static void spi_step_down(struct w3150_dev *dev){
+
+    int rate = dev->spi.rate;
+    int i;
+
+    for (i = NUM_SPI_RATES - 1; i >= 0 && spi_rates[i] >= rate; i--)
+        ;
+
+    if (i < 0 || w3150_transport_set_rate(&dev->spi, spi_rates[i]) != 0){
+        fprintf(stderr, "SPI errors at %d Hz, no slower clock\n", rate);
+        return;
+    }
+
+    dev->clock.steps_down++;
+    fprintf(stderr, "SPI errors at %d Hz, clock down to %d Hz\n", rate, spi_rates[i]);
+}
+
+/* A bad reply frame.  Receive and transmit side both get here, the
+ * thread that makes the count reach CLOCK_ERRORS_MAX steps down. */
+static void spi_clock_error(struct w3150_dev *dev){
+
+    struct w3150_clock *c = &dev->clock;
+    uint64_t now = w3150_now_ns();
+
+    atomic_fetch_add(&c->mismatches, 1);
+
+    if (now - atomic_load(&c->window_start) > CLOCK_WINDOW_NS){
+        atomic_store(&c->window_start, now);
+        atomic_store(&c->window_errors, 0);
+    }
+
+    if (atomic_fetch_add(&c->window_errors, 1) + 1 == CLOCK_ERRORS_MAX){
+        spi_step_down(dev);
+        atomic_store(&c->window_start, w3150_now_ns());
+        atomic_store(&c->window_errors, 0);
+    }
+}
+
+#define SPI_FAIL_REPORT_NS  1000000000ULL
+
+/* A transfer the transport could not make.  Reported at most once a
+ * second, whichever side gets there first. */
+static void spi_failure(struct w3150_dev *dev){
+
+    uint64_t failures = atomic_fetch_add(&dev->spi_failures, 1) + 1;
+    uint64_t now = w3150_now_ns();
+    uint64_t last = atomic_load(&dev->spi_fail_report_ns);
+
+    if ((last == 0 || now - last >= SPI_FAIL_REPORT_NS) &&
+        atomic_compare_exchange_strong(&dev->spi_fail_report_ns, &last, now))
+        fprintf(stderr, "SPI transfer failed on channel %d, %llu failures so far\n",
+                dev->channel, (unsigned long long)failures);
+}
+
+/* Failed transfers since the receive call began, see rx_start() */
+static int rx_failed(struct w3150_dev *dev){
+    return atomic_load_explicit(&dev->spi_failures, memory_order_relaxed) != dev->rx_failures;
+}
+
+/* Clock out len bytes (a multiple of 4, one W3150 frame each), the
+ * replies are left in place.  When the transport fails nothing came
+ * back, so the replies read as 0 rather than the bytes sent.  A bad
+ * reply frame means the clock garbled the transfer, which then counts
+ * as failed the same way: receive calls leave their frames on the chip
+ * to be read again once the clock has stepped down.
+ * return 0, -1 if the transfer failed */
+static int spi_transfer(struct w3150_dev *dev, uint8_t* bytes, int len, uint8_t op){
 
-    int result = 0;
-    
     #ifdef DEBUG_TRANSFER
     int i = 0;
     #endif
@@ -49,7 +206,18 @@ uint8_t spi_transfer(uint8_t* bytes, int len){
     printf("\n");
     #endif
 
-    result = wiringPiSPIDataRW(CHANNEL, (unsigned char*)bytes, len);
+    if (w3150_transport_transfer(&dev->spi, bytes, len, op) != 0){
+        memset(bytes, 0, len);
+        spi_failure(dev);
+        return -1;
+    }
+
+    if (dev->clock.check && !replies_ok(bytes, len)){
+        memset(bytes, 0, len);
+        spi_clock_error(dev);
+        spi_failure(dev);
+        return -1;
+    }
     
     #ifdef DEBUG_TRANSFER
     for (i = 0; i < len; i++)
@@ -58,12 +226,12 @@ uint8_t spi_transfer(uint8_t* bytes, int len){
     printf("+++++++++++++++++++++++++\n");
     #endif
 
-    return bytes[len-1];
+    return 0;
 
 }
 
 /* Private register IO functions */
-static uint8_t w3150_read_register(uint16_t addr){
+static uint8_t w3150_read_register(struct w3150_dev *dev, uint16_t addr, uint8_t op){
 	
     uint8_t data = 0;
     int len = 4;
@@ -74,12 +242,13 @@ static uint8_t w3150_read_register(uint16_t addr){
     buffer[2] = (uint8_t)(addr & 0xff);
     buffer[3] = 0x0;
 
-    data = spi_transfer(buffer, len);
+    spi_transfer(dev, buffer, len, op);
+    data = buffer[3];
 
     return data;
 }
 
-static void w3150_write_register(uint16_t addr, uint8_t data) {
+static void w3150_write_register(struct w3150_dev *dev, uint16_t addr, uint8_t data, uint8_t op) {
     
     int len = 4;
     uint8_t buffer[len];
@@ -89,464 +258,2755 @@ static void w3150_write_register(uint16_t addr, uint8_t data) {
     buffer[2] = (uint8_t)(addr & 0xff);
     buffer[3] = data;
     
-    data = spi_transfer(buffer, len);
+    spi_transfer(dev, buffer, len, op);
     
 }
 
-void w3150_set_mac(const uint8_t *mac){
+/* Burst engine
+ * A payload range is expanded into one buffer of auto-incrementing
+ * frames and submitted as a single transfer.  Addresses are computed as
+ * base + ((offset + i) & mask) so a range that runs off the end of a
+ * socket buffer wraps inside the same burst.  Packing and unpacking use
+ * the vector kernels in w3150_pack.c.  Reads and writes have their own
+ * buffer so the receive and transmit sides can run concurrently.  Both
+ * stop at a failed transfer and return -1, 0 once all of it went. */
 
-    int i;
-    for(i = 0; i < 6; i++)
-        w3150_write_register((SHAR+i), mac[i]);
+#define BURST_MAX_BYTES W3150_BURST_MAX_BYTES
 
-}
+static int w3150_read_ring(struct w3150_dev *dev, uint16_t base, uint16_t mask, uint16_t offset, uint8_t *buf, uint16_t len,
+                           uint8_t op){
 
-void w3150_set_ip(const uint8_t *ip){
+    uint16_t chunk;
 
-    int i;
-    for(i = 0; i < 4; i++)
-        w3150_write_register((SIPR+i), ip[i]);
+    if ((offset & mask) + len > mask + 1)
+        w3150_stat_add(&dev->stats->rx.wraps, 1);
 
-}
+    while (len > 0){
+        chunk = (len > BURST_MAX_BYTES) ? BURST_MAX_BYTES : len;
 
-void w3150_set_subnet(const uint8_t *subnet){
+        w3150_pack(dev->rx_burst, W3150_READ, base, mask, offset, NULL, chunk);
+        if (spi_transfer(dev, dev->rx_burst, chunk * W3150_FRAME_SIZE, op) != 0)
+            return -1;
+        w3150_unpack(dev->rx_burst, buf, chunk);
 
-    int i;
-    for(i = 0; i < 4; i++)
-        w3150_write_register((SUBR+i), subnet[i]);
+        buf += chunk;
+        offset += chunk;
+        len -= chunk;
+    }
 
+    return 0;
 }
 
-void w3150_set_gateway(const uint8_t *gw){
-
-    int i;
-    for(i = 0; i < 4; i++)
-        w3150_write_register((GAR+i), gw[i]);
-
-}
+static int w3150_write_ring(struct w3150_dev *dev, uint16_t base, uint16_t mask, uint16_t offset, const uint8_t *buf, uint16_t len,
+                            uint8_t op){
 
-void w3150_read_mac(uint8_t *mac){
+    uint16_t chunk;
 
-    int i;
-    for (i = 0; i < 6; i++)
-        mac[i] = w3150_read_register(SHAR+i);
+    if ((offset & mask) + len > mask + 1)
+        w3150_stat_add(&dev->stats->tx.wraps, 1);
 
-}
+    while (len > 0){
+        chunk = (len > BURST_MAX_BYTES) ? BURST_MAX_BYTES : len;
 
-void w3150_read_ip(uint8_t *ip){
+        w3150_pack(dev->tx_burst, W3150_WRITE, base, mask, offset, buf, chunk);
+        if (spi_transfer(dev, dev->tx_burst, chunk * W3150_FRAME_SIZE, op) != 0)
+            return -1;
 
-    int i;
-    for (i = 0; i < 4; i++)
-        ip[i] = w3150_read_register(SIPR+i);
+        buf += chunk;
+        offset += chunk;
+        len -= chunk;
+    }
 
+    return 0;
 }
 
-void w3150_read_subnet(uint8_t *subnet){
+/* Command queue
+ * Register reads and writes are recorded as frames and go out in one
+ * transfer on flush.  Read results are stored through the pointers
+ * given when they were queued, in queue order, so a read queued after a
+ * write to the same register sees the new value. */
 
-    int i;
-    for (i = 0; i < 4; i++)
-        subnet[i] = w3150_read_register(SUBR+i);
+enum {
+    CMDQ_WRITE = 0,
+    CMDQ_READ8,
+    CMDQ_READ16_HI,
+    CMDQ_READ16_LO,
+};
 
-}
+static void cmdq_add(struct w3150_cmdq *q, uint8_t opcode, uint16_t addr, uint8_t data, uint8_t kind, void *dest){
 
-void w3150_read_gateway(uint8_t *gw){
+    uint8_t *f;
 
-    int i;
-    for (i = 0; i < 4; i++)
-        gw[i] = w3150_read_register(GAR+i);
+    if (q->count == W3150_CMDQ_MAX)
+        w3150_cmdq_flush(q);
 
-}
+    f = &q->frames[q->count * W3150_FRAME_SIZE];
+    f[0] = opcode;
+    f[1] = (uint8_t)(addr >> 8);
+    f[2] = (uint8_t)(addr & 0xff);
+    f[3] = data;
 
-/* Public Read and Write Methods */
+    q->kind[q->count] = kind;
+    q->dest[q->count] = dest;
+    q->count++;
+}
 
-void w3150_read(uint16_t addr, uint8_t *buf, uint16_t len){
+static void cmdq_init(struct w3150_dev *dev, struct w3150_cmdq *q, uint8_t op){
+    q->dev = dev;
+    q->count = 0;
+    q->op = op;
+}
 
-    int i;
-    for (i = 0; i < len; i++)
-        buf[i] = w3150_read_register(addr + i);
+void w3150_dev_cmdq_init(struct w3150_dev *dev, struct w3150_cmdq *q){
+    cmdq_init(dev, q, W3150_OP_USER);
 }
 
+void w3150_cmdq_read(struct w3150_cmdq *q, uint16_t addr, uint8_t *dest){
+    cmdq_add(q, W3150_READ, addr, 0x0, CMDQ_READ8, dest);
+}
 
-void w3150_write(uint16_t addr, uint8_t *buf, uint16_t len){
+void w3150_cmdq_read16(struct w3150_cmdq *q, uint16_t addr, uint16_t *dest){
+    cmdq_add(q, W3150_READ, addr, 0x0, CMDQ_READ16_HI, dest);
+    cmdq_add(q, W3150_READ, addr + 1, 0x0, CMDQ_READ16_LO, dest);
+}
 
-    int i;
-    for (i = 0; i < len; i++){
-        w3150_write_register(addr+i, buf[i]);
-        #ifdef DEBUG_TRANSFER
-        printf("%X ", buf[i]);
-        #endif
-    }
-    #ifdef DEBUG_TRANSFER
-    printf("\n");
-    #endif
+void w3150_cmdq_write(struct w3150_cmdq *q, uint16_t addr, uint8_t data){
+    cmdq_add(q, W3150_WRITE, addr, data, CMDQ_WRITE, NULL);
 }
 
-/* General configuration methods */
+void w3150_cmdq_write16(struct w3150_cmdq *q, uint16_t addr, uint16_t data){
+    cmdq_add(q, W3150_WRITE, addr, (uint8_t)(data >> 8), CMDQ_WRITE, NULL);
+    cmdq_add(q, W3150_WRITE, addr + 1, (uint8_t)(data & 0xff), CMDQ_WRITE, NULL);
+}
 
-void w3150_init_networking(uint8_t *mac, uint8_t *ip, uint8_t *gw, uint8_t *subnet) {
+int w3150_cmdq_flush(struct w3150_cmdq *q){
 
-    // Use 8000000 for the baud rate
-    // seems to be the highest we can get
-    // and still be reliable
-    initializeSPI(8000000);
+    int i;
+    int ret;
+    uint8_t data;
+    uint16_t *dest16;
 
-    // Software reset
-    w3150_write_register(MR,0x80);
+    if (q->count == 0)
+        return 0;
 
-    // Wait for reset
-    usleep(5000);
+    ret = spi_transfer(q->dev, q->frames, q->count * W3150_FRAME_SIZE, q->op);
+
+    for (i = 0; i < q->count; i++){
+        data = q->frames[i * W3150_FRAME_SIZE + 3];
+        dest16 = q->dest[i];
+
+        switch (q->kind[i]){
+        case CMDQ_READ8:
+            *(uint8_t *)q->dest[i] = data;
+            break;
+        case CMDQ_READ16_HI:
+            *dest16 = (*dest16 & 0x00FF) | (data << 8);
+            break;
+        case CMDQ_READ16_LO:
+            *dest16 = (*dest16 & 0xFF00) | data;
+            break;
+        }
+    }
 
-    // Set mac address
-    w3150_set_mac(mac);
+    q->count = 0;
 
-    // Set source IP address
-    w3150_set_ip(ip);
+    return ret;
+}
 
-    // Set gateway
-    w3150_set_gateway(gw);
+static uint16_t w3150_read_register16(struct w3150_dev *dev, uint16_t addr, uint8_t op){
 
-    // Set subnet mask
-    w3150_set_subnet(subnet);
+    struct w3150_cmdq q;
+    uint16_t value = 0;
 
-    // Debug Logging 
-    #ifdef DEBUG
+    cmdq_init(dev, &q, op);
+    w3150_cmdq_read16(&q, addr, &value);
+    w3150_cmdq_flush(&q);
 
-    uint8_t r_mac[6];
-    uint8_t r_ip[4];
-    uint8_t r_subnet[4];
-    uint8_t r_gw[4];
+    return value;
+}
 
-    w3150_read_mac(r_mac);
-    w3150_read_ip(r_ip);
-    w3150_read_subnet(r_subnet);
-    w3150_read_gateway(r_gw);
+static void w3150_write_register16(struct w3150_dev *dev, uint16_t addr, uint16_t value, uint8_t op){
 
-    printf("----------------w3150 Init----------------\n");
-    printf("IP Address  : %d.%d.%d.%d\n",r_ip[0], r_ip[1], r_ip[2], r_ip[3]);
-    printf("Subnet Mask : %d.%d.%d.%d\n",r_subnet[0], r_subnet[1], r_subnet[2], r_subnet[3]);
-    printf("Gateway     : %d.%d.%d.%d\n",r_gw[0], r_gw[1], r_gw[2], r_gw[3]);
-    printf("Mac Address : %x:%x:%x:%x:%x:%x\n",r_mac[0], r_mac[1], r_mac[2], r_mac[3], r_mac[4], r_mac[5]);
-    printf("------------------------------------------\n");
-    #endif
+    struct w3150_cmdq q;
 
+    cmdq_init(dev, &q, op);
+    w3150_cmdq_write16(&q, addr, value);
+    w3150_cmdq_flush(&q);
 }
 
-void w3150_ping_block(){
-    w3150_write_register(MR, 0x10);
+/* Shadow registers
+ * Registers only the host ever writes are mirrored here and served from
+ * memory.  Writes go through to the chip when the value changes.  GAR,
+ * SUBR, SHAR and SIPR are contiguous (0x0001 to 0x0012) and kept as one
+ * block.  w3150_shadow_resync() reloads everything from the chip, e.g.
+ * after something else has touched it. */
+
+#define NET_BASE    GAR
+#define NET_SIZE    W3150_NET_SIZE
+
+/* Socket buffers
+ * RMSR and TMSR give each socket 1, 2, 4 or 8KB, two bits per socket
+ * starting with socket 0, and the buffers are packed in socket order.
+ * A socket that would run past the 8KB gets none. */
+
+#define SOCK_MEM_SIZE   0x2000
+#define TX_MEM_BASE     0x4000
+#define RX_MEM_BASE     0x6000
+
+static void mem_layout(struct w3150_dev *dev){
+
+    struct w3150_sock_mem *mem;
+    uint16_t rx_offset = 0;
+    uint16_t tx_offset = 0;
+    uint16_t rx_size;
+    uint16_t tx_size;
+    int s;
+
+    for (s = 0; s < W3150_SOCKETS; s++){
+        mem = &dev->mem[s];
+        rx_size = 1024 << ((dev->shadow.rmsr >> (2 * s)) & 0x03);
+        tx_size = 1024 << ((dev->shadow.tmsr >> (2 * s)) & 0x03);
+
+        memset(mem, 0, sizeof(*mem));
+
+        if (rx_offset + rx_size <= SOCK_MEM_SIZE){
+            mem->rx_base = RX_MEM_BASE + rx_offset;
+            mem->rx_mask = rx_size - 1;
+        }
+        if (tx_offset + tx_size <= SOCK_MEM_SIZE){
+            mem->tx_base = TX_MEM_BASE + tx_offset;
+            mem->tx_mask = tx_size - 1;
+        }
+
+        rx_offset += rx_size;
+        tx_offset += tx_size;
+    }
 }
 
-void w3150_macraw_open_socket(){
-    w3150_write_register(S0_CR, SOCK_OPEN);
-}
+/* Register value for a list of buffer sizes
+ * return -1 if they cannot be laid out */
+static int mem_size_bits(const uint16_t *sizes){
+
+    unsigned int total = 0;
+    int bits = 0;
+    int code;
+    int s;
+
+    for (s = 0; s < W3150_SOCKETS; s++){
+        if (sizes[s] == 0){
+            // only once the memory has run out
+            if (total < SOCK_MEM_SIZE)
+                return -1;
+            continue;
+        }
+
+        for (code = 0; code < 4 && (1024 << code) != sizes[s]; code++)
+            ;
+        if (code == 4 || total + sizes[s] > SOCK_MEM_SIZE)
+            return -1;
+
+        total += sizes[s];
+        bits |= code << (2 * s);
+    }
 
-void w3150_macraw_close_socket(){
-    w3150_write_register(S0_CR, SOCK_CLOSE);
+    // sockets left at 0 take the 1KB code, past the end of memory
+    return bits;
 }
 
-/* Initialize macraw mode on socket 0
- * When using macraw mode, socket 0 is the only
- * socket that can be used.  Therefore the memory
- * assigned to it is maxed out.
- *
- * Return 1 if successful */
-uint8_t w3150_init_macraw() {
-
-    // Set RX Memory Size Register
-    // Assigning 8KB to Socket 0
-    w3150_write_register(RMSR, 0xFF);
-
-    // Set the TX Memory Size Register
-    // Assigning 8KB to Socket 0
-    w3150_write_register(TMSR, 0xFF);
-   
-    // Set mode to macraw and open socket
-    // Only Socket 0 supports macraw
-    w3150_write_register(S0_MR, MACRAW);
-    w3150_macraw_open_socket();
+/* Values the chip comes out of reset with */
+static void shadow_reset(struct w3150_dev *dev){
 
-    // check if it actually went to macraw mode
-    if (w3150_read_register(S0_SR) != STATUS_MACRAW){
-        w3150_macraw_close_socket();
-        return 0;
-    }
-    else
-        return 1;
+    memset(&dev->shadow, 0, sizeof(dev->shadow));
+    dev->shadow.rmsr = 0x55;
+    dev->shadow.tmsr = 0x55;
+    dev->shadow.valid = 1;
+    mem_layout(dev);
 }
 
+/* Pipelined transmit
+ * Frames are staged into free TX memory past the committed write pointer
+ * while the previous SEND is still on the wire, and queued.  Only one
+ * SEND can be outstanding, so the next frame is committed (S0_TX_WR
+ * moved over it and SEND issued) once S0_CR reads back clear.
+ *
+ * free is a lower bound on the TX memory available for staging: the last
+ * S0_TX_FSR seen minus what has been staged since.  FSR only grows as
+ * the chip sends, so it is re-read only when a frame does not fit. */
 
-uint16_t w3150_macraw_get_received_size_register(){
-
-    uint16_t size = 0;
+#define TX_QUEUE_MAX W3150_TX_QUEUE_MAX
 
-    size = (w3150_read_register(S0_RX_RSR0) << 8) | w3150_read_register(S0_RX_RSR1);
+static void tx_reset(struct w3150_dev *dev){
+    memset(&dev->txq, 0, sizeof(dev->txq));
+    dev->txq.staged_wr = dev->shadow.tx_wr;
+}
 
-    return size;
+static void rxq_reset(struct w3150_dev *dev){
+    dev->rxq.used = 0;
+    dev->rxq.count = 0;
+    dev->rxq.next = 0;
+    dev->rxq.chip_size = 0;
 }
 
-uint16_t w3150_macraw_get_tx_free_size(){
+static void shadow_set_net(struct w3150_dev *dev, uint16_t addr, const uint8_t *data, uint16_t len){
 
-    uint16_t size = 0;
+    uint8_t *cached = &dev->shadow.net[addr - NET_BASE];
 
-    size = (w3150_read_register(S0_TX_FSR0) << 8) | w3150_read_register(S0_TX_FSR1);
+    if (dev->shadow.valid && memcmp(cached, data, len) == 0)
+        return;
 
-    return size;
+    memcpy(cached, data, len);
+    w3150_write_ring(dev, addr, 0xFFFF, 0, data, len, W3150_OP_SETUP);
 }
 
-uint16_t w3150_macraw_get_tx_write_pointer(){
-
-    uint16_t pointer = 0;
+static void shadow_get_net(struct w3150_dev *dev, uint16_t addr, uint8_t *data, uint16_t len){
 
-    pointer = (w3150_read_register(S0_TX_WR0) << 8) | w3150_read_register(S0_TX_WR1);
+    if (!dev->shadow.valid)
+        w3150_dev_shadow_resync(dev);
 
-    return pointer;
+    memcpy(data, &dev->shadow.net[addr - NET_BASE], len);
 }
 
-uint16_t w3150_macraw_get_tx_read_pointer(){
+void w3150_dev_shadow_resync(struct w3150_dev *dev){
+
+    struct w3150_shadow *shadow = &dev->shadow;
+    struct w3150_cmdq q;
 
-    uint16_t pointer = 0;
+    w3150_read_ring(dev, NET_BASE, 0xFFFF, 0, shadow->net, NET_SIZE, W3150_OP_SETUP);
 
-    pointer = (w3150_read_register(S0_TX_RD0) << 8) | w3150_read_register(S0_TX_RD1);
+    cmdq_init(dev, &q, W3150_OP_SETUP);
+    w3150_cmdq_read(&q, RMSR, &shadow->rmsr);
+    w3150_cmdq_read(&q, TMSR, &shadow->tmsr);
+    w3150_cmdq_read(&q, S0_MR, &shadow->s0_mr);
+    w3150_cmdq_read16(&q, S0_TX_WR0, &shadow->tx_wr);
+    w3150_cmdq_read16(&q, S0_RX_RD0, &shadow->rx_rd);
+    w3150_cmdq_flush(&q);
 
-    return pointer;
+    shadow->valid = 1;
+    mem_layout(dev);
 }
 
+/* Compare the shadow with the chip
+ * return 1 if they match */
+uint8_t w3150_dev_shadow_verify(struct w3150_dev *dev){
 
-uint16_t w3150_macraw_get_read_pointer(){
-    
-    uint16_t pointer = 0x0000;
+    struct w3150_shadow *shadow = &dev->shadow;
+    struct w3150_cmdq q;
+    uint8_t net[NET_SIZE];
+    uint8_t rmsr = 0, tmsr = 0, s0_mr = 0;
+    uint16_t tx_wr = 0, rx_rd = 0;
 
-    pointer = (w3150_read_register(S0_RX_RD0) << 8) | w3150_read_register(S0_RX_RD1);
+    if (!shadow->valid)
+        return 0;
 
-    return pointer;
-}
+    w3150_read_ring(dev, NET_BASE, 0xFFFF, 0, net, NET_SIZE, W3150_OP_SETUP);
 
-uint16_t w3150_macraw_get_rx_write_pointer(){
+    cmdq_init(dev, &q, W3150_OP_SETUP);
+    w3150_cmdq_read(&q, RMSR, &rmsr);
+    w3150_cmdq_read(&q, TMSR, &tmsr);
+    w3150_cmdq_read(&q, S0_MR, &s0_mr);
+    w3150_cmdq_read16(&q, S0_TX_WR0, &tx_wr);
+    w3150_cmdq_read16(&q, S0_RX_RD0, &rx_rd);
+    w3150_cmdq_flush(&q);
 
-    uint16_t pointer = 0x0000;
+    if (memcmp(net, shadow->net, NET_SIZE) != 0 ||
+        rmsr != shadow->rmsr || tmsr != shadow->tmsr || s0_mr != shadow->s0_mr)
+        return 0;
 
-    pointer = (w3150_read_register(S0_RX_WR0) << 8) | w3150_read_register(S0_RX_WR1);
+    // the pointers are MACRAW's, a TCP socket 0 keeps its own
+    if (s0_mr == MACRAW && (tx_wr != shadow->tx_wr || rx_rd != shadow->rx_rd))
+        return 0;
 
-    return pointer;
+    return 1;
 }
 
-void w3150_macraw_set_recv(){
-    // Set RECV command
-    w3150_write_register(S0_CR, SOCK_RECV);
+void w3150_dev_set_mac(struct w3150_dev *dev, const uint8_t *mac){
+    shadow_set_net(dev, SHAR, mac, 6);
 }
 
-/* check to see if data has sent
- * return 1 if it has */
-uint8_t w3150_macraw_check_send(){
+void w3150_dev_set_ip(struct w3150_dev *dev, const uint8_t *ip){
+    shadow_set_net(dev, SIPR, ip, 4);
+}
 
-    if (w3150_read_register(S0_CR) != 0x00) {
-        return 0;
-    }
-    else
-        return 1;
+void w3150_dev_set_subnet(struct w3150_dev *dev, const uint8_t *subnet){
+    shadow_set_net(dev, SUBR, subnet, 4);
 }
 
-/* Check for data in the receive buffer
- * return 1 if there is data */
-uint8_t w3150_macraw_check_recv(){
-    
-    #ifdef DEBUG_RECV_CHECK
-    printf("Received Size: %X\n", w3150_macraw_get_received_size_register());
-    #endif
-    if (w3150_macraw_get_received_size_register() != 0x0000){
-        return 1;
-    }
+void w3150_dev_set_gateway(struct w3150_dev *dev, const uint8_t *gw){
+    shadow_set_net(dev, GAR, gw, 4);
+}
 
-    else {
-        return 0;
-    }
+void w3150_dev_read_mac(struct w3150_dev *dev, uint8_t *mac){
+    shadow_get_net(dev, SHAR, mac, 6);
 }
 
-void w3150_macraw_write_read_pointer(uint16_t ptr){
+void w3150_dev_read_ip(struct w3150_dev *dev, uint8_t *ip){
+    shadow_get_net(dev, SIPR, ip, 4);
+}
 
-    w3150_write_register(S0_RX_RD0, (uint8_t) ((ptr & 0xFF00) >> 8));
-    w3150_write_register(S0_RX_RD1, (uint8_t) (ptr & 0x00FF));
+void w3150_dev_read_subnet(struct w3150_dev *dev, uint8_t *subnet){
+    shadow_get_net(dev, SUBR, subnet, 4);
+}
 
+void w3150_dev_read_gateway(struct w3150_dev *dev, uint8_t *gw){
+    shadow_get_net(dev, GAR, gw, 4);
 }
 
-void w3150_macraw_set_write_pointer(uint16_t ptr){
+/* SPI clock calibration
+ * Each step of the ladder writes patterns to the start of TX memory and
+ * reads them back along with VERSIONR, checking every reply frame. */
 
-    w3150_write_register(S0_TX_WR0, (uint8_t) ((ptr & 0xFF00) >> 8));
-    w3150_write_register(S0_TX_WR1, (uint8_t) (ptr & 0x00FF));
+#define CAL_BYTES   256
+#define CAL_ROUNDS  4
 
-}
+/* One transfer with every reply checked
+ * return 1 if they all came back right */
+static int cal_transfer(struct w3150_dev *dev, uint8_t opcode, uint16_t addr, uint8_t *buf, uint16_t len){
 
-/* Read from the RX buffer
- * returns the number of bytes read */
-uint16_t w3150_macraw_read(uint8_t *recv_buf) {
+    uint8_t *f = dev->tx_burst;
+    uint16_t i;
 
+    w3150_pack(f, opcode, addr, 0xFFFF, 0, (opcode == W3150_WRITE) ? buf : NULL, len);
 
-    // get the receive size
-    uint16_t size = w3150_macraw_get_received_size_register();
+    if (w3150_transport_transfer(&dev->spi, f, len * W3150_FRAME_SIZE, W3150_OP_SETUP) != 0)
+        return 0;
 
-    uint16_t read_pointer = w3150_macraw_get_read_pointer();
+    for (i = 0; i < len; i++){
+        if (!reply_ok(f + i * W3150_FRAME_SIZE) ||
+            (opcode == W3150_WRITE && f[i * W3150_FRAME_SIZE + 3] != 0x03))
+            return 0;
+    }
 
-    #ifdef DEBUG_RECV
-    printf("received size register: %X\n", size);
-    printf("read pointer: %X\n", read_pointer);
-    #endif
-   
-    // calculate offset address
-    uint16_t offset = read_pointer & s0_rx_mask;
+    if (opcode == W3150_READ)
+        w3150_unpack(f, buf, len);
 
-    #ifdef DEBUG_RECV
-    printf("offset: %X\n", offset);
-    #endif
+    return 1;
+}
 
-    // calculate start address
-    uint16_t start_addr = s0_rx_base + offset;
+/* return 1 if the bus is sound at the current rate */
+static int cal_check(struct w3150_dev *dev, uint8_t version){
 
-    #ifdef DEBUG_RECV
-    printf("start addr (header): %X\n", start_addr);
-    #endif
+    uint8_t pattern[CAL_BYTES];
+    uint8_t back[CAL_BYTES];
+    uint8_t v = 0;
+    uint32_t x = 0x12345678;
+    int r;
+    int i;
 
-    uint16_t upper_size = 0;
-    uint16_t left_size = 0;
+    for (r = 0; r < CAL_ROUNDS; r++){
+        // solid, alternating, walking one and noise
+        for (i = 0; i < CAL_BYTES; i++){
+            x = x * 1103515245 + 12345;
+            switch (r){
+            case 0:  pattern[i] = (i & 1) ? 0xFF : 0x00; break;
+            case 1:  pattern[i] = (i & 1) ? 0x55 : 0xAA; break;
+            case 2:  pattern[i] = 1 << (i & 7); break;
+            default: pattern[i] = x >> 24; break;
+            }
+        }
+
+        if (!cal_transfer(dev, W3150_WRITE, TX_MEM_BASE, pattern, CAL_BYTES) ||
+            !cal_transfer(dev, W3150_READ, TX_MEM_BASE, back, CAL_BYTES) ||
+            !cal_transfer(dev, W3150_READ, VERSIONR, &v, 1) ||
+            memcmp(pattern, back, CAL_BYTES) != 0 || v != version)
+            return 0;
+    }
 
-    uint16_t new_read_pointer;
+    return 1;
+}
 
-    // length of the recieved packet + 2 byte header
-    uint16_t macraw_header;
+/* Step the clock up from the current rate to at most max_rate, see
+ * w3150_spi_calibrate()
+ * return the rate the bus was left at */
+int w3150_dev_spi_calibrate(struct w3150_dev *dev, int max_rate){
+
+    struct w3150_clock *c = &dev->clock;
+    uint8_t saved[CAL_BYTES];
+    uint8_t version = 0;
+    int base = dev->spi.rate;
+    int best = -1;
+    int rate;
+    int i;
 
-    // check for rx memory overflow while reading 2 byte header
-    if ((offset + 2) > (s0_rx_mask + 1)){
-        #ifdef DEBUG_RECV
-        printf("RX MEMORY OVERFLOW: Header\n");
-        #endif
+    c->check = 0;
 
-        macraw_header = w3150_read_register(start_addr) << 8;
-        macraw_header = macraw_header | w3150_read_register(s0_rx_base);
-        offset = 1;
+    if (!cal_transfer(dev, W3150_READ, VERSIONR, &version, 1) ||
+        !cal_transfer(dev, W3150_READ, TX_MEM_BASE, saved, CAL_BYTES) ||
+        !cal_check(dev, version)){
+        printf("SPI replies do not check out, clock left at %d Hz\n", base);
+        return base;
     }
-    else {
-        macraw_header = w3150_read_register(start_addr) << 8;
-        macraw_header = macraw_header | w3150_read_register(start_addr + 1);
-        offset += 2;
-    }
-
-    #ifdef DEBUG_RECV
-    printf("macraw_header: %X\n", macraw_header);
-    #endif
 
-    start_addr = s0_rx_base + offset;
+    for (i = 0; i < (int)NUM_SPI_RATES && spi_rates[i] <= max_rate; i++){
+        if (spi_rates[i] <= base)
+            continue;
+        if (w3150_transport_set_rate(&dev->spi, spi_rates[i]) != 0 || !cal_check(dev, version))
+            break;
+        best = i;
+    }
 
-    #ifdef DEBUG_RECV
-    printf("start addr (body): %X\n", start_addr);
-    #endif
+    // one step back from the fastest that passed
+    rate = base;
+    if (best > 0 && spi_rates[best - 1] > base)
+        rate = spi_rates[best - 1];
 
-    // Check for RX memory overflow
-    if (macraw_header + offset > s0_rx_mask + 1){
-        #ifdef DEBUG_RECV
-        printf("RX MEMORY OVERFLOW: Data\n");
-        #endif 
+    w3150_transport_set_rate(&dev->spi, rate);
+    cal_transfer(dev, W3150_WRITE, TX_MEM_BASE, saved, CAL_BYTES);
 
-        upper_size = s0_rx_mask + 1 - offset;
+    c->max_ok = (best >= 0) ? spi_rates[best] : base;
+    c->check = 1;
+    atomic_store(&c->window_errors, 0);
 
-        w3150_read(start_addr, recv_buf, upper_size);
+    printf("SPI clock: %d Hz, %d Hz passed\n", rate, c->max_ok);
+    return rate;
+}
 
-        left_size = macraw_header - upper_size;
+/* Pick the rate from $W3150_SPI_RATE: a number fixes it, "auto" (or
+ * nothing) calibrates and "auto:N" calibrates up to N */
+static void spi_clock_setup(struct w3150_dev *dev){
 
-        #ifdef DEBUG_RECV
-        printf("Upper Size: %X\nLeft Size: %X\n", upper_size, left_size);
-        #endif 
+    const char *env = getenv(W3150_SPI_RATE_ENV);
+    uint8_t version = 0;
+    int max_rate = INT_MAX;
 
-        w3150_read(s0_rx_base, recv_buf + upper_size, left_size);
+    if (env != NULL && strncmp(env, "auto", 4) != 0 && atoi(env) > 0){
+        dev->clock.check = 0;
+        if (w3150_transport_set_rate(&dev->spi, atoi(env)) != 0)
+            printf("SPI clock %s not taken, left at %d Hz\n", env, dev->spi.rate);
 
+        // still watch the replies if the chip gives proper ones
+        dev->clock.check = cal_transfer(dev, W3150_READ, VERSIONR, &version, 1);
+        return;
     }
-    else {
-        w3150_read(start_addr, recv_buf, macraw_header);
-    }
- 
-    // turns out this is really important.  If this is not done correctly
-    // all sorts of bad things happen.  The read pointer value is used with
-    // some internal calculations.
-    new_read_pointer = size + read_pointer;
 
-    #ifdef DEBUG_RECV
-    printf("new read pointer: %X\n", new_read_pointer);
-    printf("new write pointer: %X\n", w3150_macraw_get_rx_write_pointer()); 
-    #endif
-
-    // Increase S0_RX_RD by size of packet, don't mess this up.
-    w3150_macraw_write_read_pointer(new_read_pointer);
+    if (env != NULL && env[4] == ':' && atoi(env + 5) > 0)
+        max_rate = atoi(env + 5);
 
-    // Set RECV command
-    w3150_macraw_set_recv();
-    
-    return size;
+    w3150_dev_spi_calibrate(dev, max_rate);
 }
 
-/* Write raw data
- * return 1 if successful */
-uint8_t w3150_macraw_write(uint8_t *tx_buf, uint16_t len) {
+/* Public Read and Write Methods */
 
-    uint16_t offset;
-    uint16_t start_address;
-    uint16_t upper_size;
-    uint16_t left_size;
-    uint16_t tx_write_pointer;
-    uint16_t new_tx_pointer;
+void w3150_dev_read(struct w3150_dev *dev, uint16_t addr, uint8_t *buf, uint16_t len){
+    w3150_read_ring(dev, addr, 0xFFFF, 0, buf, len, W3150_OP_USER);
+}
 
-    #ifdef DEBUG_TX
-    printf("S0_SR: %X\n", w3150_read_register(S0_SR));
-    printf("tx free size: %X\n" , w3150_macraw_get_tx_free_size());
-    printf("tx read pointer: %x\n", w3150_macraw_get_tx_read_pointer());
-    #endif
-    while (w3150_macraw_get_tx_free_size() < len)
-        usleep(1);
 
-    tx_write_pointer = w3150_macraw_get_tx_write_pointer();
-    #ifdef DEBUG_TX
-    printf("tx write pointer: %X\n", tx_write_pointer);
-    #endif
-    offset = tx_write_pointer & s0_tx_mask;
+void w3150_dev_write(struct w3150_dev *dev, uint16_t addr, uint8_t *buf, uint16_t len){
+    w3150_write_ring(dev, addr, 0xFFFF, 0, buf, len, W3150_OP_USER);
+}
 
-    start_address = s0_tx_base + offset;
+/* General configuration methods */
 
-    #ifdef DEBUG_TX
-    printf("Start Address: %X\n", start_address);
-    #endif
+/* Return 1 if successful */
+/* Warm and cold start
+ * A cold start resets the chip and programs it from scratch.  A warm
+ * start first reads back the configuration and socket 0; if the chip is
+ * already in MACRAW with the same addresses it is kept as it is, frames
+ * it has buffered included, and w3150_init_macraw() leaves socket 0
+ * open. */
 
-    if ((offset + len) > (s0_rx_mask + 1)){
-        
-        upper_size = s0_tx_mask + 1 - offset;
+#define RESET_TIMEOUT_NS    100000000ULL
+#define SEND_SETTLE_NS      1000000ULL
 
-        w3150_write(start_address, tx_buf, upper_size);
+/* Software reset, polled until the chip clears MR_RST
+ * return 1 if it came back */
+static int chip_reset(struct w3150_dev *dev){
 
-        left_size = len - upper_size;
+    struct w3150_wait w;
+    int done;
 
-        w3150_write(s0_tx_base, tx_buf + upper_size, left_size);
-    }
+    w3150_write_register(dev, MR, MR_RST, W3150_OP_SETUP);
 
-    else
-        w3150_write(start_address, tx_buf, len);
+    w3150_wait_init(&w, WAIT_SPIN_NS, WAIT_SLEEP_MIN_NS, WAIT_SLEEP_MAX_NS);
+    w3150_wait_begin(&w);
+    while (!(done = !(w3150_read_register(dev, MR, W3150_OP_SETUP) & MR_RST)) &&
+           w3150_wait_elapsed_ns(&w) < RESET_TIMEOUT_NS)
+        w3150_wait_step(&w);
+    w3150_wait_end(&w);
 
-    // this is really important for all of the same reasons as the
-    // read pointer
-    new_tx_pointer = tx_write_pointer + len;
+    if (!done)
+        printf("W3150 did not come out of reset\n");
 
-    w3150_macraw_set_write_pointer(new_tx_pointer);
+    return done;
+}
 
-    w3150_write_register(S0_CR, SOCK_SEND);
+/* return 1 if the net block in the shadow holds these addresses */
+static int net_matches(struct w3150_dev *dev, const uint8_t *mac, const uint8_t *ip,
+                       const uint8_t *gw, const uint8_t *subnet){
 
-    #ifdef DEBUG_TX
-    printf("tx read pointer: %X\n", w3150_macraw_get_tx_read_pointer());
-    printf("tx write pointer: %X\n", w3150_macraw_get_tx_write_pointer());
-    printf("S0_SR: %X\n", w3150_read_register(S0_SR));
+    const uint8_t *net = dev->shadow.net;
+
+    return memcmp(net + (GAR - NET_BASE), gw, 4) == 0 &&
+           memcmp(net + (SUBR - NET_BASE), subnet, 4) == 0 &&
+           memcmp(net + (SHAR - NET_BASE), mac, 6) == 0 &&
+           memcmp(net + (SIPR - NET_BASE), ip, 4) == 0;
+}
+
+/* Take over socket 0 as the previous owner left it
+ * return 1 if it is in MACRAW with these addresses */
+static int warm_start(struct w3150_dev *dev, const uint8_t *mac, const uint8_t *ip,
+                      const uint8_t *gw, const uint8_t *subnet){
+
+    struct w3150_cmdq q;
+    struct w3150_wait w;
+    uint8_t status = 0;
+    uint16_t tx_rd = 0;
+
+    w3150_dev_shadow_resync(dev);
+
+    cmdq_init(dev, &q, W3150_OP_SETUP);
+    w3150_cmdq_read(&q, S0_SR, &status);
+    w3150_cmdq_read16(&q, S0_TX_RD0, &tx_rd);
+    w3150_cmdq_flush(&q);
+
+    if (status != STATUS_MACRAW || dev->shadow.s0_mr != MACRAW || !net_matches(dev, mac, ip, gw, subnet))
+        return 0;
+
+    // TX_RD catches up with TX_WR when a SEND finishes.  If it has not
+    // after a frame time the previous owner died between moving TX_WR
+    // and SEND, and that data is dropped rather than sent ahead of ours.
+    w3150_wait_init(&w, WAIT_SPIN_NS, WAIT_SLEEP_MIN_NS, WAIT_SLEEP_MAX_NS);
+    w3150_wait_begin(&w);
+    while (tx_rd != dev->shadow.tx_wr && w3150_wait_elapsed_ns(&w) < SEND_SETTLE_NS){
+        w3150_wait_step(&w);
+        tx_rd = w3150_read_register16(dev, S0_TX_RD0, W3150_OP_SETUP);
+    }
+    w3150_wait_end(&w);
+
+    if (tx_rd != dev->shadow.tx_wr){
+        w3150_cmdq_write16(&q, S0_TX_WR0, tx_rd);
+        dev->shadow.tx_wr = tx_rd;
+    }
+
+    // RECV works RX_RSR out again from RX_RD, in case the previous owner
+    // moved RX_RD and stopped before its RECV
+    w3150_cmdq_write(&q, S0_CR, SOCK_RECV);
+    w3150_cmdq_flush(&q);
+
+    dev->mem_set = 1;
+    dev->s0_kept = 1;
+    tx_reset(dev);
+
+    return 1;
+}
+
+/* return 1 if the kept socket 0 has nothing left in TX memory to send */
+static int warm_tx_idle(struct w3150_dev *dev){
+
+    struct w3150_cmdq q;
+    uint8_t cr = 0xff;
+    uint16_t tx_rd = 0;
+
+    cmdq_init(dev, &q, W3150_OP_SETUP);
+    w3150_cmdq_read(&q, S0_CR, &cr);
+    w3150_cmdq_read16(&q, S0_TX_RD0, &tx_rd);
+    if (w3150_cmdq_flush(&q) != 0)
+        return 0;
+
+    return cr == 0 && tx_rd == dev->shadow.tx_wr;
+}
+
+/* Return 1 if successful */
+uint8_t w3150_dev_init_networking(struct w3150_dev *dev, uint8_t *mac, uint8_t *ip, uint8_t *gw, uint8_t *subnet) {
+
+    const char *env = getenv(W3150_WARM_START_ENV);
+    int warm = dev->warm_start || (env != NULL && atoi(env) != 0);
+    uint8_t *net;
+
+    // Start at the rate that has always worked, calibration below
+    // takes it up as far as the board allows
+    if (initializeSPI(dev, W3150_SPI_RATE_SAFE) != 0)
+        return 0;
+
+    w3150_wait_init(&dev->tx_space_wait, WAIT_SPIN_NS, WAIT_SLEEP_MIN_NS, WAIT_SLEEP_MAX_NS);
+    w3150_wait_init(&dev->tx_send_wait, WAIT_SPIN_NS, WAIT_SLEEP_MIN_NS, WAIT_SLEEP_MAX_NS);
+    w3150_wait_init(&dev->irq_poll_wait, WAIT_SPIN_NS, WAIT_SLEEP_MIN_NS, WAIT_SLEEP_MAX_NS);
+
+    memset(dev->sock, 0, sizeof(dev->sock));
+    dev->s0_kept = 0;
+
+    // a kept socket 0 may still be sending from the TX memory that
+    // calibration borrows, so it is looked at first, at the safe rate,
+    // and the clock only calibrated once it is idle
+    if (warm && warm_start(dev, mac, ip, gw, subnet)){
+        printf("W3150 warm start, socket 0 kept\n");
+        if (warm_tx_idle(dev))
+            spi_clock_setup(dev);
+        else
+            printf("Socket 0 still sending, SPI clock left at %d Hz\n", dev->spi.rate);
+        return 1;
+    }
+
+    if (!chip_reset(dev))
+        return 0;
+
+    spi_clock_setup(dev);
+
+    shadow_reset(dev);
+    dev->mem_set = 0;
+
+    // GAR, SUBR, SHAR and SIPR in one burst
+    net = dev->shadow.net;
+    memcpy(net + (GAR - NET_BASE), gw, 4);
+    memcpy(net + (SUBR - NET_BASE), subnet, 4);
+    memcpy(net + (SHAR - NET_BASE), mac, 6);
+    memcpy(net + (SIPR - NET_BASE), ip, 4);
+    w3150_write_ring(dev, NET_BASE, 0xFFFF, 0, net, NET_SIZE, W3150_OP_SETUP);
+
+    // Debug Logging
+    #ifdef DEBUG
+
+    uint8_t r_mac[6];
+    uint8_t r_ip[4];
+    uint8_t r_subnet[4];
+    uint8_t r_gw[4];
+
+    w3150_dev_read_mac(dev, r_mac);
+    w3150_dev_read_ip(dev, r_ip);
+    w3150_dev_read_subnet(dev, r_subnet);
+    w3150_dev_read_gateway(dev, r_gw);
+
+    printf("----------------w3150 Init----------------\n");
+    printf("IP Address  : %d.%d.%d.%d\n",r_ip[0], r_ip[1], r_ip[2], r_ip[3]);
+    printf("Subnet Mask : %d.%d.%d.%d\n",r_subnet[0], r_subnet[1], r_subnet[2], r_subnet[3]);
+    printf("Gateway     : %d.%d.%d.%d\n",r_gw[0], r_gw[1], r_gw[2], r_gw[3]);
+    printf("Mac Address : %x:%x:%x:%x:%x:%x\n",r_mac[0], r_mac[1], r_mac[2], r_mac[3], r_mac[4], r_mac[5]);
+    printf("------------------------------------------\n");
     #endif
 
-    // check to make sure data is finished sending
-    while(!w3150_macraw_check_send())
-        usleep(1);
+    return 1;
+}
+
+void w3150_dev_ping_block(struct w3150_dev *dev){
+    w3150_write_register(dev, MR, 0x10, W3150_OP_SETUP);
+}
+
+static void macraw_close_socket(struct w3150_dev *dev){
+    w3150_write_register(dev, S0_CR, SOCK_CLOSE, W3150_OP_SETUP);
+}
+
+/* Split the socket memory, see w3150_set_memory()
+ * return 1 if successful */
+uint8_t w3150_dev_set_memory(struct w3150_dev *dev, const uint16_t *rx_sizes, const uint16_t *tx_sizes){
+
+    struct w3150_cmdq q;
+    int rmsr = mem_size_bits(rx_sizes);
+    int tmsr = mem_size_bits(tx_sizes);
+
+    if (rmsr < 0 || tmsr < 0)
+        return 0;
+
+    if (rmsr == dev->shadow.rmsr && tmsr == dev->shadow.tmsr){
+        dev->mem_set = 1;
+        return 1;
+    }
+
+    // socket 0 kept by a warm start would find its buffer moved
+    dev->s0_kept = 0;
+
+    cmdq_init(dev, &q, W3150_OP_SETUP);
+    w3150_cmdq_write(&q, RMSR, rmsr);
+    w3150_cmdq_write(&q, TMSR, tmsr);
+    w3150_cmdq_flush(&q);
+
+    dev->shadow.rmsr = rmsr;
+    dev->shadow.tmsr = tmsr;
+    dev->mem_set = 1;
+    mem_layout(dev);
 
     return 1;
 }
 
+/* Initialize macraw mode on socket 0
+ * Only socket 0 can do macraw.  Unless the memory
+ * was split with w3150_set_memory() all of it is
+ * assigned to socket 0.
+ *
+ * Return 1 if successful */
+uint8_t w3150_dev_init_macraw(struct w3150_dev *dev) {
+
+    struct w3150_shadow *shadow = &dev->shadow;
+    struct w3150_cmdq q;
+    const char *env = getenv(W3150_RX_INTERLEAVE_ENV);
+    uint8_t status = 0;
+
+    cmdq_init(dev, &q, W3150_OP_SETUP);
+
+    if (env != NULL && atoi(env) != 0)
+        dev->rx_interleave = 1;
+    rxq_reset(dev);
+
+    // still open from before a warm start, with its frames
+    if (dev->s0_kept){
+        dev->s0_kept = 0;
+        w3150_cmdq_write(&q, IMR, IMR_S0_INT);
+        w3150_cmdq_flush(&q);
+        tx_reset(dev);
+        return 1;
+    }
+
+    if (!dev->mem_set){
+        // Set RX Memory Size Register
+        // Assigning 8KB to Socket 0
+        w3150_cmdq_write(&q, RMSR, 0xFF);
+
+        // Set the TX Memory Size Register
+        // Assigning 8KB to Socket 0
+        w3150_cmdq_write(&q, TMSR, 0xFF);
+
+        shadow->rmsr = 0xFF;
+        shadow->tmsr = 0xFF;
+        mem_layout(dev);
+    }
+
+    // Set mode to macraw and open socket
+    // Only Socket 0 supports macraw
+    w3150_cmdq_write(&q, S0_MR, MACRAW);
+    w3150_cmdq_write(&q, S0_CR, SOCK_OPEN);
+
+    // Socket 0 events drive the INT pin
+    w3150_cmdq_write(&q, IMR, IMR_S0_INT);
+    w3150_cmdq_flush(&q);
+
+    shadow->s0_mr = MACRAW;
+
+    // check if it actually went to macraw mode and pick up
+    // the pointers the socket opened with
+    w3150_cmdq_read(&q, S0_SR, &status);
+    w3150_cmdq_read16(&q, S0_TX_WR0, &shadow->tx_wr);
+    w3150_cmdq_read16(&q, S0_RX_RD0, &shadow->rx_rd);
+    w3150_cmdq_write(&q, S0_IR, 0xFF);
+    w3150_cmdq_flush(&q);
+
+    tx_reset(dev);
+
+    if (status != STATUS_MACRAW){
+        macraw_close_socket(dev);
+        return 0;
+    }
+    else
+        return 1;
+}
+
+void w3150_dev_macraw_set_recv(struct w3150_dev *dev){
+    // Set RECV command
+    w3150_write_register(dev, S0_CR, SOCK_RECV, W3150_OP_RX_COMMIT);
+}
+
+/* Check for data in the receive buffer
+ * return 1 if there is data */
+uint8_t w3150_dev_macraw_check_recv(struct w3150_dev *dev){
+
+    #ifdef DEBUG_RECV_CHECK
+    printf("Received Size: %X\n", w3150_read_register16(dev, S0_RX_RSR0, W3150_OP_RX_SIZE));
+    #endif
+    if (dev->rxq.next != dev->rxq.count)
+        return 1;
+
+    if (w3150_read_register16(dev, S0_RX_RSR0, W3150_OP_RX_SIZE) != 0x0000){
+        return 1;
+    }
+
+    else {
+        return 0;
+    }
+}
+
+/* Install a receive filter, NULL takes every frame again.  The filter
+ * has to be compiled and stay around while it is installed. */
+void w3150_dev_macraw_set_filter(struct w3150_dev *dev, struct w3150_filter *filter){
+    dev->rx_filter = filter;
+}
+
+// MACRAW header plus the part of the frame the filter looks at
+#define RX_HEAD_SIZE (MACRAW_INFO_SIZE + W3150_FILTER_PEEK)
+
+/* Run a frame (len bytes, of which the head has been read) through the
+ * filter and count the outcome */
+static int rx_filter_accept(struct w3150_filter *rx_filter, const uint8_t *frame, uint16_t len){
+
+    if (w3150_filter_match(rx_filter, frame, len)){
+        rx_filter->accepted++;
+        return 1;
+    }
+
+    rx_filter->rejected++;
+    if (len > W3150_FILTER_PEEK)
+        rx_filter->skipped_bytes += len - W3150_FILTER_PEEK;
+
+    return 0;
+}
+
+/* Start of a look at the chip, 0 when this one is not timed */
+static uint64_t rx_start(struct w3150_dev *dev){
+    dev->rx_failures = atomic_load_explicit(&dev->spi_failures, memory_order_relaxed);
+    return w3150_stat_sampled(dev->stats->rx.reads) ? w3150_now_ns() : 0;
+}
+
+/* Count the look at the chip begun at start_ns, which found size bytes
+ * waiting and came back with frames */
+static void rx_account(struct w3150_dev *dev, uint64_t start_ns, uint16_t size, int frames){
+
+    struct w3150_rx_stats *st = &dev->stats->rx;
+
+    w3150_stat_add(&st->reads, 1);
+
+    if (size < MACRAW_INFO_SIZE){
+        w3150_stat_add(&st->empty, 1);
+        return;
+    }
+
+    w3150_hist_add(&st->fill, size);
+    if (frames > 0 && start_ns != 0)
+        w3150_hist_add(&st->read_ns, w3150_now_ns() - start_ns);
+}
+
+/* Read one frame from the RX buffer, stepping over frames the filter
+ * drops
+ * returns the length of the frame, 0 if there was none left */
+uint16_t w3150_dev_macraw_read(struct w3150_dev *dev, uint8_t *recv_buf) {
+
+    struct w3150_sock_mem *mem = &dev->mem[0];
+    struct w3150_cmdq q;
+    struct w3150_filter *rx_filter = dev->rx_filter;
+    uint16_t size = 0;
+    uint16_t read_pointer = dev->shadow.rx_rd;
+    uint16_t new_read_pointer;
+
+    // calculate offset address
+    uint16_t offset = read_pointer & mem->rx_mask;
+
+    // length of the recieved packet + 2 byte header
+    uint16_t macraw_header;
+    uint8_t head[RX_HEAD_SIZE];
+    uint16_t head_len = (rx_filter != NULL) ? RX_HEAD_SIZE : MACRAW_INFO_SIZE;
+    uint16_t copy;
+    uint16_t skipped = 0;   // rejected by the filter
+    struct w3150_frame *queued;
+    uint64_t start;
+    int i;
+
+    if (dev->rxq.next != dev->rxq.count){
+        queued = &dev->rxq.frames[dev->rxq.next++];
+        memcpy(recv_buf, queued->data, queued->len);
+        return queued->len;
+    }
+
+    start = rx_start(dev);
+
+    // the read pointer is ours, so the receive size and the 2 byte
+    // header (which may wrap) come back in one transfer, with the start
+    // of the frame when there is a filter to run
+    cmdq_init(dev, &q, W3150_OP_RX_SIZE);
+    w3150_cmdq_read16(&q, S0_RX_RSR0, &size);
+    for (i = 0; i < head_len; i++)
+        w3150_cmdq_read(&q, mem->rx_base + ((offset + i) & mem->rx_mask), &head[i]);
+    w3150_cmdq_flush(&q);
+
+    #ifdef DEBUG_RECV
+    printf("received size register: %X\n", size);
+    printf("read pointer: %X\n", read_pointer);
+    printf("offset: %X\n", offset);
+    printf("start addr (header): %X\n", mem->rx_base + offset);
+    if ((offset + 2) > (mem->rx_mask + 1))
+        printf("RX MEMORY OVERFLOW: Header\n");
+    #endif
+
+    if (size < MACRAW_INFO_SIZE){
+        rx_account(dev, start, size, 0);
+        return 0;
+    }
+
+    // rejected frames are stepped over in the same call, so a caller
+    // that backs off on 0 only does so once the buffer is empty
+    for (;;){
+        macraw_header = (head[0] << 8) | head[1];
+
+        #ifdef DEBUG_RECV
+        printf("macraw_header: %X\n", macraw_header);
+        if (((offset + 2) & mem->rx_mask) + macraw_header - 2 > mem->rx_mask + 1)
+            printf("RX MEMORY OVERFLOW: Data\n");
+        #endif
+
+        if (macraw_header <= MACRAW_INFO_SIZE || macraw_header > size - skipped ||
+            macraw_header > MACRAW_INFO_SIZE + MACRAW_MAX_FRAME){
+            // lost track of the frame boundaries, drop everything received
+            #ifdef DEBUG_RECV
+            printf("bad macraw header, dropping %X bytes\n", size);
+            #endif
+            macraw_header = size - skipped;
+            recv_buf = NULL;
+            break;
+        }
+
+        if (rx_filter == NULL || rx_filter_accept(rx_filter, head + MACRAW_INFO_SIZE, macraw_header - MACRAW_INFO_SIZE))
+            break;
+
+        skipped += macraw_header;
+        offset = (read_pointer + skipped) & mem->rx_mask;
+        if (size - skipped < MACRAW_INFO_SIZE || w3150_read_ring(dev, mem->rx_base, mem->rx_mask, offset, head,
+                                                                 head_len, W3150_OP_RX_HEADER) != 0){
+            macraw_header = 0;
+            recv_buf = NULL;
+            break;
+        }
+    }
+
+    if (recv_buf != NULL){
+        // whatever came with the header, then the rest in one burst
+        // that wraps at the end of the RX memory by itself
+        copy = (macraw_header < head_len) ? macraw_header : head_len;
+        memcpy(recv_buf, head + MACRAW_INFO_SIZE, copy - MACRAW_INFO_SIZE);
+
+        if (macraw_header > copy)
+            w3150_read_ring(dev, mem->rx_base, mem->rx_mask, offset + copy,
+                            recv_buf + copy - MACRAW_INFO_SIZE, macraw_header - copy, W3150_OP_RX_PAYLOAD);
+    }
+
+    // turns out this is really important.  If this is not done correctly
+    // all sorts of bad things happen.  The read pointer value is used with
+    // some internal calculations.
+    new_read_pointer = read_pointer + skipped + macraw_header;
+
+    #ifdef DEBUG_RECV
+    printf("new read pointer: %X\n", new_read_pointer);
+    printf("new write pointer: %X\n", w3150_read_register16(dev, S0_RX_WR0, W3150_OP_USER));
+    #endif
+
+    // a failed transfer leaves the frame on the chip for the next call
+    if (rx_failed(dev)){
+        rx_account(dev, start, size, 0);
+        return 0;
+    }
+
+    // Increase S0_RX_RD by size of packet, don't mess this up.
+    // Then set RECV command, both in one transfer.
+    dev->rxq.chip_size = 0;
+    q.op = W3150_OP_RX_COMMIT;
+    w3150_cmdq_write16(&q, S0_RX_RD0, new_read_pointer);
+    w3150_cmdq_write(&q, S0_CR, SOCK_RECV);
+    if (w3150_cmdq_flush(&q) != 0){
+        rx_account(dev, start, size, 0);
+        return 0;
+    }
+    dev->shadow.rx_rd = new_read_pointer;
+
+    rx_account(dev, start, size, recv_buf != NULL);
+
+    if (recv_buf == NULL)
+        return 0;
+
+    w3150_stat_add(&dev->stats->rx.frames, 1);
+    w3150_stat_add(&dev->stats->rx.bytes, macraw_header - MACRAW_INFO_SIZE);
+
+    return macraw_header - MACRAW_INFO_SIZE;
+}
+
+/* Filtered form of the batch read
+ * Frames are walked on the chip instead of pulled over in one burst: the
+ * head of a frame is read, a rejected frame is stepped over and only
+ * the head of the one after it is fetched, an accepted frame has its
+ * remaining bytes read in the same burst as the head of the next one.
+ *
+ * returns the number of bytes of RX buffer consumed */
+static uint16_t read_batch_filtered(struct w3150_dev *dev, uint8_t *buf, uint16_t buf_len,
+                                    struct w3150_frame *frames, int max_frames, uint16_t size, int *count){
+
+    struct w3150_sock_mem *mem = &dev->mem[0];
+    uint16_t rx_rd = dev->shadow.rx_rd;
+    uint16_t pos = 0;       // from S0_RX_RD
+    uint16_t out = 0;       // into buf, buf[out] holds the head at pos
+    uint16_t macraw_header;
+    uint16_t end;
+    int more;
+    int n = 0;
+
+    *count = 0;
+
+    if (buf_len < RX_HEAD_SIZE)
+        return 0;
+
+    w3150_read_ring(dev, mem->rx_base, mem->rx_mask, rx_rd, buf, RX_HEAD_SIZE, W3150_OP_RX_HEADER);
+
+    while (n < max_frames && pos + MACRAW_INFO_SIZE <= size){
+
+        macraw_header = (buf[out] << 8) | buf[out + 1];
+
+        if (macraw_header <= MACRAW_INFO_SIZE || pos + macraw_header > size ||
+            macraw_header > MACRAW_INFO_SIZE + MACRAW_MAX_FRAME){
+            #ifdef DEBUG_RECV
+            printf("bad macraw header at %X, dropping %X bytes\n", pos, size - pos);
+            #endif
+            pos = size;
+            break;
+        }
+
+        more = (pos + macraw_header + MACRAW_INFO_SIZE <= size);
+
+        if (!rx_filter_accept(dev->rx_filter, buf + out + MACRAW_INFO_SIZE, macraw_header - MACRAW_INFO_SIZE)){
+            pos += macraw_header;
+            if (!more)
+                break;
+            w3150_read_ring(dev, mem->rx_base, mem->rx_mask, rx_rd + pos, buf + out, RX_HEAD_SIZE, W3150_OP_RX_HEADER);
+            continue;
+        }
+
+        // does not fit, leave it for the next call
+        if (out + macraw_header > buf_len)
+            break;
+
+        // the rest of this frame, and the head of the next one if it
+        // will be looked at
+        end = macraw_header;
+        more = more && (n + 1 < max_frames) && (out + macraw_header + RX_HEAD_SIZE <= buf_len);
+        if (more)
+            end += RX_HEAD_SIZE;
+
+        if (end > RX_HEAD_SIZE)
+            w3150_read_ring(dev, mem->rx_base, mem->rx_mask, rx_rd + pos + RX_HEAD_SIZE,
+                            buf + out + RX_HEAD_SIZE, end - RX_HEAD_SIZE, W3150_OP_RX_PAYLOAD);
+
+        frames[n].data = buf + out + MACRAW_INFO_SIZE;
+        frames[n].len = macraw_header - MACRAW_INFO_SIZE;
+        n++;
+
+        pos += macraw_header;
+        out += macraw_header;
+
+        if (!more)
+            break;
+    }
+
+    *count = n;
+    return pos;
+}
+
+/* Unfiltered form of the batch read: the received range (up to buf_len
+ * bytes) comes over in a single burst and the headers are walked on the
+ * host.
+ *
+ * returns the number of bytes of RX buffer consumed */
+static uint16_t read_batch_burst(struct w3150_dev *dev, uint8_t *buf, uint16_t buf_len,
+                                 struct w3150_frame *frames, int max_frames, uint16_t size, int *count){
+
+    struct w3150_sock_mem *mem = &dev->mem[0];
+    uint16_t avail;
+    uint16_t pos = 0;
+    uint16_t macraw_header;
+    int n = 0;
+
+    avail = (size > buf_len) ? buf_len : size;
+
+    w3150_read_ring(dev, mem->rx_base, mem->rx_mask, dev->shadow.rx_rd & mem->rx_mask, buf, avail, W3150_OP_RX_PAYLOAD);
+
+    while (n < max_frames && pos + MACRAW_INFO_SIZE <= avail){
+
+        macraw_header = (buf[pos] << 8) | buf[pos + 1];
+
+        if (macraw_header <= MACRAW_INFO_SIZE || pos + macraw_header > size ||
+            macraw_header > MACRAW_INFO_SIZE + MACRAW_MAX_FRAME){
+            // lost track of the frame boundaries, drop the rest
+            #ifdef DEBUG_RECV
+            printf("bad macraw header at %X, dropping %X bytes\n", pos, size - pos);
+            #endif
+            pos = size;
+            break;
+        }
+
+        // partially in the buffer, leave it for the next call
+        if (pos + macraw_header > avail)
+            break;
+
+        frames[n].data = buf + pos + MACRAW_INFO_SIZE;
+        frames[n].len = macraw_header - MACRAW_INFO_SIZE;
+        n++;
+
+        pos += macraw_header;
+    }
+
+    *count = n;
+    return pos;
+}
+
+/* Bytes waiting in the RX buffer, from S0_RX_RSR */
+static uint16_t rx_size(struct w3150_dev *dev){
+
+    struct w3150_cmdq q;
+    uint16_t size = 0;
+
+    cmdq_init(dev, &q, W3150_OP_RX_SIZE);
+    w3150_cmdq_read16(&q, S0_RX_RSR0, &size);
+    w3150_cmdq_flush(&q);
+
+    return size;
+}
+
+/* Advance S0_RX_RD past pos bytes and RECV, in one transfer.  Not if
+ * a transfer failed since rx_start(): what was read cannot be trusted,
+ * the frames stay on the chip for the next read, as they do when this
+ * transfer fails.
+ * return 0, -1 if the frames read are to be dropped */
+static int rx_consume(struct w3150_dev *dev, uint16_t pos){
+
+    struct w3150_cmdq q;
+
+    if (rx_failed(dev))
+        return -1;
+
+    if (pos == 0)
+        return 0;
+
+    dev->rxq.chip_size = 0;
+
+    cmdq_init(dev, &q, W3150_OP_RX_COMMIT);
+    w3150_cmdq_write16(&q, S0_RX_RD0, dev->shadow.rx_rd + pos);
+    w3150_cmdq_write(&q, S0_CR, SOCK_RECV);
+    if (w3150_cmdq_flush(&q) != 0)
+        return -1;
+
+    dev->shadow.rx_rd += pos;
+
+    return 0;
+}
+
+/* Read the complete frames among the size bytes waiting in the RX
+ * buffer, see w3150_dev_macraw_read_batch() */
+static int read_batch_chip(struct w3150_dev *dev, uint16_t size, uint8_t *buf, uint16_t buf_len,
+                           struct w3150_frame *frames, int max_frames){
+
+    uint64_t bytes;
+    uint16_t pos;
+    int n;
+    int i;
+
+    if (size < MACRAW_INFO_SIZE || max_frames <= 0)
+        return 0;
+
+    if (dev->rx_filter != NULL)
+        pos = read_batch_filtered(dev, buf, buf_len, frames, max_frames, size, &n);
+    else
+        pos = read_batch_burst(dev, buf, buf_len, frames, max_frames, size, &n);
+
+    #ifdef DEBUG_RECV
+    printf("batch: size %X, %d frames, %X bytes\n", size, n, pos);
+    #endif
+
+    if (rx_consume(dev, pos) != 0)
+        n = 0;
+
+    for (i = 0, bytes = 0; i < n; i++)
+        bytes += frames[i].len;
+    w3150_stat_add(&dev->stats->rx.frames, n);
+    w3150_stat_add(&dev->stats->rx.bytes, bytes);
+
+    return n;
+}
+
+/* Copy frames from the RX queue into buf as far as they fit
+ * returns the number of frames stored in frames[] */
+static int rxq_read_batch(struct w3150_rxq *rxq, uint8_t *buf, uint16_t buf_len,
+                          struct w3150_frame *frames, int max_frames){
+
+    struct w3150_frame *queued;
+    uint16_t out = 0;
+    int n = 0;
+
+    while (n < max_frames && rxq->next != rxq->count){
+        queued = &rxq->frames[rxq->next];
+        if (out + queued->len > buf_len)
+            break;
+
+        memcpy(buf + out, queued->data, queued->len);
+        frames[n].data = buf + out;
+        frames[n].len = queued->len;
+        out += queued->len;
+        n++;
+        rxq->next++;
+    }
 
+    return n;
+}
 
+/* Read every complete frame waiting in the RX buffer
+ * RSR is read once and the read pointer is then advanced past the frames
+ * returned (and any the filter dropped) with a single RECV.  buf_len
+ * should hold at least one full frame plus its header.  Frames read
+ * during TX waits are returned first, on their own.
+ *
+ * returns the number of frames stored in frames[] */
+int w3150_dev_macraw_read_batch(struct w3150_dev *dev, uint8_t *buf, uint16_t buf_len,
+                                struct w3150_frame *frames, int max_frames) {
 
+    uint64_t start;
+    uint16_t size;
+    int n;
 
+    if (dev->rxq.next != dev->rxq.count)
+        return rxq_read_batch(&dev->rxq, buf, buf_len, frames, max_frames);
+
+    start = rx_start(dev);
+    size = rx_size(dev);
+    n = read_batch_chip(dev, size, buf, buf_len, frames, max_frames);
+    rx_account(dev, start, size, n);
+
+    return n;
+}
+
+/* Snapshot read
+ * Only the first snaplen bytes of each frame cross the bus.  The frames
+ * are walked on the chip: one read brings a frame's header and its
+ * captured bytes, and whatever it took in past a short frame is the
+ * start of the next one, so only the rest of that is read.  Frames read
+ * during TX waits are returned first, cut the same way.
+ *
+ * returns the number of frames stored in frames[] */
+int w3150_dev_macraw_read_snap(struct w3150_dev *dev, uint8_t *buf, uint16_t buf_len,
+                               struct w3150_frame *frames, uint16_t *wire_len, int max_frames,
+                               uint16_t snaplen){
+
+    struct w3150_sock_mem *mem = &dev->mem[0];
+    struct w3150_rxq *rxq = &dev->rxq;
+    struct w3150_frame *queued;
+    uint8_t win[MACRAW_INFO_SIZE + MACRAW_MAX_FRAME];
+    uint16_t win_pos = 0;   // win holds the chip bytes [win_pos, win_pos + win_len)
+    uint16_t win_len = 0;
+    uint16_t pos = 0;       // from S0_RX_RD
+    uint16_t out = 0;
+    uint16_t macraw_header;
+    uint16_t caplen;
+    uint16_t want;
+    uint16_t keep;
+    uint64_t start;
+    uint64_t bytes = 0;
+    uint16_t size;
+    int n = 0;
+
+    if (snaplen > MACRAW_MAX_FRAME)
+        snaplen = MACRAW_MAX_FRAME;
+
+    if (rxq->next != rxq->count){
+        while (n < max_frames && rxq->next != rxq->count){
+            queued = &rxq->frames[rxq->next];
+            caplen = (queued->len > snaplen) ? snaplen : queued->len;
+            if (out + caplen > buf_len)
+                break;
+
+            memcpy(buf + out, queued->data, caplen);
+            frames[n].data = buf + out;
+            frames[n].len = caplen;
+            wire_len[n] = queued->len;
+            out += caplen;
+            n++;
+            rxq->next++;
+        }
+        return n;
+    }
+
+    start = rx_start(dev);
+    size = rx_size(dev);
+
+    while (n < max_frames && pos + MACRAW_INFO_SIZE <= size){
+
+        want = size - pos;
+        if (want > MACRAW_INFO_SIZE + snaplen)
+            want = MACRAW_INFO_SIZE + snaplen;
+
+        // what the last read took in past the frame before
+        keep = (win_pos + win_len > pos) ? win_pos + win_len - pos : 0;
+        if (keep > 0)
+            memmove(win, win + (pos - win_pos), keep);
+        if (keep < want)
+            w3150_read_ring(dev, mem->rx_base, mem->rx_mask, (dev->shadow.rx_rd + pos + keep) & mem->rx_mask,
+                            win + keep, want - keep, W3150_OP_RX_PAYLOAD);
+        win_pos = pos;
+        win_len = (keep > want) ? keep : want;
+
+        macraw_header = (win[0] << 8) | win[1];
+
+        if (macraw_header <= MACRAW_INFO_SIZE || pos + macraw_header > size ||
+            macraw_header > MACRAW_INFO_SIZE + MACRAW_MAX_FRAME){
+            // lost track of the frame boundaries, drop the rest
+            #ifdef DEBUG_RECV
+            printf("bad macraw header at %X, dropping %X bytes\n", pos, size - pos);
+            #endif
+            pos = size;
+            break;
+        }
+
+        caplen = macraw_header - MACRAW_INFO_SIZE;
+        if (caplen > snaplen)
+            caplen = snaplen;
+
+        // does not fit, leave it for the next call
+        if (out + caplen > buf_len)
+            break;
+
+        memcpy(buf + out, win + MACRAW_INFO_SIZE, caplen);
+        frames[n].data = buf + out;
+        frames[n].len = caplen;
+        wire_len[n] = macraw_header - MACRAW_INFO_SIZE;
+        bytes += wire_len[n];
+        out += caplen;
+        n++;
+
+        pos += macraw_header;
+    }
+
+    if (rx_consume(dev, pos) != 0)
+        n = bytes = 0;
+
+    w3150_stat_add(&dev->stats->rx.frames, n);
+    w3150_stat_add(&dev->stats->rx.bytes, bytes);
+    rx_account(dev, start, size, n);
+
+    return n;
+}
+
+/* Use a TX wait to read received frames into the RX queue, when the
+ * last TX status read found some and the queue has room for a full
+ * size frame
+ * returns the number of frames read */
+static int rx_interleave(struct w3150_dev *dev){
+
+    struct w3150_rxq *rxq = &dev->rxq;
+    struct w3150_frame *last;
+    uint16_t size = rxq->chip_size;
+    uint64_t start;
+    int n;
+
+    if (!dev->rx_interleave || size < MACRAW_INFO_SIZE)
+        return 0;
+
+    rxq->chip_size = 0;
+
+    if (rxq->next == rxq->count){
+        rxq->used = 0;
+        rxq->count = 0;
+        rxq->next = 0;
+    }
+
+    if (rxq->count == W3150_RXQ_FRAMES || rxq->used + RX_HEAD_SIZE + MACRAW_MAX_FRAME > W3150_RXQ_BYTES)
+        return 0;
+
+    start = rx_start(dev);
+    n = read_batch_chip(dev, size, rxq->buf + rxq->used, W3150_RXQ_BYTES - rxq->used,
+                        rxq->frames + rxq->count, W3150_RXQ_FRAMES - rxq->count);
+    rx_account(dev, start, size, n);
+    if (n == 0)
+        return 0;
+
+    last = &rxq->frames[rxq->count + n - 1];
+    rxq->used = last->data + last->len - rxq->buf;
+    rxq->count += n;
+    w3150_stat_add(&dev->stats->rx.interleaved, n);
+
+    return n;
+}
+
+void w3150_dev_set_rx_interleave(struct w3150_dev *dev, uint8_t on){
+    dev->rx_interleave = on;
+    if (!on)
+        dev->rxq.chip_size = 0;
+}
+
+_Static_assert(W3150_BUF_SIZE >= MACRAW_INFO_SIZE + MACRAW_MAX_FRAME + RX_HEAD_SIZE,
+               "a pool buffer holds a frame and the head of the next");
+
+/* Filtered form of the buffer read, read_batch_filtered() with every
+ * accepted frame in a buffer of its own.  The head of the next frame is
+ * read onto the end of the current buffer and moved to the next one,
+ * a rejected frame's buffer takes the head after it.
+ *
+ * returns the number of bytes of RX buffer consumed */
+static uint16_t read_bufs_filtered(struct w3150_dev *dev, struct w3150_buf **bufs, int max_bufs,
+                                   uint16_t size, int *count){
+
+    struct w3150_sock_mem *mem = &dev->mem[0];
+    uint16_t rx_rd = dev->shadow.rx_rd;
+    uint16_t pos = 0;
+    uint16_t macraw_header;
+    uint16_t end;
+    uint8_t *head = bufs[0]->data;
+    int more;
+    int n = 0;
+
+    w3150_read_ring(dev, mem->rx_base, mem->rx_mask, rx_rd, head, RX_HEAD_SIZE, W3150_OP_RX_HEADER);
+
+    while (pos + MACRAW_INFO_SIZE <= size){
+
+        macraw_header = (head[0] << 8) | head[1];
+
+        if (macraw_header <= MACRAW_INFO_SIZE || pos + macraw_header > size ||
+            macraw_header > MACRAW_INFO_SIZE + MACRAW_MAX_FRAME){
+            #ifdef DEBUG_RECV
+            printf("bad macraw header at %X, dropping %X bytes\n", pos, size - pos);
+            #endif
+            pos = size;
+            break;
+        }
+
+        more = (pos + macraw_header + MACRAW_INFO_SIZE <= size);
+
+        if (!rx_filter_accept(dev->rx_filter, head + MACRAW_INFO_SIZE, macraw_header - MACRAW_INFO_SIZE)){
+            pos += macraw_header;
+            if (!more)
+                break;
+            w3150_read_ring(dev, mem->rx_base, mem->rx_mask, rx_rd + pos, head, RX_HEAD_SIZE, W3150_OP_RX_HEADER);
+            continue;
+        }
+
+        end = macraw_header;
+        more = more && (n + 1 < max_bufs);
+        if (more)
+            end += RX_HEAD_SIZE;
+
+        if (end > RX_HEAD_SIZE)
+            w3150_read_ring(dev, mem->rx_base, mem->rx_mask, rx_rd + pos + RX_HEAD_SIZE,
+                            head + RX_HEAD_SIZE, end - RX_HEAD_SIZE, W3150_OP_RX_PAYLOAD);
+
+        bufs[n]->off = MACRAW_INFO_SIZE;
+        bufs[n]->len = macraw_header - MACRAW_INFO_SIZE;
+        n++;
+
+        pos += macraw_header;
+
+        if (!more)
+            break;
+
+        memcpy(bufs[n]->data, head + macraw_header, RX_HEAD_SIZE);
+        head = bufs[n]->data;
+    }
+
+    *count = n;
+    return pos;
+}
+
+/* Unfiltered form of the buffer read: the received range comes over in
+ * a single burst as with read_batch_burst(), then each frame is unpacked
+ * from the burst straight into its buffer.
+ *
+ * returns the number of bytes of RX buffer consumed */
+static uint16_t read_bufs_burst(struct w3150_dev *dev, struct w3150_buf **bufs, int max_bufs,
+                                uint16_t size, int *count){
+
+    struct w3150_sock_mem *mem = &dev->mem[0];
+    uint8_t *f = dev->rx_burst;
+    uint16_t avail;
+    uint16_t pos = 0;
+    uint16_t macraw_header;
+    int n = 0;
+
+    avail = (size > BURST_MAX_BYTES) ? BURST_MAX_BYTES : size;
+
+    if ((dev->shadow.rx_rd & mem->rx_mask) + avail > mem->rx_mask + 1)
+        w3150_stat_add(&dev->stats->rx.wraps, 1);
+
+    w3150_pack(f, W3150_READ, mem->rx_base, mem->rx_mask, dev->shadow.rx_rd & mem->rx_mask, NULL, avail);
+    spi_transfer(dev, f, avail * W3150_FRAME_SIZE, W3150_OP_RX_PAYLOAD);
+
+    while (n < max_bufs && pos + MACRAW_INFO_SIZE <= avail){
+
+        w3150_unpack(f + pos * W3150_FRAME_SIZE, bufs[n]->data, MACRAW_INFO_SIZE);
+        macraw_header = (bufs[n]->data[0] << 8) | bufs[n]->data[1];
+
+        if (macraw_header <= MACRAW_INFO_SIZE || pos + macraw_header > size ||
+            macraw_header > MACRAW_INFO_SIZE + MACRAW_MAX_FRAME){
+            // lost track of the frame boundaries, drop the rest
+            #ifdef DEBUG_RECV
+            printf("bad macraw header at %X, dropping %X bytes\n", pos, size - pos);
+            #endif
+            pos = size;
+            break;
+        }
+
+        if (pos + macraw_header > avail)
+            break;
+
+        w3150_unpack(f + (pos + MACRAW_INFO_SIZE) * W3150_FRAME_SIZE, bufs[n]->data + MACRAW_INFO_SIZE,
+                     macraw_header - MACRAW_INFO_SIZE);
+        bufs[n]->off = MACRAW_INFO_SIZE;
+        bufs[n]->len = macraw_header - MACRAW_INFO_SIZE;
+        n++;
+
+        pos += macraw_header;
+    }
+
+    *count = n;
+    return pos;
+}
+
+/* Read the frames waiting in the RX buffer into pool buffers, one
+ * frame each, with a single RSR read and a single RECV like
+ * read_batch.  Frames that do not get a buffer stay on the chip.
+ *
+ * returns the number of buffers filled, bufs[0] to bufs[n - 1] */
+int w3150_dev_macraw_read_bufs(struct w3150_dev *dev, struct w3150_buf **bufs, int max_bufs){
+
+    struct w3150_frame *queued;
+    uint64_t start;
+    uint64_t bytes;
+    uint16_t size;
+    uint16_t pos;
+    int n;
+    int i;
+
+    if (max_bufs <= 0)
+        return 0;
+
+    if (dev->rxq.next != dev->rxq.count){
+        for (n = 0; n < max_bufs && dev->rxq.next != dev->rxq.count; n++){
+            queued = &dev->rxq.frames[dev->rxq.next++];
+            memcpy(bufs[n]->data + MACRAW_INFO_SIZE, queued->data, queued->len);
+            bufs[n]->off = MACRAW_INFO_SIZE;
+            bufs[n]->len = queued->len;
+        }
+        return n;
+    }
+
+    start = rx_start(dev);
+    size = rx_size(dev);
+
+    if (size < MACRAW_INFO_SIZE){
+        rx_account(dev, start, size, 0);
+        return 0;
+    }
+
+    if (dev->rx_filter != NULL)
+        pos = read_bufs_filtered(dev, bufs, max_bufs, size, &n);
+    else
+        pos = read_bufs_burst(dev, bufs, max_bufs, size, &n);
+
+    #ifdef DEBUG_RECV
+    printf("bufs: size %X, %d frames, %X bytes\n", size, n, pos);
+    #endif
+
+    if (rx_consume(dev, pos) != 0)
+        n = 0;
+
+    for (i = 0, bytes = 0; i < n; i++)
+        bytes += bufs[i]->len;
+    w3150_stat_add(&dev->stats->rx.frames, n);
+    w3150_stat_add(&dev->stats->rx.bytes, bytes);
+    rx_account(dev, start, size, n);
+
+    return n;
+}
+
+/* Commit queued frames while the chip is idle, each SEND goes out with
+ * the S0_CR read that tells whether it already finished */
+static void tx_commit(struct w3150_dev *dev){
+
+    struct w3150_txq *txq = &dev->txq;
+    struct w3150_cmdq q;
+    uint8_t command = 0;
+
+    cmdq_init(dev, &q, W3150_OP_TX_COMMIT);
+
+    while (!txq->in_flight && txq->tail != txq->head){
+
+        dev->shadow.tx_wr += txq->len[txq->tail % TX_QUEUE_MAX];
+        txq->tail++;
+
+        w3150_cmdq_write16(&q, S0_TX_WR0, dev->shadow.tx_wr);
+        w3150_cmdq_write(&q, S0_CR, SOCK_SEND);
+        w3150_cmdq_read(&q, S0_CR, &command);
+        w3150_cmdq_flush(&q);
+
+        txq->in_flight = (command != 0x00);
+    }
+}
+
+/* Check on the SEND in flight and, if asked, refresh the free space
+ * estimate, in one transfer */
+static void tx_update(struct w3150_dev *dev, uint8_t read_free){
+
+    struct w3150_txq *txq = &dev->txq;
+    struct w3150_cmdq q;
+    uint8_t command = 0;
+    uint16_t free_size = 0;
+
+    if (!txq->in_flight && !read_free)
+        return;
+
+    cmdq_init(dev, &q, W3150_OP_TX_STATUS);
+    if (txq->in_flight)
+        w3150_cmdq_read(&q, S0_CR, &command);
+    if (read_free)
+        w3150_cmdq_read16(&q, S0_TX_FSR0, &free_size);
+    // what there is to read while waiting, see rx_interleave()
+    if (dev->rx_interleave)
+        w3150_cmdq_read16(&q, S0_RX_RSR0, &dev->rxq.chip_size);
+    w3150_cmdq_flush(&q);
+
+    if (txq->in_flight && command == 0x00)
+        txq->in_flight = 0;
+    else if (txq->in_flight)
+        w3150_stat_add(&dev->stats->tx.send_spins, 1);
+
+    // FSR does not count data staged past the committed write pointer
+    if (read_free)
+        txq->free = free_size - (uint16_t)(txq->staged_wr - dev->shadow.tx_wr);
+
+    tx_commit(dev);
+}
+
+/* Stage a frame for transmission without waiting
+ * return 1 if it was queued, 0 if there is no room right now.  A
+ * queued frame may still be waiting on the previous SEND,
+ * w3150_macraw_tx_poll() or w3150_macraw_tx_flush() moves it along. */
+uint8_t w3150_dev_macraw_tx_submit(struct w3150_dev *dev, const uint8_t *tx_buf, uint16_t len){
+
+    struct w3150_sock_mem *mem = &dev->mem[0];
+    struct w3150_txq *txq = &dev->txq;
+    struct w3150_tx_stats *st = &dev->stats->tx;
+    uint64_t start;
+
+    if (txq->head - txq->tail == TX_QUEUE_MAX)
+        tx_update(dev, 0);
+
+    if (txq->head - txq->tail == TX_QUEUE_MAX){
+        w3150_stat_add(&st->full, 1);
+        return 0;
+    }
+
+    if (txq->free < len)
+        tx_update(dev, 1);
+
+    if (txq->free < len){
+        w3150_stat_add(&st->full, 1);
+        return 0;
+    }
+
+    start = w3150_stat_sampled(st->frames) ? w3150_now_ns() : 0;
+
+    #ifdef DEBUG_TX
+    printf("staging %X bytes at %X\n", len, txq->staged_wr);
+    #endif
+
+    // the burst wraps at the end of the TX memory by itself
+    if (w3150_write_ring(dev, mem->tx_base, mem->tx_mask, txq->staged_wr & mem->tx_mask, tx_buf, len,
+                         W3150_OP_TX_PAYLOAD) != 0)
+        return 0;
+
+    txq->staged_wr += len;
+    txq->free -= len;
+    txq->len[txq->head % TX_QUEUE_MAX] = len;
+    txq->head++;
+
+    if (start != 0)
+        w3150_hist_add(&st->stage_ns, w3150_now_ns() - start);
+    w3150_stat_add(&st->frames, 1);
+    w3150_stat_add(&st->bytes, len);
+
+    tx_commit(dev);
+
+    return 1;
+}
+
+/* Move the transmit queue along
+ * return 1 once every submitted frame has been sent */
+uint8_t w3150_dev_macraw_tx_poll(struct w3150_dev *dev){
+
+    tx_update(dev, 0);
+
+    if (dev->txq.in_flight || dev->txq.tail != dev->txq.head)
+        return 0;
+    else
+        return 1;
+}
+
+/* Wait until every submitted frame has been sent */
+void w3150_dev_macraw_tx_flush(struct w3150_dev *dev){
+
+    struct w3150_tx_stats *st = &dev->stats->tx;
+    uint64_t ns;
+    int waited = 0;
+
+    w3150_wait_begin(&dev->tx_send_wait);
+    while (!w3150_dev_macraw_tx_poll(dev)){
+        waited = 1;
+        if (!rx_interleave(dev))
+            w3150_wait_step(&dev->tx_send_wait);
+    }
+    ns = w3150_wait_end(&dev->tx_send_wait);
+
+    if (waited){
+        w3150_stat_add(&st->send_waits, 1);
+        w3150_hist_add(&st->send_wait_ns, ns);
+    }
+}
+
+/* Interrupts
+ * w3150_init_macraw() routes socket 0 to the INT pin.  Sn_IR bits stay
+ * set until written back as 1, and RECV only fires for new data, so
+ * S0_IR has to be cleared before the RX buffer is drained or a frame
+ * arriving in between could be missed. */
+
+/* Attach the INT pin, call after w3150_init_networking()
+ * NULL uses $W3150_IRQ.  return 0 if a source was opened */
+int w3150_dev_irq_open(struct w3150_dev *dev, const char *name){
+
+    w3150_irq_source_close(&dev->irq);
+
+    if (w3150_irq_source_open(&dev->irq, name, dev->channel) != 0)
+        return -1;
+
+    printf("Interrupt source: %s\n", dev->irq.ops->name);
+    return 0;
+}
+
+/* File descriptor that becomes readable when INT asserts, -1 if
+ * there is no interrupt source */
+int w3150_dev_irq_fd(struct w3150_dev *dev){
+    return (dev->irq.ops != NULL) ? dev->irq.fd : -1;
+}
+
+/* Consume the notification and clear S0_IR
+ * returns the S0_IR bits that were set (IR_RECV, IR_SEND_OK, ...) */
+uint8_t w3150_dev_irq_ack(struct w3150_dev *dev){
+
+    struct w3150_cmdq q;
+    uint8_t status = 0;
+
+    if (dev->irq.ops != NULL)
+        dev->irq.ops->clear(&dev->irq);
+
+    cmdq_init(dev, &q, W3150_OP_IRQ);
+    w3150_cmdq_read(&q, S0_IR, &status);
+    w3150_cmdq_flush(&q);
+
+    // only the bits we saw, anything newer stays pending
+    if (status != 0){
+        w3150_cmdq_write(&q, S0_IR, status);
+        w3150_cmdq_flush(&q);
+    }
+
+    return status;
+}
+
+/* Block until socket 0 has an event or timeout_ms passes (-1 forever)
+ * returns the S0_IR bits, 0 on timeout.  Without an interrupt source
+ * S0_IR is polled instead. */
+uint8_t w3150_dev_irq_wait(struct w3150_dev *dev, int timeout_ms){
+
+    struct w3150_irq *irq = &dev->irq;
+    uint8_t status;
+    int level;
+
+    if (irq->ops == NULL){
+        w3150_wait_begin(&dev->irq_poll_wait);
+        while ((status = w3150_dev_irq_ack(dev)) == 0){
+            if (timeout_ms >= 0 && w3150_wait_elapsed_ns(&dev->irq_poll_wait) >= timeout_ms * 1000000ULL){
+                w3150_wait_end(&dev->irq_poll_wait);
+                return 0;
+            }
+            w3150_wait_step(&dev->irq_poll_wait);
+        }
+        w3150_wait_end(&dev->irq_poll_wait);
+        return status;
+    }
+
+    // INT may already be low, in which case no edge is coming
+    level = irq->ops->asserted(irq);
+
+    if (level < 0){
+        status = w3150_dev_irq_ack(dev);
+        if (status != 0)
+            return status;
+    }
+
+    if (level != 1 && irq->ops->wait(irq, timeout_ms) <= 0)
+        return 0;
+
+    return w3150_dev_irq_ack(dev);
+}
+
+/* Write raw data
+ * The frame is staged while any previous SEND completes and this only
+ * waits for that SEND, not for its own frame to leave.
+ * return 1 if successful */
+uint8_t w3150_dev_macraw_write(struct w3150_dev *dev, uint8_t *tx_buf, uint16_t len) {
+
+    struct w3150_sock_mem *mem = &dev->mem[0];
+    struct w3150_txq *txq = &dev->txq;
+    struct w3150_tx_stats *st = &dev->stats->tx;
+
+    #ifdef DEBUG_TX
+    printf("S0_SR: %X\n", w3150_read_register(dev, S0_SR, W3150_OP_USER));
+    printf("tx free size: %X\n" , w3150_read_register16(dev, S0_TX_FSR0, W3150_OP_USER));
+    printf("tx read pointer: %x\n", w3150_read_register16(dev, S0_TX_RD0, W3150_OP_USER));
+    printf("tx write pointer: %X\n", dev->shadow.tx_wr);
+    #endif
+
+    if (len > mem->tx_mask + 1)
+        return 0;
+
+    if (!w3150_dev_macraw_tx_submit(dev, tx_buf, len)){
+        w3150_wait_begin(&dev->tx_space_wait);
+        while (!w3150_dev_macraw_tx_submit(dev, tx_buf, len)){
+            if (!rx_interleave(dev))
+                w3150_wait_step(&dev->tx_space_wait);
+        }
+        w3150_stat_add(&st->space_waits, 1);
+        w3150_hist_add(&st->space_wait_ns, w3150_wait_end(&dev->tx_space_wait));
+    }
+
+    // hand our frame to the chip as soon as the one before it is out
+    if (txq->tail != txq->head){
+        w3150_wait_begin(&dev->tx_send_wait);
+        while (txq->tail != txq->head){
+            if (!rx_interleave(dev))
+                w3150_wait_step(&dev->tx_send_wait);
+            tx_update(dev, 0);
+        }
+        w3150_stat_add(&st->send_waits, 1);
+        w3150_hist_add(&st->send_wait_ns, w3150_wait_end(&dev->tx_send_wait));
+    }
+
+    #ifdef DEBUG_TX
+    printf("tx read pointer: %X\n", w3150_read_register16(dev, S0_TX_RD0, W3150_OP_USER));
+    printf("tx write pointer: %X\n", dev->shadow.tx_wr);
+    printf("S0_SR: %X\n", w3150_read_register(dev, S0_SR, W3150_OP_USER));
+    #endif
+
+    return 1;
+}
+
+/* UDP sockets
+ * The chip builds and strips the Ethernet, IP and UDP headers.  Each
+ * received datagram sits in the socket's RX buffer behind an 8 byte
+ * header: peer IP, peer port and payload length.  Sending is one
+ * datagram at a time: payload into TX memory, Sn_TX_WR moved over it
+ * and SEND, which ends in SEND_OK once the datagram is out or TIMEOUT
+ * when ARP got no answer. */
+
+#define UDP_SEND_DONE   (IR_SEND_OK | IR_TIMEOUT)
+// well past the chip's own ARP give up, 9 tries at the 200ms default RTR
+#define UDP_SEND_TIMEOUT_NS 4000000000ULL
+
+static int udp_socket_ok(uint8_t s){
+    return s >= 1 && s < W3150_SOCKETS;
+}
+
+/* Open socket s as UDP, bound to port
+ * return 1 if successful */
+uint8_t w3150_dev_udp_open(struct w3150_dev *dev, uint8_t s, uint16_t port){
+
+    struct w3150_sock *u;
+    struct w3150_cmdq q;
+    uint8_t status = 0;
+
+    if (!udp_socket_ok(s))
+        return 0;
+
+    u = &dev->sock[s];
+
+    // no memory left for this socket, see w3150_set_memory()
+    if (dev->mem[s].rx_base == 0 || dev->mem[s].tx_base == 0)
+        return 0;
+
+    memset(u, 0, sizeof(*u));
+
+    cmdq_init(dev, &q, W3150_OP_SETUP);
+    w3150_cmdq_write(&q, Sn(s, S0_CR), SOCK_CLOSE);
+    w3150_cmdq_write16(&q, Sn(s, S0_PORT0), port);
+    w3150_cmdq_write(&q, Sn(s, S0_MR), UDP);
+    w3150_cmdq_write(&q, Sn(s, S0_CR), SOCK_OPEN);
+    w3150_cmdq_flush(&q);
+
+    // check the mode and pick up the pointers the socket opened with
+    w3150_cmdq_read(&q, Sn(s, S0_SR), &status);
+    w3150_cmdq_read16(&q, Sn(s, S0_TX_WR0), &u->tx_wr);
+    w3150_cmdq_read16(&q, Sn(s, S0_RX_RD0), &u->rx_rd);
+    w3150_cmdq_write(&q, Sn(s, S0_IR), 0xFF);
+    w3150_cmdq_flush(&q);
+
+    if (status != STATUS_UDP){
+        w3150_dev_udp_close(dev, s);
+        return 0;
+    }
+
+    u->port = port;
+    u->mode = UDP;
+
+    return 1;
+}
+
+void w3150_dev_udp_close(struct w3150_dev *dev, uint8_t s){
+
+    if (!udp_socket_ok(s))
+        return;
+
+    w3150_write_register(dev, Sn(s, S0_CR), SOCK_CLOSE, W3150_OP_SETUP);
+    dev->sock[s].mode = CLOSE;
+}
+
+/* Send one datagram and wait until it is on the wire
+ * return 1 if it was sent, 0 if it does not fit or ARP timed out */
+uint8_t w3150_dev_udp_sendto(struct w3150_dev *dev, uint8_t s, const uint8_t *buf, uint16_t len,
+                             const uint8_t *ip, uint16_t port){
+
+    struct w3150_sock *u;
+    struct w3150_sock_mem *mem;
+    struct w3150_cmdq q;
+    uint16_t free_size = 0;
+    uint8_t status = 0;
+    int i;
+
+    if (!udp_socket_ok(s))
+        return 0;
+
+    u = &dev->sock[s];
+    mem = &dev->mem[s];
+
+    if (u->mode != UDP || len == 0)
+        return 0;
+
+    // the destination only goes to the chip when it changes,
+    // along with the free size check
+    cmdq_init(dev, &q, W3150_OP_SOCK_STATUS);
+    if (u->dst_port != port || memcmp(u->dst_ip, ip, 4) != 0){
+        for (i = 0; i < 4; i++)
+            w3150_cmdq_write(&q, Sn(s, S0_DIPR0) + i, ip[i]);
+        w3150_cmdq_write16(&q, Sn(s, S0_DPORT0), port);
+        memcpy(u->dst_ip, ip, 4);
+        u->dst_port = port;
+    }
+    w3150_cmdq_read16(&q, Sn(s, S0_TX_FSR0), &free_size);
+    w3150_cmdq_flush(&q);
+
+    if (free_size < len)
+        return 0;
+
+    // the burst wraps at the end of the TX memory by itself
+    if (w3150_write_ring(dev, mem->tx_base, mem->tx_mask, u->tx_wr & mem->tx_mask, buf, len, W3150_OP_SOCK_PAYLOAD) != 0)
+        return 0;
+    u->tx_wr += len;
+
+    q.op = W3150_OP_SOCK_COMMIT;
+    w3150_cmdq_write16(&q, Sn(s, S0_TX_WR0), u->tx_wr);
+    w3150_cmdq_write(&q, Sn(s, S0_CR), SOCK_SEND);
+    w3150_cmdq_read(&q, Sn(s, S0_IR), &status);
+    if (w3150_cmdq_flush(&q) != 0)
+        return 0;
+
+    // a bus that stopped answering reads status 0 for ever, so the wait
+    // gives up on a failed transfer and after the chip's own timeout
+    q.op = W3150_OP_SOCK_STATUS;
+    if (!(status & UDP_SEND_DONE)){
+        w3150_wait_begin(&dev->tx_send_wait);
+        while (!(status & UDP_SEND_DONE)){
+            if (w3150_wait_elapsed_ns(&dev->tx_send_wait) >= UDP_SEND_TIMEOUT_NS)
+                break;
+            w3150_wait_step(&dev->tx_send_wait);
+            w3150_cmdq_read(&q, Sn(s, S0_IR), &status);
+            if (w3150_cmdq_flush(&q) != 0)
+                break;
+        }
+        w3150_stat_add(&dev->stats->tx.send_waits, 1);
+        w3150_hist_add(&dev->stats->tx.send_wait_ns, w3150_wait_end(&dev->tx_send_wait));
+
+        if (!(status & UDP_SEND_DONE)){
+            u->timeouts++;
+            return 0;
+        }
+    }
+
+    w3150_cmdq_write(&q, Sn(s, S0_IR), status & UDP_SEND_DONE);
+    w3150_cmdq_flush(&q);
+
+    if (status & IR_TIMEOUT){
+        u->timeouts++;
+        return 0;
+    }
+
+    u->sent++;
+    return 1;
+}
+
+/* Take the next datagram off socket s
+ * return the bytes stored in buf, 0 if nothing was waiting */
+uint16_t w3150_dev_udp_recvfrom(struct w3150_dev *dev, uint8_t s, uint8_t *buf, uint16_t len,
+                                uint8_t *ip, uint16_t *port){
+
+    struct w3150_sock *u;
+    struct w3150_sock_mem *mem;
+    struct w3150_cmdq q;
+    uint8_t head[W3150_UDP_HEADER_SIZE];
+    uint16_t size = 0;
+    uint16_t data_len;
+    uint16_t copy = 0;
+    int i;
+
+    if (!udp_socket_ok(s))
+        return 0;
+
+    u = &dev->sock[s];
+    mem = &dev->mem[s];
+
+    if (u->mode != UDP)
+        return 0;
+
+    // receive size and the header that would be first, in one transfer
+    cmdq_init(dev, &q, W3150_OP_SOCK_STATUS);
+    w3150_cmdq_read16(&q, Sn(s, S0_RX_RSR0), &size);
+    for (i = 0; i < W3150_UDP_HEADER_SIZE; i++)
+        w3150_cmdq_read(&q, mem->rx_base + ((u->rx_rd + i) & mem->rx_mask), &head[i]);
+    w3150_cmdq_flush(&q);
+
+    if (size < W3150_UDP_HEADER_SIZE)
+        return 0;
+
+    data_len = (head[6] << 8) | head[7];
+
+    if (W3150_UDP_HEADER_SIZE + data_len > size){
+        // lost track of the datagrams, drop everything received
+        u->rx_rd += size;
+    }
+    else {
+        copy = (data_len > len) ? len : data_len;
+        // on a failed read the datagram stays for the next call
+        if (copy > 0 && w3150_read_ring(dev, mem->rx_base, mem->rx_mask, u->rx_rd + W3150_UDP_HEADER_SIZE, buf,
+                                        copy, W3150_OP_SOCK_PAYLOAD) != 0)
+            return 0;
+
+        if (ip != NULL)
+            memcpy(ip, head, 4);
+        if (port != NULL)
+            *port = (head[4] << 8) | head[5];
+
+        u->rx_rd += W3150_UDP_HEADER_SIZE + data_len;
+        u->received++;
+    }
+
+    q.op = W3150_OP_SOCK_COMMIT;
+    w3150_cmdq_write16(&q, Sn(s, S0_RX_RD0), u->rx_rd);
+    w3150_cmdq_write(&q, Sn(s, S0_CR), SOCK_RECV);
+    w3150_cmdq_flush(&q);
+
+    return copy;
+}
+
+/* TCP sockets
+ * Sn_SR follows the connection and Sn_IR reports SEND_OK and TIMEOUT.
+ * Data to send is staged past Sn_TX_WR like pipelined MACRAW frames and
+ * committed with SEND; one SEND may be outstanding, the next goes once
+ * SEND_OK has been seen.  free is the last Sn_TX_FSR minus what was
+ * staged since, the chip itself keeps to the peer's window. */
+
+#define TCP_PORT_FIRST  49152
+
+static int tcp_socket_ok(struct w3150_dev *dev, uint8_t s){
+
+    if (s >= W3150_SOCKETS)
+        return 0;
+
+    // socket 0 is taken while it does MACRAW
+    return !(s == 0 && dev->shadow.s0_mr == MACRAW);
+}
+
+static int tcp_connected(uint8_t status){
+    return status == STATUS_ESTABLISHED || status == STATUS_CLOSE_WAIT;
+}
+
+/* Nothing more will arrive: the peer sent FIN, or the connection is
+ * gone */
+static int tcp_rx_done(uint8_t status){
+    return status != STATUS_ESTABLISHED && status != STATUS_FIN_WAIT &&
+           status != STATUS_INIT && status != STATUS_LISTEN &&
+           status != STATUS_SYNSENT && status != STATUS_SYNRECV;
+}
+
+/* Open socket s as TCP on port, leaving it in INIT
+ * return 1 if successful */
+static uint8_t tcp_open(struct w3150_dev *dev, uint8_t s, uint16_t port){
+
+    struct w3150_sock *u = &dev->sock[s];
+    struct w3150_cmdq q;
+    uint8_t status = 0;
+
+    if (dev->mem[s].rx_base == 0 || dev->mem[s].tx_base == 0)
+        return 0;
+
+    memset(u, 0, sizeof(*u));
+
+    cmdq_init(dev, &q, W3150_OP_SETUP);
+    w3150_cmdq_write(&q, Sn(s, S0_CR), SOCK_CLOSE);
+    w3150_cmdq_write16(&q, Sn(s, S0_PORT0), port);
+    w3150_cmdq_write(&q, Sn(s, S0_MR), TCP);
+    w3150_cmdq_write(&q, Sn(s, S0_CR), SOCK_OPEN);
+    w3150_cmdq_flush(&q);
+
+    w3150_cmdq_read(&q, Sn(s, S0_SR), &status);
+    w3150_cmdq_read16(&q, Sn(s, S0_TX_WR0), &u->tx_wr);
+    w3150_cmdq_read16(&q, Sn(s, S0_TX_FSR0), &u->free);
+    w3150_cmdq_read16(&q, Sn(s, S0_RX_RD0), &u->rx_rd);
+    w3150_cmdq_write(&q, Sn(s, S0_IR), 0xFF);
+    w3150_cmdq_flush(&q);
+
+    if (s == 0)
+        dev->shadow.s0_mr = TCP;
+
+    if (status != STATUS_INIT){
+        w3150_write_register(dev, Sn(s, S0_CR), SOCK_CLOSE, W3150_OP_SETUP);
+        return 0;
+    }
+
+    u->mode = TCP;
+    u->port = port;
+    u->status = status;
+    u->staged_wr = u->tx_wr;
+    u->last_tx_ns = w3150_now_ns();
+
+    return 1;
+}
+
+/* Hand staged data to the chip if it is ready for another SEND */
+static void tcp_commit(struct w3150_dev *dev, uint8_t s, struct w3150_cmdq *q){
+
+    struct w3150_sock *u = &dev->sock[s];
+
+    if (u->send_pending || u->staged_wr == u->tx_wr || !tcp_connected(u->status))
+        return;
+
+    u->tx_wr = u->staged_wr;
+    w3150_cmdq_write16(q, Sn(s, S0_TX_WR0), u->tx_wr);
+    w3150_cmdq_write(q, Sn(s, S0_CR), SOCK_SEND);
+    u->send_pending = 1;
+    u->last_tx_ns = w3150_now_ns();
+}
+
+/* Pick up the state, free size and events of socket s in one transfer
+ * and commit staged data.  rx_size, when not NULL, gets Sn_RX_RSR. */
+static void tcp_update(struct w3150_dev *dev, uint8_t s, uint16_t *rx_size){
+
+    struct w3150_sock *u = &dev->sock[s];
+    struct w3150_cmdq q;
+    uint8_t ir = 0;
+    uint16_t free_size = 0;
+
+    cmdq_init(dev, &q, W3150_OP_SOCK_STATUS);
+    w3150_cmdq_read(&q, Sn(s, S0_SR), &u->status);
+    w3150_cmdq_read(&q, Sn(s, S0_IR), &ir);
+    w3150_cmdq_read16(&q, Sn(s, S0_TX_FSR0), &free_size);
+    if (rx_size != NULL)
+        w3150_cmdq_read16(&q, Sn(s, S0_RX_RSR0), rx_size);
+    w3150_cmdq_flush(&q);
+
+    if (ir & IR_SEND_OK)
+        u->send_pending = 0;
+
+    if (ir & IR_TIMEOUT){
+        u->error = 1;
+        u->timeouts++;
+    }
+
+    // FSR does not count data staged past the committed write pointer
+    u->free = free_size - (uint16_t)(u->staged_wr - u->tx_wr);
+
+    // only the bits we saw, RECV, CON and DISCON show in Sn_SR as well
+    q.op = W3150_OP_SOCK_COMMIT;
+    if (ir != 0)
+        w3150_cmdq_write(&q, Sn(s, S0_IR), ir);
+    tcp_commit(dev, s, &q);
+    w3150_cmdq_flush(&q);
+}
+
+/* Listen on port, see w3150_tcp_listen()
+ * return 1 if successful */
+uint8_t w3150_dev_tcp_listen(struct w3150_dev *dev, uint8_t s, uint16_t port){
+
+    struct w3150_cmdq q;
+    uint8_t status = 0;
+
+    if (!tcp_socket_ok(dev, s) || !tcp_open(dev, s, port))
+        return 0;
+
+    cmdq_init(dev, &q, W3150_OP_SETUP);
+    w3150_cmdq_write(&q, Sn(s, S0_CR), SOCK_LISTEN);
+    w3150_cmdq_read(&q, Sn(s, S0_SR), &status);
+    w3150_cmdq_flush(&q);
+
+    dev->sock[s].status = status;
+
+    if (status != STATUS_LISTEN){
+        w3150_dev_tcp_abort(dev, s);
+        return 0;
+    }
+
+    return 1;
+}
+
+/* Start a connection to ip:port, see w3150_tcp_connect()
+ * return 1 if the chip is trying */
+uint8_t w3150_dev_tcp_connect(struct w3150_dev *dev, uint8_t s, const uint8_t *ip, uint16_t port){
+
+    struct w3150_cmdq q;
+    uint16_t local;
+    int i;
+
+    if (!tcp_socket_ok(dev, s))
+        return 0;
+
+    if (dev->next_port < TCP_PORT_FIRST)
+        dev->next_port = TCP_PORT_FIRST + (dev->channel * 1021) % 1024;
+    local = dev->next_port++;
+
+    if (!tcp_open(dev, s, local))
+        return 0;
+
+    cmdq_init(dev, &q, W3150_OP_SETUP);
+    for (i = 0; i < 4; i++)
+        w3150_cmdq_write(&q, Sn(s, S0_DIPR0) + i, ip[i]);
+    w3150_cmdq_write16(&q, Sn(s, S0_DPORT0), port);
+    w3150_cmdq_write(&q, Sn(s, S0_CR), SOCK_CONNECT);
+    w3150_cmdq_flush(&q);
+
+    dev->sock[s].status = STATUS_SYNSENT;
+
+    return 1;
+}
+
+/* return 1 once a peer has connected, see w3150_tcp_accept() */
+uint8_t w3150_dev_tcp_accept(struct w3150_dev *dev, uint8_t s, uint8_t *ip, uint16_t *port){
+
+    struct w3150_cmdq q;
+    uint8_t status = 0;
+    uint8_t peer[4];
+    uint16_t peer_port = 0;
+    int i;
+
+    if (s >= W3150_SOCKETS || dev->sock[s].mode != TCP)
+        return 0;
+
+    cmdq_init(dev, &q, W3150_OP_SOCK_STATUS);
+    w3150_cmdq_read(&q, Sn(s, S0_SR), &status);
+    for (i = 0; i < 4; i++)
+        w3150_cmdq_read(&q, Sn(s, S0_DIPR0) + i, &peer[i]);
+    w3150_cmdq_read16(&q, Sn(s, S0_DPORT0), &peer_port);
+    w3150_cmdq_flush(&q);
+
+    if (!tcp_connected(status))
+        return 0;
+
+    if (ip != NULL)
+        memcpy(ip, peer, 4);
+    if (port != NULL)
+        *port = peer_port;
+
+    return 1;
+}
+
+/* Queue data on a connection, see w3150_tcp_send()
+ * return the bytes taken, 0 if there is no room, -1 if the connection
+ * is gone */
+int w3150_dev_tcp_send(struct w3150_dev *dev, uint8_t s, const uint8_t *buf, uint16_t len){
+
+    struct w3150_sock *u;
+    struct w3150_sock_mem *mem;
+    struct w3150_cmdq q;
+    uint16_t n;
+
+    if (s >= W3150_SOCKETS || dev->sock[s].mode != TCP)
+        return -1;
+
+    u = &dev->sock[s];
+    mem = &dev->mem[s];
+
+    if (u->free < len || u->send_pending || !tcp_connected(u->status))
+        tcp_update(dev, s, NULL);
+
+    if (u->error || u->status == STATUS_CLOSED)
+        return -1;
+
+    n = (len > u->free) ? u->free : len;
+    if (n == 0 || !tcp_connected(u->status))
+        return 0;
+
+    // the burst wraps at the end of the TX memory by itself
+    if (w3150_write_ring(dev, mem->tx_base, mem->tx_mask, u->staged_wr & mem->tx_mask, buf, n, W3150_OP_SOCK_PAYLOAD) != 0)
+        return 0;
+    u->staged_wr += n;
+    u->free -= n;
+    u->sent += n;
+
+    cmdq_init(dev, &q, W3150_OP_SOCK_COMMIT);
+    tcp_commit(dev, s, &q);
+    w3150_cmdq_flush(&q);
+
+    return n;
+}
+
+/* Read what has arrived, see w3150_tcp_recv()
+ * return the bytes read, 0 if nothing is waiting, -1 at the end of the
+ * stream */
+int w3150_dev_tcp_recv(struct w3150_dev *dev, uint8_t s, uint8_t *buf, uint16_t len){
+
+    struct w3150_sock *u;
+    struct w3150_sock_mem *mem;
+    struct w3150_cmdq q;
+    uint16_t size = 0;
+    uint8_t status = 0;
+    uint16_t n;
+
+    if (s >= W3150_SOCKETS || dev->sock[s].mode != TCP)
+        return -1;
+
+    u = &dev->sock[s];
+    mem = &dev->mem[s];
+
+    cmdq_init(dev, &q, W3150_OP_SOCK_STATUS);
+    w3150_cmdq_read16(&q, Sn(s, S0_RX_RSR0), &size);
+    w3150_cmdq_read(&q, Sn(s, S0_SR), &status);
+    w3150_cmdq_flush(&q);
+
+    if (size == 0)
+        return tcp_rx_done(status) ? -1 : 0;
+
+    n = (size > len) ? len : size;
+    if (w3150_read_ring(dev, mem->rx_base, mem->rx_mask, u->rx_rd & mem->rx_mask, buf, n, W3150_OP_SOCK_PAYLOAD) != 0)
+        return 0;
+
+    // RECV gives the space back to the receive window
+    q.op = W3150_OP_SOCK_COMMIT;
+    u->rx_rd += n;
+    u->received += n;
+    w3150_cmdq_write16(&q, Sn(s, S0_RX_RD0), u->rx_rd);
+    w3150_cmdq_write(&q, Sn(s, S0_CR), SOCK_RECV);
+    w3150_cmdq_flush(&q);
+
+    return n;
+}
+
+/* State of a TCP socket as W3150_TCP_* bits, also moves staged data
+ * along and sends keepalives */
+uint8_t w3150_dev_tcp_poll(struct w3150_dev *dev, uint8_t s){
+
+    struct w3150_sock *u;
+    uint16_t rx_size = 0;
+    uint8_t events = 0;
+    uint64_t now;
+
+    if (s >= W3150_SOCKETS || dev->sock[s].mode != TCP)
+        return W3150_TCP_CLOSED;
+
+    u = &dev->sock[s];
+    tcp_update(dev, s, &rx_size);
+
+    if (u->error || u->status == STATUS_CLOSED)
+        events |= W3150_TCP_CLOSED;
+    if (rx_size > 0 || ((events & W3150_TCP_CLOSED) == 0 && tcp_rx_done(u->status)))
+        events |= W3150_TCP_READABLE;
+    if (tcp_connected(u->status)){
+        events |= W3150_TCP_CONNECTED;
+        if (u->free > 0)
+            events |= W3150_TCP_WRITABLE;
+    }
+
+    // the chip only sends keepalives after some data went out
+    if (u->keepalive_ns != 0 && u->status == STATUS_ESTABLISHED && !u->send_pending && u->sent > 0){
+        now = w3150_now_ns();
+        if (now - u->last_tx_ns >= u->keepalive_ns){
+            w3150_write_register(dev, Sn(s, S0_CR), SOCK_SEND_KEEP, W3150_OP_SOCK_COMMIT);
+            u->last_tx_ns = now;
+        }
+    }
+
+    return events;
+}
+
+void w3150_dev_tcp_keepalive(struct w3150_dev *dev, uint8_t s, uint32_t idle_ms){
+
+    if (s >= W3150_SOCKETS)
+        return;
+
+    dev->sock[s].keepalive_ns = idle_ms * 1000000ULL;
+    dev->sock[s].last_tx_ns = w3150_now_ns();
+}
+
+/* Send FIN, w3150_tcp_poll() reports W3150_TCP_CLOSED once it is done */
+void w3150_dev_tcp_close(struct w3150_dev *dev, uint8_t s){
+
+    struct w3150_cmdq q;
+
+    if (s >= W3150_SOCKETS || dev->sock[s].mode != TCP)
+        return;
+
+    // whatever is still staged goes first
+    cmdq_init(dev, &q, W3150_OP_SETUP);
+    if (dev->sock[s].staged_wr != dev->sock[s].tx_wr && !dev->sock[s].send_pending)
+        tcp_commit(dev, s, &q);
+    w3150_cmdq_write(&q, Sn(s, S0_CR), SOCK_DISCON);
+    w3150_cmdq_flush(&q);
+}
+
+void w3150_dev_tcp_abort(struct w3150_dev *dev, uint8_t s){
+
+    if (s >= W3150_SOCKETS)
+        return;
+
+    w3150_write_register(dev, Sn(s, S0_CR), SOCK_CLOSE, W3150_OP_SETUP);
+    dev->sock[s].mode = CLOSE;
+    dev->sock[s].status = STATUS_CLOSED;
+}
+
+/* Default device
+ * The original single chip API, on channel 1. */
+
+/* Select the SPI transport by name before w3150_init_networking().
+ * NULL falls back to $W3150_TRANSPORT, then spidev. */
+void w3150_set_transport(const char *name){
+    default_dev.transport_name = name;
+}
+
+void w3150_set_warm_start(uint8_t on){
+    default_dev.warm_start = on;
+}
+
+void w3150_set_rx_interleave(uint8_t on){
+    w3150_dev_set_rx_interleave(&default_dev, on);
+}
+
+void w3150_cmdq_init(struct w3150_cmdq *q){
+    w3150_dev_cmdq_init(&default_dev, q);
+}
+
+uint8_t w3150_init_networking(uint8_t *mac, uint8_t *ip, uint8_t *gw, uint8_t *subnet) {
+    return w3150_dev_init_networking(&default_dev, mac, ip, gw, subnet);
+}
+
+void w3150_ping_block(){
+    w3150_dev_ping_block(&default_dev);
+}
+
+void w3150_set_mac(const uint8_t *mac){
+    w3150_dev_set_mac(&default_dev, mac);
+}
+
+void w3150_set_ip(const uint8_t *ip){
+    w3150_dev_set_ip(&default_dev, ip);
+}
+
+void w3150_set_subnet(const uint8_t *subnet){
+    w3150_dev_set_subnet(&default_dev, subnet);
+}
+
+void w3150_set_gateway(const uint8_t *gw){
+    w3150_dev_set_gateway(&default_dev, gw);
+}
+
+void w3150_read_mac(uint8_t *mac){
+    w3150_dev_read_mac(&default_dev, mac);
+}
+
+void w3150_read_ip(uint8_t *ip){
+    w3150_dev_read_ip(&default_dev, ip);
+}
+
+void w3150_read_subnet(uint8_t *subnet){
+    w3150_dev_read_subnet(&default_dev, subnet);
+}
+
+void w3150_read_gateway(uint8_t *gw){
+    w3150_dev_read_gateway(&default_dev, gw);
+}
+
+uint8_t w3150_init_macraw() {
+    return w3150_dev_init_macraw(&default_dev);
+}
+
+void w3150_shadow_resync(){
+    w3150_dev_shadow_resync(&default_dev);
+}
+
+uint8_t w3150_shadow_verify(){
+    return w3150_dev_shadow_verify(&default_dev);
+}
+
+void w3150_read(uint16_t addr, uint8_t *buf, uint16_t len){
+    w3150_dev_read(&default_dev, addr, buf, len);
+}
+
+void w3150_write(uint16_t addr, uint8_t *buf, uint16_t len){
+    w3150_dev_write(&default_dev, addr, buf, len);
+}
+
+void w3150_macraw_open_socket(){
+    w3150_write_register(&default_dev, S0_CR, SOCK_OPEN, W3150_OP_USER);
+}
+
+void w3150_macraw_close_socket(){
+    macraw_close_socket(&default_dev);
+}
+
+uint16_t w3150_macraw_get_received_size_register(){
+    return w3150_read_register16(&default_dev, S0_RX_RSR0, W3150_OP_USER);
+}
+
+uint16_t w3150_macraw_get_tx_free_size(){
+    return w3150_read_register16(&default_dev, S0_TX_FSR0, W3150_OP_USER);
+}
+
+/* Host owned, served from the shadow */
+uint16_t w3150_macraw_get_tx_write_pointer(){
+    return default_dev.shadow.tx_wr;
+}
+
+uint16_t w3150_macraw_get_tx_read_pointer(){
+    return w3150_read_register16(&default_dev, S0_TX_RD0, W3150_OP_USER);
+}
+
+/* Host owned, served from the shadow */
+uint16_t w3150_macraw_get_read_pointer(){
+    return default_dev.shadow.rx_rd;
+}
+
+uint16_t w3150_macraw_get_rx_write_pointer(){
+    return w3150_read_register16(&default_dev, S0_RX_WR0, W3150_OP_USER);
+}
+
+/* check to see if data has sent
+ * return 1 if it has */
+uint8_t w3150_macraw_check_send(){
+
+    if (w3150_read_register(&default_dev, S0_CR, W3150_OP_USER) != 0x00) {
+        return 0;
+    }
+    else
+        return 1;
+}
+
+void w3150_macraw_write_read_pointer(uint16_t ptr){
+    default_dev.shadow.rx_rd = ptr;
+    w3150_write_register16(&default_dev, S0_RX_RD0, ptr, W3150_OP_USER);
+}
+
+void w3150_macraw_set_write_pointer(uint16_t ptr){
+    default_dev.shadow.tx_wr = ptr;
+    w3150_write_register16(&default_dev, S0_TX_WR0, ptr, W3150_OP_USER);
+}
+
+void w3150_macraw_set_recv(){
+    w3150_dev_macraw_set_recv(&default_dev);
+}
+
+uint8_t w3150_macraw_check_recv(){
+    return w3150_dev_macraw_check_recv(&default_dev);
+}
+
+void w3150_macraw_set_filter(struct w3150_filter *filter){
+    w3150_dev_macraw_set_filter(&default_dev, filter);
+}
+
+uint16_t w3150_macraw_read(uint8_t *recv_buf) {
+    return w3150_dev_macraw_read(&default_dev, recv_buf);
+}
+
+int w3150_macraw_read_batch(uint8_t *buf, uint16_t buf_len, struct w3150_frame *frames, int max_frames) {
+    return w3150_dev_macraw_read_batch(&default_dev, buf, buf_len, frames, max_frames);
+}
+
+int w3150_macraw_read_bufs(struct w3150_buf **bufs, int max_bufs){
+    return w3150_dev_macraw_read_bufs(&default_dev, bufs, max_bufs);
+}
+
+int w3150_macraw_read_snap(uint8_t *buf, uint16_t buf_len, struct w3150_frame *frames, uint16_t *wire_len,
+                           int max_frames, uint16_t snaplen){
+    return w3150_dev_macraw_read_snap(&default_dev, buf, buf_len, frames, wire_len, max_frames, snaplen);
+}
+
+uint8_t w3150_macraw_tx_submit(const uint8_t *tx_buf, uint16_t len){
+    return w3150_dev_macraw_tx_submit(&default_dev, tx_buf, len);
+}
+
+uint8_t w3150_macraw_tx_poll(){
+    return w3150_dev_macraw_tx_poll(&default_dev);
+}
+
+void w3150_macraw_tx_flush(){
+    w3150_dev_macraw_tx_flush(&default_dev);
+}
+
+uint8_t w3150_macraw_write(uint8_t *tx_buf, uint16_t len) {
+    return w3150_dev_macraw_write(&default_dev, tx_buf, len);
+}
+
+uint8_t w3150_set_memory(const uint16_t *rx_sizes, const uint16_t *tx_sizes){
+    return w3150_dev_set_memory(&default_dev, rx_sizes, tx_sizes);
+}
+
+uint8_t w3150_udp_open(uint8_t s, uint16_t port){
+    return w3150_dev_udp_open(&default_dev, s, port);
+}
+
+void w3150_udp_close(uint8_t s){
+    w3150_dev_udp_close(&default_dev, s);
+}
+
+uint8_t w3150_udp_sendto(uint8_t s, const uint8_t *buf, uint16_t len, const uint8_t *ip, uint16_t port){
+    return w3150_dev_udp_sendto(&default_dev, s, buf, len, ip, port);
+}
+
+uint16_t w3150_udp_recvfrom(uint8_t s, uint8_t *buf, uint16_t len, uint8_t *ip, uint16_t *port){
+    return w3150_dev_udp_recvfrom(&default_dev, s, buf, len, ip, port);
+}
+
+uint8_t w3150_tcp_listen(uint8_t s, uint16_t port){
+    return w3150_dev_tcp_listen(&default_dev, s, port);
+}
+
+uint8_t w3150_tcp_connect(uint8_t s, const uint8_t *ip, uint16_t port){
+    return w3150_dev_tcp_connect(&default_dev, s, ip, port);
+}
+
+uint8_t w3150_tcp_accept(uint8_t s, uint8_t *ip, uint16_t *port){
+    return w3150_dev_tcp_accept(&default_dev, s, ip, port);
+}
+
+int w3150_tcp_send(uint8_t s, const uint8_t *buf, uint16_t len){
+    return w3150_dev_tcp_send(&default_dev, s, buf, len);
+}
+
+int w3150_tcp_recv(uint8_t s, uint8_t *buf, uint16_t len){
+    return w3150_dev_tcp_recv(&default_dev, s, buf, len);
+}
+
+uint8_t w3150_tcp_poll(uint8_t s){
+    return w3150_dev_tcp_poll(&default_dev, s);
+}
+
+void w3150_tcp_keepalive(uint8_t s, uint32_t idle_ms){
+    w3150_dev_tcp_keepalive(&default_dev, s, idle_ms);
+}
+
+void w3150_tcp_close(uint8_t s){
+    w3150_dev_tcp_close(&default_dev, s);
+}
+
+void w3150_tcp_abort(uint8_t s){
+    w3150_dev_tcp_abort(&default_dev, s);
+}
+
+int w3150_spi_calibrate(int max_rate){
+    return w3150_dev_spi_calibrate(&default_dev, max_rate);
+}
+
+int w3150_spi_rate(){
+    return default_dev.spi.rate;
+}
+
+int w3150_irq_open(const char *name){
+    return w3150_dev_irq_open(&default_dev, name);
+}
+
+int w3150_irq_fd(){
+    return w3150_dev_irq_fd(&default_dev);
+}
+
+uint8_t w3150_irq_ack(){
+    return w3150_dev_irq_ack(&default_dev);
+}
+
+uint8_t w3150_irq_wait(int timeout_ms){
+    return w3150_dev_irq_wait(&default_dev, timeout_ms);
+}
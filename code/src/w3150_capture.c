@@ -0,0 +1,194 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <w3150.h>
+#include <w3150_dev.h>
+#include <w3150_wait.h>
+#include <w3150_pcap.h>
+
+/*
+ * Capture what the W3150 receives into a pcapng file.
+ *
+ * Frames are taken off the chip in batches with
+ * w3150_macraw_read_snap(), so with a snaplen only the first snaplen
+ * bytes of each frame are clocked over SPI and the rest is skipped on
+ * the chip; every packet still records its length on the wire.  Each
+ * batch is stamped with the wall clock when it was read and the file
+ * is written in large blocks (see w3150_pcap.h), flushed whenever the
+ * link goes quiet.  Interrupt driven with W3150_IRQ, polled otherwise.
+ *
+ * SIGINT or SIGTERM (or -c frames) ends the capture and prints how many
+ * frames and bytes came in and what the SPI bus carried for them.
+ *
+ * Run: ./w3150_capture [-w file] [-s snaplen] [-c count]
+ * "-w -" writes to stdout.
+ */
+
+#define CAPTURE_FILE    "w3150.pcapng"
+#define BATCH_FRAMES    64
+#define BATCH_BYTES     0x8000
+#define IDLE_WAIT_MS    100
+
+static volatile sig_atomic_t stop;
+
+static void on_signal(int sig){
+    (void)sig;
+    stop = 1;
+}
+
+static uint64_t wall_ns(){
+
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int main(int argc, char **argv){
+
+    static uint8_t buf[BATCH_BYTES];
+    struct w3150_frame frames[BATCH_FRAMES];
+    uint16_t wire_len[BATCH_FRAMES];
+    struct w3150_pcapng_writer pcap;
+    struct w3150_stats *st = w3150_default_dev()->stats;
+    struct w3150_wait rx_wait;
+    struct sigaction sa;
+    const char *path = CAPTURE_FILE;
+    long snaplen = MACRAW_MAX_FRAME;
+    long count = -1;
+    uint64_t captured = 0;
+    uint64_t wire_bytes = 0;
+    uint64_t cap_bytes = 0;
+    uint64_t bus_frames;
+    uint64_t ts;
+    char if_name[32];
+    int waiting = 0;
+    int use_irq;
+    int fd;
+    int n;
+    int i;
+    int opt;
+
+    uint8_t mac_address[6] = {0xde,0xad,0xbe,0xef,0xba,0x5e};
+    uint8_t local_host[4]  = {192,168,10,123};
+    uint8_t gateway[4]     = {192,168,50,1};
+    uint8_t subnet[4]      = {255,255,255,0};
+
+    while ((opt = getopt(argc, argv, "w:s:c:h")) != -1){
+        switch (opt){
+        case 'w': path = optarg; break;
+        case 's': snaplen = atol(optarg); break;
+        case 'c': count = atol(optarg); break;
+        default:
+            fprintf(stderr, "Usage: %s [-w file] [-s snaplen] [-c count]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    if (snaplen <= 0 || snaplen > MACRAW_MAX_FRAME)
+        snaplen = MACRAW_MAX_FRAME;
+
+    if (strcmp(path, "-") == 0){
+        // the driver prints to stdout, move that to stderr and keep the
+        // real stdout for the capture
+        fd = dup(STDOUT_FILENO);
+        if (fd >= 0)
+            dup2(STDERR_FILENO, STDOUT_FILENO);
+        path = "stdout";
+    } else
+        fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0){
+        perror(path);
+        return 1;
+    }
+
+    if (w3150_init_networking(mac_address, local_host, gateway, subnet) != 1){
+        fprintf(stderr, "networking init failed\n");
+        return 1;
+    }
+
+    w3150_ping_block();
+
+    if (w3150_init_macraw() != 1){
+        fprintf(stderr, "macraw init failed\n");
+        return 1;
+    }
+
+    snprintf(if_name, sizeof(if_name), "w3150 channel %d", w3150_default_dev()->channel);
+    if (w3150_pcapng_open(&pcap, fd, 0, if_name, snaplen, "w3150_capture") != 0){
+        fprintf(stderr, "Cannot start the capture file\n");
+        return 1;
+    }
+
+    use_irq = (w3150_irq_open(NULL) == 0);
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    // busy poll up to 50us, then back off to at most 1ms
+    w3150_wait_init(&rx_wait, 50000, 10000, 1000000);
+    w3150_rt_setup_env();
+
+    fprintf(stderr, "Capturing to %s, snaplen %ld\n", path, snaplen);
+    bus_frames = st->bus.frames;
+
+    while (!stop && (count < 0 || captured < (uint64_t)count)){
+
+        n = w3150_macraw_read_snap(buf, sizeof(buf), frames, wire_len, BATCH_FRAMES, snaplen);
+
+        if (n == 0){
+            // quiet, a good time to let the file catch up
+            if (w3150_pcapng_flush(&pcap) != 0)
+                break;
+
+            if (use_irq)
+                w3150_irq_wait(IDLE_WAIT_MS);
+            else {
+                if (!waiting)
+                    w3150_wait_begin(&rx_wait);
+                waiting = 1;
+                w3150_wait_step(&rx_wait);
+            }
+            continue;
+        }
+
+        if (waiting){
+            w3150_wait_end(&rx_wait);
+            waiting = 0;
+        }
+
+        ts = wall_ns();
+        for (i = 0; i < n && (count < 0 || captured < (uint64_t)count); i++){
+            if (w3150_pcapng_add(&pcap, ts, frames[i].data, frames[i].len, wire_len[i]) != 0){
+                stop = 1;
+                break;
+            }
+            captured++;
+            wire_bytes += wire_len[i];
+            cap_bytes += frames[i].len;
+        }
+    }
+
+    if (w3150_pcapng_close(&pcap) != 0)
+        fprintf(stderr, "Writing %s failed: %s\n", path, strerror(errno));
+    close(fd);
+
+    bus_frames = st->bus.frames - bus_frames;
+    fprintf(stderr, "%llu frames, %llu bytes on the wire, %llu captured, %llu written in %llu writes\n",
+            (unsigned long long)captured, (unsigned long long)wire_bytes, (unsigned long long)cap_bytes,
+            (unsigned long long)pcap.bytes, (unsigned long long)pcap.writes);
+    fprintf(stderr, "SPI: %llu bytes clocked, %.1f per frame\n",
+            (unsigned long long)bus_frames * W3150_FRAME_SIZE,
+            captured ? (double)bus_frames * W3150_FRAME_SIZE / captured : 0.0);
+
+    return 0;
+}
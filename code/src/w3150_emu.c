@@ -0,0 +1,1143 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <w3150.h>
+#include <w3150_transport.h>
+#include <w3150_emu.h>
+
+/* W3150A+ emulator
+ *
+ * Only what the driver relies on is modelled: register storage, the
+ * buffer memory split given by RMSR/TMSR, the socket commands and the
+ * pointer/size registers they move.  Timing is counted in Sn_CR polls
+ * rather than wall clock so runs are repeatable.
+ */
+
+#define SOCK_REG_BASE   0x0400
+#define SOCK_REG_SIZE   0x0100
+#define SOCK_REG_END    (SOCK_REG_BASE + W3150_EMU_SOCKETS * SOCK_REG_SIZE)
+
+#define Sn_MR       0x00
+#define Sn_CR       0x01
+#define Sn_IR       0x02
+#define Sn_SR       0x03
+#define Sn_PORT     0x04
+#define Sn_DIPR     0x0C
+#define Sn_DPORT    0x10
+#define Sn_TTL      0x16
+#define Sn_TX_FSR   0x20
+#define Sn_TX_RD    0x22
+#define Sn_TX_WR    0x24
+#define Sn_RX_RSR   0x26
+#define Sn_RX_RD    0x28
+#define Sn_RX_WR    0x2A
+
+#define TX_MEM_BASE 0x4000
+#define RX_MEM_BASE 0x6000
+#define MEM_SIZE    0x2000
+
+#define ETH_HEADER      14
+#define ETH_TYPE_IPV4   0x0800
+#define ETH_TYPE_ARP    0x0806
+#define IP_HEADER       20
+#define UDP_HEADER      8
+#define TCP_HEADER      20
+#define IP_PROTO_TCP    6
+#define IP_PROTO_UDP    17
+#define ARP_LEN         28
+#define UDP_MAX_DATA    (1500 - IP_HEADER - UDP_HEADER)
+#define UDP_INFO_SIZE   8       // peer IP, port and length ahead of a datagram
+#define TCP_MSS         (1500 - IP_HEADER - TCP_HEADER)
+
+#define TCP_FIN     0x01
+#define TCP_SYN     0x02
+#define TCP_RST     0x04
+#define TCP_PSH     0x08
+#define TCP_ACK     0x10
+
+static struct w3150_emu *chips[W3150_EMU_MAX_CHIPS];
+
+static uint16_t be16(const uint8_t *p){
+    return (p[0] << 8) | p[1];
+}
+
+static void set_be16(uint8_t *p, uint16_t val){
+    p[0] = (uint8_t)(val >> 8);
+    p[1] = (uint8_t)(val & 0xff);
+}
+
+static uint16_t sock_reg(int s, uint16_t reg){
+    return SOCK_REG_BASE + s * SOCK_REG_SIZE + reg;
+}
+
+static uint16_t get16(struct w3150_emu *emu, uint16_t addr){
+    return (emu->mem[addr] << 8) | emu->mem[addr + 1];
+}
+
+static void set16(struct w3150_emu *emu, uint16_t addr, uint16_t val){
+    emu->mem[addr] = (uint8_t)(val >> 8);
+    emu->mem[addr + 1] = (uint8_t)(val & 0xff);
+}
+
+/* Buffer placement for socket s, sizes come 2 bits per socket from
+ * RMSR/TMSR and sockets are packed in order.  Sockets that do not fit
+ * in the 8KB get no memory. */
+static uint16_t sock_buf(struct w3150_emu *emu, int s, int tx, uint16_t *base){
+
+    uint8_t msr = emu->mem[tx ? TMSR : RMSR];
+    uint16_t offset = 0;
+    uint16_t size;
+    int i;
+
+    for (i = 0; i < s; i++)
+        offset += 1024 << ((msr >> (2 * i)) & 0x03);
+
+    size = 1024 << ((msr >> (2 * s)) & 0x03);
+
+    if (offset + size > MEM_SIZE){
+        *base = 0;
+        return 0;
+    }
+
+    *base = (tx ? TX_MEM_BASE : RX_MEM_BASE) + offset;
+    return size;
+}
+
+static void update_tx_fsr(struct w3150_emu *emu, int s){
+
+    uint16_t base;
+    uint16_t size = sock_buf(emu, s, 1, &base);
+    uint16_t used = get16(emu, sock_reg(s, Sn_TX_WR)) - get16(emu, sock_reg(s, Sn_TX_RD));
+
+    set16(emu, sock_reg(s, Sn_TX_FSR), (used > size) ? 0 : size - used);
+}
+
+/* IR carries one bit per socket with a non zero Sn_IR, INT is low
+ * while any of them is enabled in IMR */
+static void update_int(struct w3150_emu *emu){
+
+    uint8_t sockets = 0;
+    uint8_t asserted;
+    uint64_t one = 1;
+    int s;
+
+    for (s = 0; s < W3150_EMU_SOCKETS; s++){
+        if (emu->mem[sock_reg(s, Sn_IR)] != 0)
+            sockets |= 1 << s;
+    }
+
+    emu->mem[IR] = (emu->mem[IR] & 0xF0) | sockets;
+    asserted = (emu->mem[IR] & emu->mem[IMR]) != 0;
+
+    if (asserted && !emu->int_asserted){
+        emu->stats.interrupts++;
+        if (emu->irq_fd >= 0 && write(emu->irq_fd, &one, sizeof(one)) < 0)
+            perror("emu irq");
+    }
+
+    emu->int_asserted = asserted;
+}
+
+static void wire_put(struct w3150_emu_wire *wire, const uint8_t *data, uint16_t len){
+
+    struct w3150_emu_frame *f = &wire->frames[wire->head % W3150_EMU_WIRE_FRAMES];
+
+    if (len > W3150_EMU_MAX_FRAME)
+        len = W3150_EMU_MAX_FRAME;
+
+    memcpy(f->data, data, len);
+    f->len = len;
+    wire->head++;
+
+    // oldest frame is overwritten when nobody is pulling
+    if (wire->head - wire->tail > W3150_EMU_WIRE_FRAMES)
+        wire->tail = wire->head - W3150_EMU_WIRE_FRAMES;
+}
+
+static void arp_learn(struct w3150_emu *emu, const uint8_t *ip, const uint8_t *mac){
+
+    struct w3150_emu_arp *e;
+    int i;
+
+    if (mac[0] & 0x01)
+        return;
+
+    for (i = 0; i < W3150_EMU_ARP_ENTRIES; i++){
+        if (memcmp(emu->arp[i].ip, ip, 4) == 0){
+            memcpy(emu->arp[i].mac, mac, 6);
+            return;
+        }
+    }
+
+    e = &emu->arp[emu->arp_next++ % W3150_EMU_ARP_ENTRIES];
+    memcpy(e->ip, ip, 4);
+    memcpy(e->mac, mac, 6);
+}
+
+/* MAC for an IP on the wire, broadcast for the limited and subnet
+ * broadcast addresses.  return 0 if it is not known */
+static int arp_lookup(struct w3150_emu *emu, const uint8_t *ip, uint8_t *mac){
+
+    int i;
+    int bcast = 1;
+    int subnet_bcast = 1;
+
+    for (i = 0; i < 4; i++){
+        bcast &= (ip[i] == 0xFF);
+        subnet_bcast &= ((ip[i] | emu->mem[SUBR + i]) == 0xFF);
+    }
+
+    if (bcast || subnet_bcast){
+        memset(mac, 0xFF, 6);
+        return 1;
+    }
+
+    for (i = 0; i < W3150_EMU_ARP_ENTRIES; i++){
+        if (memcmp(emu->arp[i].ip, ip, 4) == 0){
+            memcpy(mac, emu->arp[i].mac, 6);
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static void put_arp(struct w3150_emu *emu, uint16_t op, const uint8_t *dst_mac, const uint8_t *target_mac,
+                    const uint8_t *target_ip){
+
+    uint8_t frame[ETH_HEADER + ARP_LEN];
+    uint8_t *arp = frame + ETH_HEADER;
+
+    memcpy(frame, dst_mac, 6);
+    memcpy(frame + 6, emu->mem + SHAR, 6);
+    frame[12] = ETH_TYPE_ARP >> 8;
+    frame[13] = ETH_TYPE_ARP & 0xff;
+
+    // Ethernet, IPv4
+    arp[0] = 0; arp[1] = 1;
+    arp[2] = 0x08; arp[3] = 0x00;
+    arp[4] = 6; arp[5] = 4;
+    arp[6] = 0; arp[7] = op;
+    memcpy(arp + 8, emu->mem + SHAR, 6);
+    memcpy(arp + 14, emu->mem + SIPR, 4);
+    memcpy(arp + 18, target_mac, 6);
+    memcpy(arp + 24, target_ip, 4);
+
+    wire_put(&emu->tx_wire, frame, sizeof(frame));
+    emu->stats.frames_out++;
+}
+
+static uint32_t checksum_add(uint32_t sum, const uint8_t *p, int len){
+
+    int i;
+
+    for (i = 0; i + 1 < len; i += 2)
+        sum += (p[i] << 8) | p[i + 1];
+    if (len & 1)
+        sum += p[len - 1] << 8;
+
+    return sum;
+}
+
+static uint16_t checksum_fold(uint32_t sum){
+
+    while (sum >> 16)
+        sum = (sum & 0xffff) + (sum >> 16);
+
+    return ~sum & 0xffff;
+}
+
+static uint16_t ip_checksum(const uint8_t *p, int len){
+    return checksum_fold(checksum_add(0, p, len));
+}
+
+static void put_ip_header(struct w3150_emu *emu, int s, uint8_t *ip, uint8_t proto, uint16_t len){
+
+    memset(ip, 0, IP_HEADER);
+    ip[0] = 0x45;
+    set_be16(ip + 2, len);
+    set_be16(ip + 4, emu->ip_id++);
+    ip[8] = emu->mem[sock_reg(s, Sn_TTL)];
+    ip[9] = proto;
+    memcpy(ip + 12, emu->mem + SIPR, 4);
+    memcpy(ip + 16, emu->mem + sock_reg(s, Sn_DIPR), 4);
+    set_be16(ip + 10, ip_checksum(ip, IP_HEADER));
+}
+
+/* Wrap data from a UDP socket into frames, MSS sized pieces like the
+ * chip.  return 0 if the destination did not resolve */
+static int send_udp(struct w3150_emu *emu, int s, const uint8_t *data, uint16_t len){
+
+    uint8_t frame[ETH_HEADER + IP_HEADER + UDP_HEADER + UDP_MAX_DATA];
+    uint8_t *ip = frame + ETH_HEADER;
+    uint8_t *udp = ip + IP_HEADER;
+    const uint8_t *dst_ip = emu->mem + sock_reg(s, Sn_DIPR);
+    static const uint8_t bcast[6] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
+    static const uint8_t zero[6] = {0};
+    uint16_t chunk;
+
+    if (!arp_lookup(emu, dst_ip, frame)){
+        put_arp(emu, 1, bcast, zero, dst_ip);
+        return 0;
+    }
+
+    memcpy(frame + 6, emu->mem + SHAR, 6);
+    frame[12] = ETH_TYPE_IPV4 >> 8;
+    frame[13] = ETH_TYPE_IPV4 & 0xff;
+
+    do {
+        chunk = (len > UDP_MAX_DATA) ? UDP_MAX_DATA : len;
+
+        put_ip_header(emu, s, ip, IP_PROTO_UDP, IP_HEADER + UDP_HEADER + chunk);
+
+        memcpy(udp, emu->mem + sock_reg(s, Sn_PORT), 2);
+        memcpy(udp + 2, emu->mem + sock_reg(s, Sn_DPORT), 2);
+        set_be16(udp + 4, UDP_HEADER + chunk);
+        set_be16(udp + 6, 0);   // no checksum
+        memcpy(udp + UDP_HEADER, data, chunk);
+
+        wire_put(&emu->tx_wire, frame, ETH_HEADER + IP_HEADER + UDP_HEADER + chunk);
+        emu->stats.frames_out++;
+
+        data += chunk;
+        len -= chunk;
+    } while (len > 0);
+
+    return 1;
+}
+
+/* Free space in the RX ring of socket s, advertised as the window */
+static uint16_t rx_free(struct w3150_emu *emu, int s){
+
+    uint16_t base;
+    uint16_t size = sock_buf(emu, s, 0, &base);
+    uint16_t used = get16(emu, sock_reg(s, Sn_RX_WR)) - get16(emu, sock_reg(s, Sn_RX_RD));
+
+    return (used > size) ? 0 : size - used;
+}
+
+/* One segment from TCP socket s to its peer */
+static void put_tcp(struct w3150_emu *emu, int s, uint8_t flags, uint32_t seq,
+                    const uint8_t *data, uint16_t len){
+
+    struct w3150_emu_tcp *t = &emu->tcp[s];
+    uint8_t frame[ETH_HEADER + IP_HEADER + TCP_HEADER + TCP_MSS];
+    uint8_t *ip = frame + ETH_HEADER;
+    uint8_t *tcp = ip + IP_HEADER;
+    uint8_t pseudo[12];
+    uint32_t sum;
+
+    memcpy(frame, t->peer_mac, 6);
+    memcpy(frame + 6, emu->mem + SHAR, 6);
+    frame[12] = ETH_TYPE_IPV4 >> 8;
+    frame[13] = ETH_TYPE_IPV4 & 0xff;
+
+    put_ip_header(emu, s, ip, IP_PROTO_TCP, IP_HEADER + TCP_HEADER + len);
+
+    memset(tcp, 0, TCP_HEADER);
+    memcpy(tcp, emu->mem + sock_reg(s, Sn_PORT), 2);
+    memcpy(tcp + 2, emu->mem + sock_reg(s, Sn_DPORT), 2);
+    set_be16(tcp + 4, seq >> 16);
+    set_be16(tcp + 6, seq & 0xffff);
+    if (flags & TCP_ACK){
+        set_be16(tcp + 8, t->rcv_nxt >> 16);
+        set_be16(tcp + 10, t->rcv_nxt & 0xffff);
+    }
+    tcp[12] = (TCP_HEADER / 4) << 4;
+    tcp[13] = flags;
+    set_be16(tcp + 14, rx_free(emu, s));
+    if (len > 0)
+        memcpy(tcp + TCP_HEADER, data, len);
+
+    memcpy(pseudo, ip + 12, 8);
+    pseudo[8] = 0;
+    pseudo[9] = IP_PROTO_TCP;
+    set_be16(pseudo + 10, TCP_HEADER + len);
+    sum = checksum_add(checksum_add(0, pseudo, sizeof(pseudo)), tcp, TCP_HEADER + len);
+    set_be16(tcp + 16, checksum_fold(sum));
+
+    wire_put(&emu->tx_wire, frame, ETH_HEADER + IP_HEADER + TCP_HEADER + len);
+    emu->stats.frames_out++;
+}
+
+/* Data from a connected TCP socket, MSS sized segments.  Nothing is
+ * retransmitted, the wire does not lose frames. */
+static void send_tcp(struct w3150_emu *emu, int s, const uint8_t *data, uint16_t len){
+
+    struct w3150_emu_tcp *t = &emu->tcp[s];
+    uint16_t chunk;
+
+    while (len > 0){
+        chunk = (len > TCP_MSS) ? TCP_MSS : len;
+        put_tcp(emu, s, TCP_ACK | TCP_PSH, t->snd_nxt, data, chunk);
+        t->snd_nxt += chunk;
+        data += chunk;
+        len -= chunk;
+    }
+}
+
+static int tcp_connected(uint8_t status){
+    return status == STATUS_ESTABLISHED || status == STATUS_CLOSE_WAIT;
+}
+
+static void complete_send(struct w3150_emu *emu, int s){
+
+    uint8_t frame[MEM_SIZE];
+    uint16_t base;
+    uint16_t size = sock_buf(emu, s, 1, &base);
+    uint16_t rd = get16(emu, sock_reg(s, Sn_TX_RD));
+    uint16_t wr = get16(emu, sock_reg(s, Sn_TX_WR));
+    uint16_t len = wr - rd;
+    uint8_t result = IR_SEND_OK;
+    uint16_t i;
+
+    if (size != 0 && len <= size){
+        for (i = 0; i < len; i++)
+            frame[i] = emu->mem[base + ((rd + i) & (size - 1))];
+
+        if (emu->mem[sock_reg(s, Sn_SR)] == STATUS_UDP){
+            if (len > 0 && !send_udp(emu, s, frame, len))
+                result = IR_TIMEOUT;
+        }
+        else if ((emu->mem[sock_reg(s, Sn_MR)] & 0x0F) == TCP){
+            if (tcp_connected(emu->mem[sock_reg(s, Sn_SR)]))
+                send_tcp(emu, s, frame, len);
+            else
+                result = IR_TIMEOUT;
+        }
+        else if (len <= W3150_EMU_MAX_FRAME){
+            wire_put(&emu->tx_wire, frame, len);
+            emu->stats.frames_out++;
+        }
+    }
+
+    set16(emu, sock_reg(s, Sn_TX_RD), wr);
+    update_tx_fsr(emu, s);
+
+    emu->mem[sock_reg(s, Sn_IR)] |= result;
+    emu->mem[sock_reg(s, Sn_CR)] = 0;
+    update_int(emu);
+}
+
+static void open_socket(struct w3150_emu *emu, int s){
+
+    uint8_t mode = emu->mem[sock_reg(s, Sn_MR)] & 0x0F;
+    uint8_t status = STATUS_CLOSED;
+
+    switch (mode){
+    case MACRAW:
+        // MACRAW only exists on socket 0
+        if (s == 0)
+            status = STATUS_MACRAW;
+        break;
+    case IPRAW:
+        status = STATUS_IPRAW;
+        break;
+    case UDP:
+        status = STATUS_UDP;
+        break;
+    case TCP:
+        status = STATUS_INIT;
+        break;
+    }
+
+    emu->mem[sock_reg(s, Sn_SR)] = status;
+    memset(&emu->tcp[s], 0, sizeof(emu->tcp[s]));
+
+    set16(emu, sock_reg(s, Sn_TX_RD), 0);
+    set16(emu, sock_reg(s, Sn_TX_WR), 0);
+    set16(emu, sock_reg(s, Sn_RX_RSR), 0);
+    set16(emu, sock_reg(s, Sn_RX_RD), 0);
+    set16(emu, sock_reg(s, Sn_RX_WR), 0);
+    update_tx_fsr(emu, s);
+}
+
+/* CONNECT: SYN to Sn_DIPR:Sn_DPORT, an unresolved peer ends in TIMEOUT
+ * like UDP */
+static void tcp_connect(struct w3150_emu *emu, int s){
+
+    struct w3150_emu_tcp *t = &emu->tcp[s];
+    const uint8_t *dst_ip = emu->mem + sock_reg(s, Sn_DIPR);
+    static const uint8_t bcast[6] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
+    static const uint8_t zero[6] = {0};
+
+    if (!arp_lookup(emu, dst_ip, t->peer_mac) || (t->peer_mac[0] & 0x01)){
+        put_arp(emu, 1, bcast, zero, dst_ip);
+        emu->mem[sock_reg(s, Sn_SR)] = STATUS_CLOSED;
+        emu->mem[sock_reg(s, Sn_IR)] |= IR_TIMEOUT;
+        update_int(emu);
+        return;
+    }
+
+    t->snd_nxt = emu->isn;
+    emu->isn += 64000;
+    put_tcp(emu, s, TCP_SYN, t->snd_nxt++, NULL, 0);
+    emu->mem[sock_reg(s, Sn_SR)] = STATUS_SYNSENT;
+}
+
+/* DISCON: FIN after whatever was sent */
+static void tcp_discon(struct w3150_emu *emu, int s){
+
+    struct w3150_emu_tcp *t = &emu->tcp[s];
+    uint8_t *sr = emu->mem + sock_reg(s, Sn_SR);
+
+    if (!tcp_connected(*sr)){
+        *sr = STATUS_CLOSED;
+        return;
+    }
+
+    put_tcp(emu, s, TCP_FIN | TCP_ACK, t->snd_nxt++, NULL, 0);
+    *sr = (*sr == STATUS_ESTABLISHED) ? STATUS_FIN_WAIT : STATUS_LAST_ACK;
+}
+
+static void socket_command(struct w3150_emu *emu, int s, uint8_t cmd){
+
+    uint16_t rx_wr;
+
+    emu->stats.commands++;
+
+    // the chip takes commands one at a time, a SEND still shown busy
+    // is finished before the next one starts
+    if (emu->cr_busy[s] != 0){
+        emu->cr_busy[s] = 0;
+        complete_send(emu, s);
+    }
+
+    emu->mem[sock_reg(s, Sn_CR)] = cmd;
+
+    switch (cmd){
+    case SOCK_OPEN:
+        open_socket(emu, s);
+        break;
+    case SOCK_CLOSE:
+        emu->mem[sock_reg(s, Sn_SR)] = STATUS_CLOSED;
+        break;
+    case SOCK_LISTEN:
+        if (emu->mem[sock_reg(s, Sn_SR)] == STATUS_INIT)
+            emu->mem[sock_reg(s, Sn_SR)] = STATUS_LISTEN;
+        break;
+    case SOCK_CONNECT:
+        if (emu->mem[sock_reg(s, Sn_SR)] == STATUS_INIT)
+            tcp_connect(emu, s);
+        break;
+    case SOCK_DISCON:
+        tcp_discon(emu, s);
+        break;
+    case SOCK_SEND_KEEP:
+        // one byte below snd_nxt, the peer answers with an ACK
+        if (emu->mem[sock_reg(s, Sn_SR)] == STATUS_ESTABLISHED)
+            put_tcp(emu, s, TCP_ACK, emu->tcp[s].snd_nxt - 1, NULL, 0);
+        break;
+    case SOCK_SEND:
+    case SOCK_SEND_MAC:
+        if (emu->send_polls != 0){
+            emu->cr_busy[s] = emu->send_polls;
+            return;
+        }
+        complete_send(emu, s);
+        return;
+    case SOCK_RECV:
+        rx_wr = get16(emu, sock_reg(s, Sn_RX_WR));
+        set16(emu, sock_reg(s, Sn_RX_RSR), rx_wr - get16(emu, sock_reg(s, Sn_RX_RD)));
+        break;
+    }
+
+    emu->mem[sock_reg(s, Sn_CR)] = 0;
+}
+
+void w3150_emu_reset(struct w3150_emu *emu){
+
+    int s;
+
+    memset(emu->mem, 0, sizeof(emu->mem));
+    memset(emu->cr_busy, 0, sizeof(emu->cr_busy));
+
+    // power on values from the datasheet
+    emu->mem[RTR0] = 0x07;
+    emu->mem[RTR1] = 0xD0;
+    emu->mem[RCR] = 0x08;
+    emu->mem[RMSR] = 0x55;
+    emu->mem[TMSR] = 0x55;
+
+    for (s = 0; s < W3150_EMU_SOCKETS; s++){
+        emu->mem[sock_reg(s, Sn_TTL)] = 0x80;
+        update_tx_fsr(emu, s);
+    }
+
+    memset(emu->arp, 0, sizeof(emu->arp));
+    emu->arp_next = 0;
+    memset(emu->tcp, 0, sizeof(emu->tcp));
+    emu->isn = 0x10000;
+
+    update_int(emu);
+}
+
+static void write_register(struct w3150_emu *emu, uint16_t addr, uint8_t data){
+
+    int s;
+    uint16_t reg;
+
+    if (addr == MR){
+        if (data & 0x80){
+            w3150_emu_reset(emu);
+            return;
+        }
+        emu->mem[MR] = data;
+        return;
+    }
+
+    if (addr >= SOCK_REG_BASE && addr < SOCK_REG_END){
+        s = (addr - SOCK_REG_BASE) / SOCK_REG_SIZE;
+        reg = (addr - SOCK_REG_BASE) % SOCK_REG_SIZE;
+
+        switch (reg){
+        case Sn_CR:
+            socket_command(emu, s, data);
+            return;
+        case Sn_IR:
+            // interrupt bits are cleared by writing 1
+            emu->mem[addr] &= ~data;
+            update_int(emu);
+            return;
+        case Sn_SR:
+        case Sn_TX_FSR:
+        case Sn_TX_FSR + 1:
+        case Sn_TX_RD:
+        case Sn_TX_RD + 1:
+        case Sn_RX_RSR:
+        case Sn_RX_RSR + 1:
+        case Sn_RX_WR:
+        case Sn_RX_WR + 1:
+            // read only
+            return;
+        }
+
+        emu->mem[addr] = data;
+
+        if (reg == Sn_TX_WR + 1)
+            update_tx_fsr(emu, s);
+        return;
+    }
+
+    if (addr == IR){
+        // socket bits follow Sn_IR, the others clear by writing 1
+        emu->mem[IR] &= ~(data & 0xF0);
+        update_int(emu);
+        return;
+    }
+
+    if (addr == IMR){
+        emu->mem[IMR] = data;
+        update_int(emu);
+        return;
+    }
+
+    if (addr == RMSR || addr == TMSR){
+        emu->mem[addr] = data;
+        for (s = 0; s < W3150_EMU_SOCKETS; s++)
+            update_tx_fsr(emu, s);
+        return;
+    }
+
+    if (addr < W3150_EMU_MEM_SIZE)
+        emu->mem[addr] = data;
+}
+
+static uint8_t read_register(struct w3150_emu *emu, uint16_t addr){
+
+    int s;
+
+    if (addr >= W3150_EMU_MEM_SIZE)
+        return 0;
+
+    if (addr >= SOCK_REG_BASE && addr < SOCK_REG_END &&
+        (addr - SOCK_REG_BASE) % SOCK_REG_SIZE == Sn_CR){
+
+        s = (addr - SOCK_REG_BASE) / SOCK_REG_SIZE;
+
+        if (emu->cr_busy[s] != 0 && --emu->cr_busy[s] == 0)
+            complete_send(emu, s);
+    }
+
+    return emu->mem[addr];
+}
+
+/* Flip a bit in one of the frame's reply bytes, in permille of frames */
+static void garble(struct w3150_emu *emu, uint8_t *f, unsigned int permille){
+
+    emu->noise = emu->noise * 1103515245 + 12345;
+
+    if ((emu->noise >> 8) % 1000 >= permille)
+        return;
+
+    f[(emu->noise >> 20) & 3] ^= 1 << ((emu->noise >> 24) & 7);
+    emu->stats.garbled++;
+}
+
+void w3150_emu_transfer(struct w3150_emu *emu, uint8_t *frames, int len){
+
+    int i;
+    uint16_t addr;
+    uint8_t opcode;
+    unsigned int permille = 0;
+
+    pthread_mutex_lock(&emu->lock);
+
+    emu->stats.submissions++;
+
+    // 5% of frames just over the limit, all of them at twice it
+    if (emu->max_rate > 0 && emu->rate > emu->max_rate){
+        permille = 50 + 950ULL * (emu->rate - emu->max_rate) / emu->max_rate;
+        if (permille > 1000)
+            permille = 1000;
+    }
+
+    for (i = 0; i + W3150_FRAME_SIZE <= len; i += W3150_FRAME_SIZE){
+        uint8_t *f = frames + i;
+
+        opcode = f[0];
+        addr = (f[1] << 8) | f[2];
+
+        emu->stats.transactions++;
+        emu->stats.bytes += W3150_FRAME_SIZE;
+
+        // the chip shifts out 0x00 0x01 0x02 ahead of the data byte
+        f[0] = 0x00;
+        f[1] = 0x01;
+        f[2] = 0x02;
+
+        if (opcode == W3150_WRITE){
+            emu->stats.writes++;
+            write_register(emu, addr, f[3]);
+            f[3] = 0x03;
+        }
+        else if (opcode == W3150_READ){
+            emu->stats.reads++;
+            f[3] = read_register(emu, addr);
+        }
+        else {
+            emu->stats.bad_opcodes++;
+            f[3] = 0x00;
+        }
+
+        if (permille != 0)
+            garble(emu, f, permille);
+    }
+
+    pthread_mutex_unlock(&emu->lock);
+}
+
+/* Copy into the RX ring of socket s behind a header of hlen bytes
+ * return -1 if there is no room */
+static int rx_put(struct w3150_emu *emu, int s, const uint8_t *head, uint16_t hlen,
+                  const uint8_t *data, uint16_t len){
+
+    uint16_t base;
+    uint16_t size = sock_buf(emu, s, 0, &base);
+    uint16_t rd = get16(emu, sock_reg(s, Sn_RX_RD));
+    uint16_t wr = get16(emu, sock_reg(s, Sn_RX_WR));
+    uint16_t total = hlen + len;
+    uint16_t i;
+
+    if (size == 0 || (uint16_t)(wr - rd) + total > size)
+        return -1;
+
+    for (i = 0; i < hlen; i++)
+        emu->mem[base + ((wr + i) & (size - 1))] = head[i];
+    for (i = 0; i < len; i++)
+        emu->mem[base + ((wr + hlen + i) & (size - 1))] = data[i];
+
+    set16(emu, sock_reg(s, Sn_RX_WR), wr + total);
+    set16(emu, sock_reg(s, Sn_RX_RSR), get16(emu, sock_reg(s, Sn_RX_RSR)) + total);
+    emu->mem[sock_reg(s, Sn_IR)] |= IR_RECV;
+    update_int(emu);
+
+    return 0;
+}
+
+static uint32_t be32(const uint8_t *p){
+    return ((uint32_t)be16(p) << 16) | be16(p + 2);
+}
+
+/* TCP socket for a segment: the connection it belongs to, else a
+ * socket listening on its port */
+static int tcp_socket(struct w3150_emu *emu, const uint8_t *ip, const uint8_t *tcp){
+
+    uint8_t status;
+    int listener = -1;
+    int s;
+
+    for (s = 0; s < W3150_EMU_SOCKETS; s++){
+        status = emu->mem[sock_reg(s, Sn_SR)];
+
+        if ((emu->mem[sock_reg(s, Sn_MR)] & 0x0F) != TCP || status == STATUS_CLOSED || status == STATUS_INIT ||
+            memcmp(emu->mem + sock_reg(s, Sn_PORT), tcp + 2, 2) != 0)
+            continue;
+
+        if (status == STATUS_LISTEN){
+            if (listener < 0)
+                listener = s;
+        }
+        else if (memcmp(emu->mem + sock_reg(s, Sn_DIPR), ip + 12, 4) == 0 &&
+                 memcmp(emu->mem + sock_reg(s, Sn_DPORT), tcp, 2) == 0)
+            return s;
+    }
+
+    return listener;
+}
+
+/* One segment for a TCP socket.  The state machine is the part of RFC
+ * 793 a well behaved peer on a lossless wire needs: in order data only,
+ * anything else is answered with an ACK for rcv_nxt.
+ * return 1 if consumed, 0 if no socket wants it, -1 if there is no room */
+static int tcp_input(struct w3150_emu *emu, const uint8_t *data, const uint8_t *ip, uint16_t ihl){
+
+    const uint8_t *tcp = ip + ihl;
+    const uint8_t *payload;
+    struct w3150_emu_tcp *t;
+    uint8_t *sr;
+    uint8_t *sir;
+    uint16_t len;
+    uint8_t flags;
+    uint32_t seq;
+    uint32_t ack;
+    int s;
+
+    s = tcp_socket(emu, ip, tcp);
+    if (s < 0)
+        return 0;
+
+    t = &emu->tcp[s];
+    sr = emu->mem + sock_reg(s, Sn_SR);
+    sir = emu->mem + sock_reg(s, Sn_IR);
+
+    flags = tcp[13];
+    seq = be32(tcp + 4);
+    ack = be32(tcp + 8);
+    payload = tcp + (tcp[12] >> 4) * 4;
+    len = be16(ip + 2) - ihl - (payload - tcp);
+
+    if (flags & TCP_RST){
+        if (*sr != STATUS_LISTEN){
+            *sir |= (*sr == STATUS_SYNSENT) ? IR_TIMEOUT : IR_DISCON;
+            *sr = STATUS_CLOSED;
+            update_int(emu);
+        }
+        return 1;
+    }
+
+    switch (*sr){
+    case STATUS_LISTEN:
+        if ((flags & (TCP_SYN | TCP_ACK)) != TCP_SYN)
+            return 1;
+        memcpy(emu->mem + sock_reg(s, Sn_DIPR), ip + 12, 4);
+        memcpy(emu->mem + sock_reg(s, Sn_DPORT), tcp, 2);
+        memcpy(t->peer_mac, data + 6, 6);
+        t->rcv_nxt = seq + 1;
+        t->snd_nxt = emu->isn;
+        emu->isn += 64000;
+        put_tcp(emu, s, TCP_SYN | TCP_ACK, t->snd_nxt++, NULL, 0);
+        *sr = STATUS_SYNRECV;
+        return 1;
+    case STATUS_SYNSENT:
+        if ((flags & (TCP_SYN | TCP_ACK)) != (TCP_SYN | TCP_ACK) || ack != t->snd_nxt)
+            return 1;
+        t->rcv_nxt = seq + 1;
+        put_tcp(emu, s, TCP_ACK, t->snd_nxt, NULL, 0);
+        *sr = STATUS_ESTABLISHED;
+        *sir |= IR_CON;
+        update_int(emu);
+        return 1;
+    case STATUS_SYNRECV:
+        if (!(flags & TCP_ACK) || ack != t->snd_nxt)
+            return 1;
+        *sr = STATUS_ESTABLISHED;
+        *sir |= IR_CON;
+        update_int(emu);
+        break;
+    case STATUS_LAST_ACK:
+        if ((flags & TCP_ACK) && ack == t->snd_nxt){
+            *sr = STATUS_CLOSED;
+            *sir |= IR_DISCON;
+            update_int(emu);
+        }
+        return 1;
+    }
+
+    if (seq != t->rcv_nxt){
+        put_tcp(emu, s, TCP_ACK, t->snd_nxt, NULL, 0);
+        return 1;
+    }
+
+    if (len > 0 && (*sr == STATUS_ESTABLISHED || *sr == STATUS_FIN_WAIT)){
+        if (rx_put(emu, s, NULL, 0, payload, len) != 0){
+            // the peer sends it again once the window opens
+            put_tcp(emu, s, TCP_ACK, t->snd_nxt, NULL, 0);
+            return -1;
+        }
+        t->rcv_nxt += len;
+    }
+
+    if (flags & TCP_FIN){
+        t->rcv_nxt++;
+        *sr = (*sr == STATUS_FIN_WAIT) ? STATUS_CLOSED : STATUS_CLOSE_WAIT;
+        *sir |= IR_DISCON;
+        update_int(emu);
+    }
+
+    if (len > 0 || (flags & TCP_FIN))
+        put_tcp(emu, s, TCP_ACK, t->snd_nxt, NULL, 0);
+
+    return 1;
+}
+
+/* The chip's own stack: learn addresses, answer ARP for SIPR, hand UDP
+ * datagrams to the socket bound to their port and TCP segments to
+ * their connection.
+ * return 1 if the frame was consumed, 0 if socket 0 should see it, -1
+ * if it was for a UDP socket without room */
+static int stack_input(struct w3150_emu *emu, const uint8_t *data, uint16_t len){
+
+    const uint8_t *ip = data + ETH_HEADER;
+    const uint8_t *udp;
+    uint8_t head[UDP_INFO_SIZE];
+    uint16_t type;
+    uint16_t ihl;
+    uint16_t udp_len;
+    int i;
+    int s;
+
+    if (len < ETH_HEADER)
+        return 0;
+
+    type = be16(data + 12);
+
+    if (type == ETH_TYPE_ARP && len >= ETH_HEADER + ARP_LEN){
+        arp_learn(emu, ip + 14, ip + 8);
+        if (be16(ip + 6) == 1 && memcmp(ip + 24, emu->mem + SIPR, 4) == 0 && be16(emu->mem + SIPR) != 0)
+            put_arp(emu, 2, ip + 8, ip + 8, ip + 14);
+        return 0;
+    }
+
+    if (type != ETH_TYPE_IPV4 || len < ETH_HEADER + IP_HEADER || (ip[0] >> 4) != 4)
+        return 0;
+
+    arp_learn(emu, ip + 12, data + 6);
+
+    ihl = (ip[0] & 0x0F) * 4;
+
+    // for us: our MAC and IP, or broadcast
+    if (!(data[0] & 0x01) && memcmp(data, emu->mem + SHAR, 6) != 0)
+        return 0;
+    for (i = 0; i < 4 && ip[16 + i] == 0xFF; i++)
+        ;
+    if (i != 4 && memcmp(ip + 16, emu->mem + SIPR, 4) != 0)
+        return 0;
+
+    if (ip[9] == IP_PROTO_TCP && i != 4 && len >= ETH_HEADER + ihl + TCP_HEADER &&
+        ETH_HEADER + be16(ip + 2) <= len && be16(ip + 2) >= ihl + (ip[ihl + 12] >> 4) * 4)
+        return tcp_input(emu, data, ip, ihl);
+
+    if (ip[9] != IP_PROTO_UDP || len < ETH_HEADER + ihl + UDP_HEADER)
+        return 0;
+
+    udp = ip + ihl;
+    udp_len = be16(udp + 4);
+    if (udp_len < UDP_HEADER || ETH_HEADER + ihl + udp_len > len)
+        return 0;
+
+    for (s = 0; s < W3150_EMU_SOCKETS; s++){
+        if (emu->mem[sock_reg(s, Sn_SR)] == STATUS_UDP && memcmp(emu->mem + sock_reg(s, Sn_PORT), udp + 2, 2) == 0)
+            break;
+    }
+    if (s == W3150_EMU_SOCKETS)
+        return 0;
+
+    memcpy(head, ip + 12, 4);
+    memcpy(head + 4, udp, 2);
+    set_be16(head + 6, udp_len - UDP_HEADER);
+
+    if (rx_put(emu, s, head, UDP_INFO_SIZE, udp + UDP_HEADER, udp_len - UDP_HEADER) != 0)
+        return -1;
+
+    emu->stats.datagrams_in++;
+    return 1;
+}
+
+static int push_frame(struct w3150_emu *emu, const uint8_t *data, uint16_t len){
+
+    uint8_t head[2];
+    int ret;
+
+    if (len > W3150_EMU_MAX_FRAME){
+        emu->stats.frames_dropped++;
+        return -1;
+    }
+
+    ret = stack_input(emu, data, len);
+
+    if (ret == 0){
+        // 2 byte big endian header holding the length including itself
+        set_be16(head, len + 2);
+        if (emu->mem[S0_SR] != STATUS_MACRAW || rx_put(emu, 0, head, 2, data, len) != 0)
+            ret = -1;
+    }
+
+    if (ret < 0){
+        emu->stats.frames_dropped++;
+        return -1;
+    }
+
+    emu->stats.frames_in++;
+    return 0;
+}
+
+int w3150_emu_push_frame(struct w3150_emu *emu, const uint8_t *data, uint16_t len){
+
+    int ret;
+
+    pthread_mutex_lock(&emu->lock);
+    ret = push_frame(emu, data, len);
+    pthread_mutex_unlock(&emu->lock);
+
+    return ret;
+}
+
+static int pull_frame(struct w3150_emu *emu, uint8_t *data, uint16_t max_len){
+
+    struct w3150_emu_wire *wire = &emu->tx_wire;
+    struct w3150_emu_frame *f;
+    uint16_t len;
+
+    if (wire->tail == wire->head)
+        return 0;
+
+    f = &wire->frames[wire->tail % W3150_EMU_WIRE_FRAMES];
+    wire->tail++;
+
+    len = (f->len > max_len) ? max_len : f->len;
+    memcpy(data, f->data, len);
+
+    return len;
+}
+
+int w3150_emu_pull_frame(struct w3150_emu *emu, uint8_t *data, uint16_t max_len){
+
+    int ret;
+
+    pthread_mutex_lock(&emu->lock);
+    ret = pull_frame(emu, data, max_len);
+    pthread_mutex_unlock(&emu->lock);
+
+    return ret;
+}
+
+uint8_t w3150_emu_peek(struct w3150_emu *emu, uint16_t addr){
+    return (addr < W3150_EMU_MEM_SIZE) ? emu->mem[addr] : 0;
+}
+
+uint16_t w3150_emu_peek16(struct w3150_emu *emu, uint16_t addr){
+    return (w3150_emu_peek(emu, addr) << 8) | w3150_emu_peek(emu, addr + 1);
+}
+
+void w3150_emu_poke(struct w3150_emu *emu, uint16_t addr, uint8_t data){
+    if (addr < W3150_EMU_MEM_SIZE)
+        emu->mem[addr] = data;
+}
+
+void w3150_emu_clear_stats(struct w3150_emu *emu){
+    memset(&emu->stats, 0, sizeof(emu->stats));
+}
+
+struct w3150_emu *w3150_emu_find(int channel){
+
+    int i;
+
+    for (i = 0; i < W3150_EMU_MAX_CHIPS; i++){
+        if (chips[i] != NULL && chips[i]->channel == channel)
+            return chips[i];
+    }
+
+    return NULL;
+}
+
+/* Transport glue */
+
+static int emu_open(struct w3150_transport *t, const char *arg){
+
+    struct w3150_emu *emu;
+    int i;
+
+    for (i = 0; i < W3150_EMU_MAX_CHIPS; i++){
+        if (chips[i] == NULL)
+            break;
+    }
+
+    if (i == W3150_EMU_MAX_CHIPS){
+        fprintf(stderr, "Too many emulated chips\n");
+        return -1;
+    }
+
+    emu = calloc(1, sizeof(*emu));
+    if (emu == NULL)
+        return -1;
+
+    emu->channel = t->channel;
+    emu->irq_fd = -1;
+    emu->rate = t->rate;
+    emu->noise = 1;
+    if (getenv(W3150_EMU_MAX_RATE_ENV) != NULL)
+        emu->max_rate = atoi(getenv(W3150_EMU_MAX_RATE_ENV));
+    pthread_mutex_init(&emu->lock, NULL);
+    w3150_emu_reset(emu);
+
+    chips[i] = emu;
+    t->priv = emu;
+    t->max_frames = 4096;
+
+    if (arg != NULL && atoi(arg) > 0)
+        t->max_frames = atoi(arg);
+
+    return 0;
+}
+
+static int emu_transfer(struct w3150_transport *t, uint8_t *frames, int len){
+    w3150_emu_transfer(t->priv, frames, len);
+    return 0;
+}
+
+static int emu_set_rate(struct w3150_transport *t, int rate){
+
+    struct w3150_emu *emu = t->priv;
+
+    pthread_mutex_lock(&emu->lock);
+    emu->rate = rate;
+    pthread_mutex_unlock(&emu->lock);
+
+    return 0;
+}
+
+static void emu_close(struct w3150_transport *t){
+
+    struct w3150_emu *emu = t->priv;
+    int i;
+
+    for (i = 0; i < W3150_EMU_MAX_CHIPS; i++){
+        if (chips[i] == emu)
+            chips[i] = NULL;
+    }
+
+    pthread_mutex_destroy(&emu->lock);
+    free(emu);
+    t->priv = NULL;
+}
+
+const struct w3150_transport_ops w3150_emu_ops = {
+    .name     = "emu",
+    .open     = emu_open,
+    .transfer = emu_transfer,
+    .set_rate = emu_set_rate,
+    .close    = emu_close,
+};
@@ -0,0 +1,217 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <w3150_filter.h>
+
+#define ETH_TYPE_VLAN   0x8100
+#define ETH_TYPE_QINQ   0x88A8
+#define BROADCAST_KEY   0xFFFFFFFFFFFFULL
+
+static uint64_t mac_key(const uint8_t *mac){
+    return ((uint64_t)mac[0] << 40) | ((uint64_t)mac[1] << 32) | ((uint64_t)mac[2] << 24) |
+           ((uint64_t)mac[3] << 16) | ((uint64_t)mac[4] << 8) | mac[5];
+}
+
+static int hash_bit(uint64_t key){
+    return (int)((key * 0x9E3779B97F4A7C15ULL) >> 58);
+}
+
+void w3150_filter_init(struct w3150_filter *f){
+    memset(f, 0, sizeof(*f));
+    f->any_dst = 1;
+}
+
+int w3150_filter_add_addr(struct w3150_filter *f, const uint8_t *mac){
+
+    if (f->n_addrs == W3150_FILTER_MAX_ADDRS)
+        return -1;
+
+    memcpy(f->addrs[f->n_addrs++], mac, 6);
+    return 0;
+}
+
+int w3150_filter_add_type(struct w3150_filter *f, uint16_t type){
+
+    if (f->n_types == W3150_FILTER_MAX_TYPES)
+        return -1;
+
+    f->types[f->n_types++] = type;
+    return 0;
+}
+
+void w3150_filter_add_vlan(struct w3150_filter *f, uint16_t vid){
+
+    vid &= 0xFFF;
+
+    if (!(f->vlans[vid / 64] & (1ULL << (vid % 64))))
+        f->n_vlans++;
+
+    f->vlans[vid / 64] |= 1ULL << (vid % 64);
+}
+
+static int parse_mac(const char *s, size_t len, uint8_t *mac){
+
+    unsigned int b[6];
+    char tmp[18];
+    int i;
+
+    if (len != 17)
+        return -1;
+
+    memcpy(tmp, s, len);
+    tmp[len] = '\0';
+
+    if (sscanf(tmp, "%2x:%2x:%2x:%2x:%2x:%2x", &b[0], &b[1], &b[2], &b[3], &b[4], &b[5]) != 6)
+        return -1;
+
+    for (i = 0; i < 6; i++)
+        mac[i] = (uint8_t)b[i];
+
+    return 0;
+}
+
+int w3150_filter_parse(struct w3150_filter *f, const char *spec){
+
+    const char *item = spec;
+    size_t len;
+    uint8_t mac[6];
+    char *end;
+    unsigned long value;
+
+    while (*item != '\0'){
+        len = strcspn(item, ",");
+
+        if (len == 9 && strncmp(item, "broadcast", len) == 0)
+            f->flags |= W3150_FILTER_BROADCAST;
+        else if (len == 9 && strncmp(item, "multicast", len) == 0)
+            f->flags |= W3150_FILTER_MULTICAST;
+        else if (len == 8 && strncmp(item, "untagged", len) == 0)
+            f->flags |= W3150_FILTER_UNTAGGED;
+        else if (strncmp(item, "type=", 5) == 0){
+            value = strtoul(item + 5, &end, 0);
+            if (end != item + len || value > 0xFFFF || w3150_filter_add_type(f, value) != 0)
+                goto bad;
+        }
+        else if (strncmp(item, "vlan=", 5) == 0){
+            value = strtoul(item + 5, &end, 0);
+            if (end != item + len || value > 0xFFF)
+                goto bad;
+            w3150_filter_add_vlan(f, value);
+        }
+        else if (parse_mac(item, len, mac) == 0){
+            if (w3150_filter_add_addr(f, mac) != 0)
+                goto bad;
+        }
+        else if (len != 0)
+            goto bad;
+
+        item += len;
+        if (*item == ',')
+            item++;
+    }
+
+    return 0;
+
+bad:
+    fprintf(stderr, "Bad filter rule: %.*s\n", (int)len, item);
+    return -1;
+}
+
+void w3150_filter_compile(struct w3150_filter *f){
+
+    uint64_t key;
+    int i;
+
+    f->n_ucast = 0;
+    f->n_mcast = 0;
+    f->mcast_hash = 0;
+
+    for (i = 0; i < f->n_addrs; i++){
+        key = mac_key(f->addrs[i]);
+
+        if (key == BROADCAST_KEY)
+            f->flags |= W3150_FILTER_BROADCAST;
+        else if (f->addrs[i][0] & 0x01){
+            f->mcast[f->n_mcast++] = key;
+            f->mcast_hash |= 1ULL << hash_bit(key);
+        }
+        else
+            f->ucast[f->n_ucast++] = key;
+    }
+
+    f->any_dst = (f->n_addrs == 0 &&
+                  !(f->flags & (W3150_FILTER_BROADCAST | W3150_FILTER_MULTICAST)));
+}
+
+static int match_dst(const struct w3150_filter *f, const uint8_t *frame){
+
+    uint64_t key;
+    int i;
+
+    if (f->any_dst)
+        return 1;
+
+    key = mac_key(frame);
+
+    if (frame[0] & 0x01){
+        if (key == BROADCAST_KEY)
+            return (f->flags & W3150_FILTER_BROADCAST) != 0;
+
+        if (f->flags & W3150_FILTER_MULTICAST)
+            return 1;
+
+        if (!(f->mcast_hash & (1ULL << hash_bit(key))))
+            return 0;
+
+        for (i = 0; i < f->n_mcast; i++){
+            if (f->mcast[i] == key)
+                return 1;
+        }
+        return 0;
+    }
+
+    for (i = 0; i < f->n_ucast; i++){
+        if (f->ucast[i] == key)
+            return 1;
+    }
+    return 0;
+}
+
+int w3150_filter_match(const struct w3150_filter *f, const uint8_t *frame, uint16_t len){
+
+    uint16_t type;
+    uint16_t vid;
+    int i;
+
+    // too short to classify
+    if (len < 14)
+        return 0;
+
+    if (!match_dst(f, frame))
+        return 0;
+
+    type = (frame[12] << 8) | frame[13];
+
+    if (type == ETH_TYPE_VLAN || type == ETH_TYPE_QINQ){
+        if (len < 18)
+            return 0;
+
+        vid = ((frame[14] << 8) | frame[15]) & 0xFFF;
+        if (f->n_vlans != 0 && !(f->vlans[vid / 64] & (1ULL << (vid % 64))))
+            return 0;
+
+        type = (frame[16] << 8) | frame[17];
+    }
+    else if (f->n_vlans != 0 && !(f->flags & W3150_FILTER_UNTAGGED))
+        return 0;
+
+    if (f->n_types == 0)
+        return 1;
+
+    for (i = 0; i < f->n_types; i++){
+        if (f->types[i] == type)
+            return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,132 @@
+#include <stdint.h>
+#include <string.h>
+#include <w3150_flow.h>
+
+#define ETH_HEADER      14
+#define ETH_TYPE_IPV4   0x0800
+#define ETH_TYPE_IPV6   0x86DD
+#define ETH_TYPE_VLAN   0x8100
+#define ETH_TYPE_QINQ   0x88A8
+
+#define IP_PROTO_TCP    6
+#define IP_PROTO_UDP    17
+#define IP_PROTO_SCTP   132
+
+#define IPV6_HEADER     40
+
+static uint16_t get16(const uint8_t *p){
+    return (p[0] << 8) | p[1];
+}
+
+static uint32_t mix(uint32_t h, uint32_t k){
+    k *= 0xCC9E2D51;
+    k = (k << 15) | (k >> 17);
+    k *= 0x1B873593;
+    h ^= k;
+    h = (h << 13) | (h >> 19);
+    return h * 5 + 0xE6546B64;
+}
+
+static uint32_t finish(uint32_t h){
+    h ^= h >> 16;
+    h *= 0x85EBCA6B;
+    h ^= h >> 13;
+    h *= 0xC2B2AE35;
+    return h ^ (h >> 16);
+}
+
+/* Hash two endpoints of size bytes in a fixed order, so swapping them
+ * gives the same result */
+static uint32_t mix_pair(uint32_t h, const uint8_t *a, const uint8_t *b, int size){
+
+    const uint8_t *t;
+    uint32_t k;
+    int i;
+
+    if (memcmp(a, b, size) > 0){
+        t = a;
+        a = b;
+        b = t;
+    }
+
+    for (i = 0; i + 4 <= size; i += 4){
+        memcpy(&k, a + i, 4);
+        h = mix(h, k);
+        memcpy(&k, b + i, 4);
+        h = mix(h, k);
+    }
+    for (; i < size; i++)
+        h = mix(h, (a[i] << 8) | b[i]);
+
+    return h;
+}
+
+static int has_ports(uint8_t proto){
+    return proto == IP_PROTO_TCP || proto == IP_PROTO_UDP || proto == IP_PROTO_SCTP;
+}
+
+/* Both ports at l4, in the order that matches the addresses */
+static uint32_t mix_ports(uint32_t h, const uint8_t *l4){
+
+    uint16_t src = get16(l4);
+    uint16_t dst = get16(l4 + 2);
+
+    if (src < dst)
+        return mix(h, ((uint32_t)src << 16) | dst);
+    else
+        return mix(h, ((uint32_t)dst << 16) | src);
+}
+
+uint32_t w3150_flow_hash(const uint8_t *frame, uint16_t len){
+
+    const uint8_t *ip;
+    uint16_t type;
+    uint16_t off = ETH_HEADER;
+    uint16_t ihl;
+    uint8_t proto;
+    uint32_t h = 0;
+    int tags;
+
+    if (len < ETH_HEADER)
+        return 0;
+
+    type = get16(frame + 12);
+    for (tags = 0; tags < 2 && (type == ETH_TYPE_VLAN || type == ETH_TYPE_QINQ); tags++){
+        if (len < off + 4)
+            break;
+        type = get16(frame + off + 2);
+        off += 4;
+    }
+
+    ip = frame + off;
+
+    if (type == ETH_TYPE_IPV4 && len >= off + 20 && (ip[0] >> 4) == 4){
+        proto = ip[9];
+        ihl = (ip[0] & 0x0F) * 4;
+        h = mix(h, proto);
+        h = mix_pair(h, ip + 12, ip + 16, 4);
+
+        // fragment offset and MF both clear: ports are in this frame
+        if (has_ports(proto) && (get16(ip + 6) & 0x3FFF) == 0 && ihl >= 20 && len >= off + ihl + 4)
+            h = mix_ports(h, ip + ihl);
+
+        return finish(h);
+    }
+
+    if (type == ETH_TYPE_IPV6 && len >= off + IPV6_HEADER){
+        proto = ip[6];
+        h = mix(h, proto);
+        h = mix_pair(h, ip + 8, ip + 24, 16);
+
+        // extension headers (fragments among them) stay on addresses
+        if (has_ports(proto) && len >= off + IPV6_HEADER + 4)
+            h = mix_ports(h, ip + IPV6_HEADER);
+
+        return finish(h);
+    }
+
+    h = mix(h, type);
+    h = mix_pair(h, frame, frame + 6, 6);
+
+    return finish(h);
+}
@@ -0,0 +1,244 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/eventfd.h>
+#include <linux/gpio.h>
+#include <w3150_irq.h>
+#include <w3150_emu.h>
+
+static const struct w3150_irq_ops *sources[] = {
+    &w3150_irq_gpio_ops,
+    &w3150_irq_eventfd_ops,
+};
+
+#define NUM_SOURCES (sizeof(sources) / sizeof(sources[0]))
+
+int w3150_irq_source_open(struct w3150_irq *irq, const char *name, int channel){
+
+    unsigned int i;
+    size_t len;
+    const char *arg;
+
+    memset(irq, 0, sizeof(*irq));
+    irq->fd = -1;
+    irq->channel = channel;
+
+    if (name == NULL || name[0] == '\0')
+        name = getenv(W3150_IRQ_ENV);
+
+    if (name == NULL || name[0] == '\0')
+        return -1;
+
+    len = strcspn(name, ":");
+    arg = strchr(name, ':');
+    if (arg != NULL)
+        arg++;
+
+    for (i = 0; i < NUM_SOURCES; i++){
+        if (strlen(sources[i]->name) == len && strncmp(sources[i]->name, name, len) == 0)
+            break;
+    }
+
+    if (i == NUM_SOURCES){
+        fprintf(stderr, "Unknown interrupt source: %s\n", name);
+        return -1;
+    }
+
+    irq->ops = sources[i];
+
+    if (irq->ops->open(irq, arg) != 0){
+        irq->ops = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+void w3150_irq_source_close(struct w3150_irq *irq){
+
+    if (irq->ops != NULL && irq->ops->close != NULL)
+        irq->ops->close(irq);
+
+    irq->ops = NULL;
+    irq->fd = -1;
+}
+
+static int wait_readable(int fd, int timeout_ms){
+
+    struct pollfd pfd;
+    int ret;
+
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+
+    do {
+        ret = poll(&pfd, 1, timeout_ms);
+    } while (ret < 0 && errno == EINTR);
+
+    if (ret < 0)
+        return -1;
+
+    return (ret > 0) ? 1 : 0;
+}
+
+/* GPIO character device
+ * The line is requested as an input with falling edge events, which is
+ * INT going active.  Edges that happened before the wait are covered by
+ * reading the line level first. */
+
+static int gpio_open(struct w3150_irq *irq, const char *arg){
+
+    struct gpioevent_request req;
+    char chip[64] = "/dev/gpiochip0";
+    const char *line = arg;
+    const char *sep;
+    int chip_fd;
+
+    if (arg == NULL){
+        fprintf(stderr, "gpio interrupt source needs a line number\n");
+        return -1;
+    }
+
+    sep = strrchr(arg, ':');
+    if (sep != NULL){
+        snprintf(chip, sizeof(chip), "%.*s", (int)(sep - arg), arg);
+        line = sep + 1;
+    }
+
+    chip_fd = open(chip, O_RDONLY);
+    if (chip_fd < 0){
+        perror(chip);
+        return -1;
+    }
+
+    memset(&req, 0, sizeof(req));
+    req.lineoffset = atoi(line);
+    req.handleflags = GPIOHANDLE_REQUEST_INPUT;
+    req.eventflags = GPIOEVENT_REQUEST_FALLING_EDGE;
+    snprintf(req.consumer_label, sizeof(req.consumer_label), "w3150");
+
+    if (ioctl(chip_fd, GPIO_GET_LINEEVENT_IOCTL, &req) < 0){
+        perror("GPIO_GET_LINEEVENT_IOCTL");
+        close(chip_fd);
+        return -1;
+    }
+
+    close(chip_fd);
+
+    irq->fd = req.fd;
+    fcntl(irq->fd, F_SETFL, fcntl(irq->fd, F_GETFL) | O_NONBLOCK);
+
+    return 0;
+}
+
+static int gpio_asserted(struct w3150_irq *irq){
+
+    struct gpiohandle_data data;
+
+    memset(&data, 0, sizeof(data));
+
+    if (ioctl(irq->fd, GPIOHANDLE_GET_LINE_VALUES_IOCTL, &data) < 0)
+        return -1;
+
+    // active low
+    return (data.values[0] == 0) ? 1 : 0;
+}
+
+static void gpio_clear(struct w3150_irq *irq){
+
+    struct gpioevent_data events[16];
+
+    while (read(irq->fd, events, sizeof(events)) > 0)
+        ;
+}
+
+static int gpio_wait(struct w3150_irq *irq, int timeout_ms){
+
+    int ret = wait_readable(irq->fd, timeout_ms);
+
+    if (ret > 0)
+        gpio_clear(irq);
+
+    return ret;
+}
+
+static void gpio_close(struct w3150_irq *irq){
+    close(irq->fd);
+}
+
+const struct w3150_irq_ops w3150_irq_gpio_ops = {
+    .name     = "gpio",
+    .open     = gpio_open,
+    .asserted = gpio_asserted,
+    .wait     = gpio_wait,
+    .clear    = gpio_clear,
+    .close    = gpio_close,
+};
+
+/* eventfd stand-in
+ * Counts INT assertions.  If an emulated chip is on the same channel it
+ * is wired up to signal this fd. */
+
+static int eventfd_open(struct w3150_irq *irq, const char *arg){
+
+    struct w3150_emu *emu;
+
+    irq->fd = eventfd(0, EFD_NONBLOCK);
+    if (irq->fd < 0){
+        perror("eventfd");
+        return -1;
+    }
+
+    emu = w3150_emu_find(irq->channel);
+    if (emu != NULL)
+        emu->irq_fd = irq->fd;
+
+    return 0;
+}
+
+static int eventfd_asserted(struct w3150_irq *irq){
+    return -1;
+}
+
+static void eventfd_clear(struct w3150_irq *irq){
+
+    uint64_t count;
+
+    if (read(irq->fd, &count, sizeof(count)) < 0)
+        return;
+}
+
+static int eventfd_wait(struct w3150_irq *irq, int timeout_ms){
+
+    int ret = wait_readable(irq->fd, timeout_ms);
+
+    if (ret > 0)
+        eventfd_clear(irq);
+
+    return ret;
+}
+
+static void eventfd_close(struct w3150_irq *irq){
+
+    struct w3150_emu *emu = w3150_emu_find(irq->channel);
+
+    if (emu != NULL && emu->irq_fd == irq->fd)
+        emu->irq_fd = -1;
+
+    close(irq->fd);
+}
+
+const struct w3150_irq_ops w3150_irq_eventfd_ops = {
+    .name     = "eventfd",
+    .open     = eventfd_open,
+    .asserted = eventfd_asserted,
+    .wait     = eventfd_wait,
+    .clear    = eventfd_clear,
+    .close    = eventfd_close,
+};
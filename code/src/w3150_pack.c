@@ -0,0 +1,329 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <w3150_pack.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define HAVE_NEON_KERNELS
+#endif
+
+/* Scalar
+ * Also finishes whatever is left over after the vector loops. */
+
+static void scalar_pack(uint8_t *frames, uint8_t opcode, uint16_t addr, const uint8_t *data, uint16_t len){
+
+    int i;
+
+    for (i = 0; i < len; i++){
+        frames[4*i]     = opcode;
+        frames[4*i + 1] = (uint8_t)((addr + i) >> 8);
+        frames[4*i + 2] = (uint8_t)((addr + i) & 0xff);
+        frames[4*i + 3] = (data != NULL) ? data[i] : 0x0;
+    }
+}
+
+static void scalar_unpack(const uint8_t *frames, uint8_t *data, uint16_t len){
+
+    int i;
+
+    for (i = 0; i < len; i++)
+        data[i] = frames[4*i + 3];
+}
+
+static int scalar_supported(){
+    return 1;
+}
+
+static const struct w3150_pack_ops scalar_ops = {
+    .name      = "scalar",
+    .supported = scalar_supported,
+    .pack      = scalar_pack,
+    .unpack    = scalar_unpack,
+};
+
+#ifdef HAVE_X86_KERNELS
+
+/* SSE2 and AVX2
+ * A frame is one little endian 32 bit lane:
+ *     opcode | addr_hi << 8 | addr_lo << 16 | data << 24
+ * so the lanes are built from a vector of incrementing addresses and the
+ * data bytes widened to 32 bits.  Unpacking shifts the data byte down
+ * and narrows the lanes back to bytes. */
+
+__attribute__((target("sse2")))
+static inline __m128i sse2_frame(__m128i addr, __m128i op, __m128i data){
+
+    __m128i hi = _mm_and_si128(addr, _mm_set1_epi32(0xff00));
+    __m128i lo = _mm_slli_epi32(_mm_and_si128(addr, _mm_set1_epi32(0xff)), 16);
+
+    return _mm_or_si128(_mm_or_si128(op, hi), _mm_or_si128(lo, _mm_slli_epi32(data, 24)));
+}
+
+__attribute__((target("sse2")))
+static void sse2_pack(uint8_t *frames, uint8_t opcode, uint16_t addr, const uint8_t *data, uint16_t len){
+
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i four = _mm_set1_epi32(4);
+    const __m128i op = _mm_set1_epi32(opcode);
+    __m128i a = _mm_add_epi32(_mm_set1_epi32(addr), _mm_set_epi32(3, 2, 1, 0));
+    __m128i bytes = zero;
+    __m128i w0, w1;
+    int i;
+
+    for (i = 0; i + 16 <= len; i += 16){
+        if (data != NULL)
+            bytes = _mm_loadu_si128((const __m128i *)(data + i));
+
+        w0 = _mm_unpacklo_epi8(bytes, zero);
+        w1 = _mm_unpackhi_epi8(bytes, zero);
+
+        _mm_storeu_si128((__m128i *)(frames + 4*i), sse2_frame(a, op, _mm_unpacklo_epi16(w0, zero)));
+        a = _mm_add_epi32(a, four);
+        _mm_storeu_si128((__m128i *)(frames + 4*i + 16), sse2_frame(a, op, _mm_unpackhi_epi16(w0, zero)));
+        a = _mm_add_epi32(a, four);
+        _mm_storeu_si128((__m128i *)(frames + 4*i + 32), sse2_frame(a, op, _mm_unpacklo_epi16(w1, zero)));
+        a = _mm_add_epi32(a, four);
+        _mm_storeu_si128((__m128i *)(frames + 4*i + 48), sse2_frame(a, op, _mm_unpackhi_epi16(w1, zero)));
+        a = _mm_add_epi32(a, four);
+    }
+
+    scalar_pack(frames + 4*i, opcode, addr + i, (data != NULL) ? data + i : NULL, len - i);
+}
+
+__attribute__((target("sse2")))
+static void sse2_unpack(const uint8_t *frames, uint8_t *data, uint16_t len){
+
+    __m128i v0, v1, v2, v3;
+    int i;
+
+    for (i = 0; i + 16 <= len; i += 16){
+        v0 = _mm_srli_epi32(_mm_loadu_si128((const __m128i *)(frames + 4*i)), 24);
+        v1 = _mm_srli_epi32(_mm_loadu_si128((const __m128i *)(frames + 4*i + 16)), 24);
+        v2 = _mm_srli_epi32(_mm_loadu_si128((const __m128i *)(frames + 4*i + 32)), 24);
+        v3 = _mm_srli_epi32(_mm_loadu_si128((const __m128i *)(frames + 4*i + 48)), 24);
+
+        // values are 0-255, so the saturating packs are exact
+        v0 = _mm_packs_epi32(v0, v1);
+        v2 = _mm_packs_epi32(v2, v3);
+        _mm_storeu_si128((__m128i *)(data + i), _mm_packus_epi16(v0, v2));
+    }
+
+    scalar_unpack(frames + 4*i, data + i, len - i);
+}
+
+static int sse2_supported(){
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse2");
+}
+
+static const struct w3150_pack_ops sse2_ops = {
+    .name      = "sse2",
+    .supported = sse2_supported,
+    .pack      = sse2_pack,
+    .unpack    = sse2_unpack,
+};
+
+__attribute__((target("avx2")))
+static inline __m256i avx2_frame(__m256i addr, __m256i op, __m256i data){
+
+    __m256i hi = _mm256_and_si256(addr, _mm256_set1_epi32(0xff00));
+    __m256i lo = _mm256_slli_epi32(_mm256_and_si256(addr, _mm256_set1_epi32(0xff)), 16);
+
+    return _mm256_or_si256(_mm256_or_si256(op, hi), _mm256_or_si256(lo, _mm256_slli_epi32(data, 24)));
+}
+
+__attribute__((target("avx2")))
+static void avx2_pack(uint8_t *frames, uint8_t opcode, uint16_t addr, const uint8_t *data, uint16_t len){
+
+    const __m256i eight = _mm256_set1_epi32(8);
+    const __m256i op = _mm256_set1_epi32(opcode);
+    __m256i a = _mm256_add_epi32(_mm256_set1_epi32(addr), _mm256_set_epi32(7, 6, 5, 4, 3, 2, 1, 0));
+    __m256i d = _mm256_setzero_si256();
+    int i, k;
+
+    for (i = 0; i + 32 <= len; i += 32){
+        for (k = 0; k < 4; k++){
+            if (data != NULL)
+                d = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(data + i + 8*k)));
+
+            _mm256_storeu_si256((__m256i *)(frames + 4*i + 32*k), avx2_frame(a, op, d));
+            a = _mm256_add_epi32(a, eight);
+        }
+    }
+
+    sse2_pack(frames + 4*i, opcode, addr + i, (data != NULL) ? data + i : NULL, len - i);
+}
+
+__attribute__((target("avx2")))
+static void avx2_unpack(const uint8_t *frames, uint8_t *data, uint16_t len){
+
+    // packs work inside 128 bit halves, this puts the dwords back in order
+    const __m256i order = _mm256_set_epi32(7, 3, 6, 2, 5, 1, 4, 0);
+    __m256i v0, v1, v2, v3;
+    int i;
+
+    for (i = 0; i + 32 <= len; i += 32){
+        v0 = _mm256_srli_epi32(_mm256_loadu_si256((const __m256i *)(frames + 4*i)), 24);
+        v1 = _mm256_srli_epi32(_mm256_loadu_si256((const __m256i *)(frames + 4*i + 32)), 24);
+        v2 = _mm256_srli_epi32(_mm256_loadu_si256((const __m256i *)(frames + 4*i + 64)), 24);
+        v3 = _mm256_srli_epi32(_mm256_loadu_si256((const __m256i *)(frames + 4*i + 96)), 24);
+
+        v0 = _mm256_packs_epi32(v0, v1);
+        v2 = _mm256_packs_epi32(v2, v3);
+        v0 = _mm256_packus_epi16(v0, v2);
+        _mm256_storeu_si256((__m256i *)(data + i), _mm256_permutevar8x32_epi32(v0, order));
+    }
+
+    sse2_unpack(frames + 4*i, data + i, len - i);
+}
+
+static int avx2_supported(){
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+}
+
+static const struct w3150_pack_ops avx2_ops = {
+    .name      = "avx2",
+    .supported = avx2_supported,
+    .pack      = avx2_pack,
+    .unpack    = avx2_unpack,
+};
+
+#endif
+
+#ifdef HAVE_NEON_KERNELS
+
+/* NEON
+ * vst4q/vld4q interleave and de-interleave four byte planes, which is
+ * exactly the frame layout: one plane each for the opcode, the address
+ * high and low bytes and the data. */
+
+static void neon_pack(uint8_t *frames, uint8_t opcode, uint16_t addr, const uint8_t *data, uint16_t len){
+
+    static const uint16_t lanes[8] = {0, 1, 2, 3, 4, 5, 6, 7};
+    uint16x8_t a0 = vaddq_u16(vdupq_n_u16(addr), vld1q_u16(lanes));
+    uint16x8_t a1 = vaddq_u16(a0, vdupq_n_u16(8));
+    const uint16x8_t sixteen = vdupq_n_u16(16);
+    uint8x16x4_t f;
+    int i;
+
+    f.val[0] = vdupq_n_u8(opcode);
+    f.val[3] = vdupq_n_u8(0);
+
+    for (i = 0; i + 16 <= len; i += 16){
+        f.val[1] = vcombine_u8(vshrn_n_u16(a0, 8), vshrn_n_u16(a1, 8));
+        f.val[2] = vcombine_u8(vmovn_u16(a0), vmovn_u16(a1));
+        if (data != NULL)
+            f.val[3] = vld1q_u8(data + i);
+
+        vst4q_u8(frames + 4*i, f);
+
+        a0 = vaddq_u16(a0, sixteen);
+        a1 = vaddq_u16(a1, sixteen);
+    }
+
+    scalar_pack(frames + 4*i, opcode, addr + i, (data != NULL) ? data + i : NULL, len - i);
+}
+
+static void neon_unpack(const uint8_t *frames, uint8_t *data, uint16_t len){
+
+    uint8x16x4_t f;
+    int i;
+
+    for (i = 0; i + 16 <= len; i += 16){
+        f = vld4q_u8(frames + 4*i);
+        vst1q_u8(data + i, f.val[3]);
+    }
+
+    scalar_unpack(frames + 4*i, data + i, len - i);
+}
+
+static int neon_supported(){
+    return 1;
+}
+
+static const struct w3150_pack_ops neon_ops = {
+    .name      = "neon",
+    .supported = neon_supported,
+    .pack      = neon_pack,
+    .unpack    = neon_unpack,
+};
+
+#endif
+
+const struct w3150_pack_ops *w3150_pack_kernels[] = {
+#ifdef HAVE_NEON_KERNELS
+    &neon_ops,
+#endif
+#ifdef HAVE_X86_KERNELS
+    &avx2_ops,
+    &sse2_ops,
+#endif
+    &scalar_ops,
+    NULL,
+};
+
+static const struct w3150_pack_ops *active = NULL;
+
+const struct w3150_pack_ops *w3150_pack_get(){
+
+    int i;
+
+    // scalar is last and always works
+    for (i = 0; active == NULL; i++){
+        if (w3150_pack_kernels[i]->supported())
+            active = w3150_pack_kernels[i];
+    }
+
+    return active;
+}
+
+int w3150_pack_select(const char *name){
+
+    int i;
+
+    for (i = 0; w3150_pack_kernels[i] != NULL; i++){
+        if (strcmp(w3150_pack_kernels[i]->name, name) == 0){
+            if (!w3150_pack_kernels[i]->supported())
+                return -1;
+            active = w3150_pack_kernels[i];
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+void w3150_pack(uint8_t *frames, uint8_t opcode, uint16_t base, uint16_t mask, uint16_t offset,
+                const uint8_t *data, uint16_t len){
+
+    const struct w3150_pack_ops *ops = w3150_pack_get();
+    uint16_t start;
+    uint32_t seg;
+
+    // split where the range wraps, the addresses run straight inside each piece
+    while (len > 0){
+        start = offset & mask;
+        seg = (uint32_t)mask + 1 - start;
+        if (seg > len)
+            seg = len;
+
+        ops->pack(frames, opcode, base + start, data, seg);
+
+        frames += 4 * seg;
+        if (data != NULL)
+            data += seg;
+        offset += seg;
+        len -= seg;
+    }
+}
+
+void w3150_unpack(const uint8_t *frames, uint8_t *data, uint16_t len){
+    w3150_pack_get()->unpack(frames, data, len);
+}
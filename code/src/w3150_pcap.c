@@ -0,0 +1,470 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <w3150_pcap.h>
+
+/* pcapng blocks are {type, total length, body, total length} with the
+ * body padded to 4 bytes, options {code, length, value padded to 4}
+ * ending in a zero option.  Everything is in host byte order, the
+ * section header's byte order magic tells readers which one. */
+
+#define BLOCK_SHB           0x0A0D0D0A
+#define BLOCK_IDB           0x00000001
+#define BLOCK_PB            0x00000002      // obsolete packet block
+#define BLOCK_SPB           0x00000003
+#define BLOCK_EPB           0x00000006
+#define BYTE_ORDER_MAGIC    0x1A2B3C4D
+
+// classic pcap, microsecond and nanosecond timestamps
+#define PCAP_MAGIC_US       0xA1B2C3D4
+#define PCAP_MAGIC_NS       0xA1B23C4D
+#define PCAP_FILE_HDR       24
+#define PCAP_REC_HDR        16
+
+#define OPT_END             0
+#define OPT_SHB_USERAPPL    4
+#define OPT_IF_NAME         2
+#define OPT_IF_TSRESOL      9
+
+#define PAD4(n)             (((n) + 3) & ~3u)
+
+// block header and trailer, EPB fields
+#define BLOCK_OVERHEAD      12
+#define EPB_FIELDS          20
+
+/* Reading */
+
+static const uint64_t powers_of_ten[] = {
+    1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL, 10000000ULL, 100000000ULL,
+    1000000000ULL, 10000000000ULL, 100000000000ULL, 1000000000000ULL, 10000000000000ULL,
+    100000000000000ULL, 1000000000000000ULL, 10000000000000000ULL, 100000000000000000ULL,
+    1000000000000000000ULL, 10000000000000000000ULL,
+};
+
+/* pcapng timestamp in units of if_tsresol to ns */
+static uint64_t to_ns(uint64_t ts, uint8_t resol){
+
+    uint8_t e = resol & 0x7F;
+    uint64_t frac;
+
+    if (resol & 0x80){
+        // 2^-e seconds
+        if (e >= 64)
+            return 0;
+        frac = ts & ((1ULL << e) - 1);
+        return (ts >> e) * 1000000000ULL + (uint64_t)((double)frac * 1e9 / (double)(1ULL << e));
+    }
+
+    if (e > 19)
+        return 0;
+    if (e <= 9)
+        return ts * powers_of_ten[9 - e];
+    return ts / powers_of_ten[e - 9];
+}
+
+static uint32_t rd32(const struct w3150_pcap_reader *r, const uint8_t *p){
+
+    uint32_t v;
+
+    memcpy(&v, p, 4);
+    return r->swap ? __builtin_bswap32(v) : v;
+}
+
+static uint16_t rd16(const struct w3150_pcap_reader *r, const uint8_t *p){
+
+    uint16_t v;
+
+    memcpy(&v, p, 2);
+    return r->swap ? __builtin_bswap16(v) : v;
+}
+
+int w3150_pcap_open(struct w3150_pcap_reader *r, const char *path){
+
+    struct stat st;
+    uint32_t magic;
+    void *map;
+    int fd;
+
+    memset(r, 0, sizeof(*r));
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+
+    if (fstat(fd, &st) != 0 || st.st_size < PCAP_FILE_HDR){
+        close(fd);
+        return -1;
+    }
+
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return -1;
+
+    // replay reads it front to back, once per loop
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+    madvise(map, st.st_size, MADV_WILLNEED);
+
+    r->map = map;
+    r->size = st.st_size;
+    memcpy(&magic, r->map, 4);
+
+    if (magic == BLOCK_SHB){
+        r->ng = 1;
+        return 0;
+    }
+
+    switch (magic){
+    case PCAP_MAGIC_US:                     break;
+    case PCAP_MAGIC_NS:     r->nsec = 1;    break;
+    case __builtin_bswap32(PCAP_MAGIC_US):  r->swap = 1; break;
+    case __builtin_bswap32(PCAP_MAGIC_NS):  r->swap = 1; r->nsec = 1; break;
+    default:
+        goto fail;
+    }
+
+    // the upper bits of the link type may carry FCS information
+    if ((rd32(r, r->map + 20) & 0x0FFFFFFF) != W3150_LINKTYPE_ETHERNET)
+        goto fail;
+
+    r->start = r->off = PCAP_FILE_HDR;
+
+    return 0;
+
+fail:
+    w3150_pcap_close(r);
+    return -1;
+}
+
+static int next_classic(struct w3150_pcap_reader *r, struct w3150_pcap_pkt *pkt){
+
+    const uint8_t *p = r->map + r->off;
+    uint32_t caplen;
+
+    if (r->off == r->size)
+        return 0;
+    if (r->size - r->off < PCAP_REC_HDR)
+        return -1;
+
+    caplen = rd32(r, p + 8);
+    if (caplen > r->size - r->off - PCAP_REC_HDR)
+        return -1;
+
+    pkt->data = p + PCAP_REC_HDR;
+    pkt->caplen = caplen;
+    pkt->wire_len = rd32(r, p + 12);
+    pkt->ts_ns = (uint64_t)rd32(r, p) * 1000000000ULL + (uint64_t)rd32(r, p + 4) * (r->nsec ? 1 : 1000);
+    r->off += PCAP_REC_HDR + caplen;
+
+    return 1;
+}
+
+/* Interface description: link type and the timestamp resolution option */
+static void read_idb(struct w3150_pcap_reader *r, const uint8_t *p, uint32_t len){
+
+    struct w3150_pcap_iface *ifc;
+    const uint8_t *opt = p + 16;
+    const uint8_t *end = p + len - 4;
+    uint16_t code;
+    uint16_t olen;
+
+    if (r->num_ifaces == W3150_PCAP_MAX_IFACES){
+        r->num_ifaces++;
+        return;
+    }
+    if (r->num_ifaces > W3150_PCAP_MAX_IFACES)
+        return;
+
+    ifc = &r->ifaces[r->num_ifaces++];
+    ifc->ethernet = (rd16(r, p + 8) == W3150_LINKTYPE_ETHERNET);
+    ifc->tsresol = 6;
+
+    while (opt + 4 <= end){
+        code = rd16(r, opt);
+        olen = rd16(r, opt + 2);
+        if (code == OPT_END || opt + 4 + olen > end)
+            break;
+        if (code == OPT_IF_TSRESOL && olen == 1)
+            ifc->tsresol = opt[4];
+        opt += 4 + PAD4(olen);
+    }
+}
+
+static int next_ng(struct w3150_pcap_reader *r, struct w3150_pcap_pkt *pkt){
+
+    const struct w3150_pcap_iface *ifc;
+    const uint8_t *p;
+    uint32_t type;
+    uint32_t len;
+    uint32_t bom;
+    uint32_t iface;
+    uint32_t caplen;
+    uint64_t ts;
+
+    while (r->off < r->size){
+        p = r->map + r->off;
+        if (r->size - r->off < BLOCK_OVERHEAD)
+            return -1;
+
+        memcpy(&type, p, 4);
+        if (type == BLOCK_SHB){
+            // every section says its own byte order
+            if (r->size - r->off < BLOCK_OVERHEAD + 4)
+                return -1;
+            memcpy(&bom, p + 8, 4);
+            if (bom == BYTE_ORDER_MAGIC)
+                r->swap = 0;
+            else if (bom == __builtin_bswap32(BYTE_ORDER_MAGIC))
+                r->swap = 1;
+            else
+                return -1;
+            r->num_ifaces = 0;
+        }
+        else
+            type = rd32(r, p);
+
+        len = rd32(r, p + 4);
+        if (len < BLOCK_OVERHEAD || (len & 3) || len > r->size - r->off)
+            return -1;
+        r->off += len;
+
+        switch (type){
+        case BLOCK_IDB:
+            if (len < 20)
+                return -1;
+            read_idb(r, p, len);
+            break;
+
+        case BLOCK_EPB:
+        case BLOCK_PB:
+            if (len < BLOCK_OVERHEAD + EPB_FIELDS)
+                return -1;
+            iface = (type == BLOCK_EPB) ? rd32(r, p + 8) : rd16(r, p + 8);
+            caplen = rd32(r, p + 20);
+            if (caplen > len - BLOCK_OVERHEAD - EPB_FIELDS)
+                return -1;
+            if (iface >= (uint32_t)r->num_ifaces || iface >= W3150_PCAP_MAX_IFACES)
+                break;
+            ifc = &r->ifaces[iface];
+            if (!ifc->ethernet)
+                break;
+            ts = ((uint64_t)rd32(r, p + 12) << 32) | rd32(r, p + 16);
+            pkt->data = p + 28;
+            pkt->caplen = caplen;
+            pkt->wire_len = rd32(r, p + 24);
+            pkt->ts_ns = to_ns(ts, ifc->tsresol);
+            return 1;
+
+        case BLOCK_SPB:
+            // interface 0, no timestamp, captured up to the block's end
+            if (len < BLOCK_OVERHEAD + 4)
+                return -1;
+            if (r->num_ifaces == 0 || !r->ifaces[0].ethernet)
+                break;
+            pkt->data = p + 12;
+            pkt->wire_len = rd32(r, p + 8);
+            pkt->caplen = len - BLOCK_OVERHEAD - 4;
+            if (pkt->caplen > pkt->wire_len)
+                pkt->caplen = pkt->wire_len;
+            pkt->ts_ns = 0;
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+int w3150_pcap_next(struct w3150_pcap_reader *r, struct w3150_pcap_pkt *pkt){
+    return r->ng ? next_ng(r, pkt) : next_classic(r, pkt);
+}
+
+void w3150_pcap_rewind(struct w3150_pcap_reader *r){
+
+    // a pcapng file is read again from its first section header
+    r->off = r->start;
+    r->num_ifaces = 0;
+}
+
+void w3150_pcap_close(struct w3150_pcap_reader *r){
+
+    if (r->map != NULL)
+        munmap((void *)r->map, r->size);
+    r->map = NULL;
+}
+
+/* Writing */
+
+/* write() all of len
+ * return 0, -1 on failure */
+static int write_all(struct w3150_pcapng_writer *w, const uint8_t *p, size_t len){
+
+    ssize_t n;
+
+    while (len > 0){
+        n = write(w->fd, p, len);
+        w->writes++;
+        if (n <= 0)
+            return -1;
+        p += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+int w3150_pcapng_flush(struct w3150_pcapng_writer *w){
+
+    int ret;
+
+    if (w->used == 0)
+        return 0;
+
+    ret = write_all(w, w->buf, w->used);
+    w->used = 0;
+
+    return ret;
+}
+
+/* Room for len more bytes in the buffer, or NULL if writing it out failed */
+static uint8_t *reserve(struct w3150_pcapng_writer *w, size_t len){
+
+    uint8_t *p;
+
+    if (len > w->size)
+        return NULL;
+
+    if (w->used + len > w->size && w3150_pcapng_flush(w) != 0)
+        return NULL;
+
+    p = w->buf + w->used;
+    w->used += len;
+    w->bytes += len;
+
+    return p;
+}
+
+static uint8_t *put32(uint8_t *p, uint32_t v){
+    memcpy(p, &v, 4);
+    return p + 4;
+}
+
+static uint8_t *put16(uint8_t *p, uint16_t v){
+    memcpy(p, &v, 2);
+    return p + 2;
+}
+
+static uint8_t *put_opt(uint8_t *p, uint16_t code, const void *value, uint16_t len){
+
+    p = put16(p, code);
+    p = put16(p, len);
+    memcpy(p, value, len);
+    memset(p + len, 0, PAD4(len) - len);
+
+    return p + PAD4(len);
+}
+
+static size_t opt_size(size_t len){
+    return 4 + PAD4(len);
+}
+
+int w3150_pcapng_open(struct w3150_pcapng_writer *w, int fd, size_t buf_size, const char *if_name,
+                      uint32_t snaplen, const char *app){
+
+    uint8_t tsresol = 9;    // 10^-9 s
+    uint64_t section_len = UINT64_MAX;
+    size_t if_len = (if_name != NULL) ? strlen(if_name) : 0;
+    size_t app_len = (app != NULL) ? strlen(app) : 0;
+    uint32_t len;
+    uint8_t *p;
+
+    if (if_len > 0xFFFF || app_len > 0xFFFF)
+        return -1;
+
+    memset(w, 0, sizeof(*w));
+    w->fd = fd;
+    w->size = buf_size ? buf_size : W3150_PCAPNG_BUF_SIZE;
+    w->buf = malloc(w->size);
+    if (w->buf == NULL)
+        return -1;
+
+    // section header, length unknown
+    len = BLOCK_OVERHEAD + 4 + 4 + 8 + (app_len ? opt_size(app_len) : 0) + 4;
+    p = reserve(w, len);
+    if (p == NULL)
+        goto fail;
+    p = put32(p, BLOCK_SHB);
+    p = put32(p, len);
+    p = put32(p, BYTE_ORDER_MAGIC);
+    p = put16(p, 1);
+    p = put16(p, 0);
+    memcpy(p, &section_len, 8);
+    p += 8;
+    if (app_len)
+        p = put_opt(p, OPT_SHB_USERAPPL, app, app_len);
+    p = put32(p, OPT_END);
+    put32(p, len);
+
+    // the one interface
+    len = BLOCK_OVERHEAD + 8 + (if_len ? opt_size(if_len) : 0) + opt_size(1) + 4;
+    p = reserve(w, len);
+    if (p == NULL)
+        goto fail;
+    p = put32(p, BLOCK_IDB);
+    p = put32(p, len);
+    p = put16(p, W3150_LINKTYPE_ETHERNET);
+    p = put16(p, 0);
+    p = put32(p, snaplen);
+    if (if_len)
+        p = put_opt(p, OPT_IF_NAME, if_name, if_len);
+    p = put_opt(p, OPT_IF_TSRESOL, &tsresol, 1);
+    p = put32(p, OPT_END);
+    put32(p, len);
+
+    return 0;
+
+fail:
+    free(w->buf);
+    w->buf = NULL;
+    return -1;
+}
+
+int w3150_pcapng_add(struct w3150_pcapng_writer *w, uint64_t ts_ns, const uint8_t *data,
+                     uint32_t caplen, uint32_t wire_len){
+
+    uint32_t len = BLOCK_OVERHEAD + EPB_FIELDS + PAD4(caplen);
+    uint8_t *p;
+
+    p = reserve(w, len);
+    if (p == NULL)
+        return -1;
+
+    p = put32(p, BLOCK_EPB);
+    p = put32(p, len);
+    p = put32(p, 0);                        // interface
+    p = put32(p, (uint32_t)(ts_ns >> 32));
+    p = put32(p, (uint32_t)ts_ns);
+    p = put32(p, caplen);
+    p = put32(p, wire_len);
+    memcpy(p, data, caplen);
+    memset(p + caplen, 0, PAD4(caplen) - caplen);
+    p += PAD4(caplen);
+    put32(p, len);
+
+    w->frames++;
+
+    return 0;
+}
+
+int w3150_pcapng_close(struct w3150_pcapng_writer *w){
+
+    int ret = w3150_pcapng_flush(w);
+
+    free(w->buf);
+    w->buf = NULL;
+
+    return ret;
+}
@@ -0,0 +1,92 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <w3150_pool.h>
+
+/* All buffers come from one allocation, the free list is LIFO so the
+ * buffer handed out next is the one most likely still in cache. */
+
+int w3150_pool_init(struct w3150_pool *pool, int count){
+
+    int i;
+
+    memset(pool, 0, sizeof(*pool));
+
+    if (count <= 0 || posix_memalign((void **)&pool->bufs, 64, (size_t)count * sizeof(struct w3150_buf)) != 0){
+        pool->bufs = NULL;
+        return -1;
+    }
+
+    pthread_mutex_init(&pool->lock, NULL);
+
+    for (i = count - 1; i >= 0; i--){
+        pool->bufs[i].pool = pool;
+        pool->bufs[i].next = pool->free;
+        pool->free = &pool->bufs[i];
+    }
+
+    pool->count = count;
+    pool->available = count;
+
+    return 0;
+}
+
+void w3150_pool_destroy(struct w3150_pool *pool){
+
+    if (pool->bufs == NULL)
+        return;
+
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->bufs);
+    pool->bufs = NULL;
+    pool->free = NULL;
+    pool->count = 0;
+    pool->available = 0;
+}
+
+struct w3150_buf *w3150_pool_get(struct w3150_pool *pool){
+
+    struct w3150_buf *buf = NULL;
+
+    w3150_pool_get_many(pool, &buf, 1);
+
+    return buf;
+}
+
+int w3150_pool_get_many(struct w3150_pool *pool, struct w3150_buf **bufs, int max){
+
+    struct w3150_buf *buf;
+    int n = 0;
+
+    pthread_mutex_lock(&pool->lock);
+
+    while (n < max && pool->free != NULL){
+        buf = pool->free;
+        pool->free = buf->next;
+        buf->next = NULL;
+        buf->off = 0;
+        buf->len = 0;
+        bufs[n++] = buf;
+    }
+
+    pool->available -= n;
+    if (n < max)
+        pool->empty++;
+
+    pthread_mutex_unlock(&pool->lock);
+
+    return n;
+}
+
+void w3150_pool_put(struct w3150_buf *buf){
+
+    struct w3150_pool *pool = buf->pool;
+
+    pthread_mutex_lock(&pool->lock);
+
+    buf->next = pool->free;
+    pool->free = buf;
+    pool->available++;
+
+    pthread_mutex_unlock(&pool->lock);
+}
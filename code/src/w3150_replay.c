@@ -0,0 +1,429 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <w3150.h>
+#include <w3150_dev.h>
+#include <w3150_emu.h>
+#include <w3150_stats.h>
+#include <w3150_wait.h>
+#include <w3150_pcap.h>
+
+/*
+ * Replay a capture onto the wire through w3150_macraw_write(), for
+ * loading the TX path with a real traffic mix.
+ *
+ * The file (pcap or pcapng, see w3150_pcap.h) is mapped and sent frame
+ * by frame straight from the mapping, at its original timing, with the
+ * gaps divided by -m, or with -f as fast as the driver takes them.
+ * Passes repeat -l times (0 for ever) at the same average rate, and -d
+ * stops after so many seconds.  Frames longer than MACRAW_MAX_FRAME or
+ * shorter than an Ethernet header are skipped, truncated ones are sent
+ * as captured.
+ *
+ * Every -i seconds a line shows the rate reached against the one asked
+ * for and how far behind the schedule sending has fallen.  At the end
+ * the TX side of the driver statistics says where the time went: submits
+ * turned away for lack of room, waits for TX memory and for the previous
+ * SEND with their latency, and SPI transfers per frame.
+ *
+ * With W3150_TRANSPORT=emu everything that leaves the chip model is
+ * pulled off its wire and compared byte for byte, in order, with what
+ * was sent, so the tool runs without hardware, in CI as well; it exits
+ * 1 on a mismatch.
+ *
+ * Run: ./w3150_replay [-m multiplier | -f] [-l loops] [-d seconds] [-i interval] file
+ */
+
+#define SPIN_NS         50000       // sleep until this close, then spin
+#define LATE_NS         100000      // sent this far behind counts as late
+#define CHECK_FRAMES    256         // written, not yet seen on the emu wire
+
+static volatile sig_atomic_t stop;
+
+static void on_signal(int sig){
+    (void)sig;
+    stop = 1;
+}
+
+/* A pass over the file, checked before sending anything */
+struct replay_file {
+    uint64_t frames;            // to send
+    uint64_t bytes;
+    uint64_t skipped;           // too long or too short
+    uint64_t truncated;         // captured shorter than on the wire
+    uint64_t first_ts;
+    uint64_t span_ns;           // one pass at the original timing
+};
+
+static struct w3150_emu *emu;   // NULL on real hardware
+static uint64_t wire_frames;
+static uint64_t wire_bytes;
+static uint64_t wire_bad;       // differ from what was written, or missing
+
+/* Frames written and not yet off the emu wire, in the order sent.  They
+ * point into the mapping, which stays for the whole run. */
+static struct {
+    const uint8_t *data;
+    uint16_t len;
+} check[CHECK_FRAMES];
+static unsigned int check_head;
+static unsigned int check_tail;
+
+static void check_add(const uint8_t *data, uint16_t len){
+
+    // the wire should never be this far behind, count the oldest as lost
+    if (check_tail - check_head == CHECK_FRAMES){
+        check_head++;
+        wire_bad++;
+    }
+
+    check[check_tail % CHECK_FRAMES].data = data;
+    check[check_tail % CHECK_FRAMES].len = len;
+    check_tail++;
+}
+
+static int usable(const struct w3150_pcap_pkt *pkt){
+    return pkt->caplen >= 14 && pkt->caplen <= MACRAW_MAX_FRAME;
+}
+
+static int scan(struct w3150_pcap_reader *r, struct replay_file *f){
+
+    struct w3150_pcap_pkt pkt;
+    uint64_t last_ts = 0;
+    int have_ts = 0;
+    int ret;
+
+    memset(f, 0, sizeof(*f));
+
+    while ((ret = w3150_pcap_next(r, &pkt)) == 1){
+        if (!usable(&pkt)){
+            f->skipped++;
+            continue;
+        }
+        if (pkt.caplen < pkt.wire_len)
+            f->truncated++;
+        if (!have_ts){
+            f->first_ts = pkt.ts_ns;
+            have_ts = 1;
+        }
+        if (pkt.ts_ns > last_ts)
+            last_ts = pkt.ts_ns;
+        f->frames++;
+        f->bytes += pkt.caplen;
+    }
+
+    // the next pass starts one average gap after the last frame
+    if (f->frames > 1 && last_ts > f->first_ts)
+        f->span_ns = (last_ts - f->first_ts) + (last_ts - f->first_ts) / (f->frames - 1);
+
+    return ret;
+}
+
+/* Sleep most of the way, spin the rest */
+static void wait_until(uint64_t due){
+
+    struct timespec ts;
+    uint64_t now = w3150_now_ns();
+
+    if (due > now + SPIN_NS){
+        ts.tv_sec = (due - SPIN_NS) / 1000000000;
+        ts.tv_nsec = (due - SPIN_NS) % 1000000000;
+        // a signal cuts it short, the caller looks at stop
+        if (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+            return;
+    }
+
+    while (!stop && w3150_now_ns() < due)
+        ;
+}
+
+/* Take what the chip model sent off its wire, which only holds a few,
+ * and compare it with the next frame written */
+static void drain_wire(){
+
+    static uint8_t frame[W3150_EMU_MAX_FRAME];
+    int len;
+
+    while ((len = w3150_emu_pull_frame(emu, frame, sizeof(frame))) > 0){
+        wire_frames++;
+        wire_bytes += len;
+
+        if (check_head == check_tail)
+            wire_bad++;
+        else {
+            if (len != check[check_head % CHECK_FRAMES].len ||
+                memcmp(frame, check[check_head % CHECK_FRAMES].data, len) != 0)
+                wire_bad++;
+            check_head++;
+        }
+    }
+}
+
+/* d = a - b, field by field */
+static void stats_sub(struct w3150_stats *d, const struct w3150_stats *a, const struct w3150_stats *b){
+
+    const uint64_t *x = (const uint64_t *)a;
+    const uint64_t *y = (const uint64_t *)b;
+    uint64_t *z = (uint64_t *)d;
+    size_t i;
+
+    for (i = 0; i < sizeof(*d) / sizeof(uint64_t); i++)
+        z[i] = x[i] - y[i];
+}
+
+static void print_wait(const char *name, uint64_t count, const struct w3150_hist *h, double seconds){
+
+    uint64_t n = w3150_hist_samples(h);
+
+    fprintf(stderr, "  %-12s %10llu %10.1f/s  mean %8.1f us  p50 %8.1f us  p99 %8.1f us  max %8.1f us  total %7.1f ms\n",
+            name, (unsigned long long)count, seconds > 0 ? count / seconds : 0.0,
+            n ? h->sum / 1e3 / n : 0.0, w3150_hist_percentile(h, 0.5) / 1e3,
+            w3150_hist_percentile(h, 0.99) / 1e3, w3150_hist_percentile(h, 1.0) / 1e3, h->sum / 1e6);
+}
+
+int main(int argc, char **argv){
+
+    struct w3150_pcap_reader reader;
+    struct w3150_pcap_pkt pkt;
+    struct replay_file file;
+    struct w3150_dev *dev;
+    struct w3150_stats base;
+    struct w3150_stats now_stats;
+    struct w3150_stats d;
+    struct sigaction sa;
+    double multiplier = 1.0;
+    double seconds;
+    double interval = 1.0;
+    double duration = 0;
+    double want_fps = 0;
+    double want_mbit = 0;
+    long loops = 1;
+    long loop;
+    long passes = 0;
+    int flat_out = 0;
+    int opt;
+    int ret = 0;
+    uint64_t start;
+    uint64_t now;
+    uint64_t due;
+    uint64_t end = 0;
+    uint64_t offset;
+    uint64_t lag;
+    uint64_t max_lag = 0;
+    uint64_t late = 0;
+    uint64_t sent = 0;
+    uint64_t sent_bytes = 0;
+    uint64_t failed = 0;
+    uint64_t next_report;
+    uint64_t last_report;
+    uint64_t last_sent = 0;
+    uint64_t last_bytes = 0;
+
+    uint8_t mac_address[6] = {0xde,0xad,0xbe,0xef,0xba,0x5e};
+    uint8_t local_host[4]  = {192,168,10,123};
+    uint8_t gateway[4]     = {192,168,50,1};
+    uint8_t subnet[4]      = {255,255,255,0};
+
+    while ((opt = getopt(argc, argv, "m:fl:d:i:h")) != -1){
+        switch (opt){
+        case 'm': multiplier = atof(optarg); break;
+        case 'f': flat_out = 1; break;
+        case 'l': loops = atol(optarg); break;
+        case 'd': duration = atof(optarg); break;
+        case 'i': interval = atof(optarg); break;
+        default:
+            goto usage;
+        }
+    }
+
+    if (optind != argc - 1 || multiplier <= 0 || loops < 0)
+        goto usage;
+
+    if (w3150_pcap_open(&reader, argv[optind]) != 0){
+        fprintf(stderr, "%s: not a readable pcap or pcapng file of Ethernet\n", argv[optind]);
+        return 1;
+    }
+
+    if (scan(&reader, &file) < 0)
+        fprintf(stderr, "%s: damaged after %llu frames, replaying those\n", argv[optind],
+                (unsigned long long)(file.frames + file.skipped));
+    if (file.frames == 0){
+        fprintf(stderr, "%s: no frames to send\n", argv[optind]);
+        return 1;
+    }
+
+    // all frames at one instant (or no timestamps at all) has no timing to keep
+    if (!flat_out && file.span_ns == 0){
+        fprintf(stderr, "No timing in the file, sending as fast as possible\n");
+        flat_out = 1;
+    }
+
+    if (!flat_out){
+        want_fps = file.frames / (file.span_ns / 1e9 / multiplier);
+        want_mbit = file.bytes * 8 / (file.span_ns / 1e3 / multiplier);
+    }
+
+    if (w3150_init_networking(mac_address, local_host, gateway, subnet) != 1){
+        fprintf(stderr, "networking init failed\n");
+        return 1;
+    }
+
+    if (w3150_init_macraw() != 1){
+        fprintf(stderr, "macraw init failed\n");
+        return 1;
+    }
+
+    dev = w3150_default_dev();
+    emu = w3150_emu_find(dev->channel);
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    w3150_rt_setup_env();
+
+    fprintf(stderr, "%s: %llu frames, %llu bytes a pass, %llu skipped, %llu truncated\n", argv[optind],
+            (unsigned long long)file.frames, (unsigned long long)file.bytes,
+            (unsigned long long)file.skipped, (unsigned long long)file.truncated);
+    if (flat_out)
+        fprintf(stderr, "Sending as fast as possible\n");
+    else
+        fprintf(stderr, "Sending at %gx the original timing: %.0f frames/s, %.2f Mbit/s\n",
+                multiplier, want_fps, want_mbit);
+
+    if (emu != NULL)
+        drain_wire();
+    wire_frames = wire_bytes = wire_bad = 0;
+
+    w3150_stats_snapshot(&base, dev->stats);
+    start = w3150_now_ns();
+    last_report = start;
+    next_report = start + (uint64_t)(interval * 1e9);
+    if (duration > 0)
+        end = start + (uint64_t)(duration * 1e9);
+
+    for (loop = 0; !stop && (loops == 0 || loop < loops); loop++){
+
+        w3150_pcap_rewind(&reader);
+        offset = 0;
+        passes++;
+
+        while (!stop && w3150_pcap_next(&reader, &pkt) == 1){
+
+            if (!usable(&pkt))
+                continue;
+
+            if (!flat_out){
+                // frames out of order in the file go straight away
+                if (pkt.ts_ns > file.first_ts && pkt.ts_ns - file.first_ts > offset)
+                    offset = pkt.ts_ns - file.first_ts;
+
+                due = start + (uint64_t)((loop * file.span_ns + offset) / multiplier);
+                if (end && due >= end)
+                    break;
+                wait_until(due);
+                if (stop)
+                    break;
+
+                lag = w3150_now_ns() - due;
+                if (lag > max_lag)
+                    max_lag = lag;
+                if (lag > LATE_NS)
+                    late++;
+            }
+
+            // the driver only reads the frame, the mapping is read only
+            if (w3150_macraw_write((uint8_t *)pkt.data, pkt.caplen) != 1){
+                failed++;
+                continue;
+            }
+            sent++;
+            sent_bytes += pkt.caplen;
+
+            if (emu != NULL){
+                check_add(pkt.data, pkt.caplen);
+                drain_wire();
+            }
+
+            now = w3150_now_ns();
+            if (interval > 0 && now >= next_report){
+                seconds = (now - last_report) / 1e9;
+                fprintf(stderr, "%8.1fs  pass %ld  %10.0f frames/s  %8.2f Mbit/s", (now - start) / 1e9, passes,
+                        (sent - last_sent) / seconds, (sent_bytes - last_bytes) * 8 / seconds / 1e6);
+                if (flat_out)
+                    fprintf(stderr, "\n");
+                else
+                    fprintf(stderr, "  late %llu  max lag %.3f ms\n", (unsigned long long)late, max_lag / 1e6);
+                last_report = now;
+                last_sent = sent;
+                last_bytes = sent_bytes;
+                next_report = now + (uint64_t)(interval * 1e9);
+            }
+
+            if (end && now >= end)
+                stop = 1;
+        }
+
+        // a duration ends the run, not the pass
+        if (end && w3150_now_ns() >= end)
+            break;
+    }
+
+    w3150_macraw_tx_flush();
+    seconds = (w3150_now_ns() - start) / 1e9;
+    if (emu != NULL){
+        drain_wire();
+        // never came out
+        wire_bad += check_tail - check_head;
+    }
+
+    w3150_stats_snapshot(&now_stats, dev->stats);
+    stats_sub(&d, &now_stats, &base);
+
+    fprintf(stderr, "\n%llu frames, %llu bytes in %.3f s, %ld pass%s, %llu failed\n",
+            (unsigned long long)sent, (unsigned long long)sent_bytes, seconds,
+            passes, passes == 1 ? "" : "es", (unsigned long long)failed);
+    fprintf(stderr, "achieved  %10.0f frames/s  %8.2f Mbit/s\n", sent / seconds, sent_bytes * 8 / seconds / 1e6);
+    if (!flat_out){
+        fprintf(stderr, "requested %10.0f frames/s  %8.2f Mbit/s  (%.1f%%)\n", want_fps, want_mbit,
+                100.0 * sent / seconds / want_fps);
+        fprintf(stderr, "late %llu frames (> %d us behind), max lag %.3f ms\n",
+                (unsigned long long)late, LATE_NS / 1000, max_lag / 1e6);
+    }
+
+    fprintf(stderr, "TX waits:\n");
+    print_wait("tx space", d.tx.space_waits, &d.tx.space_wait_ns, seconds);
+    print_wait("send", d.tx.send_waits, &d.tx.send_wait_ns, seconds);
+    print_wait("staging", w3150_hist_samples(&d.tx.stage_ns), &d.tx.stage_ns, seconds);
+    fprintf(stderr, "  full %llu  send spins %llu  wraps %llu\n",
+            (unsigned long long)d.tx.full, (unsigned long long)d.tx.send_spins, (unsigned long long)d.tx.wraps);
+    fprintf(stderr, "SPI: %.2f transfers, %.0f bytes per frame, %llu contended, %.1f ms waiting for the bus\n",
+            sent ? (double)d.bus.transfers / sent : 0.0,
+            sent ? (double)d.bus.frames * W3150_FRAME_SIZE / sent : 0.0,
+            (unsigned long long)d.bus.contended, d.bus.wait_ns / 1e6);
+
+    if (emu != NULL){
+        fprintf(stderr, "emu wire: %llu frames, %llu bytes, %llu bad\n",
+                (unsigned long long)wire_frames, (unsigned long long)wire_bytes, (unsigned long long)wire_bad);
+        if (wire_frames != sent || wire_bytes != sent_bytes || wire_bad != 0){
+            fprintf(stderr, "MISMATCH: sent %llu frames, %llu bytes\n",
+                    (unsigned long long)sent, (unsigned long long)sent_bytes);
+            ret = 1;
+        }
+    }
+
+    w3150_pcap_close(&reader);
+
+    return ret;
+
+usage:
+    fprintf(stderr, "Usage: %s [-m multiplier | -f] [-l loops] [-d seconds] [-i interval] file\n", argv[0]);
+    return 2;
+}
@@ -0,0 +1,264 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/spi/spidev.h>
+#include <w3150_transport.h>
+#include <w3150_emu.h>
+
+/* spidev backend
+ *
+ * Each 4 byte W3150 frame becomes one spi_ioc_transfer with cs_change
+ * set, so chip select is released between frames, and a whole chunk of
+ * frames goes to the kernel in a single SPI_IOC_MESSAGE ioctl.
+ *
+ * A message is limited by the spidev bufsiz module parameter (total
+ * bytes per message) and by the 14 bit ioctl size field, which holds at
+ * most 511 spi_ioc_transfer structures.
+ *
+ * The loopback backend builds the same messages and has them checked
+ * the way spidev checks an ioctl, but runs the transfers against the
+ * emu chip model (w3150_emu.h) instead of the kernel, so the message
+ * building and chunking can be tested without a board.
+ */
+
+#define SPIDEV_BUFSIZ_PARAM  "/sys/module/spidev/parameters/bufsiz"
+#define SPIDEV_BUFSIZ_DEF    4096
+#define SPIDEV_MAX_XFERS     ((1 << _IOC_SIZEBITS) / sizeof(struct spi_ioc_transfer) - 1)
+
+// one more and the size field wraps to 0, which the kernel takes as an
+// empty message and returns success without clocking anything
+_Static_assert(SPI_MSGSIZE(SPIDEV_MAX_XFERS) != 0, "SPI_IOC_MESSAGE cannot hold SPIDEV_MAX_XFERS transfers");
+
+struct spidev_priv {
+    struct spi_ioc_transfer xfer[SPIDEV_MAX_XFERS];
+    int bufsiz;
+    struct w3150_emu *emu;      // loopback only
+};
+
+static int spidev_bufsiz(){
+
+    FILE *f;
+    int bufsiz = 0;
+
+    f = fopen(SPIDEV_BUFSIZ_PARAM, "r");
+    if (f != NULL){
+        if (fscanf(f, "%d", &bufsiz) != 1)
+            bufsiz = 0;
+        fclose(f);
+    }
+
+    if (bufsiz < W3150_FRAME_SIZE)
+        bufsiz = SPIDEV_BUFSIZ_DEF;
+
+    return bufsiz;
+}
+
+/* Frames per message for a bufsiz */
+static int spidev_max_frames(int bufsiz){
+
+    int frames = bufsiz / W3150_FRAME_SIZE;
+
+    if (frames > (int)SPIDEV_MAX_XFERS)
+        frames = SPIDEV_MAX_XFERS;
+
+    return frames;
+}
+
+/* Fill the transfers for n frames
+ * return the SPI_IOC_MESSAGE request that sends them */
+static unsigned long spidev_message(struct spidev_priv *priv, int rate, uint8_t *frames, int n){
+
+    int i;
+
+    for (i = 0; i < n; i++){
+        struct spi_ioc_transfer *x = &priv->xfer[i];
+
+        memset(x, 0, sizeof(*x));
+        x->tx_buf = (unsigned long)(frames + i * W3150_FRAME_SIZE);
+        x->rx_buf = (unsigned long)(frames + i * W3150_FRAME_SIZE);
+        x->len = W3150_FRAME_SIZE;
+        x->speed_hz = rate;
+        x->bits_per_word = 8;
+        // toggle chip select between frames, but not after the last one
+        x->cs_change = (i != n - 1);
+    }
+
+    return SPI_IOC_MESSAGE(n);
+}
+
+static int spidev_open(struct w3150_transport *t, const char *arg){
+
+    char path[64];
+    uint8_t mode = SPI_MODE_0;
+    uint8_t bits = 8;
+    uint32_t speed = t->rate;
+    struct spidev_priv *priv;
+    int frames;
+
+    if (arg != NULL)
+        snprintf(path, sizeof(path), "%s", arg);
+    else
+        snprintf(path, sizeof(path), "/dev/spidev0.%d", t->channel);
+
+    t->fd = open(path, O_RDWR);
+    if (t->fd < 0){
+        perror(path);
+        return -1;
+    }
+
+    if (ioctl(t->fd, SPI_IOC_WR_MODE, &mode) < 0 ||
+        ioctl(t->fd, SPI_IOC_WR_BITS_PER_WORD, &bits) < 0 ||
+        ioctl(t->fd, SPI_IOC_WR_MAX_SPEED_HZ, &speed) < 0){
+        perror("spidev setup");
+        close(t->fd);
+        t->fd = -1;
+        return -1;
+    }
+
+    priv = calloc(1, sizeof(*priv));
+    if (priv == NULL){
+        close(t->fd);
+        t->fd = -1;
+        return -1;
+    }
+
+    priv->bufsiz = spidev_bufsiz();
+    frames = spidev_max_frames(priv->bufsiz);
+
+    t->max_frames = frames;
+    t->priv = priv;
+
+    return 0;
+}
+
+static int spidev_transfer(struct w3150_transport *t, uint8_t *frames, int len){
+
+    struct spidev_priv *priv = t->priv;
+    unsigned long request = spidev_message(priv, t->rate, frames, len / W3150_FRAME_SIZE);
+
+    if (ioctl(t->fd, request, priv->xfer) < 0){
+        perror("SPI_IOC_MESSAGE");
+        return -1;
+    }
+
+    return 0;
+}
+
+static int spidev_set_rate(struct w3150_transport *t, int rate){
+
+    uint32_t speed = rate;
+
+    if (ioctl(t->fd, SPI_IOC_WR_MAX_SPEED_HZ, &speed) < 0)
+        return -1;
+
+    return 0;
+}
+
+static void spidev_close(struct w3150_transport *t){
+
+    if (t->fd >= 0)
+        close(t->fd);
+
+    free(t->priv);
+    t->priv = NULL;
+    t->fd = -1;
+}
+
+const struct w3150_transport_ops w3150_spidev_ops = {
+    .name     = "spidev",
+    .open     = spidev_open,
+    .transfer = spidev_transfer,
+    .set_rate = spidev_set_rate,
+    .close    = spidev_close,
+};
+
+/* Loopback backend, "loopback[:bufsiz]" */
+
+static int loopback_open(struct w3150_transport *t, const char *arg){
+
+    struct spidev_priv *priv;
+
+    priv = calloc(1, sizeof(*priv));
+    if (priv == NULL)
+        return -1;
+
+    if (w3150_emu_ops.open(t, NULL) != 0){
+        free(priv);
+        return -1;
+    }
+
+    priv->emu = t->priv;
+    priv->bufsiz = SPIDEV_BUFSIZ_DEF;
+    if (arg != NULL && atoi(arg) >= W3150_FRAME_SIZE)
+        priv->bufsiz = atoi(arg);
+
+    t->max_frames = spidev_max_frames(priv->bufsiz);
+    t->priv = priv;
+
+    return 0;
+}
+
+/* What spidev_ioctl() does with the request: the number of transfers
+ * comes back out of the ioctl size field and a message of none succeeds
+ * at once, a message over bufsiz either way fails. */
+static int loopback_transfer(struct w3150_transport *t, uint8_t *frames, int len){
+
+    struct spidev_priv *priv = t->priv;
+    unsigned long request = spidev_message(priv, t->rate, frames, len / W3150_FRAME_SIZE);
+    unsigned int size = _IOC_SIZE(request);
+    unsigned int n;
+    unsigned int i;
+    int total = 0;
+
+    if (size % sizeof(struct spi_ioc_transfer) != 0)
+        return -1;
+
+    n = size / sizeof(struct spi_ioc_transfer);
+
+    for (i = 0; i < n; i++)
+        total += priv->xfer[i].len;
+    if (total > priv->bufsiz)
+        return -1;
+
+    // MOSI and MISO share the buffer, as they do for spidev_transfer()
+    for (i = 0; i < n; i++)
+        w3150_emu_transfer(priv->emu, (uint8_t *)(unsigned long)priv->xfer[i].rx_buf, priv->xfer[i].len);
+
+    return 0;
+}
+
+/* The emu glue works on t->priv, called under the bus lock */
+static int loopback_set_rate(struct w3150_transport *t, int rate){
+
+    struct spidev_priv *priv = t->priv;
+    int ret;
+
+    t->priv = priv->emu;
+    ret = w3150_emu_ops.set_rate(t, rate);
+    t->priv = priv;
+
+    return ret;
+}
+
+static void loopback_close(struct w3150_transport *t){
+
+    struct spidev_priv *priv = t->priv;
+
+    t->priv = priv->emu;
+    w3150_emu_ops.close(t);
+
+    free(priv);
+    t->priv = NULL;
+}
+
+const struct w3150_transport_ops w3150_loopback_ops = {
+    .name     = "loopback",
+    .open     = loopback_open,
+    .transfer = loopback_transfer,
+    .set_rate = loopback_set_rate,
+    .close    = loopback_close,
+};
@@ -0,0 +1,202 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <w3150_stats.h>
+#include <w3150_wait.h>
+
+/*
+ * Live view of the counters a running bridge exports (see w3150_stats.h).
+ *
+ * Every interval each device gets a line of what happened in it: frames
+ * and Mbit/s each way, SPI transfers per second and how much of the time
+ * the bus was busy or being waited for, submits turned away for lack of
+ * TX room, writes that waited for room or for SEND, status reads that
+ * found the SEND still going, bursts that wrapped, the p99 RX fill
+ * level, the p99 of a chip read, a TX staging copy and the TX waits, and
+ * tap errors.  With -a the totals since export and every histogram are
+ * printed once instead.
+ *
+ * The segment is only ever mapped read only, watching costs the bridge
+ * nothing.
+ *
+ * Run: ./w3150_stat [-i seconds] [-c count] [-a] [segment]
+ */
+
+#define HEADER_EVERY    20
+
+static void sleep_ns(uint64_t ns){
+
+    struct timespec ts;
+
+    ts.tv_sec = ns / 1000000000;
+    ts.tv_nsec = ns % 1000000000;
+    nanosleep(&ts, NULL);
+}
+
+/* d = a - b, field by field */
+static void stats_sub(struct w3150_stats *d, const struct w3150_stats *a, const struct w3150_stats *b){
+
+    const uint64_t *x = (const uint64_t *)a;
+    const uint64_t *y = (const uint64_t *)b;
+    uint64_t *z = (uint64_t *)d;
+    size_t i;
+
+    for (i = 0; i < sizeof(*d) / sizeof(uint64_t); i++)
+        z[i] = x[i] - y[i];
+}
+
+static double us(uint64_t ns){
+    return ns / 1000.0;
+}
+
+static void print_header(){
+
+    printf("dev ch   rx f/s rx Mbit   tx f/s tx Mbit  xfer/s  bus%% wait%%  full/s spcw/s sndw/s spin/s wrap/s"
+           " fill99 read99 stage99 spcw99 sndw99 taperr\n");
+}
+
+static void print_rates(int dev, const struct w3150_stats_dev *d, const struct w3150_stats *s, double seconds){
+
+    double ns = seconds * 1e9;
+
+    printf("%3d %2d %8.0f %7.2f %8.0f %7.2f %7.0f %5.1f %5.1f %7.0f %6.0f %6.0f %6.0f %6.0f"
+           " %6llu %6.1f %7.1f %6.1f %6.1f %6llu\n",
+           dev, d->channel,
+           s->rx.frames / seconds, s->rx.bytes * 8 / seconds / 1e6,
+           s->tx.frames / seconds, s->tx.bytes * 8 / seconds / 1e6,
+           s->bus.transfers / seconds,
+           100.0 * s->bus.busy_ns / ns, 100.0 * s->bus.wait_ns / ns,
+           s->tx.full / seconds, s->tx.space_waits / seconds, s->tx.send_waits / seconds,
+           s->tx.send_spins / seconds, (s->rx.wraps + s->tx.wraps) / seconds,
+           (unsigned long long)w3150_hist_percentile(&s->rx.fill, 0.99),
+           us(w3150_hist_percentile(&s->rx.read_ns, 0.99)),
+           us(w3150_hist_percentile(&s->tx.stage_ns, 0.99)),
+           us(w3150_hist_percentile(&s->tx.space_wait_ns, 0.99)),
+           us(w3150_hist_percentile(&s->tx.send_wait_ns, 0.99)),
+           (unsigned long long)(s->rx.host_errors + s->tx.host_errors));
+}
+
+static void print_hist(const char *name, const struct w3150_hist *h, double scale){
+
+    uint64_t n = w3150_hist_samples(h);
+
+    printf("  %-18s %12llu %10.1f %10.1f %10.1f %10.1f %10.1f\n", name, (unsigned long long)n,
+           n ? h->sum / scale / n : 0.0,
+           w3150_hist_percentile(h, 0.5) / scale, w3150_hist_percentile(h, 0.99) / scale,
+           w3150_hist_percentile(h, 0.999) / scale, w3150_hist_percentile(h, 1.0) / scale);
+}
+
+#define U(x) ((unsigned long long)(x))
+
+static void print_totals(int dev, const struct w3150_stats_dev *d, const struct w3150_stats *s, double seconds){
+
+    printf("device %d, channel %d, %s, %.1fs\n", dev, d->channel, d->transport, seconds);
+    printf("  bus  transfers %llu  frames %llu  errors %llu  contended %llu  busy %.1f%%  waiting %.1f%%\n",
+           U(s->bus.transfers), U(s->bus.frames), U(s->bus.errors), U(s->bus.contended),
+           100.0 * s->bus.busy_ns / (seconds * 1e9), 100.0 * s->bus.wait_ns / (seconds * 1e9));
+    printf("  rx   frames %llu  bytes %llu  reads %llu  empty %llu  interleaved %llu  wraps %llu\n",
+           U(s->rx.frames), U(s->rx.bytes), U(s->rx.reads), U(s->rx.empty), U(s->rx.interleaved),
+           U(s->rx.wraps));
+    printf("       host frames %llu  errors %llu  calls %llu\n",
+           U(s->rx.host_frames), U(s->rx.host_errors), U(s->rx.host_calls));
+    printf("  tx   frames %llu  bytes %llu  full %llu  wraps %llu  send spins %llu  space waits %llu  send waits %llu\n",
+           U(s->tx.frames), U(s->tx.bytes), U(s->tx.full), U(s->tx.wraps), U(s->tx.send_spins),
+           U(s->tx.space_waits), U(s->tx.send_waits));
+    printf("       host frames %llu  errors %llu  calls %llu\n",
+           U(s->tx.host_frames), U(s->tx.host_errors), U(s->tx.host_calls));
+    printf("  %-18s %12s %10s %10s %10s %10s %10s\n", "histogram", "samples", "mean", "p50", "p99", "p999", "max");
+    print_hist("bus transfer us", &s->bus.transfer_ns, 1000.0);
+    print_hist("rx read us", &s->rx.read_ns, 1000.0);
+    print_hist("rx fill bytes", &s->rx.fill, 1.0);
+    print_hist("tx stage us", &s->tx.stage_ns, 1000.0);
+    print_hist("tx space wait us", &s->tx.space_wait_ns, 1000.0);
+    print_hist("tx send wait us", &s->tx.send_wait_ns, 1000.0);
+}
+
+int main(int argc, char **argv){
+
+    const struct w3150_stats_shm *shm;
+    struct w3150_stats prev[W3150_STATS_DEVS];
+    struct w3150_stats cur;
+    struct w3150_stats delta;
+    const char *name = NULL;
+    double interval = 1.0;
+    long count = -1;
+    int totals = 0;
+    int lines = 0;
+    uint64_t last;
+    uint64_t now;
+    unsigned int i;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "i:c:ah")) != -1){
+        switch (opt){
+        case 'i': interval = atof(optarg); break;
+        case 'c': count = atol(optarg); break;
+        case 'a': totals = 1; break;
+        default:
+            fprintf(stderr, "Usage: %s [-i seconds] [-c count] [-a] [segment]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    if (optind < argc)
+        name = argv[optind];
+
+    if (interval <= 0)
+        return 2;
+
+    shm = w3150_stats_open(name);
+    if (shm == NULL){
+        fprintf(stderr, "No stats at %s, is the bridge running?\n",
+                name ? name : (getenv(W3150_STATS_ENV) ? getenv(W3150_STATS_ENV) : W3150_STATS_DEFAULT));
+        return 1;
+    }
+
+    if (kill(shm->pid, 0) != 0 && errno == ESRCH)
+        fprintf(stderr, "Process %d that exported these is gone\n", shm->pid);
+
+    if (totals){
+        for (i = 0; i < shm->num_devs; i++){
+            w3150_stats_snapshot(&cur, &shm->devs[i].stats);
+            print_totals(i, &shm->devs[i], &cur, (w3150_now_ns() - shm->start_ns) / 1e9);
+        }
+        w3150_stats_close(shm);
+        return 0;
+    }
+
+    for (i = 0; i < shm->num_devs; i++)
+        w3150_stats_snapshot(&prev[i], &shm->devs[i].stats);
+    last = w3150_now_ns();
+
+    while (count != 0){
+        sleep_ns(interval * 1e9);
+        now = w3150_now_ns();
+
+        if (lines % HEADER_EVERY == 0)
+            print_header();
+        lines++;
+
+        for (i = 0; i < shm->num_devs; i++){
+            w3150_stats_snapshot(&cur, &shm->devs[i].stats);
+            stats_sub(&delta, &cur, &prev[i]);
+            print_rates(i, &shm->devs[i], &delta, (now - last) / 1e9);
+            prev[i] = cur;
+        }
+        fflush(stdout);
+
+        last = now;
+        if (count > 0)
+            count--;
+    }
+
+    w3150_stats_close(shm);
+
+    return 0;
+}
@@ -0,0 +1,218 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <w3150_stats.h>
+#include <w3150_dev.h>
+#include <w3150_wait.h>
+
+/* The segment is created mode 0444: the exporting process keeps the
+ * read-write mapping it made while creating it, anyone opening it later
+ * (the owner included) can only map it read only.  The devices' stats
+ * pointers are moved onto it, so after export the counters are bumped
+ * in place and nothing is ever copied out. */
+
+static char exported[64];
+
+static const char *stats_name(const char *name){
+
+    if (name == NULL || name[0] == '\0')
+        name = getenv(W3150_STATS_ENV);
+
+    if (name == NULL || name[0] == '\0')
+        name = W3150_STATS_DEFAULT;
+
+    return name;
+}
+
+/* The process that exported an existing segment
+ * return its pid, 0 if there is no segment or it does not say */
+static pid_t stats_owner(const char *name){
+
+    const struct w3150_stats_shm *shm;
+    struct stat st;
+    pid_t pid;
+    int fd;
+
+    fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0)
+        return 0;
+
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(*shm)){
+        close(fd);
+        return 0;
+    }
+
+    shm = mmap(NULL, sizeof(*shm), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (shm == MAP_FAILED)
+        return 0;
+
+    // written before the magic, so also there while a segment is set up
+    pid = shm->pid;
+    munmap((void *)shm, sizeof(*shm));
+
+    return pid;
+}
+
+int w3150_stats_export(struct w3150_dev **devs, int count, const char *name){
+
+    struct w3150_stats_shm *shm;
+    struct w3150_stats_dev *d;
+    pid_t owner;
+    int fd;
+    int i;
+
+    name = stats_name(name);
+    if (strcmp(name, "off") == 0)
+        return 1;
+
+    if (count > W3150_STATS_DEVS){
+        fprintf(stderr, "Stats for the first %d devices only\n", W3150_STATS_DEVS);
+        count = W3150_STATS_DEVS;
+    }
+
+    // only a segment left behind by a process that died is replaced
+    owner = stats_owner(name);
+    if (owner > 0 && (kill(owner, 0) == 0 || errno != ESRCH)){
+        fprintf(stderr, "Stats segment %s is in use by process %d, set $%s to export under another name\n",
+                name, (int)owner, W3150_STATS_ENV);
+        return -1;
+    }
+    shm_unlink(name);
+
+    fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0444);
+    if (fd < 0){
+        perror("shm_open");
+        return -1;
+    }
+
+    if (ftruncate(fd, sizeof(*shm)) != 0){
+        perror("ftruncate");
+        close(fd);
+        shm_unlink(name);
+        return -1;
+    }
+
+    shm = mmap(NULL, sizeof(*shm), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (shm == MAP_FAILED){
+        perror("mmap");
+        shm_unlink(name);
+        return -1;
+    }
+
+    shm->version = W3150_STATS_VERSION;
+    shm->size = sizeof(*shm);
+    shm->num_devs = count;
+    shm->pid = getpid();
+    shm->start_ns = w3150_now_ns();
+
+    for (i = 0; i < count; i++){
+        d = &shm->devs[i];
+        d->channel = devs[i]->channel;
+        snprintf(d->transport, sizeof(d->transport), "%s",
+                 (devs[i]->spi.ops != NULL) ? devs[i]->spi.ops->name : "");
+
+        // whatever was counted during setup comes along
+        d->stats = *devs[i]->stats;
+        devs[i]->stats = &d->stats;
+        devs[i]->spi.stats = &d->stats.bus;
+    }
+
+    __atomic_store_n(&shm->magic, W3150_STATS_MAGIC, __ATOMIC_RELEASE);
+
+    snprintf(exported, sizeof(exported), "%s", name);
+
+    return 0;
+}
+
+void w3150_stats_unlink(){
+
+    if (exported[0] != '\0')
+        shm_unlink(exported);
+
+    exported[0] = '\0';
+}
+
+const struct w3150_stats_shm *w3150_stats_open(const char *name){
+
+    const struct w3150_stats_shm *shm;
+    struct stat st;
+    int fd;
+
+    fd = shm_open(stats_name(name), O_RDONLY, 0);
+    if (fd < 0)
+        return NULL;
+
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(*shm)){
+        close(fd);
+        return NULL;
+    }
+
+    shm = mmap(NULL, sizeof(*shm), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (shm == MAP_FAILED)
+        return NULL;
+
+    if (__atomic_load_n(&shm->magic, __ATOMIC_ACQUIRE) != W3150_STATS_MAGIC ||
+        shm->version != W3150_STATS_VERSION || shm->size != sizeof(*shm) ||
+        shm->num_devs > W3150_STATS_DEVS){
+        munmap((void *)shm, sizeof(*shm));
+        return NULL;
+    }
+
+    return shm;
+}
+
+void w3150_stats_close(const struct w3150_stats_shm *shm){
+    munmap((void *)shm, sizeof(*shm));
+}
+
+_Static_assert(sizeof(struct w3150_stats) % sizeof(uint64_t) == 0,
+               "stats copy as 64 bit words");
+
+void w3150_stats_snapshot(struct w3150_stats *dst, const struct w3150_stats *src){
+
+    const uint64_t *s = (const uint64_t *)src;
+    uint64_t *d = (uint64_t *)dst;
+    size_t i;
+
+    for (i = 0; i < sizeof(*src) / sizeof(uint64_t); i++)
+        d[i] = __atomic_load_n(&s[i], __ATOMIC_RELAXED);
+}
+
+uint64_t w3150_hist_samples(const struct w3150_hist *h){
+
+    uint64_t n = 0;
+    int b;
+
+    for (b = 0; b < W3150_HIST_BUCKETS; b++)
+        n += h->count[b];
+
+    return n;
+}
+
+uint64_t w3150_hist_percentile(const struct w3150_hist *h, double p){
+
+    uint64_t total = w3150_hist_samples(h);
+    uint64_t seen = 0;
+    int b;
+
+    if (total == 0)
+        return 0;
+
+    for (b = 0; b < W3150_HIST_BUCKETS - 1; b++){
+        seen += h->count[b];
+        if (seen >= p * total)
+            break;
+    }
+
+    return 2ULL << b;
+}
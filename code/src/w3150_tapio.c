@@ -0,0 +1,329 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <w3150_tapio.h>
+
+#ifdef HAVE_IO_URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+/* io_uring is driven through the raw system calls so there is no
+ * liburing to build against: the submission and completion rings are
+ * mapped once, each queued buffer fills the next SQE with its own
+ * address as user_data, and the completions are read straight off the
+ * CQ ring.  depth never exceeds the SQ size and the CQ is twice that,
+ * so neither can overflow.
+ *
+ * In plain mode writes happen when they are queued, waiting for room
+ * like a blocking write would, and reads are tried when reaping. */
+
+#ifdef HAVE_IO_URING
+
+static int uring_setup(struct w3150_tapio *io, unsigned int depth){
+
+    struct io_uring_params p;
+    int fd;
+
+    memset(&p, 0, sizeof(p));
+    fd = syscall(__NR_io_uring_setup, depth, &p);
+    if (fd < 0)
+        return -1;
+
+    io->sq_map_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    io->cq_map_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    io->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    // one mapping serves both rings on 5.4 and later
+    if (p.features & IORING_FEAT_SINGLE_MMAP){
+        if (io->cq_map_len > io->sq_map_len)
+            io->sq_map_len = io->cq_map_len;
+        io->cq_map_len = 0;
+    }
+
+    io->sq_map = mmap(NULL, io->sq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      fd, IORING_OFF_SQ_RING);
+    if (io->sq_map == MAP_FAILED)
+        goto fail;
+
+    io->cq_map = io->sq_map;
+    if (io->cq_map_len != 0){
+        io->cq_map = mmap(NULL, io->cq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                          fd, IORING_OFF_CQ_RING);
+        if (io->cq_map == MAP_FAILED)
+            goto fail_sq;
+    }
+
+    io->sqes = mmap(NULL, io->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    fd, IORING_OFF_SQES);
+    if (io->sqes == MAP_FAILED)
+        goto fail_cq;
+
+    io->sq_head = (unsigned int *)((uint8_t *)io->sq_map + p.sq_off.head);
+    io->sq_tail = (unsigned int *)((uint8_t *)io->sq_map + p.sq_off.tail);
+    io->sq_mask = (unsigned int *)((uint8_t *)io->sq_map + p.sq_off.ring_mask);
+    io->sq_array = (unsigned int *)((uint8_t *)io->sq_map + p.sq_off.array);
+    io->cq_head = (unsigned int *)((uint8_t *)io->cq_map + p.cq_off.head);
+    io->cq_tail = (unsigned int *)((uint8_t *)io->cq_map + p.cq_off.tail);
+    io->cq_mask = (unsigned int *)((uint8_t *)io->cq_map + p.cq_off.ring_mask);
+    io->cqes = (uint8_t *)io->cq_map + p.cq_off.cqes;
+    io->sq_local_tail = *io->sq_tail;
+
+    if (io->depth > p.sq_entries)
+        io->depth = p.sq_entries;
+
+    io->ring_fd = fd;
+    return 0;
+
+fail_cq:
+    if (io->cq_map_len != 0)
+        munmap(io->cq_map, io->cq_map_len);
+fail_sq:
+    munmap(io->sq_map, io->sq_map_len);
+fail:
+    close(fd);
+    return -1;
+}
+
+static int uring_enter(struct w3150_tapio *io, unsigned int to_submit, unsigned int min_complete, unsigned int flags){
+
+    int ret;
+
+    io->calls++;
+    ret = syscall(__NR_io_uring_enter, io->ring_fd, to_submit, min_complete, flags, NULL, 0);
+
+    return (ret < 0) ? -errno : ret;
+}
+
+static void uring_queue(struct w3150_tapio *io, uint8_t opcode, struct w3150_buf *buf,
+                        uint8_t *data, uint32_t len){
+
+    unsigned int index = io->sq_local_tail & *io->sq_mask;
+    struct io_uring_sqe *sqe = (struct io_uring_sqe *)io->sqes + index;
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = io->fd;
+    sqe->addr = (uintptr_t)data;
+    sqe->len = len;
+    sqe->user_data = (uintptr_t)buf;
+
+    io->sq_array[index] = index;
+    io->sq_local_tail++;
+    io->queued++;
+}
+
+static int uring_reap(struct w3150_tapio *io, struct w3150_buf **done, int max, int wait){
+
+    struct io_uring_cqe *cqe;
+    struct w3150_buf *buf;
+    unsigned int head = *io->cq_head;
+    unsigned int tail = __atomic_load_n(io->cq_tail, __ATOMIC_ACQUIRE);
+    int ret;
+    int n = 0;
+
+    while (head == tail && wait && io->inflight > 0){
+        ret = uring_enter(io, 0, 1, IORING_ENTER_GETEVENTS);
+        if (ret < 0 && ret != -EINTR)
+            break;
+        tail = __atomic_load_n(io->cq_tail, __ATOMIC_ACQUIRE);
+    }
+
+    while (head != tail && n < max){
+        cqe = (struct io_uring_cqe *)io->cqes + (head & *io->cq_mask);
+        buf = (struct w3150_buf *)(uintptr_t)cqe->user_data;
+        buf->res = cqe->res;
+        if (cqe->res >= 0)
+            buf->len = cqe->res;
+        done[n++] = buf;
+        head++;
+    }
+
+    __atomic_store_n(io->cq_head, head, __ATOMIC_RELEASE);
+    io->inflight -= n;
+
+    return n;
+}
+
+#endif
+
+int w3150_tapio_init(struct w3150_tapio *io, int fd, unsigned int depth){
+
+    const char *mode = getenv(W3150_TAPIO_ENV);
+
+    memset(io, 0, sizeof(*io));
+    io->fd = fd;
+    io->ring_fd = -1;
+    io->depth = depth;
+
+    if (fd < 0 || depth == 0)
+        return -1;
+
+    #ifdef HAVE_IO_URING
+    if (mode == NULL || mode[0] == '\0' || strcmp(mode, "uring") == 0)
+        uring_setup(io, depth);
+    #else
+    (void)mode;
+    #endif
+
+    return 0;
+}
+
+void w3150_tapio_close(struct w3150_tapio *io){
+
+    #ifdef HAVE_IO_URING
+    if (io->ring_fd >= 0){
+        munmap(io->sqes, io->sqes_len);
+        if (io->cq_map_len != 0)
+            munmap(io->cq_map, io->cq_map_len);
+        munmap(io->sq_map, io->sq_map_len);
+        close(io->ring_fd);
+    }
+    #endif
+
+    io->ring_fd = -1;
+}
+
+int w3150_tapio_uring(struct w3150_tapio *io){
+    return io->ring_fd >= 0;
+}
+
+int w3150_tapio_write(struct w3150_tapio *io, struct w3150_buf *buf){
+
+    struct pollfd pfd;
+
+    if (w3150_tapio_pending(io) >= io->depth)
+        return -1;
+
+    #ifdef HAVE_IO_URING
+    if (io->ring_fd >= 0){
+        uring_queue(io, IORING_OP_WRITE, buf, w3150_buf_frame(buf), buf->len);
+        return 0;
+    }
+    #endif
+
+    pfd.fd = io->fd;
+    pfd.events = POLLOUT;
+
+    for (;;){
+        io->calls++;
+        buf->res = write(io->fd, w3150_buf_frame(buf), buf->len);
+        if (buf->res >= 0)
+            break;
+        buf->res = -errno;
+        if (buf->res != -EAGAIN)
+            break;
+        poll(&pfd, 1, -1);
+    }
+
+    buf->next = io->done;
+    io->done = buf;
+    io->inflight++;
+
+    return 0;
+}
+
+int w3150_tapio_read(struct w3150_tapio *io, struct w3150_buf *buf){
+
+    if (w3150_tapio_pending(io) >= io->depth)
+        return -1;
+
+    buf->off = 0;
+    buf->len = 0;
+
+    #ifdef HAVE_IO_URING
+    if (io->ring_fd >= 0){
+        uring_queue(io, IORING_OP_READ, buf, buf->data, W3150_BUF_SIZE);
+        return 0;
+    }
+    #endif
+
+    buf->next = io->reads;
+    io->reads = buf;
+    io->inflight++;
+
+    return 0;
+}
+
+int w3150_tapio_submit(struct w3150_tapio *io){
+
+    int ret = 0;
+
+    #ifdef HAVE_IO_URING
+    if (io->ring_fd >= 0 && io->queued > 0){
+        __atomic_store_n(io->sq_tail, io->sq_local_tail, __ATOMIC_RELEASE);
+        ret = uring_enter(io, io->queued, 0, 0);
+        if (ret > 0){
+            io->queued -= ret;
+            io->inflight += ret;
+            ret = 0;
+        }
+    }
+    #else
+    (void)io;
+    #endif
+
+    return ret;
+}
+
+int w3150_tapio_reap(struct w3150_tapio *io, struct w3150_buf **done, int max, int wait){
+
+    struct w3150_buf *buf;
+    struct pollfd pfd;
+    int n = 0;
+
+    #ifdef HAVE_IO_URING
+    if (io->ring_fd >= 0){
+        if (io->queued > 0)
+            w3150_tapio_submit(io);
+        n = uring_reap(io, done, max, wait);
+        io->frames += n;
+        return n;
+    }
+    #endif
+
+    // writes finished when they were queued
+    while (n < max && io->done != NULL){
+        buf = io->done;
+        io->done = buf->next;
+        done[n++] = buf;
+    }
+
+    pfd.fd = io->fd;
+    pfd.events = POLLIN;
+
+    while (n < max && io->reads != NULL){
+        buf = io->reads;
+
+        io->calls++;
+        buf->res = read(io->fd, buf->data, W3150_BUF_SIZE);
+        if (buf->res < 0){
+            buf->res = -errno;
+            if (buf->res == -EAGAIN){
+                if (n == 0 && wait){
+                    poll(&pfd, 1, -1);
+                    continue;
+                }
+                break;
+            }
+        }
+        else
+            buf->len = buf->res;
+
+        io->reads = buf->next;
+        done[n++] = buf;
+    }
+
+    io->inflight -= n;
+    io->frames += n;
+
+    return n;
+}
+
+int w3150_tapio_fd(struct w3150_tapio *io){
+    return (io->ring_fd >= 0) ? io->ring_fd : io->fd;
+}
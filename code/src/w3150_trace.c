@@ -0,0 +1,251 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <w3150_trace.h>
+#include <w3150_dev.h>
+#include <w3150_wait.h>
+
+/* The ring has one writer at a time, whoever holds the bus, and head is
+ * only moved once a record is complete.  A dump reads without the lock:
+ * it copies everything below head, then looks at head again and keeps
+ * only the records a writer cannot have reached in between. */
+
+_Static_assert(sizeof(struct w3150_trace_rec) == 32, "trace records are 32 bytes");
+
+static const char *const op_names[W3150_OP_COUNT] = {
+    [W3150_OP_USER]         = "user",
+    [W3150_OP_SETUP]        = "setup",
+    [W3150_OP_RX_SIZE]      = "rx size",
+    [W3150_OP_RX_HEADER]    = "rx header",
+    [W3150_OP_RX_PAYLOAD]   = "rx payload",
+    [W3150_OP_RX_COMMIT]    = "rx commit",
+    [W3150_OP_TX_STATUS]    = "tx status",
+    [W3150_OP_TX_PAYLOAD]   = "tx payload",
+    [W3150_OP_TX_COMMIT]    = "tx commit",
+    [W3150_OP_IRQ]          = "irq",
+    [W3150_OP_SOCK_STATUS]  = "sock status",
+    [W3150_OP_SOCK_PAYLOAD] = "sock payload",
+    [W3150_OP_SOCK_COMMIT]  = "sock commit",
+};
+
+const char *w3150_trace_op_name(uint8_t op){
+    return (op < W3150_OP_COUNT) ? op_names[op] : "?";
+}
+
+struct w3150_trace *w3150_trace_alloc(uint32_t records){
+
+    struct w3150_trace *tr;
+    uint32_t size = 1;
+
+    if (records == 0 || records > W3150_TRACE_MAX)
+        return NULL;
+
+    while (size < records)
+        size <<= 1;
+
+    // touched now rather than on the first transfers
+    tr = calloc(1, sizeof(*tr) + size * sizeof(tr->rec[0]));
+    if (tr == NULL)
+        return NULL;
+
+    memset(tr->rec, 0, size * sizeof(tr->rec[0]));
+    tr->mask = size - 1;
+
+    return tr;
+}
+
+void w3150_trace_free(struct w3150_trace *tr){
+    free(tr);
+}
+
+struct w3150_trace_rec *w3150_trace_begin(struct w3150_trace *tr, uint8_t op, const uint8_t *frames, int len){
+
+    struct w3150_trace_rec *r = &tr->rec[tr->head & tr->mask];
+    const uint8_t *last = frames + len - W3150_FRAME_SIZE;
+
+    r->frames = len / W3150_FRAME_SIZE;
+    r->addr = (frames[1] << 8) | frames[2];
+    r->last_addr = (last[1] << 8) | last[2];
+    r->opcode = frames[0];
+    r->tx_data = frames[3];
+    r->op = op;
+
+    return r;
+}
+
+void w3150_trace_end(struct w3150_trace *tr, struct w3150_trace_rec *r, const uint8_t *frames,
+                     uint64_t start_ns, uint64_t end_ns, int failed){
+
+    uint64_t d = end_ns - start_ns;
+
+    r->ts_ns = start_ns;
+    r->dur_ns = (d > UINT32_MAX) ? UINT32_MAX : d;
+    r->rx_data = frames[3];
+    r->failed = (failed != 0);
+
+    __atomic_store_n(&tr->head, tr->head + 1, __ATOMIC_RELEASE);
+}
+
+/* write() all of len
+ * return 0, -1 on failure */
+static int write_all(int fd, const void *buf, size_t len){
+
+    const uint8_t *p = buf;
+    ssize_t n;
+
+    while (len > 0){
+        n = write(fd, p, len);
+        if (n <= 0)
+            return -1;
+        p += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+int w3150_trace_dump(const struct w3150_trace *tr, int fd, int channel, const char *transport){
+
+    struct w3150_trace_hdr hdr;
+    char names[W3150_OP_COUNT][W3150_TRACE_OP_NAME];
+    struct w3150_trace_rec *copy;
+    uint64_t size = (uint64_t)tr->mask + 1;
+    uint64_t first;
+    uint64_t h1;
+    uint64_t h2;
+    uint64_t i;
+    int ret;
+
+    copy = malloc(size * sizeof(*copy));
+    if (copy == NULL)
+        return -1;
+
+    h1 = __atomic_load_n(&tr->head, __ATOMIC_ACQUIRE);
+    first = (h1 > size) ? h1 - size : 0;
+
+    for (i = first; i < h1; i++)
+        copy[i & tr->mask] = tr->rec[i & tr->mask];
+
+    // a writer that got past h2 - size may have been rewriting the
+    // slots of anything older while they were copied
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    h2 = __atomic_load_n(&tr->head, __ATOMIC_RELAXED);
+    if (h2 >= size && h2 - size + 1 > first)
+        first = h2 - size + 1;
+    if (first > h1)
+        first = h1;
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = W3150_TRACE_MAGIC;
+    hdr.version = W3150_TRACE_VERSION;
+    hdr.rec_size = sizeof(struct w3150_trace_rec);
+    hdr.channel = channel;
+    hdr.num_ops = W3150_OP_COUNT;
+    hdr.count = h1 - first;
+    hdr.lost = first;
+    hdr.dump_ns = w3150_now_ns();
+    snprintf(hdr.transport, sizeof(hdr.transport), "%s", (transport != NULL) ? transport : "");
+
+    memset(names, 0, sizeof(names));
+    for (i = 0; i < W3150_OP_COUNT; i++)
+        snprintf(names[i], sizeof(names[i]), "%s", op_names[i]);
+
+    ret = write_all(fd, &hdr, sizeof(hdr));
+    if (ret == 0)
+        ret = write_all(fd, names, sizeof(names));
+
+    // oldest first, in at most two runs around the end of the ring
+    for (i = first; ret == 0 && i < h1; ){
+        uint64_t run = size - (i & tr->mask);
+
+        if (run > h1 - i)
+            run = h1 - i;
+        ret = write_all(fd, &copy[i & tr->mask], run * sizeof(*copy));
+        i += run;
+    }
+
+    free(copy);
+
+    return ret;
+}
+
+int w3150_dev_trace_start(struct w3150_dev *dev, uint32_t records){
+
+    struct w3150_trace *tr;
+
+    if (dev->spi.ops == NULL)
+        return -1;
+
+    tr = w3150_trace_alloc(records);
+    if (tr == NULL)
+        return -1;
+
+    w3150_trace_free(w3150_transport_set_trace(&dev->spi, tr));
+
+    return 0;
+}
+
+void w3150_dev_trace_stop(struct w3150_dev *dev){
+
+    if (dev->spi.ops != NULL)
+        w3150_trace_free(w3150_transport_set_trace(&dev->spi, NULL));
+}
+
+int w3150_dev_trace_dump(struct w3150_dev *dev, int fd){
+
+    const struct w3150_trace *tr = dev->spi.trace;
+
+    if (tr == NULL)
+        return 1;
+
+    return w3150_trace_dump(tr, fd, dev->channel, dev->spi.ops->name);
+}
+
+int w3150_trace_dump_file(struct w3150_dev **devs, int count, const char *path){
+
+    int sections = 0;
+    int fd;
+    int i;
+
+    if (path == NULL || path[0] == '\0')
+        path = getenv(W3150_TRACE_FILE_ENV);
+
+    if (path == NULL || path[0] == '\0')
+        path = W3150_TRACE_FILE;
+
+    // no file at all when nothing is being traced
+    for (i = 0; i < count && devs[i]->spi.trace == NULL; i++)
+        ;
+    if (i == count)
+        return 0;
+
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0){
+        perror(path);
+        return -1;
+    }
+
+    for (i = 0; i < count; i++){
+        switch (w3150_dev_trace_dump(devs[i], fd)){
+        case 0:
+            sections++;
+            break;
+        case 1:
+            break;
+        default:
+            perror("trace dump");
+            close(fd);
+            return -1;
+        }
+    }
+
+    if (close(fd) != 0){
+        perror(path);
+        return -1;
+    }
+
+    return sections;
+}
@@ -0,0 +1,252 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include <w3150_trace.h>
+
+/*
+ * Offline view of an SPI trace (see w3150_trace.h).
+ *
+ * For every device section in the file the bus turns are charged to the
+ * driver operation that made them: how many transfers and frames each
+ * took, the bus time they used and their share of it, the mean and
+ * longest transfer.  With -r each operation is broken down further by
+ * the address of its first frame, showing which registers the time goes
+ * to.  The trace covers the last records before the dump, the span
+ * printed is the time between its first and last record.
+ *
+ * Run: ./w3150_trace_analyze [-r] [-n top] [file]
+ */
+
+#define MAX_OPS     256
+#define NAME_LEN    W3150_TRACE_OP_NAME
+
+struct op_total {
+    uint64_t transfers;
+    uint64_t frames;
+    uint64_t ns;
+    uint64_t max_ns;
+    uint64_t failed;
+};
+
+static int cmp_op_addr(const void *a, const void *b){
+
+    const struct w3150_trace_rec *x = a;
+    const struct w3150_trace_rec *y = b;
+
+    if (x->op != y->op)
+        return x->op - y->op;
+    return x->addr - y->addr;
+}
+
+struct addr_total {
+    uint16_t addr;
+    struct op_total t;
+};
+
+static int cmp_addr_ns(const void *a, const void *b){
+
+    const struct addr_total *x = a;
+    const struct addr_total *y = b;
+
+    if (x->t.ns != y->t.ns)
+        return (x->t.ns < y->t.ns) ? 1 : -1;
+    return x->addr - y->addr;
+}
+
+static void add(struct op_total *t, const struct w3150_trace_rec *r){
+    t->transfers++;
+    t->frames += r->frames;
+    t->ns += r->dur_ns;
+    if (r->dur_ns > t->max_ns)
+        t->max_ns = r->dur_ns;
+    t->failed += r->failed;
+}
+
+static void print_row(const char *name, const struct op_total *t, const struct op_total *all){
+
+    printf("  %-14s %10llu %5.1f %11llu %7.1f %10.3f %5.1f %8.2f %8.2f %6llu\n", name,
+           (unsigned long long)t->transfers, all->transfers ? 100.0 * t->transfers / all->transfers : 0.0,
+           (unsigned long long)t->frames, t->transfers ? (double)t->frames / t->transfers : 0.0,
+           t->ns / 1e6, all->ns ? 100.0 * t->ns / all->ns : 0.0,
+           t->transfers ? t->ns / 1e3 / t->transfers : 0.0, t->max_ns / 1e3,
+           (unsigned long long)t->failed);
+}
+
+/* Registers of one operation by bus time, recs sorted by op then address */
+static void print_addrs(const struct w3150_trace_rec *recs, uint64_t n, const struct op_total *all, int top){
+
+    struct addr_total *a;
+    uint64_t count = 0;
+    uint64_t i;
+    char name[16];
+
+    a = calloc(n, sizeof(*a));
+    if (a == NULL)
+        return;
+
+    for (i = 0; i < n; i++){
+        if (count == 0 || a[count - 1].addr != recs[i].addr){
+            a[count].addr = recs[i].addr;
+            count++;
+        }
+        add(&a[count - 1].t, &recs[i]);
+    }
+
+    qsort(a, count, sizeof(*a), cmp_addr_ns);
+
+    for (i = 0; i < count && (top <= 0 || i < (uint64_t)top); i++){
+        snprintf(name, sizeof(name), "  @0x%04X", a[i].addr);
+        print_row(name, &a[i].t, all);
+    }
+    if (i < count)
+        printf("    ... %llu more addresses\n", (unsigned long long)(count - i));
+
+    free(a);
+}
+
+/* Read and report one section
+ * return 1 if there was one, 0 at the end of the file, -1 if it is bad */
+static int section(FILE *f, int by_addr, int top){
+
+    struct w3150_trace_hdr hdr;
+    char names[MAX_OPS][NAME_LEN];
+    struct op_total ops[MAX_OPS];
+    struct op_total all;
+    struct w3150_trace_rec *recs;
+    uint8_t raw[256];
+    uint64_t first = 0;
+    uint64_t last = 0;
+    uint64_t span;
+    uint64_t i;
+    uint64_t j;
+    unsigned int op;
+
+    if (fread(&hdr, sizeof(hdr), 1, f) != 1)
+        return 0;
+
+    if (hdr.magic != W3150_TRACE_MAGIC || hdr.version != W3150_TRACE_VERSION ||
+        hdr.rec_size < sizeof(struct w3150_trace_rec) || hdr.rec_size > sizeof(raw) ||
+        hdr.num_ops > MAX_OPS){
+        fprintf(stderr, "Not a trace section\n");
+        return -1;
+    }
+
+    memset(names, 0, sizeof(names));
+    for (op = 0; op < hdr.num_ops; op++){
+        if (fread(names[op], NAME_LEN, 1, f) != 1)
+            return -1;
+        names[op][NAME_LEN - 1] = '\0';
+    }
+    for (; op < MAX_OPS; op++)
+        snprintf(names[op], NAME_LEN, "op %u", op);
+
+    recs = malloc((hdr.count ? hdr.count : 1) * sizeof(*recs));
+    if (recs == NULL){
+        fprintf(stderr, "Out of memory for %llu records\n", (unsigned long long)hdr.count);
+        return -1;
+    }
+
+    memset(ops, 0, sizeof(ops));
+    memset(&all, 0, sizeof(all));
+
+    for (i = 0; i < hdr.count; i++){
+        if (fread(raw, hdr.rec_size, 1, f) != 1){
+            fprintf(stderr, "Section cut short after %llu records\n", (unsigned long long)i);
+            free(recs);
+            return -1;
+        }
+        memcpy(&recs[i], raw, sizeof(recs[i]));
+
+        add(&ops[recs[i].op], &recs[i]);
+        add(&all, &recs[i]);
+
+        if (i == 0)
+            first = recs[i].ts_ns;
+        if (recs[i].ts_ns + recs[i].dur_ns > last)
+            last = recs[i].ts_ns + recs[i].dur_ns;
+    }
+
+    span = (hdr.count != 0) ? last - first : 0;
+
+    printf("channel %d, %s, %llu transfers (%llu older ones overwritten), %.3f ms, bus busy %.1f%%\n",
+           hdr.channel, hdr.transport, (unsigned long long)hdr.count, (unsigned long long)hdr.lost,
+           span / 1e6, span ? 100.0 * all.ns / span : 0.0);
+    printf("  %-14s %10s %5s %11s %7s %10s %5s %8s %8s %6s\n",
+           "operation", "transfers", "%", "frames", "fr/xfer", "bus ms", "%", "mean us", "max us", "failed");
+
+    if (by_addr)
+        qsort(recs, hdr.count, sizeof(*recs), cmp_op_addr);
+
+    for (op = 0, j = 0; op < MAX_OPS; op++){
+        if (ops[op].transfers == 0)
+            continue;
+
+        print_row(names[op], &ops[op], &all);
+
+        if (by_addr){
+            while (j < hdr.count && recs[j].op < op)
+                j++;
+            print_addrs(recs + j, ops[op].transfers, &all, top);
+            j += ops[op].transfers;
+        }
+    }
+
+    print_row("total", &all, &all);
+    printf("\n");
+
+    free(recs);
+
+    return 1;
+}
+
+int main(int argc, char **argv){
+
+    const char *path = NULL;
+    FILE *f;
+    int by_addr = 0;
+    int top = 8;
+    int sections = 0;
+    int ret;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "rn:h")) != -1){
+        switch (opt){
+        case 'r': by_addr = 1; break;
+        case 'n': top = atoi(optarg); break;
+        default:
+            fprintf(stderr, "Usage: %s [-r] [-n top] [file]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    if (optind < argc)
+        path = argv[optind];
+    else if (getenv(W3150_TRACE_FILE_ENV) != NULL)
+        path = getenv(W3150_TRACE_FILE_ENV);
+    else
+        path = W3150_TRACE_FILE;
+
+    f = fopen(path, "rb");
+    if (f == NULL){
+        perror(path);
+        return 1;
+    }
+
+    while ((ret = section(f, by_addr, top)) == 1)
+        sections++;
+
+    fclose(f);
+
+    if (ret < 0)
+        return 1;
+
+    if (sections == 0){
+        fprintf(stderr, "No trace in %s\n", path);
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,228 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <w3150_transport.h>
+#include <w3150_emu.h>
+#include <w3150_wait.h>
+
+/* Transport selection and frame chunking.  The backends only ever
+ * see chunks they said they can handle in one go. */
+
+static const struct w3150_transport_ops *backends[] = {
+    &w3150_spidev_ops,
+    &w3150_loopback_ops,
+    &w3150_emu_ops,
+#ifdef HAVE_WIRINGPI
+    &w3150_wiringpi_ops,
+#endif
+};
+
+#define NUM_BACKENDS (sizeof(backends) / sizeof(backends[0]))
+
+static const char *transport_name(const char *name){
+
+    if (name == NULL || name[0] == '\0')
+        name = getenv(W3150_TRANSPORT_ENV);
+
+    if (name == NULL || name[0] == '\0')
+        name = W3150_TRANSPORT_DEFAULT;
+
+    return name;
+}
+
+const struct w3150_transport_ops *w3150_transport_find(const char *name){
+
+    unsigned int i;
+    size_t len;
+
+    name = transport_name(name);
+    len = strcspn(name, ":");
+
+    for (i = 0; i < NUM_BACKENDS; i++){
+        if (strlen(backends[i]->name) == len && strncmp(backends[i]->name, name, len) == 0)
+            return backends[i];
+    }
+
+    return NULL;
+}
+
+int w3150_transport_open(struct w3150_transport *t, const char *name, int channel, int rate){
+
+    const struct w3150_transport_ops *ops;
+    const char *arg;
+
+    name = transport_name(name);
+    ops = w3150_transport_find(name);
+
+    if (ops == NULL){
+        fprintf(stderr, "Unknown SPI transport: %s\n", name);
+        return -1;
+    }
+
+    memset(t, 0, sizeof(*t));
+    t->ops = ops;
+    t->channel = channel;
+    t->rate = rate;
+    t->fd = -1;
+    t->max_frames = 1;
+    t->stats = &t->local_stats;
+
+    arg = strchr(name, ':');
+    if (arg != NULL)
+        arg++;
+
+    if (ops->open(t, arg) != 0){
+        t->ops = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Spins before sleeping, a short register transfer is a few tens of us */
+#define BUS_SPINS 2000
+
+static void bus_lock(struct w3150_transport *t){
+
+    struct w3150_bus *b = &t->bus;
+    unsigned int ticket = atomic_fetch_add(&b->next, 1);
+    unsigned int serving;
+    uint64_t start = 0;
+    int spins = 0;
+
+    while ((serving = atomic_load(&b->serving)) != ticket){
+        if (spins == 0)
+            start = w3150_now_ns();
+
+        if (spins < BUS_SPINS){
+            w3150_cpu_relax();
+            spins++;
+            continue;
+        }
+
+        // returns at once if serving moved on since it was read
+        atomic_fetch_add(&b->waiters, 1);
+        syscall(SYS_futex, &b->serving, FUTEX_WAIT_PRIVATE, serving, NULL, NULL, 0);
+        atomic_fetch_sub(&b->waiters, 1);
+    }
+
+    // counted once the bus is ours
+    if (spins != 0){
+        w3150_stat_add(&t->stats->contended, 1);
+        w3150_stat_add(&t->stats->wait_ns, w3150_now_ns() - start);
+    }
+}
+
+static void bus_unlock(struct w3150_bus *b){
+
+    atomic_fetch_add(&b->serving, 1);
+
+    // every sleeper checks whether it is next
+    if (atomic_load(&b->waiters) != 0)
+        syscall(SYS_futex, &b->serving, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+int w3150_transport_transfer(struct w3150_transport *t, uint8_t *frames, int len, uint8_t op){
+
+    struct w3150_bus_stats *st;
+    struct w3150_trace_rec *r;
+    uint64_t start;
+    uint64_t end;
+    uint64_t ns;
+    int chunk;
+    int ret;
+    int max_len = t->max_frames * W3150_FRAME_SIZE;
+
+    while (len > 0){
+        chunk = (len > max_len) ? max_len : len;
+
+        bus_lock(t);
+
+        st = t->stats;
+        if (t->trace != NULL){
+            r = w3150_trace_begin(t->trace, op, frames, chunk);
+            start = w3150_now_ns();
+            ret = t->ops->transfer(t, frames, chunk);
+            end = w3150_now_ns();
+            w3150_trace_end(t->trace, r, frames, start, end, ret);
+
+            if (w3150_stat_sampled(st->transfers)){
+                w3150_stat_add(&st->busy_ns, (end - start) * W3150_STATS_SAMPLE);
+                w3150_hist_add(&st->transfer_ns, end - start);
+            }
+        }
+        else if (w3150_stat_sampled(st->transfers)){
+            start = w3150_now_ns();
+            ret = t->ops->transfer(t, frames, chunk);
+            ns = w3150_now_ns() - start;
+
+            w3150_stat_add(&st->busy_ns, ns * W3150_STATS_SAMPLE);
+            w3150_hist_add(&st->transfer_ns, ns);
+        }
+        else
+            ret = t->ops->transfer(t, frames, chunk);
+
+        if (ret == 0){
+            w3150_stat_add(&st->transfers, 1);
+            w3150_stat_add(&st->frames, chunk / W3150_FRAME_SIZE);
+        }
+        else
+            w3150_stat_add(&st->errors, 1);
+
+        bus_unlock(&t->bus);
+
+        if (ret != 0)
+            return -1;
+
+        frames += chunk;
+        len -= chunk;
+    }
+
+    return 0;
+}
+
+/* Takes a turn on the bus, the clock may change under a running
+ * receive or transmit thread */
+int w3150_transport_set_rate(struct w3150_transport *t, int rate){
+
+    int ret = -1;
+
+    if (t->ops->set_rate == NULL)
+        return -1;
+
+    bus_lock(t);
+
+    if (t->ops->set_rate(t, rate) == 0){
+        t->rate = rate;
+        ret = 0;
+    }
+
+    bus_unlock(&t->bus);
+
+    return ret;
+}
+
+struct w3150_trace *w3150_transport_set_trace(struct w3150_transport *t, struct w3150_trace *tr){
+
+    struct w3150_trace *old;
+
+    bus_lock(t);
+    old = t->trace;
+    t->trace = tr;
+    bus_unlock(&t->bus);
+
+    return old;
+}
+
+void w3150_transport_close(struct w3150_transport *t){
+
+    if (t->ops != NULL && t->ops->close != NULL)
+        t->ops->close(t);
+
+    t->ops = NULL;
+}
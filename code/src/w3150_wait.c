@@ -0,0 +1,168 @@
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <w3150_wait.h>
+
+uint64_t w3150_now_ns(){
+
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void sleep_ns(uint32_t ns){
+
+    struct timespec ts;
+
+    ts.tv_sec = ns / 1000000000;
+    ts.tv_nsec = ns % 1000000000;
+    nanosleep(&ts, NULL);
+}
+
+/* Spin the whole window when recent waits fit in it, otherwise only
+ * an eighth of it */
+static uint32_t spin_budget(struct w3150_wait *w){
+
+    if (w->avg_ns != 0 && w->avg_ns <= w->spin_ns)
+        return w->spin_ns;
+
+    return w->spin_ns / 8;
+}
+
+static void learn(struct w3150_wait *w, uint64_t ns){
+
+    if (ns > w->sleep_max_ns)
+        ns = w->sleep_max_ns;
+
+    // average over roughly the last 8 samples
+    if (w->avg_ns == 0)
+        w->avg_ns = ns;
+    else
+        w->avg_ns = w->avg_ns - (w->avg_ns >> 3) + (uint32_t)(ns >> 3);
+}
+
+void w3150_wait_init(struct w3150_wait *w, uint32_t spin_ns, uint32_t sleep_min_ns, uint32_t sleep_max_ns){
+
+    memset(w, 0, sizeof(*w));
+    w->spin_ns = spin_ns;
+    w->sleep_min_ns = sleep_min_ns;
+    w->sleep_max_ns = sleep_max_ns;
+    w->sleep_ns = sleep_min_ns;
+    w->start_ns = w3150_now_ns();
+}
+
+void w3150_wait_begin(struct w3150_wait *w){
+    w->start_ns = w3150_now_ns();
+    w->sleep_ns = w->sleep_min_ns;
+}
+
+uint64_t w3150_wait_elapsed_ns(struct w3150_wait *w){
+    return w3150_now_ns() - w->start_ns;
+}
+
+void w3150_wait_step(struct w3150_wait *w){
+
+    if (w3150_wait_elapsed_ns(w) < spin_budget(w)){
+        w3150_cpu_relax();
+        return;
+    }
+
+    sleep_ns(w->sleep_ns);
+
+    w->sleep_ns *= 2;
+    if (w->sleep_ns > w->sleep_max_ns)
+        w->sleep_ns = w->sleep_max_ns;
+}
+
+uint64_t w3150_wait_end(struct w3150_wait *w){
+
+    uint64_t ns = w3150_wait_elapsed_ns(w);
+
+    learn(w, ns);
+    return ns;
+}
+
+uint32_t w3150_wait_next(struct w3150_wait *w, int found_work){
+
+    uint64_t now = w3150_now_ns();
+    uint32_t ns;
+
+    if (found_work){
+        learn(w, now - w->start_ns);
+        w->start_ns = now;
+        w->sleep_ns = w->sleep_min_ns;
+        return 0;
+    }
+
+    if (now - w->start_ns < spin_budget(w))
+        return 0;
+
+    ns = w->sleep_ns;
+
+    w->sleep_ns *= 2;
+    if (w->sleep_ns > w->sleep_max_ns)
+        w->sleep_ns = w->sleep_max_ns;
+
+    return ns;
+}
+
+int w3150_rt_setup(int cpu, int priority, int lock_memory){
+
+    int ret = 0;
+    cpu_set_t set;
+    struct sched_param param;
+
+    // nanosleep and timerfd get woken on time instead of being batched
+    if (prctl(PR_SET_TIMERSLACK, 1UL) != 0)
+        ret = -1;
+
+    if (cpu >= 0){
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        if (sched_setaffinity(0, sizeof(set), &set) != 0){
+            perror("sched_setaffinity");
+            ret = -1;
+        }
+    }
+
+    if (priority > 0){
+        memset(&param, 0, sizeof(param));
+        param.sched_priority = priority;
+        if (sched_setscheduler(0, SCHED_FIFO, &param) != 0){
+            perror("sched_setscheduler");
+            ret = -1;
+        }
+    }
+
+    if (lock_memory && mlockall(MCL_CURRENT | MCL_FUTURE) != 0){
+        perror("mlockall");
+        ret = -1;
+    }
+
+    return ret;
+}
+
+int w3150_rt_setup_env(){
+
+    const char *env = getenv(W3150_RT_ENV);
+    int cpu = -1;
+    int priority = 0;
+
+    if (env == NULL || env[0] == '\0')
+        return 0;
+
+    if (sscanf(env, "%d,%d", &cpu, &priority) < 1){
+        fprintf(stderr, "%s should be cpu[,priority]\n", W3150_RT_ENV);
+        return -1;
+    }
+
+    printf("Real time: cpu %d, priority %d\n", cpu, priority);
+    return w3150_rt_setup(cpu, priority, 1);
+}
@@ -0,0 +1,63 @@
+#include <stdint.h>
+#include <unistd.h>
+#include <w3150_transport.h>
+
+/* wiringPi backend
+ * wiringPiSPIDataRW() keeps chip select asserted for the whole buffer,
+ * so it can only be given one frame at a time.  A new rate means a new
+ * wiringPiSPISetupMode(), which opens the device again and keeps only
+ * the new fd, so the old one is closed here. */
+
+#ifdef HAVE_WIRINGPI
+
+#include <wiringPiSPI.h>
+
+static int wiringpi_open(struct w3150_transport *t, const char *arg){
+
+    t->fd = wiringPiSPISetupMode(t->channel, t->rate, 0);
+    if (t->fd == -1)
+        return -1;
+
+    t->max_frames = 1;
+    return 0;
+}
+
+static int wiringpi_transfer(struct w3150_transport *t, uint8_t *frames, int len){
+
+    if (wiringPiSPIDataRW(t->channel, (unsigned char*)frames, len) == -1)
+        return -1;
+
+    return 0;
+}
+
+static int wiringpi_set_rate(struct w3150_transport *t, int rate){
+
+    int fd = wiringPiSPISetupMode(t->channel, rate, 0);
+
+    if (fd == -1)
+        return -1;
+
+    if (t->fd >= 0 && t->fd != fd)
+        close(t->fd);
+
+    t->fd = fd;
+    return 0;
+}
+
+static void wiringpi_close(struct w3150_transport *t){
+
+    if (t->fd >= 0)
+        close(t->fd);
+
+    t->fd = -1;
+}
+
+const struct w3150_transport_ops w3150_wiringpi_ops = {
+    .name     = "wiringpi",
+    .open     = wiringpi_open,
+    .transfer = wiringpi_transfer,
+    .set_rate = wiringpi_set_rate,
+    .close    = wiringpi_close,
+};
+
+#endif